@@ -80,6 +80,22 @@ GCHSource* G_main_add_IPC_Channel(int priority, IPC_Channel* ch
 ,	gpointer userdata
 ,	GDestroyNotify notify);
 
+/*
+ *	Same, but the messages are received for the dispatch function,
+ *	as many as are there (up to G_CH_BATCH_MAX) in one go. The
+ *	function owns them and must msg_done() each. It is called with
+ *	no messages when the channel goes away.
+ */
+#define	G_CH_BATCH_MAX	64
+GCHSource* G_main_add_IPC_Channel_batch(int priority, IPC_Channel* ch
+,	gboolean can_recurse
+,	gboolean (*dispatch)(IPC_Channel* source_data
+,		IPC_Message**	msgs
+,		int		nmsgs
+,		gpointer        user_data)
+,	gpointer userdata
+,	GDestroyNotify notify);
+
 /*
  *	the events in this source is paused/resumed
  */
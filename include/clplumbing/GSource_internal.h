@@ -73,6 +73,8 @@ struct GCHSource_s {
 					 * flow controlling the writer off
 					 */
 	gboolean 	(*dispatch)(IPC_Channel* ch, gpointer user_data);
+	gboolean	(*batch_dispatch)(IPC_Channel* ch, IPC_Message** msgs
+			,	int nmsgs, gpointer user_data);
 };
 
 struct GWCSource_s {
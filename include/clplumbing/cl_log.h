@@ -57,6 +57,7 @@ void            cl_limit_log(struct msg_ctrl *ml, int priority, const char * fmt
 struct msg_ctrl *cl_limit_log_new(struct logspam *lspam);
 void            cl_limit_log_destroy(struct msg_ctrl *ml);
 void            cl_limit_log_reset(struct msg_ctrl *ml);
+gboolean        cl_limit_log_allow(struct msg_ctrl *ml, time_t now, gboolean *started);
 void            cl_perror(const char * fmt, ...) G_GNUC_PRINTF(1,2);
 void		cl_log_enable_stderr(int truefalse);
 void		cl_log_enable_stdout(int truefalse);
@@ -91,8 +92,43 @@ const char *	prio2str(int priority);
  * Set do_fsync != 0, if you even want it to fsync. */
 void            cl_log_do_fflush(int do_fsync);
 void            cl_log_use_buffered_io(int truefalse);
+/* Instead of stdio, format the log file lines into a buffer of bufsize
+ * bytes per file and write it out in one go when it is full or on
+ * cl_log_do_fflush(). 0 goes back to stdio. */
+void            cl_log_use_batched_io(size_t bufsize);
+/* Opt-in: cl_log() only copies its arguments into a ring of ringsize
+ * bytes, they are formatted and logged later from the main loop or by
+ * cl_log_drain(). Messages of LOG_ERR or worse still go out at once.
+ * 0 turns it off again. */
+int             cl_log_set_deferred(size_t ringsize);
+void            cl_log_drain(void);
+
+/* Key/value fields which go along with a message to logd */
+#define	CL_LOGF_RSC	1	/* resource id */
+#define	CL_LOGF_OP	2	/* operation */
+#define	CL_LOGF_CALLID	3
+#define	CL_LOGF_RC	4
+#define	CL_LOGF_EXECMS	5	/* execution time (ms) */
+struct cl_logfield {
+	int		key;		/* CL_LOGF_* */
+	const char*	str;		/* NULL for an integer */
+	size_t		len;		/* of str, 0: strlen(str) */
+	long long	ival;
+};
+/* "rsc", "op", ... for the keys above, NULL for others */
+const char *	cl_logfield_name(int key);
+/* like cl_log(), the fields are kept apart only when sent to logd */
+void		cl_log_fields(int priority, const struct cl_logfield * fields
+,		int nfields, const char * fmt, ...) G_GNUC_PRINTF(4,5);
 /* We now keep the file handles open for a potentially very long time.
  * Sometimes we may need to close them explicitly. */
 void            cl_log_close_log_files(void);
+/* Close those which were moved or removed (rotated), right away
+ * rather than on the next once a minute check. */
+void            cl_log_check_log_files(void);
+/* the line cl_direct_log() writes to a log file, into buf like snprintf */
+int             cl_log_format_line(char * buf, size_t len, const char * entity
+,               int entity_pid, TIME_T ts, const char * pristr
+,               const char * msg);
 
 #endif
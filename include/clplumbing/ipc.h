@@ -188,18 +188,78 @@ struct IPC_CHANNEL{
 	 */
 	uid_t		farside_uid;	/* far side uid */
 	gid_t		farside_gid;	/* far side gid */
+
+	/* The ha_msg wire formats the far side reads (a mask of
+	 * 1<<MSGFMT_*, see ha_msg.h, and IPC_FMT_FRAGMENTS), as
+	 * negotiated by the application. 0 means the text formats only.
+	 */
+	unsigned int	msgfmts;
+
+	/* With should_send_block set, the time (ms) send() waits at
+	 * most for room in the send queue. 0 means until there is room
+	 * or the channel goes away.
+	 */
+	unsigned int	send_timeout;
+	/* Time (ms) spent and number of sends that had to wait for room
+	 * in the send queue, i.e. how much the far side slowed us down.
+	 */
+	unsigned long	send_blocked_ms;
+	unsigned long	send_blocked_count;
+
+	/* private: a message bigger than MAXMSG being received */
+	struct ipc_fragbuf* fragbuf;
+
+	/* Message counts and histograms, kept for every channel.
+	 * See ipc_chanstats_format(). May be NULL (out of memory).
+	 */
+	struct ipc_chanstats* stats;
 };
 
+/*
+ * The messages are kept in a ring of ring_size (a power of two) slots,
+ * the oldest one in slot head. The ring grows when it is full: the
+ * receive side may queue more than max_qlen messages from one read.
+ * Use ipc_queue_push(), ipc_queue_pop() and ipc_queue_nth() to get
+ * at them. (Up to libplumb.so.2 there was a GList* queue instead.)
+ */
 struct IPC_QUEUE{
 	size_t		current_qlen;	/* Current qlen */
 	size_t		max_qlen;	/* Max allowed qlen */
-	GList*		queue;		/* List of messages */
+	IPC_Message**	ring;		/* The messages */
+	unsigned long long* stamps;	/* When each was queued (us) */
+	size_t		ring_size;	/* Number of slots in ring */
+	size_t		head;		/* Slot of the oldest message */
 	/* keep the time of the last max queue warning */
 	time_t		last_maxqlen_warn;
 	/* and the number of messages lost */
 	unsigned	maxqlen_cnt;
 };
 
+/*
+ * A log2 scaled histogram: bucket 0 counts the zeroes, bucket n the
+ * values from 2^(n-1) to 2^n - 1, the last bucket everything bigger.
+ */
+#define IPC_HIST_BUCKETS	32
+struct ipc_hist{
+	unsigned long		count;
+	unsigned long long	sum;
+	unsigned long		max;
+	unsigned long		bucket[IPC_HIST_BUCKETS];
+};
+
+/* Per channel statistics, since the channel was made or last reset */
+struct ipc_chanstats{
+	unsigned long		nsent;		/* messages written out */
+	unsigned long long	bytes_sent;
+	unsigned long		nrecv;		/* messages handed to recv() */
+	unsigned long long	bytes_recv;
+	struct ipc_hist		send_wait;	/* us from send() to written */
+	struct ipc_hist		recv_wait;	/* us from read to recv() */
+	struct ipc_hist		send_qlen;	/* send queue after a send() */
+	struct ipc_hist		recv_qlen;	/* recv queue after a read */
+	time_t			since;
+};
+
 /* authentication information : set of gids and uids */
 struct IPC_AUTH {
 	GHashTable * uid;	/* hash table for user id */
@@ -599,7 +659,28 @@ struct IPC_OPS{
 	int (*get_conntype)(struct IPC_CHANNEL* ch);
 
 	int (*disconnect)(struct IPC_CHANNEL* ch);
-		
+
+/*
+ * IPC_OPS::recv_batch
+ *   receive up to max messages at once: one read from the peer and
+ *   then whatever is in the receive queue, so that a busy reader
+ *   doesn't pay a read and a poll for every message.
+ *
+ * Parameters:
+ *   ch    (IN)  : the pointer to the channel.
+ *   msgs  (OUT) : room for max message pointers.
+ *   max   (IN)  : the most messages to return.
+ *   nmsgs (OUT) : the number of messages in msgs.
+ *
+ * Return values:
+ *   IPC_OK     : at least one message was received.
+ *   IPC_BROKEN : the channel is broken (see recv()).
+ *   IPC_FAIL   : nothing was received.
+ *
+ *   Each message must be freed with msg_done().
+ */
+	int (*recv_batch)(struct IPC_CHANNEL* ch, struct IPC_MESSAGE** msgs
+	,	int max, int* nmsgs);
 };
 
 
@@ -634,6 +715,9 @@ struct IPC_OPS{
  *                       even with libplumb.so.2.0.0.
  *                       Which also means that you MUST NOT use the
  *                       farside_uid/gid functionality then.
+ *    IPC_SHM:           Like IPC_UDS_CRED, but once connected the
+ *                       messages go through shared memory; clients
+ *                       have to connect with IPC_SHM too.
  */
 extern IPC_WaitConnection * ipc_wait_conn_constructor(const char * ch_type
 ,	GHashTable* ch_attrs);
@@ -729,10 +813,21 @@ struct SOCKET_MSG_HEAD{
 
 /* MAXMSG is the maximum final message size on the wire. */
 #define	MAXMSG		(256*1024)
+/*
+ * Bigger messages, up to MAXFRAGMSG, can be sent to peers which
+ * reassemble them (IPC_FMT_FRAGMENTS in msgfmts). They go on the
+ * wire in pieces of MAXMSG bytes, all but the last one with
+ * HEADMAGIC_FRAG in their head. Set IPC_FMT_FRAGMENTS only once
+ * both sides said they take them: without it, a channel takes no
+ * fragments either, they break the connection.
+ */
+#define	MAXFRAGMSG	(64*1024*1024)
+#define	IPC_FMT_FRAGMENTS	(1U<<16)
 /* MAXUNCOMPRESSED is the maximum, raw data size prior to compression. */
 /* 1:8 compression ratio is to be expected on data such as xml */
 #define	MAXUNCOMPRESSED	(2048*1024)
 #define HEADMAGIC	0xabcd
+#define HEADMAGIC_FRAG	0xabce
 #define POOL_SIZE (4*1024)
 struct ipc_bufpool{
 	
@@ -744,6 +839,13 @@ struct ipc_bufpool{
 	int size;
 };
 
+/* see ipc_bufpool_update() */
+struct ipc_fragbuf{
+	char*	buf;		/* msgpad bytes, then the body */
+	size_t	len;		/* of the body received so far */
+	size_t	size;		/* of the body buf has room for */
+};
+
 struct ipc_bufpool* ipc_bufpool_new(int);
 
 void	ipc_bufpool_del(struct ipc_bufpool* pool);
@@ -767,6 +869,47 @@ void	ipc_bufpool_unref(struct ipc_bufpool* pool);
 
 void	set_ipc_time_debug_flag(gboolean flag);
 
+IPC_Queue*	ipc_queue_new(size_t max_qlen);
+
+void	ipc_queue_del(IPC_Queue* q);
+
+/* appends msg, IPC_OK or IPC_FAIL (out of memory) */
+int	ipc_queue_push(IPC_Queue* q, IPC_Message* msg);
+
+/* removes and returns the oldest message, NULL if there are none */
+IPC_Message*	ipc_queue_pop(IPC_Queue* q);
+
+/* the n-th oldest message, n < current_qlen */
+#define	ipc_queue_nth(q, n) \
+	((q)->ring[((q)->head + (n)) & ((q)->ring_size - 1)])
+
+/* and when it was pushed, see ipc_time_us() */
+#define	ipc_queue_nth_stamp(q, n) \
+	((q)->stamps[((q)->head + (n)) & ((q)->ring_size - 1)])
+
+/* microseconds on a monotonic clock */
+unsigned long long	ipc_time_us(void);
+
+void	ipc_hist_add(struct ipc_hist* h, unsigned long value);
+
+/* upper bound of the bucket holding the pct percentile, 0 if empty */
+unsigned long	ipc_hist_percentile(const struct ipc_hist* h, int pct);
+
+/* "<=bound:count ..." for the buckets in use, returns the length */
+int	ipc_hist_format(const struct ipc_hist* h, char* buf, size_t len);
+
+/*
+ * A one line summary of the channel statistics (counts, p50/p99/max
+ * of the histograms), returns the length like snprintf().
+ */
+int	ipc_chanstats_format(const IPC_Channel* ch, char* buf, size_t len);
+
+/* log the summary and the histograms of the wait times */
+void	ipc_chanstats_log(const IPC_Channel* ch, const char* name
+,		int priority);
+
+void	ipc_chanstats_reset(IPC_Channel* ch);
+
 /* pathname attribute */
 #define	IPC_PATH_ATTR		"path"
 /* socket mode attribute */
@@ -777,6 +920,12 @@ void	set_ipc_time_debug_flag(gboolean flag);
 /* Unix domain socket with farside uid + gid credentials.
  * Available since libplumb.so.2.1.0 */
 #define	IPC_UDS_CRED		"uds_c"
+/* Unix domain socket for the setup and credentials, the data goes
+ * through shared memory rings where the system has them (Linux).
+ * Both sides have to use it. */
+#define	IPC_SHM			"shm"
+/* size of the shared memory rings (client side, optional) */
+#define	IPC_RINGSIZE_ATTR	"ringsize"
 
 #ifdef IPC_UDS_CRED
 #	define	IPC_ANYTYPE		IPC_UDS_CRED
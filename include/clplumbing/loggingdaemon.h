@@ -15,6 +15,7 @@
 
 /* Messages sent to the logging daemon */
 #define	LD_LOGIT	2
+#define	LD_HELLO	3	/* asks logd which records it takes */
 #define MAXENTITY	64
 
 /* Message contains following header, followed by the text (char[]) itself */
@@ -29,3 +30,46 @@ struct LogDaemonMsgHdr_s {
 	TIME_T		timestamp;
 };
 typedef	struct LogDaemonMsgHdr_s	LogDaemonMsgHdr;
+
+/*
+ * Binary log records. A client sends LD_HELLO (with the header above)
+ * right after connecting, a logd which knows the records answers with
+ * a message of the single byte LD_REC_V1, and from then on the client
+ * may send records instead of LogDaemonMsgHdr messages:
+ *
+ *	LD_REC_V1 flags priority pid timestamp entity_id
+ *	[entity_len entity] nfields field... textlen text EOS
+ *
+ * All numbers are unsigned LEB128 varints. The entity name is sent
+ * only with LD_REC_ENTITY, the first time the sender uses entity_id
+ * on a connection. A field is key<<1|1, len, value for a string and
+ * key<<1, zigzag(value) for an integer. The EOS after the text isn't
+ * counted in textlen, it lets the text be used in place.
+ */
+#define	LD_REC_V1	0xb1	/* can't be the start of a LogDaemonMsgHdr */
+#define	LD_REC_PRISTR	0x01	/* flags: print the priority string */
+#define	LD_REC_ENTITY	0x02	/* flags: the entity name follows */
+#define	LD_REC_MAXFIELDS 16
+
+struct cl_logrec {
+	unsigned		flags;
+	int			priority;
+	int			pid;
+	TIME_T			timestamp;
+	unsigned		entity_id;
+	const char*		entity;		/* with LD_REC_ENTITY */
+	size_t			entity_len;
+	int			nfields;
+	struct cl_logfield	fields[LD_REC_MAXFIELDS];
+	const char*		text;
+	size_t			textlen;
+};
+
+/* the encoded size of rec, at most */
+size_t	cl_logrec_maxlen(const struct cl_logrec* rec);
+
+/* encodes rec into buf, returns its length or -1 if it doesn't fit */
+int	cl_logrec_encode(const struct cl_logrec* rec, char* buf, size_t len);
+
+/* decodes buf in place into rec (strings point into buf), HA_OK/HA_FAIL */
+int	cl_logrec_decode(const char* buf, size_t len, struct cl_logrec* rec);
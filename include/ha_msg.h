@@ -43,9 +43,14 @@ enum cl_netstring_type{
 
 enum cl_msgfmt{
 	MSGFMT_NVPAIR,
-	MSGFMT_NETSTRING
+	MSGFMT_NETSTRING,
+	MSGFMT_BINARY		/* see cl_binmsg.c */
 };
 
+/* the formats wirefmt2msg() reads, as a mask of (1<<MSGFMT_*) */
+#define MSGFMT_ALL	((1<<MSGFMT_NVPAIR)|(1<<MSGFMT_NETSTRING)	\
+			|(1<<MSGFMT_BINARY))
+
 
 #define NEEDHEAD	1
 #define NOHEAD		0
@@ -63,6 +68,8 @@ typedef struct hb_msg_stats_s {
 	longclock_t		lastmsg;
 }hb_msg_stats_t;
 
+struct ha_msg_index;
+
 struct ha_msg {
 	int	nfields;
 	int	nalloc;
@@ -71,6 +78,13 @@ struct ha_msg {
 	void **	values;
 	size_t*	vlens;
 	int *	types;
+	/* lazily built name hash, see cl_msg_find() */
+	struct ha_msg_index*	index;
+	/* buffer the borrowed fields point into, see wirefmt2msg_borrow() */
+	const char*	pin_start;
+	const char*	pin_end;
+	void		(*pin_release)(void*);
+	void*		pin_data;
 };
 
 typedef struct ha_msg HA_Message;
@@ -131,12 +145,16 @@ extern struct fieldtypefuncs_s fieldtypefuncs[NUM_MSG_TYPES];
 #define MSG_ALLOWINTR		0X02
 #define MSG_NEEDCOMPRESS	0x04
 #define MSG_NOSIZECHECK		0x08
+#define MSG_BORROW		0x10	/* msgfromIPC: parse in place */
+#define MSG_BINARYFMT		0x20	/* msg2wirefmt: binary format if possible */
+#define MSG_FRAGMENTS		0x40	/* msg2wirefmt: up to MAXFRAGMSG bytes */
 
 #define	IFACE		"!^!\n"  
 #define	MSG_START	">>>\n"
 #define	MSG_END		"<<<\n"
 #define	MSG_START_NETSTRING	"###\n"
 #define	MSG_END_NETSTRING	"%%%\n"
+#define	MSG_START_BINARY	"@@@\n"
 #define	EQUAL		"="
 
 #define MAXDEPTH 16     /* Maximum recursive message depth */
@@ -245,6 +263,7 @@ int	cl_msg_stats_add(longclock_t time, int size);
 void	cl_msg_setstats(volatile hb_msg_stats_t* stats);
 void	cl_dump_msgstats(void);
 void	cl_set_compression_threshold(size_t threadhold);
+void	cl_set_msg_index_threshold(int nfields);
 void	cl_set_traditional_compression(gboolean value);
 
 /* Allocate new (empty) message */
@@ -348,13 +367,41 @@ depth and with or without start/end */
 int		msg2string_buf(const struct ha_msg *m, char* buf,
 			       size_t len, int depth, int needhead);
 
+/*
+ * A growable buffer the message writers append to. The caller may
+ * set len to leave room in front of the message (e.g. for a header);
+ * buf is realloc()ed as needed and is the caller's to free().
+ */
+struct cl_msgbuf {
+	char*	buf;
+	size_t	len;	/* bytes used */
+	size_t	size;	/* bytes allocated */
+};
+
+/* Makes room for more bytes in the buffer */
+int		cl_msgbuf_reserve(struct cl_msgbuf* mb, size_t more);
+
 /* Converts a message into wire format */
 char*		msg2wirefmt(struct ha_msg *m, size_t* );
+/* Appends the wire format of a message to a buffer */
+int		msg2wirefmt_buf(struct ha_msg *m, struct cl_msgbuf* mb);
 char*		msg2wirefmt_noac(struct ha_msg*m, size_t* len);
 
 /* Converts wire format data into a message */
 struct ha_msg*	wirefmt2msg(const char* s, size_t length, int flag);
 
+/*
+ * Converts wire format data into a message without copying the
+ * names and string values: they point into s, which is modified in
+ * place and must stay valid until the message is deleted, when
+ * release(data) is called (also if the conversion fails).
+ */
+struct ha_msg*	wirefmt2msg_borrow(char* s, size_t length, int flag
+,		void (*release)(void*), void* data);
+
+/* Copies the fields a message borrows and lets go of the buffer */
+int		cl_msg_unborrow(struct ha_msg* msg);
+
 /* Convets wire format data into an IPC message */
 IPC_Message*	wirefmt2ipcmsg(void* p, size_t len, IPC_Channel* ch);
 
@@ -364,6 +411,9 @@ IPC_Message* hamsg2ipcmsg(struct ha_msg* m, IPC_Channel* ch);
 /* Converts an IPC message into an ha_msg */
 struct ha_msg* ipcmsg2hamsg(IPC_Message*m);
 
+/* Same, but the ha_msg borrows from (and takes over) the IPC message */
+struct ha_msg* ipcmsg2hamsg_borrow(IPC_Message*m);
+
 /* Outputs a message to an IPC channel */
 int msg2ipcchan(struct ha_msg*m, IPC_Channel*ch);
 
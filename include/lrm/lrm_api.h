@@ -149,6 +149,7 @@ typedef struct{
 	unsigned long		exec_time; /* time it took the op to run */
 	unsigned long		queue_time; /* time spent in queue */
 	int			rsc_deleted; /* resource just deleted? */
+	unsigned long		spawn_time; /* us it took to start the RA */
 }lrm_op_t;
 
 extern const lrm_op_t lrm_zero_op;	/* an all-zeroes lrm_op_t value */
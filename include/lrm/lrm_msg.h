@@ -68,16 +68,28 @@
 #define F_LRM_STATUS		"lrm_status"
 #define F_LRM_RSCDELETED		"lrm_rscdeleted"
 #define F_LRM_METADATA		"lrm_metadata"
+#define F_LRM_METAS		"lrm_metas"
 #define F_LRM_USERDATA		"lrm_userdata"
 #define F_LRM_DELAY		"lrm_delay"
 #define F_LRM_T_RUN		"lrm_t_run"
 #define F_LRM_T_RCCHANGE	"lrm_t_rcchange"
 #define F_LRM_EXEC_TIME		"lrm_exec_time"
 #define F_LRM_QUEUE_TIME	"lrm_queue_time"
+#define F_LRM_SPAWN_TIME	"lrm_spawn_time"
 #define F_LRM_FAIL_REASON	"lrm_fail_reason"
 #define F_LRM_ASYNCMON_RC	"lrm_asyncmon_rc"
 #define F_LRM_LRMD_PARAM_NAME	"lrm_lrmd_param_name"
 #define F_LRM_LRMD_PARAM_VAL	"lrm_lrmd_param_val"
+#define F_LRM_MSGFMTS		"lrm_msgfmts"
+
+#define F_LRM_FEATURES		"lrm_features"
+
+/* the formats we read and announce in F_LRM_MSGFMTS (see ipc.h) */
+#define LRM_MSGFMTS		(MSGFMT_ALL|IPC_FMT_FRAGMENTS)
+
+/* requests lrmd knows beyond the old set, announced in F_LRM_FEATURES */
+#define LRM_FEAT_ALLMETAS	0x01	/* GETALLMETAS */
+#define LRM_FEATURES		(LRM_FEAT_ALLMETAS)
 
 #define	PRINT 	printf("file:%s,line:%d\n",__FILE__,__LINE__);
 
@@ -88,6 +100,7 @@
 #define GETRSCTYPES		"rtypes"
 #define GETPROVIDERS		"rproviders"
 #define GETRSCMETA		"rmetadata"
+#define GETALLMETAS		"rallmetas"
 #define GETALLRCSES		"getall"
 #define GETRSC			"getrsc"
 #define GETLASTOP		"getlastop"
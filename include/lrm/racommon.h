@@ -24,5 +24,6 @@ gboolean filtered(char * file_name);
 int get_runnable_list(const char* class_path, GList ** rsc_info);
 int get_failed_exec_rc(void);
 void closefiles(void);
+char** raexec_envp(GHashTable * env);
 
 #endif /* RACOMMON_H */
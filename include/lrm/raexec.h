@@ -153,4 +153,39 @@ struct RAExecOps {
 #define RA_EXEC_TYPE	RAExec
 #define RA_EXEC_TYPE_S	"RAExec"
 
+/*
+ * Optional second interface of a RA plugin, registered under the same
+ * name as its RAExec interface. struct RAExecOps stays as it is, so
+ * plugins built without this one still load.
+ */
+struct RASpawnOps {
+	/*
+	 * Description:
+	 *	Tell what execra would run, so that lrmd can start the RA
+	 *	itself (with posix_spawn) instead of forking and calling
+	 *	execra in the child. It is called in lrmd, so it must not
+	 *	change the environment or anything else of the process.
+	 *
+	 * Parameters:
+	 *	as for execra; path, argv and envp are set on success, to
+	 *	be freed with g_free() and g_strfreev()
+	 *
+	 * Return Value:
+	 *	0:  succeed
+	 *	-1: can't be done this way, use execra
+	 */
+	int (*prepare_exec)(
+		const char * rsc_id,
+		const char * rsc_type,
+		const char * provider,
+		const char * op_type,
+		const int    timeout,
+		GHashTable * params,
+		char **	     path,
+		char ***     argv,
+		char ***     envp);
+};
+
+#define RA_SPAWN_TYPE_S	"RASpawn"
+
 #endif /* RAEXEC_H */
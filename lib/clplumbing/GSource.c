@@ -403,6 +403,7 @@ G_main_IPC_Channel_constructor(GSource* source, IPC_Channel* ch
 		g_source_add_poll(source, &chp->outfd);
 	}
 	chp->dispatch = NULL;
+	chp->batch_dispatch = NULL;
 	chp->description = "IPC channel(base)";
 	chp->gsourceid = 0;
 	return chp;
@@ -449,6 +450,31 @@ G_main_add_IPC_Channel(int priority, IPC_Channel* ch
 	return chp;
 }
 
+GCHSource*
+G_main_add_IPC_Channel_batch(int priority, IPC_Channel* ch
+		       ,	gboolean can_recurse
+		       ,	gboolean (*dispatch)(IPC_Channel* source_data,
+						     IPC_Message** msgs,
+						     int nmsgs,
+						     gpointer        user_data)
+		       ,	gpointer userdata
+		       ,	GDestroyNotify notify)
+{
+	GCHSource *chp;
+
+	if (ch && ch->ops->recv_batch == NULL) {
+		cl_log(LOG_ERR, "%s: channel can't receive in batches"
+		,	__FUNCTION__);
+		return NULL;
+	}
+	chp = G_main_add_IPC_Channel(priority, ch, can_recurse, NULL
+	,	userdata, notify);
+	if (chp != NULL) {
+		chp->batch_dispatch = dispatch;
+		chp->description = "IPC channel(batch)";
+	}
+	return chp;
+}
 
 void	/* Suspend reading from far end writer (flow control) */
 G_main_IPC_Channel_pause(GCHSource* chp)
@@ -579,6 +605,29 @@ G_CH_check_int(GSource* source)
 	return ret;
 }
 
+/*
+ *	Hand the user one batch of messages; the channel has been
+ *	resumed already, so only the queue has to be looked at, unless
+ *	the channel is going away and the user should hear about it.
+ */
+static gboolean
+G_CH_dispatch_batch(GCHSource* chp)
+{
+	IPC_Channel*	ch = chp->ch;
+	IPC_Message*	msgs[G_CH_BATCH_MAX];
+	int		nmsgs = 0;
+
+	if (ch->recv_queue->current_qlen == 0
+	&&	!ch->ops->is_message_pending(ch)) {
+		return TRUE;
+	}
+	if (ch->ops->recv_batch(ch, msgs, G_CH_BATCH_MAX, &nmsgs) != IPC_OK
+	&&	ch->ch_status == IPC_CONNECT) {
+		return TRUE;
+	}
+	return chp->batch_dispatch(ch, msgs, nmsgs, chp->udata);
+}
+
 /*
  *	Some kind of event occurred - notify the user.
  */
@@ -632,7 +681,17 @@ G_CH_dispatch_int(GSource * source,
 	}
 
 
-	if(chp->dispatch && chp->ch->ops->is_message_pending(chp->ch)) {
+	if (chp->batch_dispatch) {
+		if (!G_CH_dispatch_batch(chp)) {
+			g_source_remove_poll(source, &chp->infd);
+			if (!chp->fd_fdx) {
+				g_source_remove_poll(source, &chp->outfd);
+			}
+			CHECK_DISPATCH_TIME(chp);
+			g_source_unref(source);
+			return FALSE;
+		}
+	}else if(chp->dispatch && chp->ch->ops->is_message_pending(chp->ch)) {
 		if(!(chp->dispatch(chp->ch, chp->udata))){
 			g_source_remove_poll(source, &chp->infd);
 			if (!chp->fd_fdx) {
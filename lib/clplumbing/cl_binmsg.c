@@ -0,0 +1,371 @@
+/*
+ * binary wire format for ha_msgs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*
+ * The text formats print and parse all lengths in decimal, escape the
+ * newlines in the values and have to be scanned byte by byte to find
+ * the end of a field. In the binary format all integers are 32 bit
+ * little endian and every field starts with its lengths:
+ *
+ *	"@@@\n" flags nfields length field...
+ *
+ * where length is the number of bytes after it and each field is
+ *
+ *	type nlen vlen name EOS value EOS
+ *
+ * String, binary and compressed values are stored as they are,
+ * nested messages (FT_STRUCT, FT_UNCOMPRESS) in binary format, and
+ * lists as the number of elements followed by "len element EOS" for
+ * each of them. The EOS behind names and values lets a borrowed
+ * message (see wirefmt2msg_borrow()) use them in place. No flags are
+ * defined yet; readers refuse messages with flags they don't know.
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <ha_msg.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/netstring.h>
+
+#define BINMSG_STARTLEN	(sizeof(MSG_START_BINARY)-1)
+#define BINMSG_HDRLEN	(BINMSG_STARTLEN + 3*4)
+#define BINFIELD_HDRLEN	(3*4)
+
+int cl_msg_add_raw(struct ha_msg* msg, char* name, size_t nlen
+,	void* value, size_t vlen, int type);
+int get_binmsglen(const struct ha_msg* m);
+int msg2binary_mb(const struct ha_msg* m, struct cl_msgbuf* mb, int len);
+struct ha_msg* binmsg2msg(const char* s, size_t length, char* pin);
+static struct ha_msg* binmsg2msg_rec(const char* s, size_t length
+,	size_t* used, char* pin);
+
+static void
+put_u32(char* p, guint32 x)
+{
+	unsigned char* u = (unsigned char*)p;
+
+	u[0] = x & 0xff;
+	u[1] = (x >> 8) & 0xff;
+	u[2] = (x >> 16) & 0xff;
+	u[3] = (x >> 24) & 0xff;
+}
+
+static guint32
+get_u32(const char* p)
+{
+	const unsigned char* u = (const unsigned char*)p;
+
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((guint32)u[3] << 24);
+}
+
+static int
+binvalue_len(int type, const void* value, size_t vlen)
+{
+	const GList*	l;
+	int		len;
+
+	switch (type) {
+	case FT_STRING:
+	case FT_BINARY:
+	case FT_COMPRESS:
+		return vlen;
+	case FT_STRUCT:
+	case FT_UNCOMPRESS:
+		return get_binmsglen(value);
+	case FT_LIST:
+		len = 4;
+		for (l = value; l != NULL; l = g_list_next(l)) {
+			len += 4 + strlen(l->data) + 1;
+		}
+		return len;
+	}
+	cl_log(LOG_ERR, "%s: wrong type (%d)", __FUNCTION__, type);
+	return -1;
+}
+
+/* the length of the binary format of m, -1 on errors */
+int
+get_binmsglen(const struct ha_msg* m)
+{
+	int	len = BINMSG_HDRLEN;
+	int	vlen;
+	int	j;
+
+	for (j = 0; j < m->nfields; j++) {
+		vlen = binvalue_len(m->types[j], m->values[j], m->vlens[j]);
+		if (vlen < 0) {
+			return -1;
+		}
+		len += BINFIELD_HDRLEN + m->nlens[j] + 1 + vlen + 1;
+	}
+	return len;
+}
+
+/* write m at p (get_binmsglen() checked it), return the end */
+static char*
+binmsg_put(const struct ha_msg* m, char* p)
+{
+	char*		lenp;
+	char*		vlenp;
+	char*		vstart;
+	const GList*	l;
+	size_t		elen;
+	int		j;
+
+	memcpy(p, MSG_START_BINARY, BINMSG_STARTLEN);
+	p += BINMSG_STARTLEN;
+	put_u32(p, 0);
+	put_u32(p+4, m->nfields);
+	lenp = p + 8;
+	p += 12;
+
+	for (j = 0; j < m->nfields; j++) {
+		put_u32(p, m->types[j]);
+		put_u32(p+4, m->nlens[j]);
+		vlenp = p + 8;
+		p += BINFIELD_HDRLEN;
+		memcpy(p, m->names[j], m->nlens[j]);
+		p += m->nlens[j];
+		*p++ = EOS;
+		vstart = p;
+		switch (m->types[j]) {
+		case FT_STRING:
+		case FT_BINARY:
+		case FT_COMPRESS:
+			memcpy(p, m->values[j], m->vlens[j]);
+			p += m->vlens[j];
+			break;
+		case FT_STRUCT:
+		case FT_UNCOMPRESS:
+			p = binmsg_put(m->values[j], p);
+			break;
+		case FT_LIST:
+			put_u32(p, g_list_length(m->values[j]));
+			p += 4;
+			for (l = m->values[j]; l != NULL; l = g_list_next(l)) {
+				elen = strlen(l->data);
+				put_u32(p, elen);
+				memcpy(p+4, l->data, elen);
+				p += 4 + elen;
+				*p++ = EOS;
+			}
+			break;
+		}
+		put_u32(vlenp, p - vstart);
+		*p++ = EOS;
+	}
+	put_u32(lenp, p - (lenp + 4));
+	return p;
+}
+
+/*
+ * Append the binary format of m to mb (NUL terminated, the EOS is not
+ * counted). len is get_binmsglen(m) if the caller knows it, else -1.
+ */
+int
+msg2binary_mb(const struct ha_msg* m, struct cl_msgbuf* mb, int len)
+{
+	char*	end;
+
+	if (len < 0 && (len = get_binmsglen(m)) < 0) {
+		return HA_FAIL;
+	}
+	if (cl_msgbuf_reserve(mb, len+1) != HA_OK) {
+		return HA_FAIL;
+	}
+	end = binmsg_put(m, mb->buf + mb->len);
+	if (end - (mb->buf + mb->len) != len) {
+		cl_log(LOG_ERR, "%s: wrote %d bytes, expected %d", __FUNCTION__
+		,	(int)(end - (mb->buf + mb->len)), len);
+		return HA_FAIL;
+	}
+	*end = EOS;
+	mb->len += len;
+	return HA_OK;
+}
+
+static GList*
+binmsg_list(const char* p, size_t len)
+{
+	const char*	end = p + len;
+	GList*		list = NULL;
+	guint32		count, elen;
+	char*		elem;
+
+	if (len < 4) {
+		return NULL;
+	}
+	count = get_u32(p);
+	p += 4;
+	while (count-- > 0) {
+		if (end - p < 4
+		||	(elen = get_u32(p)) >= (size_t)(end - p) - 4
+		||	p[4+elen] != EOS
+		||	(elem = malloc(elen+1)) == NULL) {
+			list_cleanup(list);
+			return NULL;
+		}
+		memcpy(elem, p+4, elen+1);
+		list = g_list_prepend(list, elem);
+		p += 4 + elen + 1;
+	}
+	return g_list_reverse(list);
+}
+
+/* pin: the field (name), writable, if it is to be borrowed */
+static int
+binmsg_add_field(struct ha_msg* msg, int type, const char* name
+,	size_t nlen, const char* value, size_t vlen, char* pin)
+{
+	gboolean borrow = pin != NULL;
+	char*	pvalue = borrow ? pin + (value - name) : NULL;
+	char*	n = pin;
+	void*	v = NULL;
+	size_t	vl = vlen;
+	size_t	used;
+
+	switch (type) {
+	case FT_STRING:
+	case FT_BINARY:
+		v = borrow ? pvalue : fieldtypefuncs[type].dup(value, vlen);
+		break;
+	case FT_COMPRESS:
+		v = fieldtypefuncs[type].dup(value, vlen);
+		break;
+	case FT_STRUCT:
+	case FT_UNCOMPRESS:
+		v = binmsg2msg_rec(value, vlen, &used, pvalue);
+		if (v != NULL && used != vlen) {
+			ha_msg_del(v);
+			v = NULL;
+		}
+		vl = 0;
+		break;
+	case FT_LIST:
+		v = binmsg_list(value, vlen);
+		vl = string_list_pack_length(v);
+		break;
+	default:
+		cl_log(LOG_ERR, "%s: wrong type (%d)", __FUNCTION__, type);
+		return HA_FAIL;
+	}
+	if (v == NULL) {
+		return HA_FAIL;
+	}
+	if (!borrow) {
+		if ((n = malloc(nlen+1)) == NULL) {
+			fieldtypefuncs[type].memfree(v);
+			return HA_FAIL;
+		}
+		memcpy(n, name, nlen+1);
+	}
+	if (cl_msg_add_raw(msg, n, nlen, v, vl, type) != HA_OK) {
+		if (!borrow) {
+			free(n);
+		}
+		if (!borrow || v != pvalue) {
+			fieldtypefuncs[type].memfree(v);
+		}
+		return HA_FAIL;
+	}
+	return HA_OK;
+}
+
+static struct ha_msg*
+binmsg2msg_rec(const char* s, size_t length, size_t* used, char* pin)
+{
+	struct ha_msg*	msg;
+	const char*	p = s + BINMSG_HDRLEN;
+	const char*	end;
+	guint32		nfields, blen, type, nlen, vlen;
+	guint32		j;
+
+	if (length < BINMSG_HDRLEN
+	||	memcmp(s, MSG_START_BINARY, BINMSG_STARTLEN) != 0) {
+		cl_log(LOG_ERR, "%s: no binary message header", __FUNCTION__);
+		return NULL;
+	}
+	if (get_u32(s + BINMSG_STARTLEN) != 0) {
+		cl_log(LOG_ERR, "%s: unknown flags 0x%x", __FUNCTION__
+		,	get_u32(s + BINMSG_STARTLEN));
+		return NULL;
+	}
+	nfields = get_u32(s + BINMSG_STARTLEN + 4);
+	blen = get_u32(s + BINMSG_STARTLEN + 8);
+	if (blen > length - BINMSG_HDRLEN
+	||	nfields > blen / (BINFIELD_HDRLEN + 2)) {
+		cl_log(LOG_ERR, "%s: bad message length %u (%u fields)"
+		,	__FUNCTION__, blen, nfields);
+		return NULL;
+	}
+	end = p + blen;
+	if ((msg = ha_msg_new(nfields)) == NULL) {
+		return NULL;
+	}
+	if (pin) {
+		msg->pin_start = s;
+		msg->pin_end = end;
+	}
+	for (j = 0; j < nfields; j++) {
+		if (end - p < (ssize_t)BINFIELD_HDRLEN) {
+			goto bad;
+		}
+		type = get_u32(p);
+		nlen = get_u32(p+4);
+		vlen = get_u32(p+8);
+		p += BINFIELD_HDRLEN;
+		if (type >= DIMOF(fieldtypefuncs) || nlen == 0
+		||	nlen >= (size_t)(end - p)
+		||	vlen >= (size_t)(end - p) - nlen - 1
+		||	p[nlen] != EOS || p[nlen+1+vlen] != EOS) {
+			goto bad;
+		}
+		if (binmsg_add_field(msg, type, p, nlen, p + nlen + 1, vlen
+		,	pin ? pin + (p - s) : NULL) != HA_OK) {
+			goto bad;
+		}
+		p += nlen + 1 + vlen + 1;
+	}
+	if (p != end) {
+		goto bad;
+	}
+	*used = end - s;
+	return msg;
+
+bad:
+	if (!cl_msg_quiet_fmterr) {
+		cl_log(LOG_ERR, "%s: bad field %u (offset %d)", __FUNCTION__
+		,	j, (int)(p - s));
+	}
+	ha_msg_del(msg);
+	return NULL;
+}
+
+/*
+ * Converts the binary format into a message, in place if pin (the
+ * same text as s, writable) is not NULL
+ */
+struct ha_msg*
+binmsg2msg(const char* s, size_t length, char* pin)
+{
+	size_t	used;
+
+	return binmsg2msg_rec(s, length, &used, pin);
+}
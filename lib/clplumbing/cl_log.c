@@ -17,7 +17,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <time.h>
 #include <sys/utsname.h>
@@ -68,9 +71,13 @@ static gboolean		syslogformatfile = TRUE;
 
 int LogToDaemon(int priority, const char * buf, int bstrlen, gboolean use_pri_str);
 
-static int LogToLoggingDaemon(int priority, const char * buf, int bstrlen, gboolean use_pri_str);
+static int LogToLoggingDaemon(int priority, const char * buf, int bstrlen, gboolean use_pri_str, TIME_T ts
+,	const struct cl_logfield * fields, int nfields);
 static IPC_Message* ChildLogIPCMessage(int priority, const char *buf, int bstrlen, 
-				gboolean use_priority_str, IPC_Channel* ch);
+				gboolean use_priority_str, IPC_Channel* ch, TIME_T ts);
+static IPC_Message* ChildLogRecMessage(int priority, const char *buf
+,	int bstrlen, gboolean use_prio_str, IPC_Channel* ch, TIME_T ts
+,	const struct cl_logfield * fields, int nfields);
 static void	FreeChildLogIPCMessage(IPC_Message* msg);
 static gboolean send_dropped_message(gboolean use_pri_str, IPC_Channel *chan);
 static int cl_set_logging_wqueue_maxlen(int qlen);
@@ -82,6 +89,7 @@ static char		cl_log_syslogprefix[MAXENTITY] = DFLT_PREFIX;
 static char		common_log_entity[MAXENTITY]= DFLT_ENTITY;
 static int		cl_log_facility = LOG_USER;
 static int		use_buffered_io = 0;
+static size_t		batched_io_size = 0;
 
 static void		cl_opensyslog(void);
 static int		syslog_enabled = 0;
@@ -95,6 +103,17 @@ static GDestroyNotify	destroy_logging_channel_callback;
 static void		(*create_logging_channel_callback)(IPC_Channel* chan);
 static gboolean		logging_chan_in_main_loop = FALSE;
 
+/*
+ * Binary records (see loggingdaemon.h) are sent only on the channel
+ * logd answered our LD_HELLO on. The entity name is sent once per
+ * connection and then referred to by its id.
+ */
+static IPC_Channel*	logd_hello_chan = NULL;	/* waiting for the answer */
+static IPC_Channel*	logd_rec_chan = NULL;	/* records accepted */
+static IPC_Channel*	rec_entity_chan = NULL;	/* rec_entity sent on it */
+static unsigned		rec_entity_id = 0;
+static char		rec_entity[MAXENTITY];
+
 /***********************
  *debug use only, do not use this function in your program
  */
@@ -169,6 +188,13 @@ cl_log_use_buffered_io(int truefalse)
 	cl_log_close_log_files();
 }
 
+void
+cl_log_use_batched_io(size_t bufsize)
+{
+	cl_log_close_log_files();
+	batched_io_size = bufsize;
+}
+
 #define ENVPRE		"HA_"
 
 #define ENV_HADEBUGVAL	"HA_debug"
@@ -265,6 +291,32 @@ cl_inherit_logging_environment(int logqueuemax)
 }
 
 
+/* logd sends nothing but the answer to LD_HELLO */
+static void
+logd_read_answer(IPC_Channel* chan)
+{
+	IPC_Message*	msg;
+
+	while (chan->recv_queue->current_qlen > 0
+	&&	chan->ops->recv(chan, &msg) == IPC_OK) {
+		if (chan == logd_hello_chan && msg->msg_len == 1
+		&&	*(unsigned char*)msg->msg_body == LD_REC_V1) {
+			logd_rec_chan = chan;
+			logd_hello_chan = NULL;
+		}
+		if (msg->msg_done) {
+			msg->msg_done(msg);
+		}
+	}
+}
+
+static gboolean
+logd_dispatch(IPC_Channel* chan, gpointer user_data)
+{
+	logd_read_answer(chan);
+	return TRUE;
+}
+
 static void
 add_logging_channel_mainloop(IPC_Channel* chan)
 {
@@ -272,7 +324,7 @@ add_logging_channel_mainloop(IPC_Channel* chan)
 		G_main_add_IPC_Channel(	G_PRIORITY_DEFAULT,
 					chan,
 					FALSE,
-					NULL,
+					logd_dispatch,
 					NULL,
 					destroy_logging_channel_callback);
 	
@@ -295,6 +347,38 @@ remove_logging_channel_mainloop(gpointer userdata)
 }
 
 
+/*
+ * Ask logd whether it takes binary records. An older logd just logs
+ * the text as a debug message; it never answers, so we never send
+ * anything but LogDaemonMsgHdr messages to it.
+ *
+ * Only asked if the answer is read here: either by logd_dispatch()
+ * or, without a main loop, on the next send. A channel source set
+ * up by the application reads nothing we could get the answer from,
+ * and an unread answer would keep its source ready.
+ */
+static void
+logd_send_hello(IPC_Channel* chan)
+{
+	static const char	hello[] = "cl_log: binary log records offered";
+	IPC_Message*		msg;
+	int			type = LD_HELLO;
+
+	logd_hello_chan = NULL;
+	msg = ChildLogIPCMessage(LOG_DEBUG, hello, sizeof(hello)-1, TRUE
+	,	chan, NULLTIME);
+	if (msg == NULL) {
+		return;
+	}
+	memcpy((char*)msg->msg_body + offsetof(LogDaemonMsgHdr, msgtype)
+	,	&type, sizeof(type));
+	if (chan->ops->send(chan, msg) != IPC_OK) {
+		FreeChildLogIPCMessage(msg);
+		return;
+	}
+	logd_hello_chan = chan;
+}
+
 static IPC_Channel* 
 create_logging_channel(void)
 {
@@ -332,6 +416,15 @@ create_logging_channel(void)
 	}
 	complained_yet = FALSE;
 
+	logd_rec_chan = NULL;
+	rec_entity_chan = NULL;
+	if (create_logging_channel_callback == NULL
+	||	create_logging_channel_callback == add_logging_channel_mainloop) {
+		logd_send_hello(chan);
+	}else{
+		logd_hello_chan = NULL;
+	}
+
 	if (create_logging_channel_callback){
 		create_logging_channel_callback(chan);
 	}
@@ -502,26 +595,51 @@ prio2str(int priority)
 static char * syslog_timestamp(TIME_T t);
 static void cl_limit_log_update(struct msg_ctrl *ml, time_t ts);
 
-static void
-append_log(FILE * fp, const char * entity, int entity_pid
-,	TIME_T timestamp, const char * pristr, const char * msg)
+static const char *
+log_nodename(void)
 {
 	static int		got_uname = FALSE;
 	static struct utsname	un;
 
+	if (!got_uname) {
+		uname(&un);
+		got_uname = TRUE;
+	}
+	return un.nodename;
+}
+
+/* the same line as print_logline()/append_log() into buf, like snprintf */
+int
+cl_log_format_line(char * buf, size_t len, const char * entity, int entity_pid
+,	TIME_T timestamp, const char * pristr, const char * msg)
+{
+	if (!syslogformatfile) {
+		return snprintf(buf, len, "%s[%d]: %s %s%s%s\n"
+		,	entity, entity_pid, ha_timestamp(timestamp)
+		,	(pristr ? pristr : ""), (pristr ? ": " : ""), msg);
+	}
+	return snprintf(buf, len, "%s %s %s: [%d]: %s%s%s\n"
+	,	syslog_timestamp(timestamp)
+	,	log_nodename(), entity, entity_pid
+	,	(pristr ? pristr : "")
+	,	(pristr ? ": " : "")
+	,	msg);
+}
+
+static void
+append_log(FILE * fp, const char * entity, int entity_pid
+,	TIME_T timestamp, const char * pristr, const char * msg)
+{
 	if (!syslogformatfile) {
 		print_logline(fp, entity, entity_pid, timestamp, pristr, msg);
 		return;
 	}
-	if (!got_uname) {
-		uname(&un);
-	}
 	/*
 	 * Jul 14 21:45:18 beam logd: [1056]: info: setting log file to /dev/null
 	 */
 	fprintf(fp, "%s %s %s: [%d]: %s%s%s\n"
 	,	syslog_timestamp(timestamp)
-	,	un.nodename, entity, entity_pid
+	,	log_nodename(), entity, entity_pid
 	,	(pristr ? pristr : "")
 	,	(pristr ? ": " : "")
 	,	msg);
@@ -540,13 +658,84 @@ append_log(FILE * fp, const char * entity, int entity_pid
 struct log_file_context {
 	FILE *fp;
 	struct stat stat_buf;
+	char *wbuf;	/* batched lines not written yet, see below */
+	size_t wlen;
 };
 
 static struct log_file_context log_file, debug_file;
 
+/*
+ * With cl_log_use_batched_io() the lines bypass stdio: they are
+ * formatted straight into a large per file buffer, which goes out in
+ * a single write() when it is full or on cl_log_do_fflush(). The file
+ * is opened for appending, so there is no offset to keep track of.
+ */
+static void write_log_file(struct log_file_context *lfc
+,	const char * buf, size_t len)
+{
+	size_t	done = 0;
+	ssize_t	rc;
+
+	while (done < len) {
+		rc = write(fileno(lfc->fp), buf + done, len - done);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* nowhere else to complain, drop the batch */
+			syslog(LOG_ERR, "Failed to write %lu bytes of log: %s"
+			,	(unsigned long)(len - done), strerror(errno));
+			break;
+		}
+		done += rc;
+	}
+}
+
+static void flush_log_file(struct log_file_context *lfc)
+{
+	write_log_file(lfc, lfc->wbuf, lfc->wlen);
+	lfc->wlen = 0;
+}
+
+static void append_log_batched(struct log_file_context *lfc
+,	const char * entity, int entity_pid, TIME_T ts
+,	const char * pristr, const char * msg)
+{
+	char *	line;
+	int	len;
+
+	len = cl_log_format_line(lfc->wbuf + lfc->wlen, batched_io_size - lfc->wlen
+	,	entity, entity_pid, ts, pristr, msg);
+	if (len < 0) {
+		return;
+	}
+	if ((size_t)len < batched_io_size - lfc->wlen) {
+		lfc->wlen += len;
+		return;
+	}
+	flush_log_file(lfc);
+	if ((size_t)len < batched_io_size) {
+		lfc->wlen = cl_log_format_line(lfc->wbuf, batched_io_size
+		,	entity, entity_pid, ts, pristr, msg);
+		return;
+	}
+	/* longer than the whole buffer: write it on its own */
+	if ((line = malloc(len + 1)) == NULL) {
+		return;
+	}
+	cl_log_format_line(line, len + 1, entity, entity_pid, ts, pristr, msg);
+	write_log_file(lfc, line, len);
+	free(line);
+}
+
 static void close_log_file(struct log_file_context *lfc)
 {
 	/* ignore errors, we cannot do anything about them anyways */
+	if (lfc->wbuf) {
+		flush_log_file(lfc);
+		free(lfc->wbuf);
+		lfc->wbuf = NULL;
+	}
 	fflush(lfc->fp);
 	fsync(fileno(lfc->fp));
 	fclose(lfc->fp);
@@ -583,12 +772,25 @@ static void open_log_file(const char *fname, struct log_file_context *lfc)
 		       fname, strerror(errno));
 	} else {
 		setvbuf(lfc->fp, NULL,
-				use_buffered_io ? _IOFBF : _IONBF,
+				use_buffered_io && !batched_io_size
+				?	_IOFBF : _IONBF,
 				BUFSIZ);
 		fstat(fileno(lfc->fp), &lfc->stat_buf);
+		if (batched_io_size) {
+			/* without it, the lines go through stdio */
+			lfc->wbuf = malloc(batched_io_size);
+			lfc->wlen = 0;
+		}
 	}
 }
 
+/* for those who know the files were moved, see ha_logd */
+void cl_log_check_log_files(void)
+{
+	maybe_close_log_file(logfile_name, &log_file);
+	maybe_close_log_file(debugfile_name, &debug_file);
+}
+
 static void maybe_reopen_log_files(const char *log_fname, const char *debug_fname)
 {
 	static TIME_T last_stat_time;
@@ -662,10 +864,14 @@ cl_direct_log(int priority, const char* buf, gboolean use_priority_str,
 
 	maybe_reopen_log_files(logfile_name, debugfile_name);
 
-	if (debug_file.fp)
+	if (debug_file.wbuf)
+		append_log_batched(&debug_file, entity, entity_pid, ts, pristr, buf);
+	else if (debug_file.fp)
 		append_log(debug_file.fp, entity, entity_pid, ts, pristr, buf);
 
-	if (priority != LOG_DEBUG && log_file.fp)
+	if (priority != LOG_DEBUG && log_file.wbuf)
+		append_log_batched(&log_file, entity, entity_pid, ts, pristr, buf);
+	else if (priority != LOG_DEBUG && log_file.fp)
 		append_log(log_file.fp, entity, entity_pid, ts, pristr, buf);
 
 	if (needprivs) {
@@ -676,6 +882,10 @@ cl_direct_log(int priority, const char* buf, gboolean use_priority_str,
 
 void cl_log_do_fflush(int do_fsync)
 {
+	if (log_file.wbuf)
+		flush_log_file(&log_file);
+	if (debug_file.wbuf)
+		flush_log_file(&debug_file);
 	if (log_file.fp) {
 		fflush(log_file.fp);
 		if (do_fsync)
@@ -696,6 +906,455 @@ void cl_log_do_fflush(int do_fsync)
 
 static int	cl_log_depth = 0;
 
+/* send a formatted message wherever it has to go */
+static void
+cl_log_deliver(int priority, const char * buf, ssize_t nbytes, TIME_T ts
+,	const struct cl_logfield * fields, int nfields)
+{
+	if (stderr_enabled) {
+		append_log(stderr, cl_log_entity,cl_process_pid,
+			ts, prio2str(priority), buf);
+	}
+
+	if (stdout_enabled) {
+		append_log(stdout, cl_log_entity,cl_process_pid,
+			ts, prio2str(priority), buf);
+	}
+
+	if (use_logging_daemon && cl_log_depth <= 1) {
+		LogToLoggingDaemon(priority, buf, nbytes, TRUE, ts
+		,	fields, nfields);
+	}else{
+		/* this may cause blocking... maybe should make it optional? */ 
+		cl_direct_log(priority, buf, TRUE, NULL, cl_process_pid, ts);
+	}
+}
+
+/*
+ * Deferred logging (cl_log_set_deferred()): cl_log() doesn't format
+ * the message, it parses the format just far enough to know the types
+ * of the arguments and copies the format, the arguments and the strings
+ * they point to into a ring. The messages are formatted and delivered
+ * later from the main loop, by cl_log_drain(), when the ring is full,
+ * or right before a message of LOG_ERR or worse, which is never
+ * deferred. Formats with conversions we can't copy the arguments of
+ * (%n, %m, long double, wide characters) are logged at once as well.
+ *
+ * The ring is only used by the main loop of one process, so there is
+ * nothing to lock. A child inherits the ring of its parent; it throws
+ * the copy away and logs directly, it has no main loop to drain it.
+ */
+#define	DEFER_MAXARGS	24
+#define	DEFER_MAXSPEC	32
+#define	DEFER_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+enum defer_kind {
+	DK_INT, DK_LONG, DK_LLONG, DK_SIZE, DK_PTRDIFF, DK_INTMAX
+,	DK_DOUBLE, DK_PTR, DK_STR
+};
+
+union defer_arg {
+	long long	ll;
+	double		d;
+	const void*	p;
+};
+
+struct deferred_log {
+	size_t		len;		/* of the record, 0: wrapped */
+	int		priority;
+	int		nargs;
+	TIME_T		ts;
+	/* nargs union defer_arg, the format, the strings */
+};
+
+static char*	defer_ring = NULL;
+static size_t	defer_size = 0;
+static size_t	defer_head = 0;	/* oldest record */
+static size_t	defer_tail = 0;	/* where the next one goes */
+static size_t	defer_used = 0;
+static int	defer_pid = 0;
+static guint	defer_drain_id = 0;
+static gboolean	defer_draining = FALSE;
+
+/*
+ * Parse the conversion spec after a '%': the kinds of the arguments
+ * it takes ('*' width and precision first) go to kinds, the return
+ * value is how many, -1 if it can't be deferred. *len is set to the
+ * length of the spec, *prec to the precision (-1 none, -2 '*').
+ */
+static int
+defer_parse_conv(const char * spec, size_t * len, enum defer_kind * kinds
+,	long * prec)
+{
+	const char *	p = spec;
+	int		n = 0;
+	int		kind = DK_INT;
+
+	*prec = -1;
+	p += strspn(p, "-+ #0'");
+	if (*p == '*') {
+		kinds[n++] = DK_INT;
+		p++;
+	}
+	while (isdigit((unsigned char)*p)) {
+		p++;
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			kinds[n++] = DK_INT;
+			*prec = -2;
+			p++;
+		} else {
+			*prec = strtol(p, NULL, 10);
+		}
+		while (isdigit((unsigned char)*p)) {
+			p++;
+		}
+	}
+	switch (*p) {
+	case 'h':
+		p += p[1] == 'h' ? 2 : 1;
+		break;
+	case 'l':
+		if (p[1] == 'l') {
+			kind = DK_LLONG;
+			p += 2;
+		} else {
+			kind = DK_LONG;
+			p++;
+		}
+		break;
+	case 'q':	kind = DK_LLONG;	p++; break;
+	case 'j':	kind = DK_INTMAX;	p++; break;
+	case 'z':	kind = DK_SIZE;		p++; break;
+	case 't':	kind = DK_PTRDIFF;	p++; break;
+	}
+	switch (*p) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		kinds[n++] = kind;
+		break;
+	case 'c':
+		if (kind != DK_INT || p[-1] == 'l') {
+			return -1;
+		}
+		kinds[n++] = DK_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		if (p > spec && strchr("hqjzt", p[-1]) != NULL) {
+			return -1;
+		}
+		kinds[n++] = DK_DOUBLE;
+		break;
+	case 's':
+		if (p > spec && strchr("hlqjzt", p[-1]) != NULL) {
+			return -1;
+		}
+		kinds[n++] = DK_STR;
+		break;
+	case 'p':
+		kinds[n++] = DK_PTR;
+		break;
+	case '%':
+		break;
+	default:
+		return -1;
+	}
+	*len = p + 1 - spec;
+	return *len < DEFER_MAXSPEC - 1 ? n : -1;
+}
+
+/* room for len bytes at the tail of the ring, NULL if full */
+static void*
+defer_reserve(size_t len)
+{
+	void*	rec;
+
+	if (defer_used == 0) {
+		defer_head = defer_tail = 0;
+	}
+	if (defer_tail >= defer_head && defer_size - defer_tail < len
+	&&	defer_used + (defer_size - defer_tail) + len <= defer_size) {
+		/* doesn't fit at the end, but at the start */
+		((struct deferred_log*)(defer_ring + defer_tail))->len = 0;
+		defer_used += defer_size - defer_tail;
+		defer_tail = 0;
+	}
+	if ((defer_tail >= defer_head && defer_used != defer_size
+	&&		defer_size - defer_tail >= len)
+	||	(defer_tail < defer_head && defer_head - defer_tail >= len)) {
+		rec = defer_ring + defer_tail;
+		defer_tail += len;
+		defer_used += len;
+		if (defer_tail == defer_size) {
+			defer_tail = 0;
+		}
+		return rec;
+	}
+	return NULL;
+}
+
+/* vsnprintf() with the arguments of a record */
+static int
+defer_format(const struct deferred_log * rec, char * buf, size_t size)
+{
+	const union defer_arg*	args = (const union defer_arg*)(rec + 1);
+	const char*		p = (const char*)(args + rec->nargs);
+	enum defer_kind		kinds[3];
+	char			spec[DEFER_MAXSPEC];
+	char*			out;
+	size_t			used = 0;
+	size_t			room;
+	size_t			len;
+	long			prec;
+	int			star[2];
+	int			nstar, n;
+	int			rc = 0;
+	union defer_arg		v;
+
+	/* what doesn't fit is cut off, like vsnprintf() would */
+	while (*p != EOS && used < size - 1) {
+		out = buf + used;
+		room = size - used;
+		if (*p != '%') {
+			len = strcspn(p, "%");
+			memcpy(out, p, len < room - 1 ? len : room - 1);
+			used += len < room - 1 ? len : room - 1;
+			p += len;
+			continue;
+		}
+		n = defer_parse_conv(p+1, &len, kinds, &prec);
+		memcpy(spec, p, len + 1);
+		spec[len + 1] = EOS;
+		p += len + 1;
+		if (n == 0) {
+			*out = '%';
+			used++;
+			continue;
+		}
+		for (nstar = 0; nstar < n - 1; nstar++) {
+			star[nstar] = (int)(args++)->ll;
+		}
+		v = *args++;
+		/*
+		 * spec comes from the record's format, and
+		 * defer_parse_conv() picked the argument type for it
+		 */
+#if defined(__GNUC__)
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+#define DEFER_PRINT(x) (nstar == 0 \
+		?	snprintf(out, room, spec, x) \
+		:	nstar == 1 \
+		?	snprintf(out, room, spec, star[0], x) \
+		:	snprintf(out, room, spec, star[0], star[1], x))
+		switch (kinds[n-1]) {
+		case DK_INT:	rc = DEFER_PRINT((int)v.ll); break;
+		case DK_LONG:	rc = DEFER_PRINT((long)v.ll); break;
+		case DK_LLONG:	rc = DEFER_PRINT(v.ll); break;
+		case DK_SIZE:	rc = DEFER_PRINT((size_t)v.ll); break;
+		case DK_PTRDIFF: rc = DEFER_PRINT((ptrdiff_t)v.ll); break;
+		case DK_INTMAX:	rc = DEFER_PRINT((intmax_t)v.ll); break;
+		case DK_DOUBLE:	rc = DEFER_PRINT(v.d); break;
+		case DK_PTR:	rc = DEFER_PRINT(v.p); break;
+		case DK_STR:
+			rc = DEFER_PRINT(v.ll < 0 ? "(null)"
+			:	(const char*)rec + v.ll);
+			break;
+		}
+#undef DEFER_PRINT
+#if defined(__GNUC__)
+#	pragma GCC diagnostic pop
+#endif
+		if (rc > 0) {
+			used += (size_t)rc < room - 1 ? (size_t)rc : room - 1;
+		}
+	}
+	buf[used] = EOS;
+	return used;
+}
+
+static void
+defer_discard(void)
+{
+	defer_head = defer_tail = defer_used = 0;
+}
+
+void
+cl_log_drain(void)
+{
+	struct deferred_log*	rec;
+	char			buf[MAXLINE];
+	int			nbytes;
+
+	if (defer_draining || defer_used == 0) {
+		return;
+	}
+	if (defer_pid != (int)getpid()) {
+		defer_discard();
+		return;
+	}
+	defer_draining = TRUE;
+	while (defer_used > 0) {
+		rec = (struct deferred_log*)(defer_ring + defer_head);
+		if (rec->len == 0) {
+			defer_used -= defer_size - defer_head;
+			defer_head = 0;
+			continue;
+		}
+		nbytes = defer_format(rec, buf, sizeof(buf));
+		if (nbytes >= (int)sizeof(buf)) {
+			nbytes = sizeof(buf) - 1;
+		}
+		cl_log_deliver(rec->priority, buf, nbytes, rec->ts
+		,	NULL, 0);
+		defer_used -= rec->len;
+		defer_head += rec->len;
+		if (defer_head == defer_size) {
+			defer_head = 0;
+		}
+	}
+	defer_draining = FALSE;
+}
+
+static gboolean
+defer_drain_idle(gpointer data)
+{
+	defer_drain_id = 0;
+	cl_log_drain();
+	return FALSE;
+}
+
+/* record a cl_log() call, FALSE if it has to be logged right away */
+static gboolean
+cl_log_defer(int priority, const char * fmt, va_list ap)
+{
+	enum defer_kind		kinds[DEFER_MAXARGS];
+	union defer_arg		args[DEFER_MAXARGS];
+	size_t			slen[DEFER_MAXARGS];
+	long			prec[DEFER_MAXARGS];
+	long			cprec;
+	size_t			fmtlen, reclen, len, off;
+	struct deferred_log*	rec;
+	const char*		p;
+	int			nargs = 0;
+	int			n, j;
+
+	if (priority <= LOG_ERR || defer_draining || cl_log_depth > 1) {
+		cl_log_drain();
+		return FALSE;
+	}
+	if (defer_pid != cl_process_pid) {
+		/* forked: the parent logs what's in the ring */
+		defer_discard();
+		free(defer_ring);
+		defer_ring = NULL;
+		defer_size = 0;
+		return FALSE;
+	}
+	for (p = strchr(fmt, '%'); p != NULL; p = strchr(p + 1 + len, '%')) {
+		if (nargs + 3 > DEFER_MAXARGS
+		||	(n = defer_parse_conv(p+1, &len, kinds + nargs
+			,	&cprec)) < 0) {
+			cl_log_drain();
+			return FALSE;
+		}
+		nargs += n;
+		if (n > 0) {
+			prec[nargs - 1] = cprec;
+		}
+	}
+	fmtlen = strlen(fmt) + 1;
+	reclen = sizeof(*rec) + nargs * sizeof(union defer_arg) + fmtlen;
+	for (j = 0; j < nargs; j++) {
+		switch (kinds[j]) {
+		case DK_INT:	args[j].ll = va_arg(ap, int); break;
+		case DK_LONG:	args[j].ll = va_arg(ap, long); break;
+		case DK_LLONG:	args[j].ll = va_arg(ap, long long); break;
+		case DK_SIZE:	args[j].ll = va_arg(ap, size_t); break;
+		case DK_PTRDIFF: args[j].ll = va_arg(ap, ptrdiff_t); break;
+		case DK_INTMAX:	args[j].ll = va_arg(ap, intmax_t); break;
+		case DK_DOUBLE:	args[j].d = va_arg(ap, double); break;
+		case DK_PTR:	args[j].p = va_arg(ap, void*); break;
+		case DK_STR:
+			args[j].p = va_arg(ap, const char*);
+			if (prec[j] == -2) {
+				prec[j] = args[j-1].ll;
+			}
+			/* "%.*s" may well point at no terminated string */
+			slen[j] = args[j].p == NULL ? 0
+			:	prec[j] >= 0 ? strnlen(args[j].p, prec[j]) + 1
+			:	strlen(args[j].p) + 1;
+			reclen += slen[j];
+			break;
+		}
+	}
+	reclen = DEFER_ALIGN(reclen);
+	if (reclen > defer_size / 4) {
+		cl_log_drain();
+		return FALSE;
+	}
+	if ((rec = defer_reserve(reclen)) == NULL) {
+		cl_log_drain();
+		rec = defer_reserve(reclen);
+	}
+	rec->len = reclen;
+	rec->priority = priority;
+	rec->nargs = nargs;
+	rec->ts = time(NULL);
+	off = sizeof(*rec) + nargs * sizeof(union defer_arg);
+	memcpy((char*)rec + off, fmt, fmtlen);
+	off += fmtlen;
+	for (j = 0; j < nargs; j++) {
+		if (kinds[j] != DK_STR) {
+			continue;
+		}
+		if (args[j].p == NULL) {
+			args[j].ll = -1;
+			continue;
+		}
+		len = slen[j];
+		memcpy((char*)rec + off, args[j].p, len - 1);
+		((char*)rec)[off + len - 1] = EOS;
+		args[j].ll = off;
+		off += len;
+	}
+	memcpy(rec + 1, args, nargs * sizeof(union defer_arg));
+	if (defer_drain_id == 0) {
+		defer_drain_id = g_idle_add_full(G_PRIORITY_DEFAULT
+		,	defer_drain_idle, NULL, NULL);
+	}
+	return TRUE;
+}
+
+int
+cl_log_set_deferred(size_t ringsize)
+{
+	static gboolean	atexit_done = FALSE;
+
+	cl_log_drain();
+	free(defer_ring);
+	defer_ring = NULL;
+	defer_size = 0;
+	defer_discard();
+	if (ringsize == 0) {
+		return HA_OK;
+	}
+	ringsize = DEFER_ALIGN(ringsize);
+	if ((defer_ring = malloc(ringsize)) == NULL) {
+		return HA_FAIL;
+	}
+	defer_size = ringsize;
+	defer_pid = (int)getpid();
+	if (!atexit_done) {
+		atexit(cl_log_drain);
+		atexit_done = TRUE;
+	}
+	return HA_OK;
+}
+
 /* Cluster logging function */
 void
 cl_log(int priority, const char * fmt, ...)
@@ -708,6 +1367,18 @@ cl_log(int priority, const char * fmt, ...)
 
 	cl_log_depth++;
 
+	if (defer_ring) {
+		gboolean	deferred;
+
+		va_start(ap, fmt);
+		deferred = cl_log_defer(priority, fmt, ap);
+		va_end(ap);
+		if (deferred) {
+			cl_log_depth--;
+			return;
+		}
+	}
+
 	buf[MAXLINE-1] = EOS;
 	va_start(ap, fmt);
 	nbytes=vsnprintf(buf, sizeof(buf), fmt, ap);
@@ -717,25 +1388,42 @@ cl_log(int priority, const char * fmt, ...)
 		nbytes =  sizeof(buf) -1 ;
 	}
 
-	if (stderr_enabled) {
-		append_log(stderr, cl_log_entity,cl_process_pid,
-			NULLTIME, prio2str(priority), buf);
-	}
+	cl_log_deliver(priority, buf, nbytes, NULLTIME, NULL, 0);
+	
+	cl_log_depth--;
+	return;
+}
 
-	if (stdout_enabled) {
-		append_log(stdout, cl_log_entity,cl_process_pid,
-			NULLTIME, prio2str(priority), buf);
-	}
+/*
+ * cl_log() with key/value fields. The text should say what the fields
+ * say, they are only kept apart (in binary records) when logd takes
+ * them. These messages aren't deferred.
+ */
+void
+cl_log_fields(int priority, const struct cl_logfield * fields, int nfields
+,	const char * fmt, ...)
+{
+	va_list		ap;
+	char		buf[MAXLINE];
+	ssize_t		nbytes;
 
-	if (use_logging_daemon && cl_log_depth <= 1) {
-		LogToLoggingDaemon(priority, buf, nbytes, TRUE);
-	}else{
-		/* this may cause blocking... maybe should make it optional? */ 
-		cl_direct_log(priority, buf, TRUE, NULL, cl_process_pid, NULLTIME);
+	cl_process_pid = (int)getpid();
+	cl_log_drain();
+
+	cl_log_depth++;
+
+	buf[MAXLINE-1] = EOS;
+	va_start(ap, fmt);
+	nbytes=vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (nbytes >= (ssize_t)sizeof(buf)){
+		nbytes =  sizeof(buf) -1 ;
 	}
-	
+
+	cl_log_deliver(priority, buf, nbytes, NULLTIME, fields, nfields);
+
 	cl_log_depth--;
-	return;
 }
 
 /*
@@ -809,18 +1497,22 @@ cl_limit_log_update(struct msg_ctrl *ml, time_t ts)
 		ml->cnt++;
 }
 
-void
-cl_limit_log(struct msg_ctrl *ml, int priority, const char * fmt, ...)
+/*
+ * The accounting of cl_limit_log(), for those who don't log the
+ * messages themselves (see ha_logd). TRUE if one more message may go
+ * at now; *started (if not NULL) tells whether this one started the
+ * suppression.
+ */
+gboolean
+cl_limit_log_allow(struct msg_ctrl *ml, time_t now, gboolean *started)
 {
-	va_list ap;
-	char buf[MAXLINE];
-	time_t last_ts, now = time(NULL);
+	time_t last_ts;
 
-	if (!ml)
-		goto log_msg;
+	if (started)
+		*started = FALSE;
 	if (ml->suppress_t) {
 		if ((now - ml->suppress_t) < ml->lspam->reset_time)
-			return;
+			return FALSE;
 		/* message blocking expired */
 		cl_limit_log_reset(ml);
 	}
@@ -830,18 +1522,32 @@ cl_limit_log(struct msg_ctrl *ml, int priority, const char * fmt, ...)
 		(now - last_ts) > ml->lspam->window /* messages far apart */
 	) {
 		cl_limit_log_update(ml, now);
-		goto log_msg;
-	} else {
-		cl_log(LOG_INFO
-			, "'%s' messages logged too often, "
-			"suppressing messages of this kind for %ld seconds"
-			, ml->lspam->id, ml->lspam->reset_time);
-		cl_log(priority, "%s", ml->lspam->advice);
-		ml->suppress_t = now;
+		return TRUE;
+	}
+	ml->suppress_t = now;
+	if (started)
+		*started = TRUE;
+	return FALSE;
+}
+
+void
+cl_limit_log(struct msg_ctrl *ml, int priority, const char * fmt, ...)
+{
+	va_list ap;
+	char buf[MAXLINE];
+	gboolean started;
+
+	if (ml && !cl_limit_log_allow(ml, time(NULL), &started)) {
+		if (started) {
+			cl_log(LOG_INFO
+				, "'%s' messages logged too often, "
+				"suppressing messages of this kind for %ld seconds"
+				, ml->lspam->id, ml->lspam->reset_time);
+			cl_log(priority, "%s", ml->lspam->advice);
+		}
 		return;
 	}
 
-log_msg:
 	va_start(ap, fmt);
 	vsnprintf(buf, MAXLINE, fmt, ap);
 	va_end(ap);
@@ -889,6 +1595,7 @@ static char *
 syslog_timestamp(TIME_T t)
 {
 	static char		ts[64];
+	static TIME_T		last = 0;
 	struct tm*		ttm;
 	TIME_T			now;
 	time_t			nowtt;
@@ -906,6 +1613,11 @@ syslog_timestamp(TIME_T t)
 		now = t;
 	}
 
+	/* many lines per second in a busy log */
+	if (now == last) {
+		return(ts);
+	}
+	last = now;
 	nowtt = (time_t)now;
 	ttm = localtime(&nowtt);
 
@@ -921,6 +1633,7 @@ char *
 ha_timestamp(TIME_T t)
 {
 	static char ts[64];
+	static TIME_T	last = 0;
 	struct tm*	ttm;
 	TIME_T		now;
 	time_t		nowtt;
@@ -932,6 +1645,10 @@ ha_timestamp(TIME_T t)
 		now = t;
 	}
 
+	if (now == last) {
+		return(ts);
+	}
+	last = now;
 	nowtt = (time_t)now;
 	ttm = localtime(&nowtt);
 
@@ -985,7 +1702,8 @@ LogToDaemon(int priority, const char * buf,
 	
 	cl_log_depth++;
 
-	rc= LogToLoggingDaemon(priority, buf, bufstrlen, use_pri_str);
+	rc= LogToLoggingDaemon(priority, buf, bufstrlen, use_pri_str, NULLTIME
+	,	NULL, 0);
 	
 	cl_log_depth--;
 	
@@ -993,10 +1711,51 @@ LogToDaemon(int priority, const char * buf,
 }
 
 static int		drop_msg_num = 0;
+static int		drop_pri_num[LOG_DEBUG+1];
+
+/*
+ * When logd is behind, the low priorities go first: debug messages
+ * are dropped once the queue is half full, info and notice at three
+ * quarters. The rest of the queue is kept for warnings, the last
+ * QUEUE_SATURATION_FUZZ slots for errors and the message telling how
+ * many were dropped. Errors which don't fit are logged directly.
+ */
+static gboolean
+logd_has_room(IPC_Channel* chan, int priority)
+{
+	long	qlen = chan->send_queue->current_qlen;
+	long	max = chan->send_queue->max_qlen;
+
+	if (priority <= LOG_ERR) {
+		return qlen < max;
+	}
+	if (priority == LOG_WARNING) {
+		return qlen < max - 1 - QUEUE_SATURATION_FUZZ;
+	}
+	if (priority >= LOG_DEBUG) {
+		return qlen < max / 2;
+	}
+	return qlen < (max * 3) / 4;
+}
+
+static void
+logd_drop(int priority)
+{
+	drop_msg_num++;
+	drop_pri_num[priority & LOG_PRIMASK]++;
+}
+
+static void
+logd_drop_reset(void)
+{
+	drop_msg_num = 0;
+	memset(drop_pri_num, 0, sizeof(drop_pri_num));
+}
 
 void
 cl_flush_logs(void) 
 {
+	cl_log_drain();
 	if(logging_daemon_chan == NULL) {
 		return;
 	}
@@ -1005,7 +1764,8 @@ cl_flush_logs(void)
 
 static int
 LogToLoggingDaemon(int priority, const char * buf, 
-		   int bufstrlen, gboolean use_pri_str)
+		   int bufstrlen, gboolean use_pri_str, TIME_T ts,
+		   const struct cl_logfield * fields, int nfields)
 {
 	IPC_Channel*		chan = logging_daemon_chan;
 	static longclock_t	nexttime = 0;
@@ -1030,60 +1790,70 @@ LogToLoggingDaemon(int priority, const char * buf,
 
 	if (chan == NULL){
 		cl_direct_log(
-			priority, buf, TRUE, NULL, cl_process_pid, NULLTIME);
+			priority, buf, TRUE, NULL, cl_process_pid, ts);
 		return HA_FAIL;
 	}
 
-	msg = ChildLogIPCMessage(priority, buf, bufstrlen, use_pri_str, chan);	
+	if (chan == logd_hello_chan) {
+		/* the answer came in with our last send */
+		logd_read_answer(chan);
+	}
+	if (chan->ch_status == IPC_CONNECT) {
+		if (chan->ops->is_sending_blocked(chan)) {
+			chan->ops->resume_io(chan);
+		}
+		if (!logd_has_room(chan, priority)) {
+			if (priority <= LOG_ERR) {
+				cl_direct_log(priority, buf, TRUE, NULL
+				,	cl_process_pid, ts);
+			}else{
+				logd_drop(priority);
+			}
+			return HA_FAIL;
+		}
+	}
+	if (chan == logd_rec_chan) {
+		msg = ChildLogRecMessage(priority, buf, bufstrlen, use_pri_str
+		,	chan, ts, fields, nfields);
+	}else{
+		msg = ChildLogIPCMessage(priority, buf, bufstrlen, use_pri_str
+		,	chan, ts);
+	}
 	if (msg == NULL) {
-		drop_msg_num++;
+		logd_drop(priority);
 		return HA_FAIL;
 	}
 	
 	if (chan->ch_status == IPC_CONNECT){		
 		
-		if (chan->ops->is_sending_blocked(chan)) {
-			chan->ops->resume_io(chan);
-		}
-		/* Make sure there is room for the drop message _and_ the
-		 * one we wish to log.  Otherwise there is no point.
-		 *
-		 * Try to avoid bouncing on the limit by additionally
-		 * waiting until there is room for QUEUE_SATURATION_FUZZ
-		 * messages.
+		/* Tell about the dropped messages once we're well below
+		 * the point where debug messages are dropped, so that
+		 * there is room for more than the drop message, and we
+		 * don't bounce on the limit.
 		 */
 		if (drop_msg_num > 0
 		    && chan->send_queue->current_qlen
-		    < (chan->send_queue->max_qlen -1 -QUEUE_SATURATION_FUZZ))
+		    < chan->send_queue->max_qlen / 4)
 		{
 			/* have to send it this way so the order is correct */
 			send_dropped_message(use_pri_str, chan);
 		}
-	
-		/* Don't log a debug message if we're
-		 * approaching the queue limit and already
-		 * dropped a message
-		 */
-		if (drop_msg_num == 0
-		    || chan->send_queue->current_qlen <
-		      (chan->send_queue->max_qlen -1 -QUEUE_SATURATION_FUZZ)
-		    || priority != LOG_DEBUG )
-		{
-			sendrc =  chan->ops->send(chan, msg);
-		}
+		sendrc =  chan->ops->send(chan, msg);
 	}
 
 	if (sendrc == IPC_OK) {
 		return HA_OK;
 		
 	} else {
+		/* the entity may have gone with this message */
+		rec_entity_chan = NULL;
 		
 		if (chan->ops->get_chan_status(chan) != IPC_CONNECT) {
 			if (!logging_chan_in_main_loop){
 				chan->ops->destroy(chan);
 			}
 			logging_daemon_chan = NULL;
-			cl_direct_log(priority, buf, TRUE, NULL, cl_process_pid, NULLTIME);
+			cl_direct_log(priority, buf, TRUE, NULL, cl_process_pid, ts);
 
 			if (drop_msg_num > 0){
 				/* Direct logging here is ok since we're
@@ -1095,12 +1865,17 @@ LogToLoggingDaemon(int priority, const char * buf,
 				       " : channel destroyed", drop_msg_num);
 			}
 			
-			drop_msg_num=0;
+			logd_drop_reset();
 			FreeChildLogIPCMessage(msg);
 			return HA_FAIL;
 		}
 
-		drop_msg_num++;
+		if (priority <= LOG_ERR) {
+			cl_direct_log(priority, buf, TRUE, NULL
+			,	cl_process_pid, ts);
+		}else{
+			logd_drop(priority);
+		}
 
 	}
 	
@@ -1113,14 +1888,31 @@ static gboolean
 send_dropped_message(gboolean use_pri_str, IPC_Channel *chan)
 {
 	int sendrc;
-	char buf[64];
+	char buf[128];
 	int buf_len = 0;
+	int pri;
+	const char *sep = " (";
 	IPC_Message *drop_msg = NULL;
 
-	memset(buf, 0, 64);
-	snprintf(buf, 64, "cl_log: %d messages were dropped", drop_msg_num);
+	memset(buf, 0, sizeof(buf));
+	snprintf(buf, sizeof(buf), "cl_log: %d messages were dropped"
+	,	drop_msg_num);
+	for (pri = LOG_DEBUG; pri >= 0; pri--) {
+		if (drop_pri_num[pri] == 0) {
+			continue;
+		}
+		buf_len = strlen(buf);
+		snprintf(buf + buf_len, sizeof(buf) - buf_len, "%s%s %d"
+		,	sep, prio2str(pri), drop_pri_num[pri]);
+		sep = ", ";
+	}
+	if (*sep == ',') {
+		buf_len = strlen(buf);
+		snprintf(buf + buf_len, sizeof(buf) - buf_len, ")");
+	}
 	buf_len = strlen(buf)+1;
-	drop_msg = ChildLogIPCMessage(LOG_ERR, buf, buf_len, use_pri_str, chan);
+	drop_msg = ChildLogIPCMessage(LOG_ERR, buf, buf_len, use_pri_str, chan
+	,	NULLTIME);
 
 	if(drop_msg == NULL || drop_msg->msg_len == 0) {
 		return FALSE;
@@ -1129,7 +1921,7 @@ send_dropped_message(gboolean use_pri_str, IPC_Channel *chan)
 	sendrc = chan->ops->send(chan, drop_msg);
 
 	if(sendrc == IPC_OK) {
-		drop_msg_num = 0;
+		logd_drop_reset();
 	}else{
 		FreeChildLogIPCMessage(drop_msg);
 	}
@@ -1139,7 +1931,7 @@ send_dropped_message(gboolean use_pri_str, IPC_Channel *chan)
 
 static IPC_Message*
 ChildLogIPCMessage(int priority, const char *buf, int bufstrlen, 
-		   gboolean use_prio_str, IPC_Channel* ch)
+		   gboolean use_prio_str, IPC_Channel* ch, TIME_T ts)
 {
 	IPC_Message*	ret;
 	LogDaemonMsgHdr	logbuf;
@@ -1177,7 +1969,7 @@ ChildLogIPCMessage(int priority, const char *buf, int bufstrlen,
 	logbuf.priority = priority;
 	logbuf.use_pri_str = use_prio_str;
 	logbuf.entity_pid = getpid();
-	logbuf.timestamp = time(NULL);
+	logbuf.timestamp = ts != NULLTIME ? ts : (TIME_T)time(NULL);
 	if (*cl_log_entity){
 		strncpy(logbuf.entity,cl_log_entity,MAXENTITY);
 	}else {
@@ -1200,6 +1992,75 @@ ChildLogIPCMessage(int priority, const char *buf, int bufstrlen,
 }
 
 
+static IPC_Message*
+ChildLogRecMessage(int priority, const char *buf, int bufstrlen,
+		   gboolean use_prio_str, IPC_Channel* ch, TIME_T ts,
+		   const struct cl_logfield * fields, int nfields)
+{
+	IPC_Message*		ret;
+	struct cl_logrec	rec;
+	const char*		entity;
+	char*			bodybuf;
+	size_t			maxlen;
+	int			len;
+
+	if (ch->msgpad > MAX_MSGPAD) {
+		cl_log(LOG_ERR, "ChildLogRecMessage: invalid msgpad(%d)",
+		       ch->msgpad);
+		return NULL;
+	}
+	entity = *cl_log_entity ? cl_log_entity : DFLT_ENTITY;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.flags = use_prio_str ? LD_REC_PRISTR : 0;
+	rec.priority = priority;
+	rec.pid = getpid();
+	rec.timestamp = ts != NULLTIME ? ts : (TIME_T)time(NULL);
+	if (rec_entity_chan != ch
+	||	strncmp(rec_entity, entity, MAXENTITY) != 0) {
+		rec_entity_chan = ch;
+		strncpy(rec_entity, entity, MAXENTITY);
+		rec_entity[MAXENTITY-1] = EOS;
+		rec_entity_id++;
+		rec.flags |= LD_REC_ENTITY;
+		rec.entity = rec_entity;
+		rec.entity_len = strlen(rec_entity);
+	}
+	rec.entity_id = rec_entity_id;
+	if (nfields > LD_REC_MAXFIELDS) {
+		nfields = LD_REC_MAXFIELDS;
+	}
+	if (nfields > 0) {
+		memcpy(rec.fields, fields, nfields * sizeof(fields[0]));
+		rec.nfields = nfields;
+	}
+	rec.text = buf;
+	rec.textlen = bufstrlen;
+
+	maxlen = cl_logrec_maxlen(&rec);
+	if ((ret = malloc(sizeof(IPC_Message))) == NULL) {
+		return NULL;
+	}
+	memset(ret, 0, sizeof(IPC_Message));
+	if ((bodybuf = malloc(maxlen + ch->msgpad)) == NULL) {
+		free(ret);
+		return NULL;
+	}
+	len = cl_logrec_encode(&rec, bodybuf + ch->msgpad, maxlen);
+	if (len < 0) {
+		free(bodybuf);
+		free(ret);
+		return NULL;
+	}
+	ret->msg_len = len;
+	ret->msg_buf = bodybuf;
+	ret->msg_body = bodybuf + ch->msgpad;
+	ret->msg_done = FreeChildLogIPCMessage;
+	ret->msg_ch = ch;
+
+	return ret;
+}
+
 static void
 FreeChildLogIPCMessage(IPC_Message* msg)
 {
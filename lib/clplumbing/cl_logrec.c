@@ -0,0 +1,213 @@
+/*
+ * binary log records for the logging daemon
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* The format is described in loggingdaemon.h */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/loggingdaemon.h>
+
+#define VARINT_MAXLEN	10
+
+static const char * logfield_names[] = {
+	NULL, "rsc", "op", "call_id", "rc", "exec_ms"
+};
+
+const char *
+cl_logfield_name(int key)
+{
+	if (key <= 0 || key >= DIMOF(logfield_names)) {
+		return NULL;
+	}
+	return logfield_names[key];
+}
+
+static char*
+put_varint(char* p, unsigned long long v)
+{
+	while (v >= 0x80) {
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char)v;
+	return p;
+}
+
+/* NULL if the varint is cut off or too long */
+static const char*
+get_varint(const char* p, const char* end, unsigned long long* v)
+{
+	unsigned long long	x = 0;
+	int			shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		x |= (unsigned long long)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*v = x;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static size_t
+field_strlen(const struct cl_logfield* f)
+{
+	return f->len ? f->len : strlen(f->str);
+}
+
+size_t
+cl_logrec_maxlen(const struct cl_logrec* rec)
+{
+	size_t	len = 1 + 6 * VARINT_MAXLEN + rec->textlen + 1;
+	int	j;
+
+	if (rec->flags & LD_REC_ENTITY) {
+		len += VARINT_MAXLEN + rec->entity_len;
+	}
+	for (j = 0; j < rec->nfields; j++) {
+		len += 2 * VARINT_MAXLEN;
+		if (rec->fields[j].str) {
+			len += field_strlen(&rec->fields[j]);
+		}
+	}
+	return len;
+}
+
+int
+cl_logrec_encode(const struct cl_logrec* rec, char* buf, size_t len)
+{
+	char*				p = buf;
+	const struct cl_logfield*	f;
+	size_t				slen;
+	int				j;
+
+	if (len < cl_logrec_maxlen(rec) || rec->nfields > LD_REC_MAXFIELDS) {
+		return -1;
+	}
+	*p++ = (char)LD_REC_V1;
+	p = put_varint(p, rec->flags);
+	p = put_varint(p, rec->priority);
+	p = put_varint(p, rec->pid);
+	p = put_varint(p, rec->timestamp);
+	p = put_varint(p, rec->entity_id);
+	if (rec->flags & LD_REC_ENTITY) {
+		p = put_varint(p, rec->entity_len);
+		memcpy(p, rec->entity, rec->entity_len);
+		p += rec->entity_len;
+	}
+	p = put_varint(p, rec->nfields);
+	for (j = 0; j < rec->nfields; j++) {
+		f = &rec->fields[j];
+		if (f->str) {
+			slen = field_strlen(f);
+			p = put_varint(p, (unsigned long long)f->key << 1 | 1);
+			p = put_varint(p, slen);
+			memcpy(p, f->str, slen);
+			p += slen;
+		} else {
+			p = put_varint(p, (unsigned long long)f->key << 1);
+			/* zigzag: small negative numbers stay short */
+			p = put_varint(p, ((unsigned long long)f->ival << 1)
+			^	(unsigned long long)(f->ival >> 63));
+		}
+	}
+	p = put_varint(p, rec->textlen);
+	memcpy(p, rec->text, rec->textlen);
+	p += rec->textlen;
+	*p++ = EOS;
+	return p - buf;
+}
+
+/* a length followed by that many bytes */
+static const char*
+get_string(const char* p, const char* end, const char** s, size_t* len)
+{
+	unsigned long long	l;
+
+	if ((p = get_varint(p, end, &l)) == NULL
+	||	l > (unsigned long long)(end - p)) {
+		return NULL;
+	}
+	*s = p;
+	*len = l;
+	return p + l;
+}
+
+int
+cl_logrec_decode(const char* buf, size_t len, struct cl_logrec* rec)
+{
+	const char*		p = buf + 1;
+	const char*		end = buf + len;
+	struct cl_logfield*	f;
+	unsigned long long	v[5];
+	unsigned long long	nfields, key, x;
+	int			j;
+
+	if (len < 2 || (unsigned char)buf[0] != LD_REC_V1) {
+		return HA_FAIL;
+	}
+	for (j = 0; j < DIMOF(v); j++) {
+		if ((p = get_varint(p, end, &v[j])) == NULL) {
+			return HA_FAIL;
+		}
+	}
+	rec->flags = v[0];
+	rec->priority = v[1];
+	rec->pid = v[2];
+	rec->timestamp = v[3];
+	rec->entity_id = v[4];
+	rec->entity = NULL;
+	rec->entity_len = 0;
+	if ((rec->flags & LD_REC_ENTITY)
+	&&	(p = get_string(p, end, &rec->entity, &rec->entity_len)) == NULL) {
+		return HA_FAIL;
+	}
+	if ((p = get_varint(p, end, &nfields)) == NULL
+	||	nfields > LD_REC_MAXFIELDS) {
+		return HA_FAIL;
+	}
+	rec->nfields = nfields;
+	for (j = 0; j < rec->nfields; j++) {
+		f = &rec->fields[j];
+		if ((p = get_varint(p, end, &key)) == NULL) {
+			return HA_FAIL;
+		}
+		f->key = key >> 1;
+		if (key & 1) {
+			p = get_string(p, end, &f->str, &f->len);
+			f->ival = 0;
+		} else {
+			p = get_varint(p, end, &x);
+			f->str = NULL;
+			f->len = 0;
+			f->ival = (long long)(x >> 1) ^ -(long long)(x & 1);
+		}
+		if (p == NULL) {
+			return HA_FAIL;
+		}
+	}
+	if ((p = get_string(p, end, &rec->text, &rec->textlen)) == NULL
+	||	p >= end || *p != EOS) {
+		return HA_FAIL;
+	}
+	return HA_OK;
+}
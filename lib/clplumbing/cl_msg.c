@@ -52,6 +52,25 @@
 #define		MAXCHILDMSGLEN  512
 
 static int	compression_threshold = (128*1024);
+/* messages with at least this many fields get a name index */
+static int	index_threshold = 16;
+
+/*
+ * The name index of a message (see cl_msg_find()). Lookups in const
+ * messages update it, so it is not part of struct ha_msg but
+ * allocated along with it and pointed to.
+ */
+struct ha_msg_index {
+	int*	slots;
+	int	size;		/* number of slots */
+	int	nfields;	/* fields hashed into it */
+};
+
+/* what ha_msg_new() allocates; free(msg) frees both */
+struct ha_msg_indexed {
+	struct ha_msg		msg;
+	struct ha_msg_index	index;
+};
 
 static enum cl_msgfmt msgfmt = MSGFMT_NVPAIR;
 static	gboolean use_traditional_compression = FALSE;
@@ -96,14 +115,48 @@ gboolean cl_msg_quiet_fmterr = FALSE;
 
 extern int		netstring_format;
 
-static struct ha_msg* wirefmt2msg_ll(const char* s, size_t length, int need_auth);
+static struct ha_msg* wirefmt2msg_ll(const char* s, size_t length, int need_auth
+,	char* pin);
 
 struct ha_msg* string2msg_ll(const char * s, size_t length, int need_auth, int depth);
+static struct ha_msg* string2msg_rec(const char * s, size_t length, int depth
+,	int need_auth, char* pin);
+struct ha_msg* netstring2msg_ll(const char* s, size_t length, int needauth
+,	char* pin);
+int cl_msg_add_raw(struct ha_msg* msg, char* name, size_t nlen
+,	void* value, size_t vlen, int type);
+int cl_msg_terminate_borrowed(struct ha_msg* msg);
+int get_binmsglen(const struct ha_msg* m);
+int msg2binary_mb(const struct ha_msg* m, struct cl_msgbuf* mb, int len);
+struct ha_msg* binmsg2msg(const char* s, size_t length, char* pin);
+static void ipcmsg_release(void* data);
+
+/*
+ * A borrowed message (see wirefmt2msg_borrow()) was parsed in place:
+ * the names and string values of its fields point into the buffer it
+ * was parsed from, as do those of the messages nested in it. Other
+ * values (binary, lists, ...) and fields added later are allocated as
+ * usual, so whatever is in [pin_start, pin_end) must not be freed.
+ * Nested messages have the range, but only the outermost message
+ * releases the buffer.
+ */
+#define msg_borrows(m, p) ((m)->pin_start != NULL			\
+	&& (const char*)(p) >= (m)->pin_start				\
+	&& (const char*)(p) < (m)->pin_end)
+
+static void cl_msg_index_drop(const struct ha_msg* msg);
+static int cl_msg_find(const struct ha_msg* msg, const char* name);
 
 extern int struct_stringlen(size_t namlen, size_t vallen, const void* value);
 extern int struct_netstringlen(size_t namlen, size_t vallen, const void* value);
 extern int process_netstring_nvpair(struct ha_msg* m, const char* nvpair, int nvlen);
-static char*	msg2wirefmt_ll(struct ha_msg*m, size_t* len, gboolean need_compress);
+static int	msg2wirefmt_ll(struct ha_msg*m, struct cl_msgbuf* mb, int flag);
+static int	msg2string_mb(const struct ha_msg *m, struct cl_msgbuf* mb, int len);
+int	msg2string_ll(const struct ha_msg* m, char* buf, char* maxp
+,	int depth, int needhead, char nl, size_t* slen);
+int	msg2netstring_mb(const struct ha_msg* m, struct cl_msgbuf* mb
+,	int len, int need_auth);
+char*	msg_put_int(char* p, int x);
 extern GHashTable*		CompressFuncs;
 
 
@@ -128,6 +181,13 @@ cl_set_compression_threshold(size_t threadhold)
 
 }
 
+/* 0 disables the field name index */
+void
+cl_set_msg_index_threshold(int nfields)
+{
+	index_threshold = nfields;
+}
+
 void
 cl_msg_setstats(volatile hb_msg_stats_t* stats)
 {
@@ -230,12 +290,22 @@ list_cleanup(GList* list)
 struct ha_msg *
 ha_msg_new(int nfields)
 {
+	struct ha_msg_indexed *	reti;
 	struct ha_msg *	ret;
 	int	nalloc;
 	
-	ret = MALLOCT(struct ha_msg);
+	reti = MALLOCT(struct ha_msg_indexed);
+	ret = reti ? &reti->msg : NULL;
 	if (ret) {
 		ret->nfields = 0;
+		ret->index = &reti->index;
+		ret->index->slots = NULL;
+		ret->index->size = 0;
+		ret->index->nfields = 0;
+		ret->pin_start = NULL;
+		ret->pin_end = NULL;
+		ret->pin_release = NULL;
+		ret->pin_data = NULL;
 
 		if (nfields > MINFIELDS) {
 			nalloc = nfields;
@@ -281,7 +351,8 @@ ha_msg_del(struct ha_msg *msg)
 		}
 		if (msg->names) {
 			for (j=0; j < msg->nfields; ++j) {
-				if (msg->names[j]) {
+				if (msg->names[j]
+				&&	!msg_borrows(msg, msg->names[j])) {
 					free(msg->names[j]);
 					msg->names[j] = NULL;
 				}
@@ -292,7 +363,8 @@ ha_msg_del(struct ha_msg *msg)
 		if (msg->values) {
 			for (j=0; j < msg->nfields; ++j) {
 
-				if (msg->values[j] == NULL){
+				if (msg->values[j] == NULL
+				||	msg_borrows(msg, msg->values[j])){
 					continue;
 				}
 				
@@ -315,6 +387,10 @@ ha_msg_del(struct ha_msg *msg)
 			free(msg->types);
 			msg->types = NULL;
 		}
+		cl_msg_index_drop(msg);
+		if (msg->pin_release) {
+			msg->pin_release(msg->pin_data);
+		}
 		msg->nfields = -1;
 		msg->nalloc = -1;
 		free(msg);
@@ -543,13 +619,8 @@ cl_msg_remove(struct ha_msg* msg, const char* name)
 		return HA_FAIL;
 	}
 	
-	for (j = 0; j < msg->nfields; ++j){
-		if (strcmp(name, msg->names[j]) == 0){
-			break;			
-		}
-	}
-	
-	if (j == msg->nfields){		
+	j = cl_msg_find(msg, name);
+	if (j < 0){
 		cl_log(LOG_ERR, "cl_msg_remove: field %s not found", name);
 		return HA_FAIL;
 	}
@@ -567,8 +638,14 @@ cl_msg_remove_offset(struct ha_msg* msg, int offset)
 		return HA_FAIL;
 	}
 		
-	free(msg->names[j]);
-	fieldtypefuncs[msg->types[j]].memfree(msg->values[j]);
+	if (!msg_borrows(msg, msg->names[j])) {
+		free(msg->names[j]);
+	}
+	if (!msg_borrows(msg, msg->values[j])) {
+		fieldtypefuncs[msg->types[j]].memfree(msg->values[j]);
+	}
+	/* the fields behind j move down */
+	cl_msg_index_drop(msg);
 	
 	for (i= j + 1; i < msg->nfields ; i++){
 		msg->names[i -1] = msg->names[i];
@@ -1001,10 +1078,13 @@ ha_msg_nadd_type(struct ha_msg * msg, const char * name, int namelen
 
 
 
-/* Add a "name=value" line to the name, value pairs in a message */
+/*
+ * Add a "name=value" line to the name, value pairs in a message.
+ * pin is where the line is, writable (see string2msg_rec()), or NULL.
+ */
 static int
 ha_msg_add_nv_depth(struct ha_msg* msg, const char * nvline,
-		    const char * bufmax, int depth)
+		    const char * bufmax, int depth, char* pin)
 {
 	int		namelen;
 	const char *	valp;
@@ -1036,6 +1116,11 @@ ha_msg_add_nv_depth(struct ha_msg* msg, const char * nvline,
 	if (vallen == 0){
 		valp = NULL;
 	}
+	if (pin && valp && nvline[0] != '(') {
+		/* a plain string field, borrowed */
+		return(cl_msg_add_raw(msg, pin, namelen
+		,	pin + (valp - nvline), vallen, FT_STRING));
+	}
 	/* Call ha_msg_nadd to actually add the name/value pair */
 	return(ha_msg_addraw(msg, nvline, namelen, valp, vallen
 	,	FT_STRING, depth));
@@ -1047,11 +1132,131 @@ ha_msg_add_nv(struct ha_msg* msg, const char * nvline,
 	      const char * bufmax)
 {
 
-	return(ha_msg_add_nv_depth(msg, nvline, bufmax, 0));
+	return(ha_msg_add_nv_depth(msg, nvline, bufmax, 0, NULL));
 
 }
 
 
+/*
+ * Finding a field by name is a linear scan, which gets expensive for
+ * messages with many fields accessed many times (e.g. lrmd ops with
+ * big parameter sets). Messages with at least index_threshold fields
+ * get an open addressed hash of the field names. It is built on the
+ * first lookup, extended on lookups after fields were appended (all
+ * the add functions append), and dropped when a field is removed.
+ * The index holds field numbers + 1, 0 is an empty slot. Like the
+ * scan, it finds the first of several fields of the same name.
+ *
+ * The index is only a cache, so lookups in const messages update it
+ * too. It is kept apart from the message, see struct ha_msg_index.
+ */
+static guint
+cl_msg_name_hash(const char* name)
+{
+	guint h = 5381;
+
+	while (*name) {
+		h = (h << 5) + h + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static void
+cl_msg_index_drop(const struct ha_msg* msg)
+{
+	struct ha_msg_index* ix = msg->index;
+
+	if (ix->slots) {
+		free(ix->slots);
+	}
+	ix->slots = NULL;
+	ix->size = 0;
+	ix->nfields = 0;
+}
+
+static void
+cl_msg_index_insert(const struct ha_msg* msg, int j)
+{
+	struct ha_msg_index* ix = msg->index;
+	int mask = ix->size - 1;
+	int slot = cl_msg_name_hash(msg->names[j]) & mask;
+	int k;
+
+	while ((k = ix->slots[slot]) != 0) {
+		if (msg->nlens[k-1] == msg->nlens[j]
+		&&	strcmp(msg->names[k-1], msg->names[j]) == 0) {
+			return; /* keep the first one */
+		}
+		slot = (slot + 1) & mask;
+	}
+	ix->slots[slot] = j + 1;
+}
+
+/* (re)build the index or add the fields appended since; HA_FAIL if
+ * there is no index to use */
+static int
+cl_msg_index_update(const struct ha_msg* msg)
+{
+	struct ha_msg_index* ix = msg->index;
+	int size, j;
+
+	if (ix->nfields > msg->nfields) {
+		cl_msg_index_drop(msg);
+	}
+	if (ix->slots && ix->nfields == msg->nfields) {
+		return HA_OK;
+	}
+	if (msg->nfields * 2 > ix->size) {
+		/* keep the load at most 1/2 */
+		for (size = 32; size < msg->nfields * 4; size <<= 1) {
+			;
+		}
+		cl_msg_index_drop(msg);
+		ix->slots = (int*)calloc(size, sizeof(int));
+		if (ix->slots == NULL) {
+			return HA_FAIL;
+		}
+		ix->size = size;
+	}
+	for (j = ix->nfields; j < msg->nfields; ++j) {
+		cl_msg_index_insert(msg, j);
+	}
+	ix->nfields = msg->nfields;
+	return HA_OK;
+}
+
+/* the number of the first field called name or -1 */
+static int
+cl_msg_find(const struct ha_msg* msg, const char* name)
+{
+	struct ha_msg_index* ix = msg->index;
+	size_t namelen;
+	int mask, slot, k, j;
+
+	if (index_threshold <= 0 || msg->nfields < index_threshold
+	||	cl_msg_index_update(msg) != HA_OK) {
+		for (j=0; j < msg->nfields; ++j) {
+			const char *local_name = msg->names[j];
+			if (name[0] == local_name[0]
+			    && strcmp(name, local_name) == 0) {
+				return j;
+			}
+		}
+		return -1;
+	}
+	namelen = strlen(name);
+	mask = ix->size - 1;
+	slot = cl_msg_name_hash(name) & mask;
+	while ((k = ix->slots[slot]) != 0) {
+		if (msg->nlens[k-1] == namelen
+		&&	strcmp(msg->names[k-1], name) == 0) {
+			return k-1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
 static void *
 cl_get_value(const struct ha_msg * msg, const char * name,
 	     size_t * vallen, int *type)
@@ -1065,20 +1270,17 @@ cl_get_value(const struct ha_msg * msg, const char * name,
 	}
 
 	PARANOIDAUDITMSG(msg);
-	for (j=0; j < msg->nfields; ++j) {
-		const char *local_name = msg->names[j];
-		if (name[0] == local_name[0]
-		    && strcmp(name, local_name) == 0) {
-			if (vallen){
-				*vallen = msg->vlens[j];
-			}
-			if (type){
-				*type = msg->types[j];
-			}			
-			return(msg->values[j]);
-		}
+	j = cl_msg_find(msg, name);
+	if (j < 0) {
+		return(NULL);
 	}
-	return(NULL);
+	if (vallen){
+		*vallen = msg->vlens[j];
+	}
+	if (type){
+		*type = msg->types[j];
+	}
+	return(msg->values[j]);
 }
 
 static void *
@@ -1094,21 +1296,20 @@ cl_get_value_mutate(struct ha_msg * msg, const char * name,
 	}
 	
 	AUDITMSG(msg);
-	for (j=0; j < msg->nfields; ++j) {
-		if (strcmp(name, msg->names[j]) == 0) {
-			int tp = msg->types[j];
-			if (fieldtypefuncs[tp].pregetaction){
-				fieldtypefuncs[tp].pregetaction(msg, j);
-			}
-			
-			if (vallen){
-				*vallen = msg->vlens[j];
-			}
-			if (type){
-				*type = msg->types[j];
-			}			
-			return(msg->values[j]);
+	j = cl_msg_find(msg, name);
+	if (j >= 0) {
+		int tp = msg->types[j];
+		if (fieldtypefuncs[tp].pregetaction){
+			fieldtypefuncs[tp].pregetaction(msg, j);
+		}
+
+		if (vallen){
+			*vallen = msg->vlens[j];
+		}
+		if (type){
+			*type = msg->types[j];
 		}
+		return(msg->values[j]);
 	}
 	return(NULL);
 }
@@ -1546,7 +1747,9 @@ cl_msg_replace(struct ha_msg* msg, int index,
 		return HA_FAIL;
 	}
 	
-	fieldtypefuncs[oldtype].memfree(msg->values[index]);
+	if (!msg_borrows(msg, msg->values[index])) {
+		fieldtypefuncs[oldtype].memfree(msg->values[index]);
+	}
 	
 	msg->values[index] = newv;
 	msg->vlens[index] = newlen;
@@ -1576,32 +1779,32 @@ cl_msg_mod(struct ha_msg * msg, const char * name,
 		return HA_FAIL;
 	}
 
-	for (j=0; j < msg->nfields; ++j) {
-		if (strcmp(name, msg->names[j]) == 0) {
-			
-			char *	newv ;
-			int	newlen = vlen;
-			
-			if (type != msg->types[j]){
-				cl_log(LOG_ERR, "%s: type mismatch(%d %d)",
-				       __FUNCTION__, type, msg->types[j]);
-				return HA_FAIL;
-			}
-			
-			newv = fieldtypefuncs[type].dup(value,vlen);
-			if (!newv){
-				cl_log(LOG_ERR, "duplicating message fields failed"
-				       "value=%p, vlen=%d, msg->names[j]=%s", 
-				       value, (int)vlen, msg->names[j]);
-				return HA_FAIL;
-			}
-						
+	j = cl_msg_find(msg, name);
+	if (j >= 0) {
+		char *	newv ;
+		int	newlen = vlen;
+
+		if (type != msg->types[j]){
+			cl_log(LOG_ERR, "%s: type mismatch(%d %d)",
+			       __FUNCTION__, type, msg->types[j]);
+			return HA_FAIL;
+		}
+
+		newv = fieldtypefuncs[type].dup(value,vlen);
+		if (!newv){
+			cl_log(LOG_ERR, "duplicating message fields failed"
+			       "value=%p, vlen=%d, msg->names[j]=%s", 
+			       value, (int)vlen, msg->names[j]);
+			return HA_FAIL;
+		}
+
+		if (!msg_borrows(msg, msg->values[j])) {
 			fieldtypefuncs[type].memfree(msg->values[j]);
-			msg->values[j] = newv;
-			msg->vlens[j] = newlen;
-			PARANOIDAUDITMSG(msg);
-			return(HA_OK);
 		}
+		msg->values[j] = newv;
+		msg->vlens[j] = newlen;
+		PARANOIDAUDITMSG(msg);
+		return(HA_OK);
 	}
 	
 	rc = ha_msg_nadd_type(msg, name,strlen(name), value, vlen, type);
@@ -1858,9 +2061,15 @@ msgfromIPC_ll(IPC_Channel * ch, int flag, unsigned int timeout, int *rc_out)
 		return NULL;
 	}
 
-	hmsg = wirefmt2msg_ll((char *)ipcmsg->msg_body, ipcmsg->msg_len, need_auth);
-	if (ipcmsg->msg_done) {
-		ipcmsg->msg_done(ipcmsg);
+	if (flag & MSG_BORROW) {
+		hmsg = wirefmt2msg_borrow((char *)ipcmsg->msg_body
+		,	ipcmsg->msg_len, need_auth, ipcmsg_release, ipcmsg);
+	} else {
+		hmsg = wirefmt2msg_ll((char *)ipcmsg->msg_body, ipcmsg->msg_len
+		,	need_auth, NULL);
+		if (ipcmsg->msg_done) {
+			ipcmsg->msg_done(ipcmsg);
+		}
 	}
 
 	AUDITMSG(hmsg);
@@ -2031,34 +2240,33 @@ wirefmt2ipcmsg(void* p, size_t len, IPC_Channel* ch)
 IPC_Message*
 hamsg2ipcmsg(struct ha_msg* m, IPC_Channel* ch)
 {
-	size_t		len;
-	char *		s  = msg2wirefmt_ll(m, &len, MSG_NEEDCOMPRESS);
+	/* the message is written right behind the room for the IPC
+	 * header, so it needs neither a copy nor another malloc */
+	struct cl_msgbuf mb = {NULL, 0, 0};
 	IPC_Message*	ret = NULL;
 
-	if (s == NULL) {
+	mb.len = ch->msgpad;
+	if (msg2wirefmt_ll(m, &mb, MSG_NEEDCOMPRESS
+	|	((ch->msgfmts & (1<<MSGFMT_BINARY)) ? MSG_BINARYFMT : 0)
+	|	((ch->msgfmts & IPC_FMT_FRAGMENTS) ? MSG_FRAGMENTS : 0))
+	!=	HA_OK) {
+		free(mb.buf);
 		return ret;
 	}
 	ret = MALLOCT(IPC_Message);
 	if (!ret) {
-		free(s);
+		free(mb.buf);
 		return ret;
 	}
 	
 	memset(ret, 0, sizeof(IPC_Message));
 
-	if (NULL == (ret->msg_buf = malloc(len + ch->msgpad))) {
-		free(s);
-		free(ret);
-		return NULL;
-	}
-	ret->msg_body = (char*)ret->msg_buf + ch->msgpad;
-	memcpy(ret->msg_body, s, len);
-	free(s);
-	
+	ret->msg_buf = mb.buf;
+	ret->msg_body = mb.buf + ch->msgpad;
 	ret->msg_done = ipcmsg_done;
 	ret->msg_private = NULL;
 	ret->msg_ch = ch;
-	ret->msg_len = len;
+	ret->msg_len = mb.len - ch->msgpad;
 
 	clmsg_ipcmsg_allocated ++;
 
@@ -2075,6 +2283,23 @@ ipcmsg2hamsg(IPC_Message*m)
 	return ret;
 }
 
+static void
+ipcmsg_release(void* data)
+{
+	IPC_Message*	m = (IPC_Message*)data;
+
+	if (m && m->msg_done) {
+		m->msg_done(m);
+	}
+}
+
+struct ha_msg*
+ipcmsg2hamsg_borrow(IPC_Message*m)
+{
+	return wirefmt2msg_borrow((char*)m->msg_body, m->msg_len
+	,	MSG_NEEDAUTH, ipcmsg_release, m);
+}
+
 int
 msg2ipcchan(struct ha_msg*m, IPC_Channel*ch)
 {
@@ -2118,6 +2343,18 @@ cl_set_oldmsgauthfunc(gboolean (*authfunc)(const struct ha_msg*))
 /* Converts a string (perhaps received via UDP) into a message */
 struct ha_msg *
 string2msg_ll(const char * s, size_t length, int depth, int need_auth)
+{
+	return(string2msg_rec(s, length, depth, need_auth, NULL));
+}
+
+/*
+ * A message to be borrowed (pin != NULL) is parsed in place. pin is
+ * the same text as s, but writable: cl_msg_terminate_borrowed() puts
+ * the EOS behind the borrowed fields through it.
+ */
+static struct ha_msg *
+string2msg_rec(const char * s, size_t length, int depth, int need_auth
+,	char* pin)
 {
 	struct ha_msg*	ret;
 	int		startlen;
@@ -2130,6 +2367,10 @@ string2msg_ll(const char * s, size_t length, int depth, int need_auth)
 		cl_log(LOG_ERR, "%s: creating new msg failed", __FUNCTION__);
 		return(NULL);
 	}
+	if (pin) {
+		ret->pin_start = s;
+		ret->pin_end = smax;
+	}
 	
 	startlen = sizeof(MSG_START)-1;
 	if (strncmp(sp, MSG_START, startlen) != 0) {
@@ -2169,7 +2410,8 @@ string2msg_ll(const char * s, size_t length, int depth, int need_auth)
 			break;
 		}
 		/* Add the "name=value" string on this line to the message */
-		if (ha_msg_add_nv_depth(ret, sp, smax, depth) != HA_OK) {
+		if (ha_msg_add_nv_depth(ret, sp, smax, depth
+		,	pin ? pin + (sp - s) : NULL) != HA_OK) {
 			if (!cl_msg_quiet_fmterr) {
 				cl_log(LOG_ERR, "NV failure (string2msg_ll):");
 				cl_log(LOG_ERR, "Input string: [%s]", s);
@@ -2187,6 +2429,10 @@ string2msg_ll(const char * s, size_t length, int depth, int need_auth)
 		}
 		sp += strcspn(sp, NEWLINE);
 	}
+	if (pin && cl_msg_terminate_borrowed(ret) != HA_OK) {
+		ha_msg_del(ret);
+		return(NULL);
+	}
 	
 	if (need_auth && msg_authentication_method
 	    &&		!msg_authentication_method(ret)) {
@@ -2229,39 +2475,45 @@ string2msg(const char * s, size_t length)
 
 #define	NOROOM						{	\
 		cl_log(LOG_ERR, "%s:%d: out of memory bound"	\
-		", bp=%p, buf + len=%p, len=%ld"		\
+		", bp=%p, maxp=%p"				\
 		,	__FUNCTION__, __LINE__		\
-		,	bp, buf + len, (long)len);		\
+		,	bp, maxp);				\
 		cl_log_message(LOG_ERR, m);			\
 		return(HA_FAIL);				\
 	}
 
-#define	CHECKROOM_CONST(c)		CHECKROOM_INT(STRLEN_CONST(c))
-#define	CHECKROOM_STRING(s)		CHECKROOM_INT(strnlen(s, len))
-#define	CHECKROOM_STRING_INT(s,i)	CHECKROOM_INT(strnlen(s, len)+(i))
 #define	CHECKROOM_INT(i)	{		\
 		if ((bp + (i)) > maxp) {	\
 			NOROOM;			\
 		}				\
 	}
 
+/* copy a constant ending in a new line, which is written as nl */
+#define	PUT_LINE_CONST(c)	{				\
+		CHECKROOM_INT(STRLEN_CONST(c));			\
+		memcpy(bp, c, STRLEN_CONST(c));			\
+		bp += STRLEN_CONST(c);				\
+		bp[-1] = nl;					\
+	}
 
+/*
+ * The writer behind msg2string_buf() and the child messages in
+ * struct2string(). Everything is copied once, at the write pointer.
+ * nl is written for the new lines which end the fields (and the
+ * start/end markers); child messages use the special symbol of their
+ * parent's depth for it instead of converting afterwards.
+ * *slen is set to the length written, not counting the final EOS.
+ */
 int
-msg2string_buf(const struct ha_msg *m, char* buf, size_t len
-,	int depth,int needhead)
+msg2string_ll(const struct ha_msg *m, char* buf, char* maxp
+,	int depth, int needhead, char nl, size_t* slen)
 {
 
-	char *	bp = NULL;
+	char *	bp = buf;
 	int	j;
-	char* maxp = buf + len;
-
-	buf[0]=0;
-	bp = buf;
 
 	if (needhead){
-		CHECKROOM_CONST(MSG_START);
-		strcpy(bp, MSG_START);
-		bp += STRLEN_CONST(MSG_START);
+		PUT_LINE_CONST(MSG_START);
 	}
 
 	for (j=0; j < m->nfields; ++j) {
@@ -2273,28 +2525,26 @@ msg2string_buf(const struct ha_msg *m, char* buf, size_t len
 			continue;
 		}
 
-		if (m->types[j] != FT_STRING){
-			CHECKROOM_STRING_INT(FT_strings[m->types[j]],2);
-			strcat(bp, "(");
-			bp++;
-			strcat(bp, FT_strings[m->types[j]]);
-			bp++;
-			strcat(bp,")");
-			bp++;
-		}
-
-		CHECKROOM_STRING_INT(m->names[j],1);
-		strcat(bp, m->names[j]);
-		bp += m->nlens[j];
-		strcat(bp, "=");
-		bp++;
-		
 		if(m->types[j] < DIMOF(fieldtypefuncs)){
 			tostring = fieldtypefuncs[m->types[j]].tostring;
 		} else {
 			cl_log(LOG_ERR, "type(%d) unrecognized", m->types[j]);
 			return HA_FAIL;
 		}
+
+		if (m->types[j] != FT_STRING){
+			/* "(" type ")" */
+			CHECKROOM_INT(3);
+			*bp++ = '(';
+			*bp++ = FT_strings[m->types[j]][0];
+			*bp++ = ')';
+		}
+
+		CHECKROOM_INT(m->nlens[j]+1);
+		memcpy(bp, m->names[j], m->nlens[j]);
+		bp += m->nlens[j];
+		*bp++ = '=';
+		
 		if (!tostring ||
 		    (truelen = tostring(bp, maxp, m->values[j], m->vlens[j], depth))
 		    < 0){
@@ -2304,28 +2554,79 @@ msg2string_buf(const struct ha_msg *m, char* buf, size_t len
 		
 		CHECKROOM_INT(truelen+1);
 		bp +=truelen;
-		
-		strcat(bp,"\n");
-		bp++;
+		*bp++ = nl;
 	}
 	if (needhead){
-		CHECKROOM_CONST(MSG_END);
-		strcat(bp, MSG_END);
-		bp += strlen(MSG_END);
+		PUT_LINE_CONST(MSG_END);
 	}
 
 	CHECKROOM_INT(1);
 	bp[0] = EOS;
+	if (slen) {
+		*slen = bp - buf;
+	}
 
 	return(HA_OK);
 }
 
+int
+msg2string_buf(const struct ha_msg *m, char* buf, size_t len
+,	int depth,int needhead)
+{
+	return msg2string_ll(m, buf, buf + len, depth, needhead, '\n', NULL);
+}
+
+/*
+ * Make room for more bytes behind mb->len. The buffers are sized from
+ * get_stringlen()/get_netstringlen(), so normally this allocates once.
+ */
+int
+cl_msgbuf_reserve(struct cl_msgbuf* mb, size_t more)
+{
+	size_t	need = mb->len + more;
+	char*	nbuf;
+
+	if (mb->buf && need <= mb->size) {
+		return HA_OK;
+	}
+	if (need < 2*mb->size) {
+		need = 2*mb->size;
+	}
+	if ((nbuf = realloc(mb->buf, need)) == NULL) {
+		return HA_FAIL;
+	}
+	mb->buf = nbuf;
+	mb->size = need;
+	return HA_OK;
+}
+
+/* Append the string of m (and the EOS) to mb, len is get_stringlen(m)
+ * if the caller knows it already (or -1) */
+static int
+msg2string_mb(const struct ha_msg *m, struct cl_msgbuf* mb, int len)
+{
+	size_t	slen;
+
+	if (len < 0) {
+		len = get_stringlen(m);
+	}
+	if (cl_msgbuf_reserve(mb, len) != HA_OK) {
+		cl_log(LOG_ERR, "msg2string: no memory for string");
+		return HA_FAIL;
+	}
+	if (msg2string_ll(m, mb->buf + mb->len, mb->buf + mb->len + len
+	,	0, NEEDHEAD, '\n', &slen) != HA_OK){
+		cl_log(LOG_ERR, "msg2string: msg2string_buf failed");
+		return HA_FAIL;
+	}
+	mb->len += slen + 1;
+	return HA_OK;
+}
 
 char *
 msg2string(const struct ha_msg *m)
 {
-	void	*buf;
-	int	len;
+	struct cl_msgbuf mb = {NULL, 0, 0};
 
 	AUDITMSG(m);
 	if (m->nfields <= 0) {
@@ -2333,22 +2634,12 @@ msg2string(const struct ha_msg *m)
 		return(NULL);
 	}
 	
-	len = get_stringlen(m);
-	
-	buf = malloc(len);
-
-	if (buf == NULL) {
-		cl_log(LOG_ERR, "msg2string: no memory for string");
-		return(NULL);
-	}
-
-	if (msg2string_buf(m, buf, len ,0, NEEDHEAD) != HA_OK){
-		cl_log(LOG_ERR, "msg2string: msg2string_buf failed");
-		free(buf);
+	if (msg2string_mb(m, &mb, -1) != HA_OK) {
+		free(mb.buf);
 		return(NULL);
 	}
 	
-	return(buf);
+	return(mb.buf);
 }
 
 gboolean
@@ -2369,22 +2660,50 @@ must_use_netstring(const struct ha_msg* msg)
 }
 
 #define use_netstring(m) (msgfmt == MSGFMT_NETSTRING || must_use_netstring(m))
+/* the binary format carries no authentication */
+#define use_binary(flag) (!((flag) & MSG_NEEDAUTH)			\
+	&& (msgfmt == MSGFMT_BINARY || ((flag) & MSG_BINARYFMT)))
+#define wirefmt_len(m, binfmt, netstg) ((binfmt) ? get_binmsglen(m)	\
+	: (netstg) ? get_netstringlen(m) : get_stringlen(m))
 
-static char*
-msg2wirefmt_ll(struct ha_msg*m, size_t* len, int flag)
+/* append the compressed message to mb */
+static int
+msg2wirefmt_compress(struct ha_msg*m, struct cl_msgbuf* mb)
+{
+	size_t	len;
+	char*	s = cl_compressmsg(m, &len);
+
+	if (s == NULL) {
+		return HA_FAIL;
+	}
+	if (cl_msgbuf_reserve(mb, len) != HA_OK) {
+		free(s);
+		return HA_FAIL;
+	}
+	memcpy(mb->buf + mb->len, s, len);
+	mb->len += len;
+	free(s);
+	return HA_OK;
+}
+
+/* append the wire format of m to mb */
+static int
+msg2wirefmt_ll(struct ha_msg*m, struct cl_msgbuf* mb, int flag)
 {
 	
 	int	wirefmtlen;
 	int	i;
 	int	netstg = use_netstring(m);
+	int	binfmt = use_binary(flag);
 
-	wirefmtlen = netstg ? get_netstringlen(m) : get_stringlen(m);
 	if (use_traditional_compression
 	    &&(flag & MSG_NEEDCOMPRESS) 
- 	    && (wirefmtlen> compression_threshold) 
- 	    && cl_get_compress_fns() != NULL){ 
- 		return cl_compressmsg(m, len);		 
- 	} 
+	    && cl_get_compress_fns() != NULL) {
+		wirefmtlen = wirefmt_len(m, binfmt, netstg);
+		if (wirefmtlen > compression_threshold) {
+			return msg2wirefmt_compress(m, mb);
+		}
+	}
 
 	if (flag & MSG_NEEDCOMPRESS){
 		for (i=0 ;i < m->nfields; i++){
@@ -2395,47 +2714,79 @@ msg2wirefmt_ll(struct ha_msg*m, size_t* len, int flag)
 		}
 	}
 
-	wirefmtlen = netstg ? get_netstringlen(m) : get_stringlen(m);
-	if (wirefmtlen >= MAXMSG){
+	/* the fields may have been packed, so (re)compute */
+	netstg = use_netstring(m);
+	wirefmtlen = wirefmt_len(m, binfmt, netstg);
+	if (wirefmtlen < 0) {
+		return HA_FAIL;
+	}
+	if (wirefmtlen >= ((flag & MSG_FRAGMENTS) ? MAXFRAGMSG : MAXMSG)){
 		if (flag&MSG_NEEDCOMPRESS) {
 			if (cl_get_compress_fns() != NULL)
-				return cl_compressmsg(m, len);
+				return msg2wirefmt_compress(m, mb);
 		}
 		cl_log(LOG_ERR, "%s: msg too big(%d)",
 			   __FUNCTION__, wirefmtlen);
-		return NULL;
+		return HA_FAIL;
+	}
+	if (binfmt) {
+		return msg2binary_mb(m, mb, wirefmtlen);
 	}
 	if (flag & MSG_NEEDAUTH) {
-		return msg2netstring(m, len);
+		return msg2netstring_mb(m, mb
+		,	netstg ? wirefmtlen : -1, TRUE);
 	}
-	return msg2wirefmt_noac(m, len);
+	if (netstg) {
+		return msg2netstring_mb(m, mb, wirefmtlen, FALSE);
+	}
+	return msg2string_mb(m, mb, wirefmtlen);
 }
 
 char*
 msg2wirefmt(struct ha_msg*m, size_t* len){
-	return msg2wirefmt_ll(m, len, MSG_NEEDAUTH|MSG_NEEDCOMPRESS);
+	struct cl_msgbuf mb = {NULL, 0, 0};
+
+	if (msg2wirefmt_ll(m, &mb, MSG_NEEDAUTH|MSG_NEEDCOMPRESS) != HA_OK) {
+		free(mb.buf);
+		return NULL;
+	}
+	*len = mb.len;
+	return mb.buf;
+}
+
+int
+msg2wirefmt_buf(struct ha_msg*m, struct cl_msgbuf* mb)
+{
+	return msg2wirefmt_ll(m, mb, MSG_NEEDAUTH|MSG_NEEDCOMPRESS);
 }
 
 char*
 msg2wirefmt_noac(struct ha_msg*m, size_t* len)
 {
-	if (use_netstring(m)) {
-		return msg2netstring_noauth(m, len);
-	} else {
-		char	*tmp;
+	struct cl_msgbuf mb = {NULL, 0, 0};
+	int	rc;
 
-		tmp = msg2string(m);
-		if(tmp == NULL){
-			*len = 0;
-			return NULL;
-		}
-		*len = strlen(tmp) + 1;
-		return tmp;
+	if (msgfmt == MSGFMT_BINARY) {
+		rc = msg2binary_mb(m, &mb, -1);
+	} else if (use_netstring(m)) {
+		rc = msg2netstring_mb(m, &mb, -1, FALSE);
+	} else if (m->nfields <= 0) {
+		cl_log(LOG_ERR, "msg2string: Message with zero fields");
+		rc = HA_FAIL;
+	} else {
+		rc = msg2string_mb(m, &mb, -1);
 	}
+	if (rc != HA_OK) {
+		free(mb.buf);
+		*len = 0;
+		return NULL;
+	}
+	*len = mb.len;
+	return mb.buf;
 }
 
 static struct ha_msg*
-wirefmt2msg_ll(const char* s, size_t length, int need_auth)
+wirefmt2msg_ll(const char* s, size_t length, int need_auth, char* pin)
 {
 
 	size_t startlen;
@@ -2449,7 +2800,7 @@ wirefmt2msg_ll(const char* s, size_t length, int need_auth)
 	}
 
 	if (strncmp( s, MSG_START, startlen) == 0) {
-		msg = string2msg_ll(s, length, 0, need_auth);
+		msg = string2msg_rec(s, length, 0, need_auth, pin);
 		goto out;
 	}
 
@@ -2460,7 +2811,24 @@ wirefmt2msg_ll(const char* s, size_t length, int need_auth)
 	}
 	
 	if (strncmp(s, MSG_START_NETSTRING, startlen) == 0) {
-		msg =  netstring2msg(s, length, need_auth);
+		msg =  netstring2msg_ll(s, length, need_auth, pin);
+		goto out;
+	}
+
+	startlen = sizeof(MSG_START_BINARY) - 1;
+
+	if (startlen <= length
+	&&	strncmp(s, MSG_START_BINARY, startlen) == 0) {
+		msg = binmsg2msg(s, length, pin);
+		if (msg && need_auth && msg_authentication_method
+		&&	!msg_authentication_method(msg)) {
+			if (!cl_msg_quiet_fmterr) {
+				cl_log(LOG_WARNING, "%s: message failed"
+				" authentication", __FUNCTION__);
+			}
+			ha_msg_del(msg);
+			msg = NULL;
+		}
 		goto out;
 	}
 
@@ -2485,8 +2853,137 @@ out:
 struct ha_msg*
 wirefmt2msg(const char* s, size_t length, int flag)
 {
- 	return wirefmt2msg_ll(s, length, flag& MSG_NEEDAUTH);
+ 	return wirefmt2msg_ll(s, length, flag& MSG_NEEDAUTH, NULL);
+
+}
+
+/*
+ * cl_msg_add_raw() adds a field as it is, nothing is copied or
+ * converted. The parsers use it for the borrowed fields, whose names
+ * and values are not terminated yet: the terminators are still
+ * needed to find the end of the field (and a netstring message must
+ * stay intact until it is authenticated). cl_msg_terminate_borrowed()
+ * then puts an EOS behind each of them and converts the string
+ * values like string2str() does. That is what add_string_field() does
+ * to every string value the copying parsers add, the netstring one
+ * included, and the borrowed fields must end up the same.
+ */
+int
+cl_msg_add_raw(struct ha_msg* msg, char* name, size_t nlen
+,	void* value, size_t vlen, int type)
+{
+	int	next;
+
+	if (msg->nfields >= msg->nalloc && ha_msg_expand(msg) != HA_OK) {
+		cl_log(LOG_ERR, "message expanding failed");
+		return(HA_FAIL);
+	}
+	if (nlen == 0 || value == NULL) {
+		cl_log(LOG_ERR, "%s: invalid field", __FUNCTION__);
+		return(HA_FAIL);
+	}
+	next = msg->nfields;
+	msg->names[next] = name;
+	msg->nlens[next] = nlen;
+	msg->values[next] = value;
+	msg->vlens[next] = vlen;
+	msg->types[next] = type;
+	msg->nfields++;
+	return(HA_OK);
+}
+
+int
+cl_msg_terminate_borrowed(struct ha_msg* msg)
+{
+	void*	value;
+	size_t	vlen;
+	int	j;
 
+	for (j = 0; j < msg->nfields; ++j) {
+		if (msg_borrows(msg, msg->names[j])) {
+			msg->names[j][msg->nlens[j]] = EOS;
+		}
+		if (msg->types[j] == FT_STRUCT
+		&&	((struct ha_msg*)msg->values[j])->pin_start != NULL) {
+			if (cl_msg_terminate_borrowed(msg->values[j]) != HA_OK) {
+				return(HA_FAIL);
+			}
+			continue;
+		}
+		if (!msg_borrows(msg, msg->values[j])) {
+			continue;
+		}
+		((char*)msg->values[j])[msg->vlens[j]] = EOS;
+		if (fieldtypefuncs[FT_STRING].stringtofield(msg->values[j]
+		,	msg->vlens[j], 0, &value, &vlen) != HA_OK) {
+			return(HA_FAIL);
+		}
+	}
+	return(HA_OK);
+}
+
+struct ha_msg*
+wirefmt2msg_borrow(char* s, size_t length, int flag
+,	void (*release)(void*), void* data)
+{
+	struct ha_msg*	msg;
+
+	msg = wirefmt2msg_ll(s, length, flag & MSG_NEEDAUTH, s);
+	if (msg == NULL || msg->pin_start == NULL) {
+		/* failed, or decompressed into a message of its own */
+		if (release) {
+			release(data);
+		}
+		return msg;
+	}
+	msg->pin_release = release;
+	msg->pin_data = data;
+	return msg;
+}
+
+int
+cl_msg_unborrow(struct ha_msg* msg)
+{
+	void*	value;
+	char*	name;
+	int	j;
+
+	if (msg == NULL || msg->pin_start == NULL) {
+		return(HA_OK);
+	}
+	for (j = 0; j < msg->nfields; ++j) {
+		if (msg_borrows(msg, msg->names[j])) {
+			if ((name = malloc(msg->nlens[j]+1)) == NULL) {
+				cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+				return(HA_FAIL);
+			}
+			memcpy(name, msg->names[j], msg->nlens[j]+1);
+			msg->names[j] = name;
+		}
+		if (msg->types[j] == FT_STRUCT) {
+			if (cl_msg_unborrow(msg->values[j]) != HA_OK) {
+				return(HA_FAIL);
+			}
+			continue;
+		}
+		if (msg_borrows(msg, msg->values[j])) {
+			value = fieldtypefuncs[msg->types[j]].dup(msg->values[j]
+			,	msg->vlens[j]);
+			if (value == NULL) {
+				cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+				return(HA_FAIL);
+			}
+			msg->values[j] = value;
+		}
+	}
+	msg->pin_start = NULL;
+	msg->pin_end = NULL;
+	if (msg->pin_release) {
+		msg->pin_release(msg->pin_data);
+		msg->pin_release = NULL;
+		msg->pin_data = NULL;
+	}
+	return(HA_OK);
 }
 
 
@@ -79,6 +79,9 @@ int struct_stringlen(size_t namlen, size_t vallen, const void* value);
 int struct_netstringlen(size_t namlen, size_t vallen, const void* value);
 int	convert_nl_sym(char* s, int len, char sym, int direction);
 int	bytes_for_int(int x);
+char*	msg_put_int(char* p, int x);
+int	msg2string_ll(const struct ha_msg* m, char* buf, char* maxp
+,	int depth, int needhead, char nl, size_t* slen);
 
 int
 bytes_for_int(int x)
@@ -95,6 +98,25 @@ bytes_for_int(int x)
  	return len+1;
 }
 
+/* print x at p without the terminating EOS, return the end */
+char*
+msg_put_int(char* p, int x)
+{
+	char	tmp[16];
+	char*	tp = tmp + sizeof(tmp);
+	unsigned int ux = (x < 0) ? 0U-(unsigned int)x : (unsigned int)x;
+
+	do {
+		*--tp = '0' + ux % 10;
+		ux /= 10;
+	} while (ux);
+	if (x < 0) {
+		*--tp = '-';
+	}
+	memcpy(p, tp, tmp + sizeof(tmp) - tp);
+	return p + (tmp + sizeof(tmp) - tp);
+}
+
 int
 netstring_extra(int x)
 {
@@ -176,10 +198,10 @@ string_list_pack_length(const GList* _list)
 
 		return 0;
 	}
-	for (i = 0; i < g_list_length(list) ; i++){
+	for (i = 0; list != NULL; i++, list = g_list_next(list)){
 		
 		int len = 0;
-		char * element = g_list_nth_data(list, i);
+		char * element = list->data;
 		if (element == NULL){
 			cl_log(LOG_ERR, "string_list_pack_length: "
 			       "%luth element of the string list is NULL"
@@ -215,8 +237,8 @@ string_list_pack(GList* list, char* buf, char* maxp)
 	size_t i;
 	char* p =  buf;
 
-	for (i = 0; i < g_list_length(list) ; i++){
-		char * element = g_list_nth_data(list, i);
+	for (i = 0; list != NULL; i++, list = g_list_next(list)){
+		char * element = list->data;
 		int element_len;
 
 		if (element == NULL){
@@ -231,7 +253,11 @@ string_list_pack(GList* list, char* buf, char* maxp)
 			       __FUNCTION__);
 			return 0;
 		}
-		p += sprintf(p, "%d:%s,", element_len,element);
+		p = msg_put_int(p, element_len);
+		*p++ = ':';
+		memcpy(p, element, element_len);
+		p += element_len;
+		*p++ = ',';
 		
 		if (p > maxp){
 			cl_log(LOG_ERR, "string_list_pack: "
@@ -1084,10 +1110,10 @@ add_uncompress_field(struct ha_msg* msg, char* name, size_t namelen,
 static int
 str2string(char* buf, char* maxp, void* value, size_t len, int depth)
 {
-	char* s =  value;
+	const char* s =  value;
+	const char* smax = s + len;
 	char* p = buf;
-	(void)maxp;
-	(void)depth;
+	int i;
 	
 	if (buf + len > maxp){
 		cl_log(LOG_ERR, "%s: out of boundary",
@@ -1095,19 +1121,30 @@ str2string(char* buf, char* maxp, void* value, size_t len, int depth)
 		return -1;
 	}
 
-	if ( strlen(s) != len){
+	/* copy and escape in one go; in a child message of depth the
+	 * symbols of the enclosing messages must not appear */
+	for (; s < smax; s++) {
+		if (*s == '\n') {
+			*p++ = SPECIAL_SYM;
+			continue;
+		}
+		if (*s == EOS) {
+			break;
+		}
+		for (i = 0; i < depth; i++) {
+			if (*s == SPECIAL_SYMS[i]) {
+				cl_log(LOG_ERR, "str2string: special symbol"
+				" '0x%x' found in string", *s);
+				return -1;
+			}
+		}
+		*p++ = *s;
+	}
+	if (s != smax){
 		cl_log(LOG_ERR, "str2string:"
 		       "the input len != string length");
 		return -1;
 	}
-	
-	strcat(buf, s);
-	while(*p != '\0'){
-		if (*p == '\n'){
-			*p = SPECIAL_SYM;
-		}
-		p++;
-	}
 
 	return len;
 	
@@ -1145,18 +1182,19 @@ struct2string(char* buf, char* maxp, void* value, size_t len, int depth)
 {
 
 	struct ha_msg* msg = value;
-	int	baselen = get_stringlen(msg);
+	size_t	slen;
 	
 	(void)len;
 
-	if ( buf + baselen > maxp){
-		cl_log(LOG_ERR, "struct2string: not enough buffer"
-		       "for the struct to generate a string");
+	if (depth >= MAXDEPTH ){
+		cl_log(LOG_ERR, "struct2string(): MAXDEPTH exceeded: %d", depth);
 		return -1;
 	}
 
-	if (msg2string_buf(msg, buf ,baselen,depth + 1, NEEDHEAD)
-	    != HA_OK){
+	/* the child writes its new lines as our symbol straight away,
+	 * no need to convert() afterwards */
+	if (msg2string_ll(msg, buf, maxp, depth + 1, NEEDHEAD
+	,	SPECIAL_SYMS[depth], &slen) != HA_OK){
 		
 		cl_log(LOG_ERR
 		       , "struct2string(): msg2string_buf for"
@@ -1165,12 +1203,7 @@ struct2string(char* buf, char* maxp, void* value, size_t len, int depth)
 		
 	}
 	
-	if (convert(buf, baselen, depth, NL_TO_SYM) != HA_OK){		
-		cl_log(LOG_ERR , "struct2string(): convert failed");		
-		return -1;		
-	}
-	
-	return strlen(buf);
+	return slen;
 }
 
 
@@ -1186,13 +1219,17 @@ list2string(char* buf, char* maxp, void* value, size_t len, int depth)
 	GList* list = (GList*) value;
 
 	(void)len;
-	(void)depth;
 	listlen = string_list_pack(list , buf, maxp);			
 	if (listlen == 0){
 		cl_log(LOG_ERR, "list2string():"
 		       "string_list_pack() failed");
 		return -1;
 	}
+	/* in a child message the new lines are the parent's symbol */
+	if (depth > 0 && convert(buf, listlen, depth-1, NL_TO_SYM) != HA_OK){
+		cl_log(LOG_ERR , "list2string(): convert failed");
+		return -1;
+	}
 	
 	return listlen;	
 	
@@ -1343,7 +1380,15 @@ fields2netstring(char* sp, char* smax, char* name, size_t nlen,
 		       __FUNCTION__, tmpsp, smax);
 		return HA_FAIL;
 	}
-	sp += sprintf(sp , "%d:(%d)%s=", (int)fieldlen, type, name);
+	sp = msg_put_int(sp, fieldlen);
+	*sp++ = ':';
+	*sp++ = '(';
+	sp = msg_put_int(sp, type);
+	*sp++ = ')';
+	memcpy(sp, name, nlen);
+	sp += nlen;
+	*sp++ = '=';
+	fieldlen -= 3 + nlen + 1; /* what is left for the value */
 	switch (type){
 
 	case FT_STRING:
@@ -1360,35 +1405,23 @@ fields2netstring(char* sp, char* smax, char* name, size_t nlen,
 			/* infinite recursion? Must say that I got lost at
 			 * this point
 			 */
-			ret = msg2netstring_buf(msg, sp,get_netstringlen(msg),
-						&slen);
+			ret = msg2netstring_buf(msg, sp, fieldlen, &slen);
 			break;
 		}
 	case FT_LIST:
 		{
-
-			char buf[MAXLENGTH];
 			GList* list = NULL;
 			int tmplen;
 			
 			list = (GList*) value;
 			
-			tmplen = string_list_pack_length(list);
-			if (tmplen >= MAXLENGTH){
-				cl_log(LOG_ERR,
-				       "string list length exceeds limit");
-				return(HA_FAIL);
-			}
-			
-			if (string_list_pack(list, buf, buf + MAXLENGTH) 
-			    != tmplen ){
+			/* the room was checked above */
+			tmplen = string_list_pack(list, sp, sp + fieldlen);
+			if (tmplen == 0 && list != NULL){
 				cl_log(LOG_ERR, 
-				       "packing string list return wrong length");
+				       "packing string list failed");
 				return(HA_FAIL);
 			}
-			
-			
-			memcpy(sp, buf, tmplen);
 			slen = tmplen;
 			ret = HA_OK;
 			break;
@@ -1402,6 +1435,12 @@ fields2netstring(char* sp, char* smax, char* name, size_t nlen,
 	if (ret == HA_FAIL){
 		return ret;
 	}
+	if (slen != fieldlen){
+		cl_log(LOG_ERR, "%s: netstring len discrepency: actual usage"
+		       " is %d bytes, it should use %d", __FUNCTION__
+		,	(int)slen, (int)fieldlen);
+		return HA_FAIL;
+	}
 	
 	sp +=slen;
 	*sp++ = ',';
@@ -47,6 +47,17 @@ int compose_netstring(char*, const char*, const char*, size_t, size_t*);
 int is_auth_netstring(const char*, size_t, const char*, size_t);
 char* msg2netstring(const struct ha_msg*, size_t*);
 int process_netstring_nvpair(struct ha_msg* m, const char* nvpair, int nvlen);
+int cl_msg_add_raw(struct ha_msg* msg, char* name, size_t nlen
+,	void* value, size_t vlen, int type);
+int cl_msg_terminate_borrowed(struct ha_msg* msg);
+struct ha_msg* netstring2msg_ll(const char* s, size_t length, int needauth
+,	char* pin);
+static struct ha_msg* netstring2msg_rec(const char *s, size_t length
+,	int* slen, char* pin);
+static int process_netstring_nvpair_ll(struct ha_msg* m, const char* nvpair
+,	int nvlen, char* pin);
+int msg2netstring_mb(const struct ha_msg* m, struct cl_msgbuf* mb
+,	int len, int need_auth);
 extern int	bytes_for_int(int x);
 extern const char *	FT_strings[];
 
@@ -135,15 +146,19 @@ msg2netstring_buf(const struct ha_msg *m, char *s,
 	sp = s;
 	smax = s + buflen;
 
-	strcpy(sp, MSG_START_NETSTRING);
-
-	sp += strlen(MSG_START_NETSTRING);
+	if (sp + STRLEN_CONST(MSG_START_NETSTRING) > smax){
+		cl_log(LOG_ERR, "%s: out of boundary for MSG_START_NETSTRING",
+		       __FUNCTION__);
+		return HA_FAIL;
+	}
+	memcpy(sp, MSG_START_NETSTRING, STRLEN_CONST(MSG_START_NETSTRING));
+	sp += STRLEN_CONST(MSG_START_NETSTRING);
 
 	for (i=0; i < m->nfields; i++) {
 		size_t flen;
-		int	tmplen;
 		
-		/* some of these functions in its turn invoke us again */
+		/* some of these functions in its turn invoke us again;
+		 * they check the length of what they wrote */
 		ret = fieldtypefuncs[m->types[i]].tonetstring(sp, 
 							      smax,
 							      m->names[i],
@@ -158,26 +173,17 @@ msg2netstring_buf(const struct ha_msg *m, char *s,
 			cl_log_message(LOG_ERR, m);
 			return ret;
 		}
-		
-		tmplen = netstring_extra(fieldtypefuncs[m->types[i]].netstringlen(m->nlens[i],
-										  m->vlens[i],
-										  m->values[i]));
-		
-		if (flen != tmplen ){
-			cl_log(LOG_ERR,"netstring len discrepency: actual usage is %d bytes"
-			       "it should use %d", (int)flen, tmplen);			       
-		}
 		sp +=flen;
 		
 	}
 	
-	if (sp + strlen(MSG_END_NETSTRING) > smax){
+	if (sp + STRLEN_CONST(MSG_END_NETSTRING) > smax){
 		cl_log(LOG_ERR, "%s: out of boundary for MSG_END_NETSTRING",
 		       __FUNCTION__);
 		return HA_FAIL;
 	}
-	strcpy(sp, MSG_END_NETSTRING);
-	sp += sizeof(MSG_END_NETSTRING) -1;
+	memcpy(sp, MSG_END_NETSTRING, STRLEN_CONST(MSG_END_NETSTRING));
+	sp += STRLEN_CONST(MSG_END_NETSTRING);
 	
 	if (sp > smax){
 		cl_log(LOG_ERR,
@@ -201,39 +207,41 @@ int get_netstringlen_auth(const struct ha_msg* m)
 
 
 
-static char *
-msg2netstring_ll(const struct ha_msg *m, size_t * slen, int need_auth)
+/*
+ * Append the netstring of m to mb, len is get_netstringlen(m) if the
+ * caller knows it already (or -1). The result is followed by an EOS
+ * which is not counted in mb->len.
+ */
+int
+msg2netstring_mb(const struct ha_msg *m, struct cl_msgbuf* mb
+,	int len, int need_auth)
 {
-	int	len;
-	char*	s;
 	int	authnum;
 	char	authtoken[MAXLINE];
 	char	authstring[MAXLINE];
+	char*	s;
 	char*	sp;
 	size_t	payload_len;
-	char*   smax;
 
-	len= get_netstringlen_auth(m) + 1;
-	
+	if (len < 0) {
+		len = get_netstringlen(m);
+	}
 	/* use MAXUNCOMPRESSED for the in memory size check */
-	if (len >= MAXUNCOMPRESSED){
+	if (len + MAX_AUTH_BYTES + 1 >= MAXUNCOMPRESSED){
 		cl_log(LOG_ERR, "%s: msg is too large; len=%d,"
-		       " MAX msg allowed=%d", __FUNCTION__, len, MAXUNCOMPRESSED);
-		return NULL;
+		       " MAX msg allowed=%d", __FUNCTION__
+		,	len + MAX_AUTH_BYTES + 1, MAXUNCOMPRESSED);
+		return HA_FAIL;
 	}
-
-	s = calloc(1, len);
-	if (!s){
+	if (cl_msgbuf_reserve(mb, len + MAX_AUTH_BYTES + 1) != HA_OK){
 		cl_log(LOG_ERR, "%s: no memory for netstring", __FUNCTION__);
-		return(NULL);
+		return HA_FAIL;
 	}
-
-	smax = s + len;
+	s = mb->buf + mb->len;
 
 	if (msg2netstring_buf(m, s, len, &payload_len) != HA_OK){
 		cl_log(LOG_ERR, "%s:  msg2netstring_buf() failed", __FUNCTION__);
-		free(s);
-		return(NULL);
+		return HA_FAIL;
 	}
 	
 	sp = s + payload_len;
@@ -245,23 +253,36 @@ msg2netstring_ll(const struct ha_msg *m, size_t * slen, int need_auth)
 		if (authnum < 0){
 			cl_log(LOG_WARNING
 			       ,	"Cannot compute message authentication!");
-			free(s);
-			return(NULL);
+			return HA_FAIL;
 		}
 		
 		sprintf(authstring, "%d %s", authnum, authtoken);
 		auth_strlen = strlen(authstring);
-		if (sp  + 2 + auth_strlen + bytes_for_int(auth_strlen)  >= smax){
+		if (sp  + 2 + auth_strlen + bytes_for_int(auth_strlen)
+		>=	s + len + MAX_AUTH_BYTES + 1){
 			cl_log(LOG_ERR, "%s: out of boundary for auth", __FUNCTION__);
-			free(s);
-			return NULL;
+			return HA_FAIL;
 		}
 		sp += sprintf(sp, "%ld:%s,", (long)strlen(authstring), authstring);	
 		
 	}
-	*slen = sp - s;
+	*sp = EOS;
+	mb->len += sp - s;
 
-	return(s);
+	return HA_OK;
+}
+
+static char *
+msg2netstring_ll(const struct ha_msg *m, size_t * slen, int need_auth)
+{
+	struct cl_msgbuf mb = {NULL, 0, 0};
+
+	if (msg2netstring_mb(m, &mb, -1, need_auth) != HA_OK){
+		free(mb.buf);
+		return NULL;
+	}
+	*slen = mb.len;
+	return mb.buf;
 }
 
 char *
@@ -335,8 +356,17 @@ peel_netstring(const char * s, const char * smax, int* len,
 
 int
 process_netstring_nvpair(struct ha_msg* m, const char* nvpair, int nvlen)
+{
+	return process_netstring_nvpair_ll(m, nvpair, nvlen, NULL);
+}
+
+/* pin: the nvpair, writable, if the field is to be borrowed */
+static int
+process_netstring_nvpair_ll(struct ha_msg* m, const char* nvpair, int nvlen
+,	char* pin)
 {
 	
+	const char	*start = nvpair;
 	const char	*name;
 	int		nlen;
 	const char	*ns_value;
@@ -374,6 +404,31 @@ process_netstring_nvpair(struct ha_msg* m, const char* nvpair, int nvlen)
 	name = nvpair;
 	ns_value = name +nlen + 1;
 	ns_vlen = nvpair + nvlen - ns_value -3 ;
+	if (pin && (type == FT_STRING || type == FT_STRUCT) && ns_vlen > 0) {
+		/* borrowed, see cl_msg_add_raw() */
+		char*	pvalue = pin + (ns_value - start);
+		int	slen;
+
+		if (type == FT_STRING) {
+			value = pvalue;
+		} else if ((value = netstring2msg_rec(ns_value, ns_vlen
+		,	&slen, pvalue)) == NULL) {
+			cl_log(LOG_ERR, "%s: netstring2msg_rec failed"
+			,	__FUNCTION__);
+			return HA_FAIL;
+		}
+		if (cl_msg_add_raw(m, pin + (name - start), nlen, value, ns_vlen
+		,	type) != HA_OK) {
+			if (type == FT_STRUCT) {
+				ha_msg_del(value);
+			}
+			return HA_FAIL;
+		}
+		if (type == FT_STRUCT) {
+			m->vlens[m->nfields-1] = 0;
+		}
+		return HA_OK;
+	}
 	if (fieldtypefuncs[type].netstringtofield(ns_value,ns_vlen, &value, &vlen) != HA_OK){
 		cl_log(LOG_ERR, "netstringtofield failed in %s", __FUNCTION__);
 		return HA_FAIL;
@@ -405,7 +460,7 @@ process_netstring_nvpair(struct ha_msg* m, const char* nvpair, int nvlen)
 
 /* Converts a netstring into a message*/
 static struct ha_msg *
-netstring2msg_rec(const char *s, size_t length, int* slen)
+netstring2msg_rec(const char *s, size_t length, int* slen, char* pin)
 {
 	struct ha_msg*	ret = NULL;
 	const char *	sp = s;
@@ -416,6 +471,10 @@ netstring2msg_rec(const char *s, size_t length, int* slen)
 	if ((ret = ha_msg_new(0)) == NULL){
 		return(NULL);
 	}
+	if (pin) {
+		ret->pin_start = s;
+		ret->pin_end = smax;
+	}
 
 	startlen = sizeof(MSG_START_NETSTRING)-1;
 
@@ -448,7 +507,8 @@ netstring2msg_rec(const char *s, size_t length, int* slen)
 		}
 		sp +=  parselen;
 		
-		if (process_netstring_nvpair(ret, nvpair, nvlen) != HA_OK){
+		if (process_netstring_nvpair_ll(ret, nvpair, nvlen
+		,	pin ? pin + (nvpair - s) : NULL) != HA_OK){
 			cl_log(LOG_ERR, "%s: processing nvpair failed", __FUNCTION__);
 			return HA_FAIL;
 		}
@@ -465,6 +525,12 @@ netstring2msg_rec(const char *s, size_t length, int* slen)
 
 struct ha_msg *
 netstring2msg(const char* s, size_t length, int needauth)
+{
+	return netstring2msg_ll(s, length, needauth, FALSE);
+}
+
+struct ha_msg *
+netstring2msg_ll(const char* s, size_t length, int needauth, char* pin)
 {
 	const char	*sp;
 	struct ha_msg	*msg;
@@ -475,7 +541,10 @@ netstring2msg(const char* s, size_t length, int needauth)
 	/*actual string length used excluding auth string*/
 	int		slen = 0; /* assign to keep compiler happy */
 	
-	msg = netstring2msg_rec(s, length, &slen);
+	msg = netstring2msg_rec(s, length, &slen, pin);
+	if (msg == NULL) {
+		return(NULL);
+	}
 	
 	if (needauth == FALSE || !authmethod){
 		goto out;
@@ -511,6 +580,11 @@ netstring2msg(const char* s, size_t length, int needauth)
 	}	
 	
  out:
+	/* the message is intact up to here, for the authentication */
+	if (pin && cl_msg_terminate_borrowed(msg) != HA_OK) {
+		ha_msg_del(msg);
+		return(NULL);
+	}
 	return msg;
 }
 
@@ -0,0 +1,294 @@
+/* File: ha_msg_borrow_test.c
+ * Description: tests and microbenchmark for the ha_msg wire formats
+ *	and borrowed (parsed in place) ha_msgs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <clplumbing/cl_log.h>
+#include <ha_msg.h>
+
+#define PARSES	100000
+
+static int released;
+
+static void
+count_release(void* data)
+{
+	released++;
+	free(data);
+}
+
+static struct ha_msg*
+make_msg(int nfields, gboolean nested)
+{
+	struct ha_msg* msg = ha_msg_new(0);
+	struct ha_msg* child;
+	char name[32], value[32];
+	int i;
+
+	for (i = 0; i < nfields; i++) {
+		snprintf(name, sizeof(name), "param_%d", i);
+		snprintf(value, sizeof(value), "value_%d", i);
+		ha_msg_add(msg, name, value);
+	}
+	ha_msg_add(msg, "multiline", "one\ntwo");
+	if (nested) {
+		child = make_msg(nfields, FALSE);
+		ha_msg_addstruct(msg, "child", child);
+		ha_msg_del(child);
+		ha_msg_addbin(msg, "bin", "a\0b", 3);
+		cl_msg_list_add_string(msg, "list", "first");
+		cl_msg_list_add_string(msg, "list", "second");
+	}
+	return msg;
+}
+
+/* parse a copy of the wire format of msg in place */
+static struct ha_msg*
+borrow_msg(struct ha_msg* msg)
+{
+	size_t len;
+	char* wire = msg2wirefmt_noac(msg, &len);
+	char* buf;
+
+	if (wire == NULL || (buf = malloc(len+1)) == NULL) {
+		free(wire);
+		return NULL;
+	}
+	memcpy(buf, wire, len);
+	buf[len] = EOS;
+	free(wire);
+	return wirefmt2msg_borrow(buf, len, 0, count_release, buf);
+}
+
+static struct ha_msg*
+copy_msg(struct ha_msg* msg)
+{
+	size_t len;
+	char* wire = msg2wirefmt_noac(msg, &len);
+	struct ha_msg* ret = wirefmt2msg(wire, len, 0);
+
+	free(wire);
+	return ret;
+}
+
+static int
+same_msg(struct ha_msg* a, struct ha_msg* b, const char* what)
+{
+	char* sa = msg2string(a);
+	char* sb = msg2string(b);
+	int rc = 0;
+
+	if (sa == NULL || sb == NULL || strcmp(sa, sb) != 0) {
+		cl_log(LOG_ERR, "%s: messages differ", what);
+		rc = 1;
+	}
+	free(sa);
+	free(sb);
+	return rc;
+}
+
+static int
+test_borrow(gboolean nested)
+{
+	struct ha_msg* msg = make_msg(20, nested);
+	struct ha_msg* b;
+	struct ha_msg* copy;
+	const char* v;
+	int errors = 0;
+
+	released = 0;
+	if ((b = borrow_msg(msg)) == NULL) {
+		cl_log(LOG_ERR, "borrowed parse failed");
+		ha_msg_del(msg);
+		return 1;
+	}
+	errors += same_msg(msg, b, "parse");
+	copy = copy_msg(msg);
+	errors += same_msg(msg, copy, "copying parse");
+	ha_msg_del(copy);
+	v = ha_msg_value(b, "multiline");
+	if (v == NULL || strcmp(v, "one\ntwo") != 0) {
+		cl_log(LOG_ERR, "multiline value not converted");
+		errors++;
+	}
+	if (nested && (cl_get_struct(b, "child") == NULL
+	||	strcmp(ha_msg_value(cl_get_struct(b, "child"), "param_3")
+		,	"value_3") != 0)) {
+		cl_log(LOG_ERR, "nested message not parsed");
+		errors++;
+	}
+
+	/* changes must not free what is borrowed */
+	ha_msg_mod(msg, "param_1", "changed");
+	ha_msg_mod(b, "param_1", "changed");
+	cl_msg_remove(msg, "param_2");
+	cl_msg_remove(b, "param_2");
+	ha_msg_add(msg, "param_x", "added");
+	ha_msg_add(b, "param_x", "added");
+	errors += same_msg(msg, b, "changed");
+
+	copy = ha_msg_copy(b);
+	if (cl_msg_unborrow(b) != HA_OK || released != 1) {
+		cl_log(LOG_ERR, "unborrow failed");
+		errors++;
+	}
+	errors += same_msg(copy, b, "unborrowed");
+	ha_msg_del(copy);
+	ha_msg_del(b);
+	if (released != 1) {
+		cl_log(LOG_ERR, "buffer released %d times", released);
+		errors++;
+	}
+
+	/* and deleting releases the buffer */
+	released = 0;
+	b = borrow_msg(msg);
+	ha_msg_del(b);
+	if (released != 1) {
+		cl_log(LOG_ERR, "buffer released %d times", released);
+		errors++;
+	}
+	ha_msg_del(msg);
+	return errors;
+}
+
+/*
+ * A netstring string value that holds the string format's symbol for
+ * a new line: the borrowed field must be what the copying parser
+ * makes of it (which is what add_string_field() makes of it)
+ */
+static int
+test_netstring_value(void)
+{
+	const char wire[] = "###\n14:(0)sym=one\023two,%%%\n";
+	char* buf = strdup(wire);
+	struct ha_msg* b;
+	struct ha_msg* copy;
+	const char* vb;
+	const char* vc;
+	int errors = 0;
+
+	copy = wirefmt2msg(wire, sizeof(wire)-1, 0);
+	b = wirefmt2msg_borrow(buf, sizeof(wire)-1, 0, free, buf);
+	if (b == NULL || copy == NULL) {
+		cl_log(LOG_ERR, "netstring parse failed");
+		ha_msg_del(b);
+		ha_msg_del(copy);
+		return 1;
+	}
+	vb = ha_msg_value(b, "sym");
+	vc = ha_msg_value(copy, "sym");
+	if (vb == NULL || vc == NULL || strcmp(vb, vc) != 0) {
+		cl_log(LOG_ERR, "netstring value: borrowed and copied differ");
+		errors++;
+	}
+	ha_msg_del(copy);
+	ha_msg_del(b);
+	return errors;
+}
+
+static double
+time_encode(struct ha_msg* msg)
+{
+	struct timeval start, end;
+	size_t len;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < PARSES; i++) {
+		free(msg2wirefmt_noac(msg, &len));
+	}
+	gettimeofday(&end, NULL);
+	return ((end.tv_sec - start.tv_sec)*1e6
+		+ (end.tv_usec - start.tv_usec)) / PARSES;
+}
+
+static double
+time_parse(struct ha_msg* msg, gboolean borrow)
+{
+	size_t len;
+	char* wire = msg2wirefmt_noac(msg, &len);
+	char* buf = malloc(len+1);
+	struct timeval start, end;
+	struct ha_msg* m;
+	int i;
+
+	buf[len] = EOS;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < PARSES; i++) {
+		/* the copy is what the IPC layer would have received */
+		memcpy(buf, wire, len);
+		if (borrow) {
+			m = wirefmt2msg_borrow(buf, len, 0, NULL, NULL);
+		} else {
+			m = wirefmt2msg(buf, len, 0);
+		}
+		ha_msg_value(m, "param_0");
+		ha_msg_del(m);
+	}
+	gettimeofday(&end, NULL);
+	free(buf);
+	free(wire);
+	return ((end.tv_sec - start.tv_sec)*1e6
+		+ (end.tv_usec - start.tv_usec)) / PARSES;
+}
+
+int main(void)
+{
+	int sizes[] = {4, 16, 64, 256};
+	int formats[] = {MSGFMT_NVPAIR, MSGFMT_NETSTRING, MSGFMT_BINARY};
+	const char* names[] = {"string", "netstring", "binary"};
+	int error_count = 0;
+	int i, f;
+
+	cl_log_set_entity("ha_msg_borrow_test");
+	cl_log_enable_stderr(TRUE);
+
+	for (f = 0; f < DIMOF(formats); f++) {
+		cl_set_msg_format(formats[f]);
+		error_count += test_borrow(FALSE);
+		error_count += test_borrow(TRUE);
+	}
+	error_count += test_netstring_value();
+
+	printf("fields   format      encode (us)   copy (us)   borrow (us)\n");
+	for (i = 0; i < DIMOF(sizes); i++) {
+		/* no nested messages, they need netstrings */
+		struct ha_msg* msg = make_msg(sizes[i], FALSE);
+
+		for (f = 0; f < DIMOF(formats); f++) {
+			cl_set_msg_format(formats[f]);
+			printf("%6d   %-9s %13.2f %11.2f %13.2f\n"
+			,	sizes[i], names[f], time_encode(msg)
+			,	time_parse(msg, FALSE), time_parse(msg, TRUE));
+		}
+		ha_msg_del(msg);
+	}
+	cl_set_msg_format(MSGFMT_NVPAIR);
+
+	if (error_count == 0) {
+		cl_log(LOG_INFO, "ha_msg wire format test passed.");
+	} else {
+		cl_log(LOG_ERR, "ha_msg wire format test failed"
+		" (%d errors).", error_count);
+	}
+	return error_count;
+}
@@ -0,0 +1,157 @@
+/* File: ha_msg_index_test.c
+ * Description: ha_msg field lookup tests and microbenchmark
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <clplumbing/cl_log.h>
+#include <ha_msg.h>
+
+#define LOOKUPS	2000000
+
+static struct ha_msg*
+make_msg(int nfields)
+{
+	struct ha_msg* msg = ha_msg_new(0);
+	char name[32], value[32];
+	int i;
+
+	for (i = 0; i < nfields; i++) {
+		snprintf(name, sizeof(name), "param_%d", i);
+		snprintf(value, sizeof(value), "value_%d", i);
+		if (ha_msg_add(msg, name, value) != HA_OK) {
+			ha_msg_del(msg);
+			return NULL;
+		}
+	}
+	return msg;
+}
+
+static int
+check_value(struct ha_msg* msg, int i, const char* expected)
+{
+	char name[32];
+	const char* v;
+
+	snprintf(name, sizeof(name), "param_%d", i);
+	v = ha_msg_value(msg, name);
+	if ((v == NULL) != (expected == NULL)
+	||	(v && strcmp(v, expected) != 0)) {
+		cl_log(LOG_ERR, "%s: got %s, expected %s"
+		,	name, v ? v : "NULL", expected ? expected : "NULL");
+		return 1;
+	}
+	return 0;
+}
+
+/* the index must give the same answers as the scan, also after
+ * the message changed */
+static int
+test_lookup(void)
+{
+	struct ha_msg* msg = make_msg(100);
+	struct ha_msg* copy;
+	char value[32];
+	int errors = 0, i;
+
+	for (i = 0; i < 100; i++) {
+		snprintf(value, sizeof(value), "value_%d", i);
+		errors += check_value(msg, i, value);
+	}
+	errors += check_value(msg, 100, NULL);
+
+	/* appended fields, the first of two equal names wins */
+	ha_msg_add(msg, "param_100", "new");
+	ha_msg_add(msg, "param_100", "dup");
+	errors += check_value(msg, 100, "new");
+
+	/* removing moves the fields behind */
+	cl_msg_remove(msg, "param_10");
+	errors += check_value(msg, 10, NULL);
+	errors += check_value(msg, 11, "value_11");
+	errors += check_value(msg, 99, "value_99");
+	cl_msg_remove(msg, "param_100");
+	errors += check_value(msg, 100, "dup");
+
+	ha_msg_mod(msg, "param_50", "modified");
+	errors += check_value(msg, 50, "modified");
+
+	copy = ha_msg_copy(msg);
+	errors += check_value(copy, 50, "modified");
+	errors += check_value(copy, 10, NULL);
+	ha_msg_del(copy);
+	ha_msg_del(msg);
+	return errors;
+}
+
+static double
+time_lookups(int nfields, int threshold)
+{
+	struct ha_msg* msg = make_msg(nfields);
+	char name[32];
+	struct timeval start, end;
+	int i, found = 0;
+
+	cl_set_msg_index_threshold(threshold);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOOKUPS; i++) {
+		snprintf(name, sizeof(name), "param_%d", (i*7) % nfields);
+		if (ha_msg_value(msg, name)) {
+			found++;
+		}
+	}
+	gettimeofday(&end, NULL);
+	ha_msg_del(msg);
+	if (found != LOOKUPS) {
+		cl_log(LOG_ERR, "lookups failed: %d of %d", LOOKUPS-found, LOOKUPS);
+	}
+	return ((end.tv_sec - start.tv_sec)*1e6
+		+ (end.tv_usec - start.tv_usec)) * 1000 / LOOKUPS;
+}
+
+int main(void)
+{
+	int sizes[] = {8, 16, 32, 64, 128, 512};
+	int error_count = 0;
+	int i;
+
+	cl_log_set_entity("ha_msg_index_test");
+	cl_log_enable_stderr(TRUE);
+
+	error_count += test_lookup();
+	cl_set_msg_index_threshold(0);
+	error_count += test_lookup();
+	cl_set_msg_index_threshold(1);
+	error_count += test_lookup();
+
+	printf("fields   scan (ns/lookup)   index (ns/lookup)\n");
+	for (i = 0; i < DIMOF(sizes); i++) {
+		double scan = time_lookups(sizes[i], 0);
+		double index = time_lookups(sizes[i], 1);
+		printf("%6d   %16.1f   %17.1f\n", sizes[i], scan, index);
+	}
+
+	if (error_count == 0) {
+		cl_log(LOG_INFO, "ha_msg field lookup test passed.");
+	} else {
+		cl_log(LOG_ERR, "ha_msg field lookup test failed"
+		" (%d errors).", error_count);
+	}
+	return error_count;
+}
@@ -0,0 +1,611 @@
+/*
+ * ipcshm.c: shared memory rings for local IPC channels (IPC_SHM)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * An IPC_SHM channel is a unix domain socket channel which, once
+ * connected, moves its byte stream through two rings in a memfd
+ * instead of through the socket. The client creates the memfd and
+ * one eventfd per side (the "doorbells") and passes them to the
+ * server with SCM_RIGHTS in the first message on the socket:
+ *
+ *	magic ringsize			+ memfd, client bell, server bell
+ *
+ * ringsize 0 (and no descriptors) means no shared memory, the socket
+ * is then used as usual. The server doesn't wait for the setup when
+ * it accepts the connection; the channel reads it like any input,
+ * and holds back its output until then. After the setup the socket carries no data,
+ * it's kept for the credentials and to see the peer go away.
+ *
+ * Each ring has one writer and one reader which only move their own
+ * position. Nobody is woken up while both sides keep up; a reader
+ * which finds its ring empty (or a writer which finds it full) sets
+ * its waiting flag, looks again, and the other side rings its bell
+ * when it sees the flag. Channels poll an epoll fd with the bell and
+ * the socket in it.
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#	include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#	include <sys/epoll.h>
+#endif
+#include <sys/mman.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/ipc.h>
+#include "ipcshm.h"
+
+#define IPC_SHM_MAGIC	0x6873686dU	/* "mhsh" on the wire */
+#define SHM_MINSIZE	(64*1024)
+#define SHM_MAXSIZE	(1U<<30)
+#define SHM_HDRSIZE	4096		/* struct shm_ring, page aligned */
+#define SHM_NFDS	3
+#define CACHELINE	64
+
+struct ipc_shm_setup {
+	guint32	magic;
+	guint32	ringsize;	/* 0: no shared memory */
+};
+
+#ifdef HAVE_IPC_SHM
+
+/* the shared part of a ring, in front of its data */
+struct shm_ring {
+	guint32	head;		/* bytes written, only the writer moves it */
+	char	pad1[CACHELINE - sizeof(guint32)];
+	guint32	tail;		/* bytes read, only the reader moves it */
+	char	pad2[CACHELINE - sizeof(guint32)];
+	gint	reader_waiting;	/* set by the reader, cleared by the writer */
+	gint	writer_waiting;	/* and the other way round */
+};
+
+struct shm_end {
+	struct shm_ring*	ring;
+	char*			data;
+	guint32			pos;	/* our copy of head or tail */
+};
+
+struct ipc_shm {
+	char*		map;
+	size_t		maplen;
+	guint32		size;		/* of each ring, a power of 2 */
+	struct shm_end	tx;
+	struct shm_end	rx;
+	int		bell;		/* ours, in epfd */
+	int		peer_bell;
+	int		epfd;
+};
+
+static size_t
+shm_maplen(guint32 size)
+{
+	return 2 * ((size_t)SHM_HDRSIZE + size);
+}
+
+/* the poll fd of a channel, with the socket in it for now */
+static struct ipc_shm*
+shm_new(int sock)
+{
+	struct ipc_shm*		shm;
+	struct epoll_event	ev;
+
+	if ((shm = calloc(1, sizeof(*shm))) == NULL) {
+		return NULL;
+	}
+	shm->bell = -1;
+	shm->peer_bell = -1;
+	if ((shm->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		cl_perror("%s: epoll_create1", __FUNCTION__);
+		free(shm);
+		return NULL;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.fd = sock;
+	if (epoll_ctl(shm->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		cl_perror("%s: epoll_ctl(socket)", __FUNCTION__);
+		close(shm->epfd);
+		free(shm);
+		return NULL;
+	}
+	return shm;
+}
+
+/* map the rings, ring 0 goes from the client to the server */
+static int
+shm_map(struct ipc_shm* shm, int memfd, guint32 size, gboolean client
+,	int bell, int peer_bell)
+{
+	struct epoll_event	ev;
+	char*			ring[2];
+
+	shm->size = size;
+	shm->maplen = shm_maplen(size);
+	shm->map = mmap(NULL, shm->maplen, PROT_READ|PROT_WRITE, MAP_SHARED
+	,	memfd, 0);
+	if (shm->map == MAP_FAILED) {
+		cl_perror("%s: mmap of %lu bytes", __FUNCTION__
+		,	(unsigned long)shm->maplen);
+		shm->map = NULL;
+		return IPC_FAIL;
+	}
+	ring[0] = shm->map;
+	ring[1] = shm->map + SHM_HDRSIZE + size;
+	shm->tx.ring = (struct shm_ring*)ring[client ? 0 : 1];
+	shm->rx.ring = (struct shm_ring*)ring[client ? 1 : 0];
+	shm->tx.data = (char*)shm->tx.ring + SHM_HDRSIZE;
+	shm->rx.data = (char*)shm->rx.ring + SHM_HDRSIZE;
+	shm->tx.pos = 0;
+	shm->rx.pos = 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = bell;
+	if (epoll_ctl(shm->epfd, EPOLL_CTL_ADD, bell, &ev) < 0) {
+		cl_perror("%s: epoll_ctl(bell)", __FUNCTION__);
+		munmap(shm->map, shm->maplen);
+		shm->map = NULL;
+		return IPC_FAIL;
+	}
+	shm->bell = bell;
+	shm->peer_bell = peer_bell;
+	return IPC_OK;
+}
+
+static int
+shm_create(guint32 size, int fds[SHM_NFDS])
+{
+	int	j;
+
+	fds[0] = memfd_create("ipc_shm", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (fds[0] < 0) {
+		return IPC_FAIL;
+	}
+	fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	/* the server must not get a SIGBUS because we shrunk it */
+	if (fds[1] < 0 || fds[2] < 0
+	||	ftruncate(fds[0], shm_maplen(size)) < 0
+	||	fcntl(fds[0], F_ADD_SEALS
+		,	F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) < 0) {
+		for (j = 0; j < SHM_NFDS; ++j) {
+			if (fds[j] >= 0) {
+				close(fds[j]);
+			}
+		}
+		return IPC_FAIL;
+	}
+	return IPC_OK;
+}
+
+/* check what a client sent before we map it */
+static int
+shm_check_fds(guint32 size, int fds[SHM_NFDS])
+{
+	struct stat	st;
+	int		seals;
+
+	if (size < SHM_MINSIZE || size > SHM_MAXSIZE
+	||	(size & (size - 1)) != 0) {
+		cl_log(LOG_ERR, "%s: bad ring size %u", __FUNCTION__, size);
+		return IPC_FAIL;
+	}
+	if (fstat(fds[0], &st) < 0
+	||	(size_t)st.st_size != shm_maplen(size)
+	||	(seals = fcntl(fds[0], F_GET_SEALS)) < 0
+	||	(seals & F_SEAL_SHRINK) == 0) {
+		cl_log(LOG_ERR, "%s: unusable shared memory", __FUNCTION__);
+		return IPC_FAIL;
+	}
+	/* we write to the peer's bell, that must never block */
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0
+	||	fcntl(fds[2], F_SETFL, O_NONBLOCK) < 0) {
+		cl_perror("%s: cannot set O_NONBLOCK", __FUNCTION__);
+		return IPC_FAIL;
+	}
+	return IPC_OK;
+}
+
+static void
+shm_copy_in(struct ipc_shm* shm, guint32 pos, const char* src, size_t len)
+{
+	size_t	off = pos & (shm->size - 1);
+	size_t	first = shm->size - off;
+
+	if (len <= first) {
+		memcpy(shm->tx.data + off, src, len);
+	} else {
+		memcpy(shm->tx.data + off, src, first);
+		memcpy(shm->tx.data, src + first, len - first);
+	}
+}
+
+static void
+shm_copy_out(struct ipc_shm* shm, guint32 pos, char* dst, size_t len)
+{
+	size_t	off = pos & (shm->size - 1);
+	size_t	first = shm->size - off;
+
+	if (len <= first) {
+		memcpy(dst, shm->rx.data + off, len);
+	} else {
+		memcpy(dst, shm->rx.data + off, first);
+		memcpy(dst + first, shm->rx.data, len - first);
+	}
+}
+
+/* ring the peer's bell if it asked for it */
+static void
+shm_wake(struct ipc_shm* shm, gint* waiting)
+{
+	guint64	one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)
+	&&	__atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL)) {
+		if (write(shm->peer_bell, &one, sizeof(one)) < 0
+		&&	errno != EAGAIN) {
+			cl_perror("%s: write", __FUNCTION__);
+		}
+	}
+}
+
+ssize_t
+ipc_shm_writev(struct ipc_shm* shm, const struct iovec* iov, int niov)
+{
+	struct shm_ring*	r = shm->tx.ring;
+	guint32			used;
+	size_t			room;
+	size_t			done = 0;
+	size_t			n;
+	int			j;
+
+	used = shm->tx.pos - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used == shm->size) {
+		/* full: ask for a wakeup, then look again */
+		__atomic_store_n(&r->writer_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		used = shm->tx.pos - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (used == shm->size) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if (used > shm->size) {
+		cl_log(LOG_ERR, "%s: bad ring tail", __FUNCTION__);
+		errno = EPROTO;
+		return -1;
+	}
+	room = shm->size - used;
+	for (j = 0; j < niov && done < room; ++j) {
+		n = iov[j].iov_len;
+		if (n > room - done) {
+			n = room - done;
+		}
+		shm_copy_in(shm, shm->tx.pos + done, iov[j].iov_base, n);
+		done += n;
+	}
+	shm->tx.pos += done;
+	__atomic_store_n(&r->head, shm->tx.pos, __ATOMIC_RELEASE);
+	shm_wake(shm, &r->reader_waiting);
+	return done;
+}
+
+ssize_t
+ipc_shm_read(struct ipc_shm* shm, void* buf, size_t len)
+{
+	struct shm_ring*	r = shm->rx.ring;
+	guint32			avail;
+	guint64			count;
+	size_t			n;
+
+	avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - shm->rx.pos;
+	if (avail == 0) {
+		/*
+		 * Empty: forget the old wakeups, ask for a new one and
+		 * look again. This is the only place the bell is reset;
+		 * the wakeups after a full tx ring come through it too,
+		 * which is fine as socket_resume_io() always tries to
+		 * write after it read.
+		 */
+		while (read(shm->bell, &count, sizeof(count)) > 0) {
+			;
+		}
+		__atomic_store_n(&r->reader_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+		-	shm->rx.pos;
+		if (avail == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if (avail > shm->size) {
+		cl_log(LOG_ERR, "%s: bad ring head", __FUNCTION__);
+		errno = EPROTO;
+		return -1;
+	}
+	n = (avail < len) ? avail : len;
+	shm_copy_out(shm, shm->rx.pos, buf, n);
+	shm->rx.pos += n;
+	__atomic_store_n(&r->tail, shm->rx.pos, __ATOMIC_RELEASE);
+	shm_wake(shm, &r->writer_waiting);
+	return n;
+}
+
+int
+ipc_shm_select_fd(struct ipc_shm* shm)
+{
+	return shm->epfd;
+}
+
+int
+ipc_shm_mapped(const struct ipc_shm* shm)
+{
+	return shm->map != NULL;
+}
+
+void
+ipc_shm_del(struct ipc_shm* shm)
+{
+	if (shm == NULL) {
+		return;
+	}
+	if (shm->map != NULL) {
+		munmap(shm->map, shm->maplen);
+	}
+	close(shm->epfd);
+	if (shm->bell >= 0) {
+		close(shm->bell);
+		close(shm->peer_bell);
+	}
+	free(shm);
+}
+
+int
+ipc_shm_connect(int sock, size_t ringsize, struct ipc_shm** shm)
+{
+	struct ipc_shm_setup	setup;
+	struct iovec		iov;
+	struct msghdr		mh;
+	struct cmsghdr*		cmsg;
+	char			cbuf[CMSG_SPACE(sizeof(int) * SHM_NFDS)];
+	int			fds[SHM_NFDS];
+	guint32			size;
+	int			rc;
+
+	for (size = SHM_MINSIZE; size < ringsize && size < SHM_MAXSIZE; ) {
+		size <<= 1;
+	}
+	*shm = NULL;
+	memset(&mh, 0, sizeof(mh));
+	setup.magic = IPC_SHM_MAGIC;
+	setup.ringsize = 0;
+	iov.iov_base = &setup;
+	iov.iov_len = sizeof(setup);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (shm_create(size, fds) != IPC_OK) {
+		cl_perror("%s: no shared memory, using the socket"
+		,	__FUNCTION__);
+	} else if ((*shm = shm_new(sock)) == NULL
+	||	shm_map(*shm, fds[0], size, TRUE, fds[1], fds[2]) != IPC_OK) {
+		ipc_shm_del(*shm);
+		*shm = NULL;
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+	} else {
+		setup.ringsize = size;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	}
+
+	rc = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	if (setup.ringsize) {
+		/* mapped, the server has its own reference */
+		close(fds[0]);
+	}
+	if (rc != (int)sizeof(setup)) {
+		cl_perror("%s: sending the setup", __FUNCTION__);
+		ipc_shm_del(*shm);
+		*shm = NULL;
+		return IPC_FAIL;
+	}
+	return IPC_OK;
+}
+
+struct ipc_shm*
+ipc_shm_accept(int sock)
+{
+	return shm_new(sock);
+}
+
+int
+ipc_shm_setup(struct ipc_shm* shm, int sock)
+{
+	struct ipc_shm_setup	setup;
+	struct iovec		iov;
+	struct msghdr		mh;
+	struct cmsghdr*		cmsg;
+	char			cbuf[CMSG_SPACE(sizeof(int) * SHM_NFDS)];
+	int			fds[SHM_NFDS];
+	int			nfds = 0;
+	int			rc;
+	int			j;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &setup;
+	iov.iov_len = sizeof(setup);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	rc = recvmsg(sock, &mh, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+	||	errno == EINTR)) {
+		errno = EAGAIN;
+		return IPC_FAIL;
+	}
+	if (rc == 0) {
+		return IPC_BROKEN;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); rc >= 0 && cmsg != NULL
+	;	cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+		&&	cmsg->cmsg_type == SCM_RIGHTS) {
+			int	n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+			for (j = 0; j < n; ++j) {
+				int	fd;
+
+				memcpy(&fd, CMSG_DATA(cmsg) + j*sizeof(int)
+				,	sizeof(int));
+				if (nfds < SHM_NFDS) {
+					fds[nfds++] = fd;
+				} else {
+					close(fd);
+				}
+			}
+		}
+	}
+	if (rc != (int)sizeof(setup) || setup.magic != IPC_SHM_MAGIC
+	||	(mh.msg_flags & MSG_CTRUNC)
+	||	nfds != (setup.ringsize ? SHM_NFDS : 0)) {
+		cl_log(LOG_ERR, "%s: bad setup from the client (%d bytes"
+		", %d descriptors)", __FUNCTION__, rc, nfds);
+		rc = IPC_FAIL;
+	} else if (setup.ringsize == 0) {
+		return IPC_OK;
+	} else if (shm_check_fds(setup.ringsize, fds) != IPC_OK
+	||	shm_map(shm, fds[0], setup.ringsize, FALSE, fds[2], fds[1])
+	!=	IPC_OK) {
+		rc = IPC_FAIL;
+	} else {
+		close(fds[0]);
+		return IPC_OK;
+	}
+	for (j = 0; j < nfds; ++j) {
+		close(fds[j]);
+	}
+	errno = EPROTO;
+	return rc;
+}
+
+#else /* HAVE_IPC_SHM */
+
+struct ipc_shm {
+	int	unused;
+};
+
+/* the socket is all we have, tell the server */
+int
+ipc_shm_connect(int sock, size_t ringsize, struct ipc_shm** shm)
+{
+	struct ipc_shm_setup	setup;
+
+	*shm = NULL;
+	setup.magic = IPC_SHM_MAGIC;
+	setup.ringsize = 0;
+	if (write(sock, &setup, sizeof(setup)) != (ssize_t)sizeof(setup)) {
+		cl_perror("%s: sending the setup", __FUNCTION__);
+		return IPC_FAIL;
+	}
+	return IPC_OK;
+}
+
+struct ipc_shm*
+ipc_shm_accept(int sock)
+{
+	return calloc(1, sizeof(struct ipc_shm));
+}
+
+int
+ipc_shm_setup(struct ipc_shm* shm, int sock)
+{
+	struct ipc_shm_setup	setup;
+	ssize_t			rc;
+
+	rc = recv(sock, &setup, sizeof(setup), MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+	||	errno == EINTR)) {
+		errno = EAGAIN;
+		return IPC_FAIL;
+	}
+	if (rc == 0) {
+		return IPC_BROKEN;
+	}
+	if (rc != (ssize_t)sizeof(setup)
+	||	setup.magic != IPC_SHM_MAGIC || setup.ringsize != 0) {
+		cl_log(LOG_ERR, "%s: bad setup from the client"
+		,	__FUNCTION__);
+		errno = EPROTO;
+		return IPC_FAIL;
+	}
+	return IPC_OK;
+}
+
+void
+ipc_shm_del(struct ipc_shm* shm)
+{
+	free(shm);
+}
+
+int
+ipc_shm_select_fd(struct ipc_shm* shm)
+{
+	return -1;
+}
+
+int
+ipc_shm_mapped(const struct ipc_shm* shm)
+{
+	return 0;
+}
+
+ssize_t
+ipc_shm_writev(struct ipc_shm* shm, const struct iovec* iov, int niov)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t
+ipc_shm_read(struct ipc_shm* shm, void* buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* HAVE_IPC_SHM */
@@ -0,0 +1,64 @@
+/*
+ * ipcshm.h: shared memory rings for local IPC channels (IPC_SHM)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _IPCSHM_H
+#define _IPCSHM_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H) \
+	&& defined(HAVE_SYS_EPOLL_H)
+#	define HAVE_IPC_SHM	1
+#endif
+
+/* default size of each of the two rings */
+#define IPC_SHM_RINGSIZE	(1024*1024)
+
+struct ipc_shm;
+
+/*
+ * Set up the rings on a freshly connected socket. ipc_shm_connect()
+ * returns IPC_OK with *shm NULL if this system can't do shared
+ * memory, the socket is then used as before.
+ *
+ * The server doesn't wait for the client's setup: ipc_shm_accept()
+ * only makes the poll fd, and ipc_shm_setup() reads the setup once
+ * it's there, without blocking. That returns IPC_OK when it's done
+ * (the rings are mapped then, unless the client can't do shared
+ * memory), IPC_BROKEN if the client went away, IPC_FAIL with errno
+ * EAGAIN if there's no setup yet, and IPC_FAIL otherwise.
+ */
+int ipc_shm_connect(int sock, size_t ringsize, struct ipc_shm** shm);
+struct ipc_shm* ipc_shm_accept(int sock);
+int ipc_shm_setup(struct ipc_shm* shm, int sock);
+void ipc_shm_del(struct ipc_shm* shm);
+
+/* do the data go through the rings (or through the socket)? */
+int ipc_shm_mapped(const struct ipc_shm* shm);
+
+/*
+ * readable on input, on room after a full ring and on socket events,
+ * -1 if the socket is all there is to poll
+ */
+int ipc_shm_select_fd(struct ipc_shm* shm);
+
+/* like sendmsg()/recv() with MSG_DONTWAIT: -1 and EAGAIN if full/empty */
+ssize_t ipc_shm_writev(struct ipc_shm* shm, const struct iovec* iov
+,	int niov);
+ssize_t ipc_shm_read(struct ipc_shm* shm, void* buf, size_t len);
+
+#endif
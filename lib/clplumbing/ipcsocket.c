@@ -28,8 +28,10 @@
 #include <clplumbing/cl_log.h>
 #include <clplumbing/realtime.h>
 #include <clplumbing/cl_poll.h>
+#include <clplumbing/longclock.h>
 
 #include <ha_msg.h>
+#include "ipcshm.h"
 /* avoid including cib.h - used in gshi's "late message" code to avoid
  *   printing insanely large messages
  */
@@ -105,6 +107,9 @@
 #	define UNIX_PATH_MAX 108
 #endif
 
+/* max. number of messages socket_resume_io_write() sends at once */
+#define SENDBATCH	32
+
 #if HB_IPC_METHOD == HB_IPC_SOCKET
 
 # define MAX_LISTEN_NUM 128
@@ -163,6 +168,8 @@ struct SOCKET_WAIT_CONN_PRIVATE{
   /* the streams pipe */
   int pipefds[2];
 #endif
+  /* clients set up shared memory rings (IPC_SHM) */
+  gboolean shm;
 };
 
 /* channel private data. */
@@ -186,6 +193,14 @@ struct SOCKET_CH_PRIVATE{
 
   /* the buf used to save unfinished message */
   struct IPC_MESSAGE *buf_msg;
+
+  /* IPC_SHM: the size of the rings we ask for (clients) and the
+   * rings, NULL if the data goes through the socket. A server has
+   * them from accept on, but gets to know the client's setup (and
+   * sends nothing) only once shm_setup is cleared. */
+  size_t shm_ringsize;
+  struct ipc_shm *shm;
+  gboolean shm_setup;
 };
 
 struct IPC_Stats {
@@ -215,6 +230,8 @@ struct IPC_WAIT_CONNECTION *socket_wait_conn_new(GHashTable* ch_attrs);
 
 /* *** FIXME: This is also declared in 'ocf_ipc.c'. */
 struct IPC_CHANNEL* socket_client_channel_new(GHashTable *attrs);
+struct IPC_WAIT_CONNECTION *socket_shm_wait_conn_new(GHashTable* ch_attrs);
+struct IPC_CHANNEL* socket_shm_client_channel_new(GHashTable *attrs);
 
 static struct IPC_CHANNEL* socket_server_channel_new(int sockfd);
 
@@ -232,6 +249,7 @@ static pid_t socket_get_farside_pid(int sockfd);
 extern int (*ipc_pollfunc_ptr)(struct pollfd *, nfds_t, int);
 
 static int socket_resume_io_read(struct IPC_CHANNEL *ch, int*, gboolean read1anyway);
+static int socket_check_poll(struct IPC_CHANNEL * ch, struct pollfd * sockpoll);
 
 static struct IPC_OPS socket_ops;
 static gboolean ipc_time_debug_flag = TRUE;
@@ -448,6 +466,11 @@ socket_chan_audit(const struct IPC_CHANNEL* ch)
 		cl_log(LOG_CRIT, "bad send_queue");
 		badch = TRUE;
 	}
+	if (ch->recv_queue->current_qlen > ch->recv_queue->ring_size
+	||	ch->send_queue->current_qlen > ch->send_queue->ring_size) {
+		cl_log(LOG_CRIT, "bad queue ring");
+		badch = TRUE;
+	}
 	if (badch) {
 		cl_log(LOG_CRIT, "Bad channel @ 0x%lx", (unsigned long)ch);
 		dump_ipc_info(ch);
@@ -507,6 +530,7 @@ saveandcheck(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg, char * savearea
 ,	size_t savesize, long* lastseq, const char * text)
 {
 	long	cheatseq = cheat_get_sequence(msg);
+	size_t	qi;
 
 	save_body(msg, savearea, savesize);
 	if (*lastseq != 0 ) {
@@ -536,7 +560,9 @@ saveandcheck(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg, char * savearea
 		}
 
 	}
-	g_list_foreach(ch->recv_queue->queue, audit_readmsgq_msg, NULL);
+	for (qi = 0; qi < ch->recv_queue->current_qlen; ++qi) {
+		audit_readmsgq_msg(ipc_queue_nth(ch->recv_queue, qi), NULL);
+	}
 	if (cheatseq > 0) {
 		*lastseq = cheatseq;
 	}
@@ -564,24 +590,26 @@ dump_msg(struct IPC_MESSAGE *msg, const char * label)
 }
 
 static void
-dump_msgq_msg(gpointer data, gpointer user_data)
+dump_msgq(IPC_Queue* q, const char * label)
 {
-	dump_msg(data, user_data);
+	size_t	j;
+
+	for (j = 0; j < q->current_qlen; ++j) {
+		dump_msg(ipc_queue_nth(q, j), label);
+	}
 }
 
 void
 dump_ipc_info(const IPC_Channel* chan)
 {
-	char squeue[] = "Send queue";
-	char rqueue[] = "Receive queue";
 #ifdef CHEAT_CHECKS
 	cl_log(LOG_DEBUG, "Saved Last Body read[%s]", SavedReadBody);
 	cl_log(LOG_DEBUG, "Saved Last Body received[%s]", SavedReceivedBody);
 	cl_log(LOG_DEBUG, "Saved Last Body Queued[%s]", SavedQueuedBody);
 	cl_log(LOG_DEBUG, "Saved Last Body Sent[%s]", SavedSentBody);
 #endif
-	g_list_foreach(chan->send_queue->queue, dump_msgq_msg, squeue);
-	g_list_foreach(chan->recv_queue->queue, dump_msgq_msg, rqueue);
+	dump_msgq(chan->send_queue, "Send queue");
+	dump_msgq(chan->recv_queue, "Receive queue");
 	CHANAUDIT(chan);
 }
 
@@ -720,6 +748,21 @@ socket_accept_connection(struct IPC_WAIT_CONNECTION * wait_conn
 	/* Verify the client authorization information. */
 	if(was_error == FALSE) {
 		auth_result = ch->ops->verify_auth(ch, auth_info);
+		conn_private = wait_conn->ch_private;
+		if (auth_result == IPC_OK && conn_private->shm) {
+			/* the setup is read with the input, see ipcshm.c */
+			if ((ch_private->shm = ipc_shm_accept(new_sock))
+			==	NULL) {
+				saveerrno = errno;
+				cl_log(LOG_ERR, "socket_accept_connection:"
+				" shared memory setup failed");
+				/* this frees peer_addr too */
+				ch->ops->destroy(ch);
+				errno = saveerrno;
+				return NULL;
+			}
+			ch_private->shm_setup = TRUE;
+		}
 		if (auth_result == IPC_OK) {
 			ch->ch_status = IPC_CONNECT;
 			ch->farside_pid = socket_get_farside_pid(new_sock);
@@ -779,6 +822,13 @@ socket_disconnect(struct IPC_CHANNEL* ch)
 		cl_poll_ignore(conn_info->s);
 		conn_info->s = -1;
 	}
+	if (conn_info->shm != NULL) {
+		if (ipc_shm_select_fd(conn_info->shm) >= 0) {
+			cl_poll_ignore(ipc_shm_select_fd(conn_info->shm));
+		}
+		ipc_shm_del(conn_info->shm);
+		conn_info->shm = NULL;
+	}
 	ch->ch_status = IPC_DISCONNECT;
 	if (debug_level > 1) {
 		cl_log(LOG_DEBUG, "}/*%s(sock=%d, ch=0x%lx)*/"
@@ -799,9 +849,7 @@ socket_disconnect(struct IPC_CHANNEL* ch)
 static void
 socket_destroy_queue(struct IPC_QUEUE * q)
 {
-  g_list_free(q->queue);
-
-  g_free((void *) q);
+  ipc_queue_del(q);
 }
 
 static void
@@ -825,6 +873,11 @@ socket_destroy_channel(struct IPC_CHANNEL * ch)
 	if (ch->pool) {
 		ipc_bufpool_unref(ch->pool);
 	}
+	if (ch->fragbuf) {
+		free(ch->fragbuf->buf);
+		free(ch->fragbuf);
+	}
+	free(ch->stats);
 
 	if (ch->ch_private != NULL) {
 #if HB_IPC_METHOD == HB_IPC_SOCKET
@@ -916,6 +969,11 @@ socket_initiate_connection(struct IPC_CHANNEL * ch)
 	, 	sizeof(struct sockaddr_un)) == -1) {
 		return IPC_FAIL;
 	}
+	if (conn_info->shm_ringsize > 0
+	&&	ipc_shm_connect(conn_info->s, conn_info->shm_ringsize
+		,	&conn_info->shm) != IPC_OK) {
+		return IPC_FAIL;
+	}
 #elif HB_IPC_METHOD == HB_IPC_STREAM
 
 #endif
@@ -962,6 +1020,171 @@ socket_check_flow_control(struct IPC_CHANNEL* ch,
 	}
 }
 
+/*
+ * Wait until there is room in the send queue of a blocking channel:
+ * poll for the socket becoming writable (and for input, so that a
+ * peer which is itself blocked sending to us can go on) and push out
+ * what we can on every wakeup.
+ */
+static int
+socket_wait_sendq(struct IPC_CHANNEL * ch)
+{
+	struct pollfd	sockpoll;
+	longclock_t	start = time_longclock();
+	unsigned long	waited = 0;
+	int		timeout;
+	int		rc = IPC_OK;
+
+	sockpoll.fd = ch->ops->get_send_select_fd(ch);
+	while (ch->send_queue->current_qlen >= ch->send_queue->max_qlen) {
+		if (ch->ch_status != IPC_CONNECT) {
+		 	cl_log(LOG_WARNING, "socket_send:"
+			" message queue exceeded and IPC not connected");
+			rc = IPC_FAIL;
+			break;
+		}
+		timeout = -1;
+		if (ch->send_timeout > 0) {
+			waited = longclockto_ms(sub_longclock(time_longclock()
+			,	start));
+			if (waited >= ch->send_timeout) {
+				cl_log(LOG_WARNING, "socket_send: send queue"
+				" still full after %lu ms (peer pid %d)"
+				,	waited, (int)ch->farside_pid);
+				rc = IPC_FAIL;
+				break;
+			}
+			timeout = ch->send_timeout - waited;
+		}
+
+		sockpoll.events = POLLOUT;
+		/* with shared memory the room comes as input, too */
+		if (ch->recv_queue->current_qlen < ch->recv_queue->max_qlen
+		||	((struct SOCKET_CH_PRIVATE *)ch->ch_private)->shm) {
+			sockpoll.events |= POLLIN;
+		}
+		sockpoll.revents = 0;
+		if (ipc_pollfunc_ptr(&sockpoll, 1, timeout) < 0
+		&&	errno != EINTR) {
+			cl_perror("socket_send: poll");
+			rc = IPC_FAIL;
+			break;
+		}
+		if (socket_check_poll(ch, &sockpoll) != IPC_OK) {
+			rc = IPC_FAIL;
+			break;
+		}
+		ch->ops->resume_io(ch);
+	}
+
+	waited = longclockto_ms(sub_longclock(time_longclock(), start));
+	ch->send_blocked_ms += waited;
+	ch->send_blocked_count++;
+	if (waited >= 1000) {
+		cl_log(LOG_INFO, "socket_send: waited %lu ms for peer pid %d"
+		" to read (%lu ms in %lu blocked sends so far)"
+		,	waited, (int)ch->farside_pid
+		,	ch->send_blocked_ms, ch->send_blocked_count);
+	}
+	return rc;
+}
+
+/*
+ * A piece of a message bigger than MAXMSG, its body points into the
+ * body of the whole message. The pieces are queued and sent in order,
+ * so the last one can give the whole message back when it's done.
+ */
+struct SOCKET_FRAGMENT{
+	struct IPC_MESSAGE	msg;	/* must be first */
+	struct SOCKET_MSG_HEAD	head;	/* msg_buf, for IPC_TIME_DEBUG */
+	struct IPC_MESSAGE*	whole;
+	gboolean		more;	/* not the last piece */
+};
+
+static void
+socket_fragment_done(struct IPC_MESSAGE* msg)
+{
+	struct SOCKET_FRAGMENT*	frag = (struct SOCKET_FRAGMENT*)msg;
+
+	if (!frag->more && frag->whole->msg_done != NULL) {
+		frag->whole->msg_done(frag->whole);
+	}
+	free(frag);
+}
+
+/* the magic for the head of msg on the wire */
+static unsigned int
+socket_msg_magic(struct IPC_MESSAGE* msg)
+{
+	if (msg->msg_done == socket_fragment_done
+	&&	((struct SOCKET_FRAGMENT*)msg)->more) {
+		return HEADMAGIC_FRAG;
+	}
+	return HEADMAGIC;
+}
+
+/*
+ * Queue msg in pieces of MAXMSG bytes. A blocking channel waits for
+ * room in the send queue before each piece; once the first piece is
+ * queued the others have to follow though, or the far side would
+ * glue the next message onto this one.
+ */
+static int
+socket_queue_fragments(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
+{
+	struct SOCKET_FRAGMENT*	frag;
+	/* msg is gone once its last piece was sent */
+	char*			body = msg->msg_body;
+	size_t			len = msg->msg_len;
+	size_t			off;
+	int			orig_qlen;
+	gboolean		wait = ch->should_send_block;
+
+	for (off = 0; off < len; off += MAXMSG) {
+		if (off > 0 && wait
+		&&	ch->send_queue->current_qlen >= ch->send_queue->max_qlen
+		&&	socket_wait_sendq(ch) != IPC_OK) {
+			if (ch->ch_status != IPC_CONNECT) {
+				return IPC_FAIL;
+			}
+			wait = FALSE;
+		}
+		if ((frag = calloc(1, sizeof(*frag))) == NULL) {
+			cl_log(LOG_ERR, "socket_send: out of memory for"
+			" message fragments, closing the channel");
+			ch->ch_status = IPC_DISCONNECT;
+			return IPC_FAIL;
+		}
+		frag->msg.msg_body = body + off;
+		frag->msg.msg_len = len - off;
+		if (frag->msg.msg_len > MAXMSG) {
+			frag->msg.msg_len = MAXMSG;
+		}
+		frag->msg.msg_buf = &frag->head;
+		frag->msg.msg_done = socket_fragment_done;
+		frag->msg.msg_ch = ch;
+		frag->whole = msg;
+		frag->more = (off + MAXMSG < len);
+#ifdef IPC_TIME_DEBUG
+		ipc_time_debug(ch, &frag->msg, MSGPOS_ENQUEUE);
+#endif
+		orig_qlen = ch->send_queue->current_qlen;
+		if (ipc_queue_push(ch->send_queue, &frag->msg) != IPC_OK) {
+			free(frag);
+			if (off > 0) {
+				/* the far side has a part of it already */
+				cl_log(LOG_ERR, "socket_send: cannot queue"
+				" message fragments, closing the channel");
+				ch->ch_status = IPC_DISCONNECT;
+			}
+			return IPC_FAIL;
+		}
+		socket_check_flow_control(ch, orig_qlen, orig_qlen +1 );
+		ch->ops->resume_io(ch);
+	}
+	return IPC_OK;
+}
+
 static int
 socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 {
@@ -969,10 +1192,14 @@ socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 	int diff;
 	struct IPC_MESSAGE* newmsg;
 
-	if (msg->msg_len > MAXMSG) {
+	if (msg->msg_len > MAXMSG
+	&&	(!(ch->msgfmts & IPC_FMT_FRAGMENTS)
+	||	msg->msg_len > MAXFRAGMSG)) {
 		cl_log(LOG_ERR, "%s: sorry, cannot send messages "
 			"bigger than %d (requested %lu)",
-			__FUNCTION__, MAXMSG, (unsigned long)msg->msg_len);
+			__FUNCTION__
+		,	(ch->msgfmts & IPC_FMT_FRAGMENTS) ? MAXFRAGMSG : MAXMSG
+		,	(unsigned long)msg->msg_len);
 		return IPC_FAIL;
 	}
 	if (msg->msg_len < 0) {
@@ -1007,14 +1234,9 @@ socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 		}
 	}
 
-	while (ch->send_queue->current_qlen >= ch->send_queue->max_qlen) {
-		if (ch->ch_status != IPC_CONNECT) {
-		 	cl_log(LOG_WARNING, "socket_send:"
-			" message queue exceeded and IPC not connected");
-			return IPC_FAIL;
-		}
-		cl_shortsleep();
-		ch->ops->resume_io(ch);
+	if (ch->send_queue->current_qlen >= ch->send_queue->max_qlen
+	&&	socket_wait_sendq(ch) != IPC_OK) {
+		return IPC_FAIL;
 	}
 
 	/* add the message into the send queue */
@@ -1025,16 +1247,22 @@ socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 	if (msg->msg_buf ) {
 		diff = (char*)msg->msg_body - (char*)msg->msg_buf;
 	}
+	/*
+	 * socket_resume_io_write() sends the head from its own array, so
+	 * messages without room for it are only copied if the caller
+	 * still owns them (no msg_done) and may reuse them once we
+	 * return. The time debugging code needs the room for its stamps.
+	 */
+#ifdef IPC_TIME_DEBUG
 	if ( diff < (int)sizeof(struct SOCKET_MSG_HEAD) ) {
-		/* either we don't have msg->msg_buf set
-		 * or we don't have enough bytes for socket head
-		 * we delete this message and creates
-		 * a new one and delete the old one
-		 */
+#else
+	if ( diff < (int)sizeof(struct SOCKET_MSG_HEAD)
+	&&	msg->msg_done == NULL ) {
+#endif
 
 		newmsg= socket_message_new(ch, msg->msg_len);
 		if (newmsg == NULL) {
-			cl_log(LOG_ERR, "socket_resume_io_write: "
+			cl_log(LOG_ERR, "socket_send: "
 			       "allocating memory for new ipc msg failed");
 			return IPC_FAIL;
 		}
@@ -1046,12 +1274,20 @@ socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 		};
 		msg = newmsg;
 	}
+	if (msg->msg_len > MAXMSG) {
+		return socket_queue_fragments(ch, msg);
+	}
 #ifdef IPC_TIME_DEBUG
 	ipc_time_debug(ch,msg, MSGPOS_ENQUEUE);
 #endif
-	ch->send_queue->queue = g_list_append(ch->send_queue->queue,
-					      msg);
-	orig_qlen = ch->send_queue->current_qlen++;
+	orig_qlen = ch->send_queue->current_qlen;
+	if (ipc_queue_push(ch->send_queue, msg) != IPC_OK) {
+		return IPC_FAIL;
+	}
+	if (ch->stats) {
+		ipc_hist_add(&ch->stats->send_qlen
+		,	ch->send_queue->current_qlen);
+	}
 
 	socket_check_flow_control(ch, orig_qlen, orig_qlen +1 );
 
@@ -1060,11 +1296,31 @@ socket_send(struct IPC_CHANNEL * ch, struct IPC_MESSAGE* msg)
 	return IPC_OK;
 }
 
+/* take the first message off the receive queue; there must be one */
+static struct IPC_MESSAGE*
+socket_recv_one(struct IPC_CHANNEL * ch)
+{
+	struct IPC_MESSAGE*	message;
+
+	if (ch->stats) {
+		ipc_hist_add(&ch->stats->recv_wait, ipc_time_us()
+		-	ipc_queue_nth_stamp(ch->recv_queue, 0));
+		ch->stats->nrecv++;
+		ch->stats->bytes_recv += ipc_queue_nth(ch->recv_queue, 0)->msg_len;
+	}
+	message = ipc_queue_pop(ch->recv_queue);
+#ifdef IPC_TIME_DEBUG
+	ipc_time_debug(ch, message, MSGPOS_DEQUEUE);
+#endif
+
+	CHECKFOO(1,ch, message, SavedReadBody, "read message");
+	SocketIPCStats.nreceived++;
+	return message;
+}
+
 static int
 socket_recv(struct IPC_CHANNEL * ch, struct IPC_MESSAGE** message)
 {
-	GList *element;
-
 	int		nbytes;
 	int		result;
 
@@ -1077,26 +1333,34 @@ socket_recv(struct IPC_CHANNEL * ch, struct IPC_MESSAGE** message)
 		return result != IPC_OK ? result : IPC_FAIL;
 		/*return IPC_OK;*/
 	}
-	element = g_list_first(ch->recv_queue->queue);
+	*message = socket_recv_one(ch);
+	return IPC_OK;
+}
 
-	if (element == NULL) {
-		/* Internal accounting error, but correctable */
-		cl_log(LOG_ERR
-		, "recv failure: qlen (%ld) > 0, but no message found."
-		,	(long)ch->recv_queue->current_qlen);
-		ch->recv_queue->current_qlen = 0;
-		return IPC_FAIL;
-	}
-	*message = (struct IPC_MESSAGE *) (element->data);
-#ifdef IPC_TIME_DEBUG
-	ipc_time_debug(ch, *message, MSGPOS_DEQUEUE);
-#endif
+/*
+ * The stream is read in as large pieces as the buffer pool allows and
+ * all the messages in a piece are queued by socket_resume_io_read(),
+ * so a batch costs one read however many messages it has. (recvmmsg()
+ * is no help on a stream socket, it's for datagrams.)
+ */
+static int
+socket_recv_batch(struct IPC_CHANNEL * ch, struct IPC_MESSAGE** msgs
+,		int max, int* nmsgs)
+{
+	int		nbytes;
+	int		result;
+	int		n = 0;
 
-	CHECKFOO(1,ch, *message, SavedReadBody, "read message");
-	SocketIPCStats.nreceived++;
-	ch->recv_queue->queue =	g_list_remove(ch->recv_queue->queue
-	,	element->data);
-	ch->recv_queue->current_qlen--;
+	socket_resume_io(ch);
+	result = socket_resume_io_read(ch, &nbytes, TRUE);
+
+	while (n < max && ch->recv_queue->current_qlen > 0) {
+		msgs[n++] = socket_recv_one(ch);
+	}
+	*nmsgs = n;
+	if (n == 0) {
+		return result != IPC_OK ? result : IPC_FAIL;
+	}
 	return IPC_OK;
 }
 
@@ -1269,6 +1533,23 @@ socket_assert_auth(struct IPC_CHANNEL *ch, GHashTable *auth)
 	return IPC_FAIL;
 }
 
+#if HB_IPC_METHOD == HB_IPC_SOCKET
+/*
+ * Read the shared memory setup an IPC_SHM client sends first, see
+ * ipc_shm_setup(). IPC_FAIL with errno EAGAIN while it's not there.
+ */
+static int
+socket_shm_setup(struct SOCKET_CH_PRIVATE* conn_info)
+{
+	if (ipc_shm_setup(conn_info->shm, conn_info->s) == IPC_FAIL) {
+		return IPC_FAIL;
+	}
+	/* done, or the client is gone and recv() will tell */
+	conn_info->shm_setup = FALSE;
+	return IPC_OK;
+}
+#endif
+
 static int
 socket_resume_io_read(struct IPC_CHANNEL *ch, int* nbytes, gboolean read1anyway)
 {
@@ -1336,7 +1617,22 @@ socket_resume_io_read(struct IPC_CHANNEL *ch, int* nbytes, gboolean read1anyway)
 		/* Now try to receive some data */
 
 #if HB_IPC_METHOD == HB_IPC_SOCKET
-		msg_len = recv(conn_info->s, msg_begin, len, MSG_DONTWAIT);
+		if (conn_info->shm_setup
+		&&	socket_shm_setup(conn_info) != IPC_OK) {
+			/* EAGAIN: not there yet */
+			msg_len = -1;
+		} else if (conn_info->shm != NULL
+		&&	ipc_shm_mapped(conn_info->shm)) {
+			msg_len = ipc_shm_read(conn_info->shm, msg_begin, len);
+			/* the ring drained after a hangup is our EOF */
+			if (msg_len < 0 && errno == EAGAIN
+			&&	ch->ch_status == IPC_DISC_PENDING) {
+				msg_len = 0;
+			}
+		} else {
+			msg_len = recv(conn_info->s, msg_begin, len
+			,	MSG_DONTWAIT);
+		}
 #elif HB_IPC_METHOD == HB_IPC_STREAM
 		d.maxlen = len;
 		d.len = 0;
@@ -1395,6 +1691,10 @@ socket_resume_io_read(struct IPC_CHANNEL *ch, int* nbytes, gboolean read1anyway)
 				retcode = IPC_FAIL;
 			} else {
 				SocketIPCStats.ninqueued += nmsgs;
+				if (nmsgs > 0 && ch->stats) {
+					ipc_hist_add(&ch->stats->recv_qlen
+					,	ch->recv_queue->current_qlen);
+				}
 			}
 		}
 	}
@@ -1420,114 +1720,120 @@ socket_resume_io_read(struct IPC_CHANNEL *ch, int* nbytes, gboolean read1anyway)
 	return IPC_ISRCONN(ch) ? IPC_OK : IPC_BROKEN;
 }
 
+/*
+ * Send the iovecs, as much as the socket takes without blocking.
+ * Returns the number of bytes sent, -1 (errno set) if nothing was.
+ */
+static int
+socket_send_iov(struct SOCKET_CH_PRIVATE* conn_info, struct iovec* iov
+,	int niov)
+{
+#if HB_IPC_METHOD == HB_IPC_SOCKET
+	struct msghdr	mh;
+
+	if (conn_info->shm != NULL && ipc_shm_mapped(conn_info->shm)) {
+		return ipc_shm_writev(conn_info->shm, iov, niov);
+	}
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = niov;
+	return sendmsg(conn_info->s, &mh, (MSG_DONTWAIT|MSG_NOSIGNAL));
+#elif HB_IPC_METHOD == HB_IPC_STREAM
+	/* putmsg() can't gather, but the reader sees a byte stream */
+	struct strbuf	d;
+	int		sent = 0;
+	int		j;
+
+	for (j = 0; j < niov; j++) {
+		if (iov[j].iov_len == 0) {
+			continue;
+		}
+		d.maxlen = 0;
+		d.len = iov[j].iov_len;
+		d.buf = iov[j].iov_base;
+		if (putmsg(conn_info->s, NULL, &d, 0) != 0) {
+			return sent ? sent : -1;
+		}
+		sent += iov[j].iov_len;
+	}
+	return sent;
+#endif
+}
+
+/*
+ * Up to SENDBATCH queued messages are sent with one sendmsg(). The
+ * message heads are built in heads[] and sent from there, so messages
+ * without room for the head in front of the body needn't be copied.
+ */
 static int
 socket_resume_io_write(struct IPC_CHANNEL *ch, int* nmsg)
 {
 	int				retcode = IPC_OK;
 	struct SOCKET_CH_PRIVATE*	conn_info;
+	struct SOCKET_MSG_HEAD		heads[SENDBATCH];
+	struct iovec			iov[2*SENDBATCH];
+	unsigned long long		now = 0;
 
 	CHANAUDIT(ch);
 	*nmsg = 0;
 	conn_info = (struct SOCKET_CH_PRIVATE *) ch->ch_private;
+	if (conn_info->shm_setup) {
+		/* the client doesn't read the socket once it has rings */
+		return IPC_OK;
+	}
 
 	while (ch->ch_status == IPC_CONNECT
 	&&		retcode == IPC_OK
 	&&		ch->send_queue->current_qlen > 0) {
 
-		GList *				element;
+		IPC_Queue *			q = ch->send_queue;
 		struct IPC_MESSAGE *		msg;
-		struct SOCKET_MSG_HEAD		head;
-                struct IPC_MESSAGE* 		oldmsg = NULL;
 		int				sendrc = 0;
-                struct IPC_MESSAGE* 		newmsg;
-		char*				p;
-		unsigned int			bytes_remaining;
-		int				diff;
+		unsigned int			skip;
+		unsigned int			msgbytes;
+		int				nbatch;
+		int				j;
 
 		CHANAUDIT(ch);
-		element = g_list_first(ch->send_queue->queue);
-		if (element == NULL) {
-			/* OOPS!  - correct consistency problem */
-			ch->send_queue->current_qlen = 0;
-			break;
-		}
-		msg = (struct IPC_MESSAGE *) (element->data);
-
-		diff = 0;
-		if (msg->msg_buf ) {
-			diff = (char*)msg->msg_body - (char*)msg->msg_buf;
-		}
-		if ( diff < (int)sizeof(struct SOCKET_MSG_HEAD) ) {
-			/* either we don't have msg->msg_buf set
-			 * or we don't have enough bytes for socket head
-			 * we delete this message and creates
-			 * a new one and delete the old one
-			 */
-
-			newmsg= socket_message_new(ch, msg->msg_len);
-			if (newmsg == NULL) {
-				cl_log(LOG_ERR, "socket_resume_io_write: "
-					"allocating memory for new ipc msg failed");
-                		return IPC_FAIL;
-			}
-
-                	memcpy(newmsg->msg_body, msg->msg_body, msg->msg_len);
-                	oldmsg = msg;
-			msg = newmsg;
-		}
-
-                head.msg_len = msg->msg_len;
-		head.magic = HEADMAGIC;
-		memcpy(msg->msg_buf, &head, sizeof(struct SOCKET_MSG_HEAD));
-
-		if (ch->bytes_remaining == 0) {
-			/*we start to send a new message*/
+		for (nbatch = 0; nbatch < (int)q->current_qlen
+		&&	nbatch < SENDBATCH; ++nbatch) {
+			msg = ipc_queue_nth(q, nbatch);
 #ifdef IPC_TIME_DEBUG
-			ipc_time_debug(ch, msg, MSGPOS_SEND);
+			/* the times travel in the head in msg_buf */
+			if (nbatch > 0 || ch->bytes_remaining == 0) {
+				ipc_time_debug(ch, msg, MSGPOS_SEND);
+			}
+			memcpy(&heads[nbatch], msg->msg_buf
+			,	sizeof(struct SOCKET_MSG_HEAD));
 #endif
-			bytes_remaining = msg->msg_len + ch->msgpad;
-			p = msg->msg_buf;
-		} else {
-			bytes_remaining = ch->bytes_remaining;
-			p = ((char*)msg->msg_buf) + msg->msg_len + ch->msgpad
-				- bytes_remaining;
-
+			heads[nbatch].msg_len = msg->msg_len;
+			heads[nbatch].magic = socket_msg_magic(msg);
+			iov[2*nbatch].iov_base = &heads[nbatch];
+			iov[2*nbatch].iov_len = sizeof(struct SOCKET_MSG_HEAD);
+			iov[2*nbatch+1].iov_base = msg->msg_body;
+			iov[2*nbatch+1].iov_len = msg->msg_len;
 		}
 
-		sendrc = 0;
-
-                do {
-#if HB_IPC_METHOD == HB_IPC_STREAM
-			struct strbuf d;
-			int msglen, putmsgrc;
-#endif
-
-                        CHANAUDIT(ch);
-
-#if HB_IPC_METHOD == HB_IPC_SOCKET
-			sendrc = send(conn_info->s, p
-			,       bytes_remaining, (MSG_DONTWAIT|MSG_NOSIGNAL));
-#elif HB_IPC_METHOD == HB_IPC_STREAM
-			d.maxlen = 0;
-			d.len = msglen = bytes_remaining;
-			d.buf = p;
-			putmsgrc = putmsg(conn_info->s, NULL, &d, 0);
-			sendrc = putmsgrc == 0 ? msglen : -1;
-#endif
-                        SocketIPCStats.last_send_rc = sendrc;
-                        SocketIPCStats.last_send_errno = errno;
-                        ++SocketIPCStats.send_count;
-
-			if (sendrc <= 0) {
-				break;
+		/* skip what we sent of the first message last time */
+		msg = ipc_queue_nth(q, 0);
+		msgbytes = msg->msg_len + sizeof(struct SOCKET_MSG_HEAD);
+		skip = ch->bytes_remaining ? msgbytes - ch->bytes_remaining : 0;
+		for (j = 0; skip > 0; ++j) {
+			if (skip >= iov[j].iov_len) {
+				skip -= iov[j].iov_len;
+				iov[j].iov_len = 0;
 			} else {
-				p = p + sendrc;
-				bytes_remaining -= sendrc;
+				iov[j].iov_base = (char*)iov[j].iov_base + skip;
+				iov[j].iov_len -= skip;
+				skip = 0;
 			}
+		}
 
-                } while(bytes_remaining > 0 );
-
-		ch->bytes_remaining = bytes_remaining;
+		CHANAUDIT(ch);
+		sendrc = socket_send_iov(conn_info, iov, 2*nbatch);
+		SocketIPCStats.last_send_rc = sendrc;
+		SocketIPCStats.last_send_errno = errno;
+		++SocketIPCStats.send_count;
 
 		if (sendrc < 0) {
 			switch (errno) {
@@ -1547,29 +1853,46 @@ socket_resume_io_write(struct IPC_CHANNEL *ch, int* nmsg)
 				break;
 			}
 			break;
-		} else {
-			int orig_qlen;
+		}
 
-			CHECKFOO(3,ch, msg, SavedSentBody, "sent message")
+		/* retire the messages which went out completely */
+		while (sendrc > 0) {
+			int orig_qlen;
 
-			if (oldmsg) {
-		                if (msg->msg_done != NULL) {
-                                	msg->msg_done(msg);
-                        	}
-				msg=oldmsg;
+			msg = ipc_queue_nth(q, 0);
+			msgbytes = ch->bytes_remaining ? ch->bytes_remaining
+			:	msg->msg_len + sizeof(struct SOCKET_MSG_HEAD);
+			if ((unsigned int)sendrc < msgbytes) {
+				ch->bytes_remaining = msgbytes - sendrc;
+				break;
 			}
+			sendrc -= msgbytes;
+			ch->bytes_remaining = 0;
 
-			if(ch->bytes_remaining ==0) {
-				ch->send_queue->queue = g_list_remove(ch->send_queue->queue,	msg);
-				if (msg->msg_done != NULL) {
-					msg->msg_done(msg);
-				}
+			CHECKFOO(3,ch, msg, SavedSentBody, "sent message")
 
-				SocketIPCStats.nsent++;
-				orig_qlen = ch->send_queue->current_qlen--;
-				socket_check_flow_control(ch, orig_qlen, orig_qlen -1 );
-				(*nmsg)++;
+			if (ch->stats) {
+				if (now == 0) {
+					now = ipc_time_us();
+				}
+				ipc_hist_add(&ch->stats->send_wait
+				,	now - ipc_queue_nth_stamp(q, 0));
+				ch->stats->nsent++;
+				ch->stats->bytes_sent += msg->msg_len;
+			}
+			orig_qlen = q->current_qlen;
+			ipc_queue_pop(q);
+			if (msg->msg_done != NULL) {
+				msg->msg_done(msg);
 			}
+
+			SocketIPCStats.nsent++;
+			socket_check_flow_control(ch, orig_qlen, orig_qlen -1 );
+			(*nmsg)++;
+		}
+		if (ch->bytes_remaining != 0) {
+			/* the socket is full */
+			break;
 		}
 	}
 	CHANAUDIT(ch);
@@ -1627,6 +1950,10 @@ socket_get_recv_fd(struct IPC_CHANNEL *ch)
 {
 	struct SOCKET_CH_PRIVATE* chp = ch ->ch_private;
 
+	if (chp != NULL && chp->shm != NULL
+	&&	ipc_shm_select_fd(chp->shm) >= 0) {
+		return ipc_shm_select_fd(chp->shm);
+	}
 	return (chp == NULL ? -1 : chp->s);
 }
 
@@ -1640,7 +1967,7 @@ static void
 socket_adjust_buf(struct IPC_CHANNEL *ch, int optname, unsigned q_len)
 {
 	const char *direction = optname == SO_SNDBUF ? "snd" : "rcv";
-	int fd = socket_get_send_fd(ch);
+	int fd = ((struct SOCKET_CH_PRIVATE *)ch->ch_private)->s;
 	unsigned byte;
 
 	/* Arbitrary scaling.
@@ -1804,23 +2131,14 @@ static struct IPC_WAIT_OPS socket_wait_ops = {
 };
 
 /*
- * create a new ipc queue whose length = 0 and inner queue = NULL.
+ * create a new, empty ipc queue.
  * return the pointer to a new ipc queue or NULL is the queue can't be created.
  */
 
 static struct IPC_QUEUE*
 socket_queue_new(void)
 {
-  struct IPC_QUEUE *temp_queue;
-
-  /* temp queue with length = 0 and inner queue = NULL. */
-  temp_queue =  g_new(struct IPC_QUEUE, 1);
-  temp_queue->current_qlen = 0;
-  temp_queue->max_qlen = DEFAULT_MAX_QLEN;
-  temp_queue->queue = NULL;
-  temp_queue->last_maxqlen_warn = 0;
-  temp_queue->maxqlen_cnt = 0;
-  return temp_queue;
+  return ipc_queue_new(DEFAULT_MAX_QLEN);
 }
 
 /*
@@ -1975,6 +2293,7 @@ socket_wait_conn_new(GHashTable *ch_attrs)
   wait_private->pipefds[1] = pipefds[1];
 #endif
   strncpy(wait_private->path_name, path_name, sizeof(wait_private->path_name));
+  wait_private->shm = FALSE;
   temp_ch = g_new(struct IPC_WAIT_CONNECTION, 1);
   temp_ch->ch_private = (void *) wait_private;
   temp_ch->ch_status = IPC_WAIT;
@@ -2073,6 +2392,45 @@ int client_channel_new_auth(int sockfd) {
   return 0;
 }
 
+/*
+ * IPC_SHM: socket channels which move their data through shared
+ * memory once connected (see ipcshm.c). The server takes the rings
+ * from the clients in accept, the clients set them up in
+ * initiate_connection.
+ */
+struct IPC_WAIT_CONNECTION *
+socket_shm_wait_conn_new(GHashTable *ch_attrs)
+{
+	struct IPC_WAIT_CONNECTION *	wait_conn;
+
+	wait_conn = socket_wait_conn_new(ch_attrs);
+	if (wait_conn != NULL) {
+		((struct SOCKET_WAIT_CONN_PRIVATE *)
+			wait_conn->ch_private)->shm = TRUE;
+	}
+	return wait_conn;
+}
+
+struct IPC_CHANNEL *
+socket_shm_client_channel_new(GHashTable *ch_attrs)
+{
+	struct IPC_CHANNEL *		ch;
+	struct SOCKET_CH_PRIVATE *	conn_info;
+	const char *			size;
+
+	ch = socket_client_channel_new(ch_attrs);
+	if (ch == NULL) {
+		return NULL;
+	}
+	conn_info = ch->ch_private;
+	conn_info->shm_ringsize = IPC_SHM_RINGSIZE;
+	size = g_hash_table_lookup(ch_attrs, IPC_RINGSIZE_ATTR);
+	if (size != NULL && atol(size) > 0) {
+		conn_info->shm_ringsize = atol(size);
+	}
+	return ch;
+}
+
 static
 struct IPC_CHANNEL *
 socket_server_channel_new(int sockfd) {
@@ -2119,6 +2477,9 @@ channel_new(int sockfd, int conntype, const char *path_name) {
   conn_info->s = sockfd;
   conn_info->remaining_data = 0;
   conn_info->buf_msg = NULL;
+  conn_info->shm_ringsize = 0;
+  conn_info->shm = NULL;
+  conn_info->shm_setup = FALSE;
 #if HB_IPC_METHOD == HB_IPC_SOCKET
   conn_info->peer_addr = NULL;
 #endif
@@ -2143,6 +2504,10 @@ channel_new(int sockfd, int conntype, const char *path_name) {
   temp_ch->refcount = 0;
   temp_ch->farside_uid = -1;
   temp_ch->farside_gid = -1;
+  temp_ch->stats = calloc(1, sizeof(struct ipc_chanstats));
+  if (temp_ch->stats) {
+	  temp_ch->stats->since = time(NULL);
+  }
 
   return temp_ch;
 }
@@ -2763,4 +3128,5 @@ static struct IPC_OPS socket_ops = {
 	socket_is_recvq_full,
 	socket_get_conntype,
 	socket_disconnect,
+	socket_recv_batch,
 };
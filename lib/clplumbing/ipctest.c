@@ -31,6 +31,7 @@
 #include <clplumbing/cl_poll.h>
 #include <clplumbing/GSource.h>
 #include <clplumbing/ipc.h>
+#include <clplumbing/longclock.h>
 
 #define	MAXERRORS	1000
 #define	MAXERRORS_RECV	10
@@ -48,6 +49,15 @@ static int asyn_echoserver(IPC_Channel*, int repcount);
 static int asyn_echoclient(IPC_Channel*, int repcount);
 static int mainloop_server(IPC_Channel* chan, int repcount);
 static int mainloop_client(IPC_Channel* chan, int repcount);
+static int burst_server(IPC_Channel* chan, int repcount);
+static int burst_client(IPC_Channel* chan, int repcount);
+static int batch_client(IPC_Channel* chan, int repcount);
+static int bigmsg_server(IPC_Channel* chan, int repcount);
+static int bigmsg_client(IPC_Channel* chan, int repcount);
+static int fragreject_server(IPC_Channel* chan, int repcount);
+static int fragreject_client(IPC_Channel* chan, int repcount);
+static int checkinput(IPC_Channel* chan, const char * where, int* rdcount
+,	int maxcount);
 
 static int checksock(IPC_Channel* channel);
 static void checkifblocked(IPC_Channel* channel);
@@ -72,6 +82,7 @@ static int verbosity;			/* verbosity level */
 /* *** CLIENTS_MAX currently 1 while coding *** */
 #define CLIENTS_MAX 1	/* max. number of independent clients */
 static int clients_def;	/* number of independent clients */
+static const char *ipc_type = IPC_ANYTYPE;	/* for client/server */
 
 static int
 channelpair(TestFunc_t	clientfunc, TestFunc_t serverfunc, int count)
@@ -231,7 +242,7 @@ clientserver(TestFunc_t clientfunc, TestFunc_t serverfunc, int count, int client
 		  procname, (int)getpid(), __LINE__);
 	}
 
-	wconn = ipc_wait_conn_constructor(IPC_ANYTYPE, wattrs);
+	wconn = ipc_wait_conn_constructor(ipc_type, wattrs);
 	if (! wconn) {
 		cl_perror("could not establish server");
 		exit(1);
@@ -259,7 +270,7 @@ clientserver(TestFunc_t clientfunc, TestFunc_t serverfunc, int count, int client
 					cl_log(LOG_DEBUG, "%s[%d]%d: client %d starting...",
 					  procname, (int)getpid(), __LINE__, i);
 				}
-				channel = ipc_channel_constructor(IPC_ANYTYPE, wattrs);
+				channel = ipc_channel_constructor(ipc_type, wattrs);
 				if (channel == NULL) {
 					cl_perror("client: channel creation failed");
 					exit(1);
@@ -390,6 +401,28 @@ transport_tests(int iterations, int clients)
 	  ? channelpair(mainloop_client, mainloop_server, iterations)
 	  : clientserver(mainloop_client, mainloop_server, iterations, clients);
 
+#ifdef CHEAT_CHECKS
+	memset(SeqNums, 0, sizeof(SeqNums));
+#endif
+	rc += (clients <= 0)
+	  ? channelpair(burst_client, burst_server, iterations)
+	  : clientserver(burst_client, burst_server, iterations, clients);
+
+#ifdef CHEAT_CHECKS
+	memset(SeqNums, 0, sizeof(SeqNums));
+#endif
+	rc += (clients <= 0)
+	  ? channelpair(batch_client, burst_server, iterations)
+	  : clientserver(batch_client, burst_server, iterations, clients);
+
+	rc += (clients <= 0)
+	  ? channelpair(bigmsg_client, bigmsg_server, 1)
+	  : clientserver(bigmsg_client, bigmsg_server, 1, clients);
+
+	rc += (clients <= 0)
+	  ? channelpair(fragreject_client, fragreject_server, 1)
+	  : clientserver(fragreject_client, fragreject_server, 1, clients);
+
 	return rc;
 }
 
@@ -409,13 +442,14 @@ main(int argc, char ** argv)
 	 *	-i: number of iterations
 	 *	-c: number of clients (invokes client/server mechanism)
 	 *	-s: data-size
+	 *	-t: channel type (invokes client/server mechanism)
 	 */
 	procname = basename(argv[0]);
 
 	argerrs = 0;
 	iterations = iter_def;
 	clients = clients_def;
-	while ((argflag = getopt(argc, argv, "i:vuc:s:")) != EOF) {
+	while ((argflag = getopt(argc, argv, "i:vuc:s:t:")) != EOF) {
 		switch (argflag) {
 		case 'i':	/* iterations */
 			iterations = atoi(optarg);
@@ -442,6 +476,12 @@ main(int argc, char ** argv)
 				argerrs++;
 			}
 			break;
+		case 't':	/* channel type */
+			ipc_type = optarg;
+			if (clients < 1) {
+				clients = 1;
+			}
+			break;
 		default:
 			argerrs++;
 			break;
@@ -449,12 +489,14 @@ main(int argc, char ** argv)
 	}
 	if (argerrs) {
 		fprintf(stderr,
-		  "Usage: %s [-v] [-i iterations] [-c clients] [-s size]\n"
+		  "Usage: %s [-v] [-i iterations] [-c clients] [-s size]"
+			" [-t type]\n"
 			"\t-v : verbose\n"
 			"\t-i : iterations (default %d)\n"
 			"\t-c : number of clients (default %d; nonzero invokes client/server)\n"
-			"\t-s : data size (default 20 bytes)\n",
-		  procname, iter_def, clients_def);
+			"\t-s : data size (default 20 bytes)\n"
+			"\t-t : channel type (default %s; implies -c 1)\n",
+		  procname, iter_def, clients_def, IPC_ANYTYPE);
 		exit(1);
 	}
 
@@ -717,6 +759,244 @@ echoclient(IPC_Channel* rchan, int repcount)
 	return errcount;
 }
 
+/*
+ * The burst test measures throughput: the server queues all messages
+ * as fast as it can (like lrmd sending callbacks to crmd) and the
+ * client reads them.
+ */
+#define BURST_QLEN	500
+
+static int
+burst_server(IPC_Channel* wchan, int repcount)
+{
+	IPC_Message*	wmsg;
+	int		errcount = 0;
+	int		j;
+	int		rc;
+
+	cl_log(LOG_INFO, "Burst server: %d reps pid %d."
+	,	repcount, (int)getpid());
+	wchan->ops->set_send_qlen(wchan, BURST_QLEN);
+	wchan->should_send_block = TRUE;
+
+	for (j=1; j <= repcount; ++j) {
+		wmsg = wchan->ops->new_ipcmsg(wchan, NULL, data_size, NULL);
+		if (wmsg == NULL) {
+			cl_log(LOG_ERR, "Out of memory");
+			exit(1);
+		}
+		echomsgbody(wmsg->msg_body, data_size, j, &wmsg->msg_len);
+		if ((rc = wchan->ops->send(wchan, wmsg)) != IPC_OK) {
+			cl_log(LOG_ERR
+			,	"burst_server: send failed %d rc iter %d"
+			,	rc, j);
+			++errcount;
+			break;
+		}
+	}
+	wchan->ops->waitout(wchan);
+
+	cl_log(LOG_INFO, "burst_server: %lu sends waited %lu ms for the client"
+	,	wchan->send_blocked_count, wchan->send_blocked_ms);
+	cl_log(LOG_INFO, "burst_server: %d errors", errcount);
+	wchan->ops->destroy(wchan); wchan = NULL;
+	return errcount;
+}
+
+static int
+burst_client(IPC_Channel* rchan, int repcount)
+{
+	int		rdcount = 0;
+	int		errcount = 0;
+	longclock_t	start = zero_longclock;
+	unsigned long	ms;
+	int		rc;
+
+	cl_log(LOG_INFO, "Burst client: %d reps pid %d."
+	,	repcount, (int)getpid());
+
+	while (rdcount < repcount && errcount < MAXERRORS_RECV) {
+		while ((rc = rchan->ops->waitin(rchan)) == IPC_INTR);
+		if (rc != IPC_OK) {
+			cl_log(LOG_ERR
+			,	"burst_client: waitin failed %d rc rdcount %d"
+			,	rc, rdcount);
+			++errcount;
+			break;
+		}
+		/* don't count the wait for the server to accept */
+		if (rdcount == 0) {
+			start = time_longclock();
+		}
+		errcount += checkinput(rchan, "burst_client", &rdcount
+		,	repcount);
+	}
+
+	ms = longclockto_ms(sub_longclock(time_longclock(), start));
+	cl_log(LOG_INFO, "burst_client: %d messages of %d bytes in %lu ms"
+	" (%lu msgs/s)", rdcount, data_size, ms
+	,	ms ? (unsigned long)rdcount * 1000 / ms : 0UL);
+	ipc_chanstats_log(rchan, "burst_client", LOG_INFO);
+	if (rchan->stats && rchan->stats->nrecv != (unsigned long)rdcount) {
+		cl_log(LOG_ERR, "burst_client: %lu messages counted, %d read"
+		,	rchan->stats->nrecv, rdcount);
+		++errcount;
+	}
+	cl_log(LOG_INFO, "burst_client: %d errors", errcount);
+	rchan->ops->destroy(rchan); rchan = NULL;
+	return errcount;
+}
+
+/*
+ * Messages bigger than MAXMSG go out in fragments. The sizes are
+ * chosen around the fragment boundaries.
+ */
+static const size_t bigmsg_sizes[] = {
+	MAXMSG, MAXMSG+1, 2*MAXMSG, 3*MAXMSG-1, 20*MAXMSG+7, 100
+};
+
+static char
+bigmsg_byte(size_t size, size_t off)
+{
+	return 'a' + (off * 7 + size) % 26;
+}
+
+static int
+bigmsg_server(IPC_Channel* wchan, int repcount)
+{
+	IPC_Message*	wmsg;
+	int		errcount = 0;
+	size_t		j, off;
+	int		rc;
+
+	cl_log(LOG_INFO, "Big message server: pid %d.", (int)getpid());
+	wchan->msgfmts |= IPC_FMT_FRAGMENTS;
+	wchan->should_send_block = TRUE;
+
+	for (j = 0; j < DIMOF(bigmsg_sizes); ++j) {
+		wmsg = wchan->ops->new_ipcmsg(wchan, NULL, bigmsg_sizes[j]
+		,	NULL);
+		if (wmsg == NULL) {
+			cl_log(LOG_ERR, "Out of memory");
+			exit(1);
+		}
+		for (off = 0; off < bigmsg_sizes[j]; ++off) {
+			((char*)wmsg->msg_body)[off]
+			=	bigmsg_byte(bigmsg_sizes[j], off);
+		}
+		if ((rc = wchan->ops->send(wchan, wmsg)) != IPC_OK) {
+			cl_log(LOG_ERR, "bigmsg_server: send of %lu bytes"
+			" failed %d rc", (unsigned long)bigmsg_sizes[j], rc);
+			++errcount;
+		}
+	}
+	wchan->ops->waitout(wchan);
+
+	cl_log(LOG_INFO, "bigmsg_server: %d errors", errcount);
+	wchan->ops->destroy(wchan); wchan = NULL;
+	return errcount;
+}
+
+static int
+bigmsg_client(IPC_Channel* rchan, int repcount)
+{
+	IPC_Message*	rmsg;
+	int		errcount = 0;
+	size_t		j, off;
+	int		rc;
+
+	cl_log(LOG_INFO, "Big message client: pid %d.", (int)getpid());
+	rchan->msgfmts |= IPC_FMT_FRAGMENTS;
+
+	for (j = 0; j < DIMOF(bigmsg_sizes); ++j) {
+		while ((rc = rchan->ops->waitin(rchan)) == IPC_INTR);
+		if (rc != IPC_OK
+		||	(rc = rchan->ops->recv(rchan, &rmsg)) != IPC_OK) {
+			cl_log(LOG_ERR, "bigmsg_client: receive failed %d rc"
+			,	rc);
+			++errcount;
+			break;
+		}
+		if (rmsg->msg_len != bigmsg_sizes[j]) {
+			cl_log(LOG_ERR, "bigmsg_client: got %lu bytes"
+			", expected %lu", (unsigned long)rmsg->msg_len
+			,	(unsigned long)bigmsg_sizes[j]);
+			++errcount;
+		} else {
+			for (off = 0; off < rmsg->msg_len; ++off) {
+				if (((char*)rmsg->msg_body)[off]
+				!=	bigmsg_byte(bigmsg_sizes[j], off)) {
+					cl_log(LOG_ERR, "bigmsg_client: data"
+					" mismatch at %lu of %lu"
+					,	(unsigned long)off
+					,	(unsigned long)rmsg->msg_len);
+					++errcount;
+					break;
+				}
+			}
+		}
+		rmsg->msg_done(rmsg);
+	}
+
+	cl_log(LOG_INFO, "bigmsg_client: %d errors", errcount);
+	rchan->ops->destroy(rchan); rchan = NULL;
+	return errcount;
+}
+
+/*
+ * A peer that did not negotiate fragments must not get them: the
+ * server sends them anyway, the client has to drop the connection.
+ */
+static int
+fragreject_server(IPC_Channel* wchan, int repcount)
+{
+	IPC_Message*	wmsg;
+
+	cl_log(LOG_INFO, "Fragment reject server: pid %d.", (int)getpid());
+	wchan->msgfmts |= IPC_FMT_FRAGMENTS;
+	wchan->should_send_block = TRUE;
+
+	wmsg = wchan->ops->new_ipcmsg(wchan, NULL, 2*MAXMSG, NULL);
+	if (wmsg == NULL) {
+		cl_log(LOG_ERR, "Out of memory");
+		exit(1);
+	}
+	memset(wmsg->msg_body, 'f', 2*MAXMSG);
+	/* whether this works depends on how soon the client gives up */
+	if (wchan->ops->send(wchan, wmsg) == IPC_OK) {
+		wchan->ops->waitout(wchan);
+	}
+	wchan->ops->destroy(wchan); wchan = NULL;
+	return 0;
+}
+
+static int
+fragreject_client(IPC_Channel* rchan, int repcount)
+{
+	IPC_Message*	rmsg;
+	int		errcount = 0;
+	int		rc;
+
+	cl_log(LOG_INFO, "Fragment reject client: pid %d.", (int)getpid());
+
+	while ((rc = rchan->ops->waitin(rchan)) == IPC_INTR);
+	if (rc == IPC_OK && rchan->ops->recv(rchan, &rmsg) == IPC_OK) {
+		cl_log(LOG_ERR, "fragreject_client: took %lu bytes in"
+		" fragments it did not ask for"
+		,	(unsigned long)rmsg->msg_len);
+		rmsg->msg_done(rmsg);
+		++errcount;
+	}
+	if (rchan->ch_status != IPC_DISCONNECT) {
+		cl_log(LOG_ERR, "fragreject_client: still connected");
+		++errcount;
+	}
+
+	cl_log(LOG_INFO, "fragreject_client: %d errors", errcount);
+	rchan->ops->destroy(rchan); rchan = NULL;
+	return errcount;
+}
+
 void dump_ipc_info(IPC_Channel* chan);
 
 static int
@@ -1358,6 +1638,58 @@ mainloop_server(IPC_Channel* chan, int repcount)
 	cl_log(LOG_INFO, "Mainloop echo server: %d errors", info.errcount);
 	return info.errcount;
 }
+/* wcount counts the batches here */
+static gboolean
+s_rcv_batch(IPC_Channel* chan, IPC_Message** msgs, int nmsgs, gpointer data)
+{
+	struct iterinfo*i = data;
+	int		j;
+
+	if (nmsgs > G_CH_BATCH_MAX) {
+		cl_log(LOG_ERR, "s_rcv_batch: %d messages in a batch", nmsgs);
+		++i->errcount;
+	}
+	for (j = 0; j < nmsgs; j++) {
+		i->rcount += 1;
+		if (!checkmsg(msgs[j], "s_rcv_batch", i->rcount)) {
+			++i->errcount;
+		}
+		msgs[j]->msg_done(msgs[j]);
+	}
+	if (nmsgs > 0) {
+		i->wcount++;
+	}
+
+	if (nmsgs == 0 || i->rcount >= i->max || i->errcount > MAXERRORS) {
+		if (i->rcount < i->max) {
+			++i->errcount;
+			cl_log(LOG_INFO, "Early exit from s_rcv_batch");
+		}
+		g_main_quit(loop);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* burst_server's messages, taken in batches from the mainloop */
+static int
+batch_client(IPC_Channel* chan, int repcount)
+{
+	struct iterinfo info;
+
+	loop = g_main_new(FALSE);
+	init_iterinfo(&info, chan, repcount);
+	G_main_add_IPC_Channel_batch(G_PRIORITY_DEFAULT, chan
+	,	FALSE, s_rcv_batch, &info, NULL);
+	cl_log(LOG_INFO, "Batch client: %d reps pid %d.", repcount, (int)getpid());
+	g_main_run(loop);
+	g_main_destroy(loop);
+	loop = NULL;
+	cl_log(LOG_INFO, "Batch client: %d errors, %d read in %d batches"
+	,	info.errcount, info.rcount, info.wcount);
+	return info.errcount;
+}
+
 static int
 mainloop_client(IPC_Channel* chan, int repcount)
 {
@@ -27,6 +27,8 @@
 #include <sys/poll.h>
 #include <clplumbing/cl_log.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <pwd.h>
@@ -45,6 +47,8 @@ void	ipc_time_debug(IPC_Channel* ch, IPC_Message* ipcmsg, int whichpos);
 
 struct IPC_WAIT_CONNECTION * socket_wait_conn_new(GHashTable* ch_attrs);
 struct IPC_CHANNEL * socket_client_channel_new(GHashTable* ch_attrs);
+struct IPC_WAIT_CONNECTION * socket_shm_wait_conn_new(GHashTable* ch_attrs);
+struct IPC_CHANNEL * socket_shm_client_channel_new(GHashTable* ch_attrs);
 
 int (*ipc_pollfunc_ptr)(struct pollfd*, unsigned int, int)
 =	(int (*)(struct pollfd*, unsigned int, int)) poll;
@@ -65,6 +69,9 @@ ipc_wait_conn_constructor(const char * ch_type, GHashTable* ch_attrs)
   ||	strcmp(ch_type, IPC_DOMAIN_SOCKET) == 0) {
     return socket_wait_conn_new(ch_attrs);
   }
+  if	(strcmp(ch_type, IPC_SHM) == 0) {
+    return socket_shm_wait_conn_new(ch_attrs);
+  }
   return NULL;
 }
 
@@ -78,6 +85,9 @@ ipc_channel_constructor(const char * ch_type, GHashTable* ch_attrs)
 
 	return socket_client_channel_new(ch_attrs);
   }
+  if	(strcmp(ch_type, IPC_SHM) == 0) {
+	return socket_shm_client_channel_new(ch_attrs);
+  }
   return NULL;
 }
 
@@ -374,6 +384,74 @@ ipc_bufpool_msg_done(struct IPC_MESSAGE * msg)
 	free(msg);
 }
 
+static void
+ipc_fragmsg_done(struct IPC_MESSAGE * msg)
+{
+	free(msg->msg_buf);
+	free(msg);
+}
+
+/*
+ * Append a piece of a message bigger than MAXMSG to ch->fragbuf. The
+ * whole message is handed out in *msg when the last piece arrived.
+ */
+static int
+ipc_fragbuf_add(struct IPC_CHANNEL* ch, const char* data, size_t len
+,		gboolean last, struct IPC_MESSAGE** msg)
+{
+	struct ipc_fragbuf*	fb = ch->fragbuf;
+	size_t			newsize;
+	char*			newbuf;
+
+	if (fb == NULL) {
+		if ((fb = calloc(1, sizeof(*fb))) == NULL) {
+			cl_log(LOG_ERR, "ipc_fragbuf_add: out of memory");
+			return IPC_FAIL;
+		}
+		ch->fragbuf = fb;
+	}
+	if (fb->len + len > MAXFRAGMSG) {
+		cl_log(LOG_ERR, "ipc_fragbuf_add: message from pid %d"
+		       " bigger than %d", ch->farside_pid, MAXFRAGMSG);
+		return IPC_FAIL;
+	}
+	if (fb->len + len > fb->size) {
+		newsize = fb->size ? 2 * fb->size : 4 * MAXMSG;
+		if (newsize < fb->len + len) {
+			newsize = fb->len + len;
+		}
+		if (newsize > MAXFRAGMSG) {
+			newsize = MAXFRAGMSG;
+		}
+		newbuf = realloc(fb->buf, ch->msgpad + newsize);
+		if (newbuf == NULL) {
+			cl_log(LOG_ERR, "ipc_fragbuf_add: out of memory"
+			       " (%lu bytes)", (unsigned long)newsize);
+			return IPC_FAIL;
+		}
+		fb->buf = newbuf;
+		fb->size = newsize;
+	}
+	memcpy(fb->buf + ch->msgpad + fb->len, data, len);
+	fb->len += len;
+	if (!last) {
+		return IPC_OK;
+	}
+
+	if ((*msg = calloc(1, sizeof(struct IPC_MESSAGE))) == NULL) {
+		cl_log(LOG_ERR, "ipc_fragbuf_add: out of memory");
+		return IPC_FAIL;
+	}
+	(*msg)->msg_buf = fb->buf;
+	(*msg)->msg_body = fb->buf + ch->msgpad;
+	(*msg)->msg_len = fb->len;
+	(*msg)->msg_done = ipc_fragmsg_done;
+	(*msg)->msg_ch = ch;
+	free(fb);
+	ch->fragbuf = NULL;
+	return IPC_OK;
+}
+
 static struct IPC_MESSAGE*
 ipc_bufpool_msg_new(void)
 {
@@ -441,8 +519,7 @@ ipc_bufpool_update(struct ipc_bufpool* pool,
 
 		memcpy(head, pool->consumepos, sizeof(struct SOCKET_MSG_HEAD));
 
-		if (head->magic != HEADMAGIC) {
-			GList* last = g_list_last(rqueue->queue);
+		if (head->magic != HEADMAGIC && head->magic != HEADMAGIC_FRAG) {
 			cl_log(LOG_ERR, "ipc_bufpool_update: "
 			       "magic number in head does not match. "
 			       "Something very bad happened, farside pid =%d",
@@ -451,13 +528,22 @@ ipc_bufpool_update(struct ipc_bufpool* pool,
 			ipc_bufpool_display(pool);
 			cl_log(LOG_INFO, "nmsgs=%d", nmsgs);
 			/*print out the last message in queue*/
-			if (last) {
-				IPC_Message* m = (IPC_Message*)last;
-				ipcmsg_display(m);
+			if (rqueue->current_qlen > 0) {
+				ipcmsg_display(ipc_queue_nth(rqueue
+				,	rqueue->current_qlen - 1));
 			}
 			return -1;
 		}
 
+		/* only if we said we'd take them, see IPC_FMT_FRAGMENTS */
+		if (head->magic == HEADMAGIC_FRAG
+		&&	!(ch->msgfmts & IPC_FMT_FRAGMENTS)) {
+			cl_log(LOG_ERR, "ipc_bufpool_update: message fragment"
+			       " from pid %d, fragments were not negotiated"
+			,      ch->farside_pid);
+			return -1;
+		}
+
 		if ( head->msg_len > MAXMSG) {
 			cl_log(LOG_ERR, "ipc_update_bufpool:"
 			       "msg length is corruptted(%d)",
@@ -470,6 +556,28 @@ ipc_bufpool_update(struct ipc_bufpool* pool,
 			break;
 		}
 
+		if (head->magic == HEADMAGIC_FRAG || ch->fragbuf != NULL) {
+			ipcmsg = NULL;
+			if (ipc_fragbuf_add(ch, pool->consumepos + ch->msgpad
+			,	head->msg_len, head->magic == HEADMAGIC
+			,	&ipcmsg) != IPC_OK) {
+				return -1;
+			}
+			pool->consumepos += ch->msgpad + head->msg_len;
+			if (ipcmsg == NULL) {
+				continue;
+			}
+#ifdef IPC_TIME_DEBUG
+			ipc_time_debug(ch,ipcmsg, MSGPOS_RECV);
+#endif
+			if (ipc_queue_push(rqueue, ipcmsg) != IPC_OK) {
+				ipc_fragmsg_done(ipcmsg);
+				return -1;
+			}
+			nmsgs++;
+			continue;
+		}
+
 		ipcmsg = ipc_bufpool_msg_new();
 		if (ipcmsg == NULL) {
 			cl_log(LOG_ERR, "ipc_update_bufpool:"
@@ -485,8 +593,10 @@ ipc_bufpool_update(struct ipc_bufpool* pool,
 #ifdef IPC_TIME_DEBUG
 		ipc_time_debug(ch,ipcmsg, MSGPOS_RECV);
 #endif
-		rqueue->queue = g_list_append(rqueue->queue, ipcmsg);
-		rqueue->current_qlen ++;
+		if (ipc_queue_push(rqueue, ipcmsg) != IPC_OK) {
+			free(ipcmsg);
+			break;
+		}
 		nmsgs++;
 
 		pool->consumepos += ch->msgpad + head->msg_len;
@@ -591,3 +701,230 @@ ipc_bufpool_unref(struct ipc_bufpool* pool)
 		ipc_bufpool_del(pool);
 	}
 }
+
+/* initial number of slots in a queue ring, a power of two */
+#define QUEUE_RING_MIN	16
+
+IPC_Queue*
+ipc_queue_new(size_t max_qlen)
+{
+	IPC_Queue*	q;
+
+	q = g_new0(IPC_Queue, 1);
+	q->max_qlen = max_qlen;
+	return q;
+}
+
+void
+ipc_queue_del(IPC_Queue* q)
+{
+	free(q->ring);
+	free(q->stamps);
+	g_free(q);
+}
+
+/* double the ring, the messages end up in slots 0 .. current_qlen-1 */
+static int
+ipc_queue_grow(IPC_Queue* q)
+{
+	size_t		newsize;
+	IPC_Message**	newring;
+	unsigned long long* newstamps;
+	size_t		j;
+
+	newsize = q->ring_size ? 2 * q->ring_size : QUEUE_RING_MIN;
+	newring = malloc(newsize * sizeof(IPC_Message*));
+	newstamps = malloc(newsize * sizeof(unsigned long long));
+	if (newring == NULL || newstamps == NULL) {
+		cl_log(LOG_ERR, "ipc_queue_grow: out of memory"
+		       " (%lu slots)", (unsigned long)newsize);
+		free(newring);
+		free(newstamps);
+		return IPC_FAIL;
+	}
+	for (j = 0; j < q->current_qlen; ++j) {
+		newring[j] = ipc_queue_nth(q, j);
+		newstamps[j] = ipc_queue_nth_stamp(q, j);
+	}
+	free(q->ring);
+	free(q->stamps);
+	q->ring = newring;
+	q->stamps = newstamps;
+	q->ring_size = newsize;
+	q->head = 0;
+	return IPC_OK;
+}
+
+int
+ipc_queue_push(IPC_Queue* q, IPC_Message* msg)
+{
+	if (q->current_qlen == q->ring_size && ipc_queue_grow(q) != IPC_OK) {
+		return IPC_FAIL;
+	}
+	ipc_queue_nth(q, q->current_qlen) = msg;
+	ipc_queue_nth_stamp(q, q->current_qlen) = ipc_time_us();
+	q->current_qlen++;
+	return IPC_OK;
+}
+
+IPC_Message*
+ipc_queue_pop(IPC_Queue* q)
+{
+	IPC_Message*	msg;
+
+	if (q->current_qlen == 0) {
+		return NULL;
+	}
+	msg = q->ring[q->head];
+	q->head = (q->head + 1) & (q->ring_size - 1);
+	q->current_qlen--;
+	return msg;
+}
+
+unsigned long long
+ipc_time_us(void)
+{
+	struct timeval	tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+void
+ipc_hist_add(struct ipc_hist* h, unsigned long value)
+{
+	unsigned long	v = value;
+	int		n = 0;
+
+	while (v != 0 && n < IPC_HIST_BUCKETS - 1) {
+		v >>= 1;
+		n++;
+	}
+	h->bucket[n]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+/* the largest value bucket n counts */
+static unsigned long
+ipc_hist_bound(const struct ipc_hist* h, int n)
+{
+	if (n == IPC_HIST_BUCKETS - 1) {
+		return h->max;
+	}
+	return (1UL << n) - 1;
+}
+
+unsigned long
+ipc_hist_percentile(const struct ipc_hist* h, int pct)
+{
+	unsigned long long	want;
+	unsigned long long	seen = 0;
+	int			n;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	want = ((unsigned long long)h->count * pct + 99) / 100;
+	for (n = 0; n < IPC_HIST_BUCKETS; n++) {
+		seen += h->bucket[n];
+		if (seen >= want) {
+			break;
+		}
+	}
+	if (n == IPC_HIST_BUCKETS) {
+		n--;
+	}
+	/* no point in a bound above what we have seen */
+	return ipc_hist_bound(h, n) < h->max ? ipc_hist_bound(h, n) : h->max;
+}
+
+int
+ipc_hist_format(const struct ipc_hist* h, char* buf, size_t len)
+{
+	size_t	used = 0;
+	int	rc;
+	int	n;
+
+	if (len > 0) {
+		buf[0] = EOS;
+	}
+	for (n = 0; n < IPC_HIST_BUCKETS; n++) {
+		if (h->bucket[n] == 0) {
+			continue;
+		}
+		rc = snprintf(buf + used, used < len ? len - used : 0
+		,	"%s<=%lu:%lu", used ? " " : ""
+		,	ipc_hist_bound(h, n), h->bucket[n]);
+		if (rc < 0) {
+			return rc;
+		}
+		used += rc;
+	}
+	return used;
+}
+
+int
+ipc_chanstats_format(const IPC_Channel* ch, char* buf, size_t len)
+{
+	const struct ipc_chanstats* s = ch->stats;
+
+	if (s == NULL) {
+		return snprintf(buf, len, "no statistics");
+	}
+	return snprintf(buf, len
+	,	"sent %lu msgs %llu bytes, wait p50 %luus p99 %luus max %luus"
+	", qlen p99 %lu max %lu, blocked %lu sends %lums;"
+	" received %lu msgs %llu bytes, wait p50 %luus p99 %luus"
+	" max %luus, qlen p99 %lu max %lu; over %lds"
+	,	s->nsent, s->bytes_sent
+	,	ipc_hist_percentile(&s->send_wait, 50)
+	,	ipc_hist_percentile(&s->send_wait, 99), s->send_wait.max
+	,	ipc_hist_percentile(&s->send_qlen, 99), s->send_qlen.max
+	,	ch->send_blocked_count, ch->send_blocked_ms
+	,	s->nrecv, s->bytes_recv
+	,	ipc_hist_percentile(&s->recv_wait, 50)
+	,	ipc_hist_percentile(&s->recv_wait, 99), s->recv_wait.max
+	,	ipc_hist_percentile(&s->recv_qlen, 99), s->recv_qlen.max
+	,	(long)(time(NULL) - s->since));
+}
+
+void
+ipc_chanstats_log(const IPC_Channel* ch, const char* name, int priority)
+{
+	char	buf[1024];
+
+	ipc_chanstats_format(ch, buf, sizeof(buf));
+	cl_log(priority, "%s: %s", name, buf);
+	if (ch->stats == NULL) {
+		return;
+	}
+	if (ch->stats->send_wait.count) {
+		ipc_hist_format(&ch->stats->send_wait, buf, sizeof(buf));
+		cl_log(priority, "%s: send wait (us) %s", name, buf);
+	}
+	if (ch->stats->recv_wait.count) {
+		ipc_hist_format(&ch->stats->recv_wait, buf, sizeof(buf));
+		cl_log(priority, "%s: recv wait (us) %s", name, buf);
+	}
+}
+
+void
+ipc_chanstats_reset(IPC_Channel* ch)
+{
+	if (ch->stats != NULL) {
+		memset(ch->stats, 0, sizeof(*ch->stats));
+		ch->stats->since = time(NULL);
+	}
+	ch->send_blocked_ms = 0;
+	ch->send_blocked_count = 0;
+}
@@ -142,6 +142,7 @@ static struct rsc_ops rsc_ops_instance =
 static int is_signed_on					= FALSE;
 static IPC_Channel* ch_cmd				= NULL;
 static IPC_Channel* ch_cbk 				= NULL;
+static int lrmd_features				= 0;
 static lrm_op_done_callback_t	op_done_callback 	= NULL;
 
 /* define some utility functions*/
@@ -228,6 +229,7 @@ lrm_signon (ll_lrm_t* lrm, const char * app_name)
 	}
 
 	/* send the msg*/
+	lrmd_features = 0;
 	if (HA_OK != msg2ipcchan(msg,ch_cmd)) {
 		lrm_signoff(lrm);
 		ha_msg_del(msg);
@@ -482,16 +484,80 @@ lrm_get_rsc_provider_supported (ll_lrm_t* lrm, const char* class, const char* ty
  * The key of the hash table is in the format "type:provider"
  * The value of the hash table is the metadata.
  */
+/* GETALLMETAS: lrmd collects the meta-data of all types in parallel */
+static int
+get_all_metas_from_lrmd (const char* rclass, GHashTable* metas)
+{
+	struct ha_msg* msg;
+	struct ha_msg* ret;
+	struct ha_msg* all;
+	int i;
+
+	msg = create_lrm_msg(GETALLMETAS);
+	if (NULL == msg) {
+		LOG_FAIL_create_lrm_msg(GETALLMETAS);
+		return HA_FAIL;
+	}
+	if (HA_OK != ha_msg_add(msg, F_LRM_RCLASS, rclass)) {
+		ha_msg_del(msg);
+		LOG_BASIC_ERROR("ha_msg_add");
+		return HA_FAIL;
+	}
+	if (HA_OK != msg2ipcchan(msg, ch_cmd)) {
+		ha_msg_del(msg);
+		LOG_FAIL_SEND_MSG(GETALLMETAS, "ch_cmd");
+		return HA_FAIL;
+	}
+	ha_msg_del(msg);
+
+	ret = msgfromIPC(ch_cmd, MSG_ALLOWINTR);
+	if (NULL == ret) {
+		LOG_FAIL_receive_reply(GETALLMETAS);
+		return HA_FAIL;
+	}
+	if (HA_OK != get_ret_from_msg(ret)) {
+		LOG_GOT_FAIL_RET(LOG_ERR, GETALLMETAS);
+		ha_msg_del(ret);
+		return HA_FAIL;
+	}
+	/* one field per agent, named "type:provider" */
+	if (NULL != (all = cl_get_struct(ret, F_LRM_METAS))) {
+		for (i = 0; i < all->nfields; i++) {
+			if (all->types[i] != FT_STRING) {
+				continue;
+			}
+			g_hash_table_insert(metas
+			,	g_strndup(all->names[i], all->nlens[i])
+			,	g_strndup(all->values[i], all->vlens[i]));
+		}
+	}
+	ha_msg_del(ret);
+	return HA_OK;
+}
+
 static GHashTable*
 lrm_get_all_type_metadata (ll_lrm_t* lrm, const char* rclass)
 {
 	GHashTable* metas = g_hash_table_new_full(g_str_hash, g_str_equal
 						  , g_free, g_free);
-	GList* types = lrm_get_rsc_type_supported (lrm, rclass);
+	GList* types = NULL;
 	GList* providers = NULL;
 	GList* cur_type = NULL;
 	GList* cur_provider = NULL;
 
+	if (NULL == ch_cmd) {
+		cl_log(LOG_ERR,
+			"lrm_get_all_type_metadata: ch_mod is null.");
+		return metas;
+	}
+	if ((lrmd_features & LRM_FEAT_ALLMETAS)
+	&&  HA_OK == get_all_metas_from_lrmd(rclass, metas)) {
+		return metas;
+	}
+
+	/* an older lrmd: one type and provider at a time */
+	types = lrm_get_rsc_type_supported (lrm, rclass);
+
 	cur_type = g_list_first(types);
 	while (cur_type != NULL)
 	{
@@ -964,8 +1030,8 @@ lrm_rcvmsg (ll_lrm_t* lrm, int blocking)
 		if (ch_cbk->ch_status == IPC_DISCONNECT) {
 			return msg_count;
 		}
-		/* get the message */
-		msg = msgfromIPC(ch_cbk, MSG_ALLOWINTR);
+		/* get the message; msg_to_op() copies all it needs */
+		msg = msgfromIPC(ch_cbk, MSG_ALLOWINTR|MSG_BORROW);
 		if (msg == NULL) {
 			cl_log(LOG_WARNING,
 				"%s(%d): receive a null message with msgfromIPC."
@@ -1402,6 +1468,8 @@ msg_to_op(struct ha_msg* msg)
 		*/
 	}
 	
+	ha_msg_value_ul(msg, F_LRM_SPAWN_TIME, &op->spawn_time);
+
 	/* op->params */
 	op->params = ha_msg_value_str_table(msg, F_LRM_PARAM);
 
@@ -1446,6 +1514,7 @@ static int
 get_ret_from_ch(IPC_Channel* ch)
 {
 	int ret;
+	int fmts;
 	struct ha_msg* msg;
 
 	msg = msgfromIPC(ch, MSG_ALLOWINTR);
@@ -1461,6 +1530,14 @@ get_ret_from_ch(IPC_Channel* ch)
 		ha_msg_del(msg);
 		return HA_FAIL;
 	}
+	/* the reply to REGISTER says which formats lrmd reads */
+	if (HA_OK == ha_msg_value_int(msg, F_LRM_MSGFMTS, &fmts)) {
+		ch->msgfmts = fmts & LRM_MSGFMTS;
+	}
+	/* and which requests beyond the old set it knows */
+	if (HA_OK == ha_msg_value_int(msg, F_LRM_FEATURES, &fmts)) {
+		lrmd_features = fmts;
+	}
 	ha_msg_del(msg);
 	return ret;
 }
@@ -123,13 +123,14 @@ create_lrm_reg_msg(const char* app_name)
 		return NULL;
 	}
 
-	ret = ha_msg_new(5);
+	ret = ha_msg_new(6);
 
 	if(HA_OK != ha_msg_add(ret, F_LRM_TYPE, REGISTER)
 	|| HA_OK != ha_msg_add(ret, F_LRM_APP, app_name)
 	|| HA_OK != ha_msg_add_int(ret, F_LRM_PID, getpid())
 	|| HA_OK != ha_msg_add_int(ret, F_LRM_GID, getegid())
-	|| HA_OK != ha_msg_add_int(ret, F_LRM_UID, getuid())) {
+	|| HA_OK != ha_msg_add_int(ret, F_LRM_UID, getuid())
+	|| HA_OK != ha_msg_add_int(ret, F_LRM_MSGFMTS, LRM_MSGFMTS)) {
 		ha_msg_del(ret);
 		LOG_BASIC_ERROR("ha_msg_add");
 		return NULL;
@@ -169,9 +169,74 @@ closefiles(void)
 {
 	int fd;
 
+#ifdef HAVE_CLOSE_RANGE
+	if (close_range(STDERR_FILENO + 1, ~0U, 0) == 0) {
+		return;
+	}
+#endif
 	/* close all descriptors except stdin/out/err and channels to logd */
 	for (fd = getdtablesize() - 1; fd > STDERR_FILENO; fd--) {
 		/*if (!cl_log_is_logd_fd(fd))*/
 			close(fd);
 	}
 }
+
+extern char **environ;
+
+struct envp_fill {
+	char**	envp;
+	int	n;
+};
+
+static void
+envp_add(gpointer key, gpointer value, gpointer user_data)
+{
+	struct envp_fill* f = user_data;
+
+	f->envp[f->n++] = g_strdup_printf("%s=%s"
+	,	(const char*)key, (const char*)value);
+}
+
+/*
+ * The environment for a RA started with posix_spawn(): ours, with the
+ * pairs in env (may be NULL) added or replacing those of the same
+ * name. HALOGD is set as a forked RA gets it, unless env has it. To
+ * be freed with g_strfreev().
+ */
+char**
+raexec_envp(GHashTable * env)
+{
+	struct envp_fill f;
+	char*		name;
+	const char*	eq;
+	gboolean	skip;
+	int		i;
+
+	for (i = 0; environ[i] != NULL; i++) {
+		;
+	}
+	f.envp = g_new(char*, i + (env ? g_hash_table_size(env) : 0) + 2);
+	f.n = 0;
+	for (i = 0; environ[i] != NULL; i++) {
+		if ((eq = strchr(environ[i], '=')) != NULL) {
+			name = g_strndup(environ[i], eq - environ[i]);
+			skip = strcmp(name, HALOGD) == 0 || (env != NULL
+			&&	g_hash_table_lookup(env, name) != NULL);
+			g_free(name);
+			if (skip) {
+				continue;
+			}
+		}
+		f.envp[f.n++] = g_strdup(environ[i]);
+	}
+	if (env != NULL) {
+		g_hash_table_foreach(env, envp_add, &f);
+	}
+	if (env == NULL || g_hash_table_lookup(env, HALOGD) == NULL) {
+		/* whether the RA should log through the logging daemon */
+		f.envp[f.n++] = g_strdup_printf("%s=%s", HALOGD
+		,	cl_log_get_uselogd() ? "yes" : "no");
+	}
+	f.envp[f.n] = NULL;
+	return f.envp;
+}
@@ -142,6 +142,15 @@ static uniform_ret_execra_t map_ra_retvalue(int ret_execra
 static char* get_resource_meta(const char* rsc_type, const char* provider);
 static int get_resource_list(GList ** rsc_info);
 static int get_provider_list(const char* ra_type, GList ** providers);
+static int prepare_exec(const char * rsc_id,
+			const char * rsc_type,
+			const char * provider,
+			const char * op_type,
+			const int    timeout,
+			GHashTable * params,
+			char **	     path,
+			char ***     argv,
+			char ***     envp);
 
 /* The end of exported function list */
 
@@ -155,6 +164,9 @@ typedef char * RA_ARGV[MAX_PARAMETER_NUM];
 
 static int prepare_cmd_parameters(const char * rsc_type, const char * op_type,
 	GHashTable * params, RA_ARGV params_argv);
+static int prepare_argv(const char * rsc_type, const char * op_type,
+	GHashTable * params, RA_ARGV params_argv);
+static void log_execra(const char * rsc_id, RA_ARGV params_argv);
 /* The end of internal function & data list */
 
 /* Rource agent execution plugin operations */
@@ -166,12 +178,19 @@ static struct RAExecOps raops =
 	get_resource_meta
 };
 
+/* lrmd starts the RA itself with these */
+static struct RASpawnOps spawnops =
+{	prepare_exec
+};
+
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
 
 static const PILPluginImports*  PluginImports;
 static PILPlugin*               OurPlugin;
 static PILInterface*		OurInterface;
 static void*			OurImports;
+static PILInterface*		OurSpawnInterface;
+static void*			OurSpawnImports;
 static void*			interfprivate;
 
 /*
@@ -184,6 +203,8 @@ PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports);
 PIL_rc
 PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports)
 {
+	PIL_rc rc;
+
 	/* Force the compiler to do a little type checking */
 	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
 
@@ -194,9 +215,17 @@ PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports)
 	imports->register_plugin(us, &OurPIExports);
 
 	/*  Register our interfaces */
- 	return imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S,
+ 	rc = imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S,
 		&raops, NULL, &OurInterface, &OurImports,
 		interfprivate);
+	if (rc != PIL_OK) {
+		return rc;
+	}
+	/* only lrmd knows this one, the others do without it */
+	imports->register_interface(us, RA_SPAWN_TYPE_S, PIL_PLUGIN_S,
+		&spawnops, NULL, &OurSpawnInterface, &OurSpawnImports,
+		interfprivate);
+	return PIL_OK;
 }
 
 /*
@@ -209,10 +238,6 @@ execra( const char * rsc_id, const char * rsc_type, const char * provider,
 {
 	RA_ARGV params_argv;
 	char ra_pathname[RA_MAX_NAME_LENGTH];
-	GString * debug_info;
-	char * inherit_debuglevel = NULL;
-	char * optype_tmp = NULL;
-	int index_tmp = 0;
 	int save_errno;
 
 	/* Specially handle the operation "metameta-data". To build up its
@@ -223,6 +248,59 @@ execra( const char * rsc_id, const char * rsc_type, const char * provider,
 		exit(0);
 	}
 
+	if (prepare_argv(rsc_type, op_type, params, params_argv) != 0) {
+		return -1;
+	}
+	get_ra_pathname(RA_PATH, rsc_type, NULL, ra_pathname);
+	log_execra(rsc_id, params_argv);
+
+	closefiles(); /* don't leak open files */
+	execv(ra_pathname, params_argv);
+	/* oops, exec failed */
+	save_errno = errno; /* cl_perror may change errno */
+	cl_perror("(%s:%s:%d) execv failed for %s"
+		  , __FILE__, __FUNCTION__, __LINE__, ra_pathname);
+	errno = save_errno;
+	exit(get_failed_exec_rc());
+}
+
+/* What execra() would run; the environment is ours */
+static int
+prepare_exec(const char * rsc_id, const char * rsc_type, const char * provider,
+	     const char * op_type, const int timeout, GHashTable * params,
+	     char ** path, char *** argv, char *** envp)
+{
+	RA_ARGV params_argv;
+	char ra_pathname[RA_MAX_NAME_LENGTH];
+	int i;
+
+	if ( 0 == STRNCMP_CONST(op_type, "meta-data")) {
+		return -1;
+	}
+	get_ra_pathname(RA_PATH, rsc_type, NULL, ra_pathname);
+	if (ra_pathname[0] == EOS
+	||  prepare_argv(rsc_type, op_type, params, params_argv) != 0) {
+		return -1;
+	}
+	log_execra(rsc_id, params_argv);
+
+	for (i = 0; params_argv[i] != NULL; i++) {
+		;
+	}
+	*argv = g_new(char *, i + 1);
+	memcpy(*argv, params_argv, (i + 1) * sizeof(char *));
+	*path = g_strdup(ra_pathname);
+	*envp = raexec_envp(NULL);
+	return 0;
+}
+
+static int
+prepare_argv(const char * rsc_type, const char * op_type,
+	     GHashTable * params, RA_ARGV params_argv)
+{
+	char * optype_tmp = NULL;
+	int rc;
+
 	/* To simulate the 'monitor' operation with 'status'.
 	 * Now suppose there is no 'monitor' operation for LSB scripts.
 	 */
@@ -233,14 +311,20 @@ execra( const char * rsc_id, const char * rsc_type, const char * provider,
 	}
 
 	/* Prepare the call parameter */
-	if ( prepare_cmd_parameters(rsc_type, optype_tmp, params, params_argv)
-		 != 0) {
+	rc = prepare_cmd_parameters(rsc_type, optype_tmp, params, params_argv);
+	if (rc != 0) {
 		cl_log(LOG_ERR, "lsb RA: Error of preparing parameters");
-		g_free(optype_tmp);
-		return -1;
 	}
 	g_free(optype_tmp);
-	get_ra_pathname(RA_PATH, rsc_type, NULL, ra_pathname);
+	return rc;
+}
+
+static void
+log_execra(const char * rsc_id, RA_ARGV params_argv)
+{
+	GString * debug_info;
+	char * inherit_debuglevel = NULL;
+	int index_tmp = 0;
 
 	/* let this log show only high loglevel. */
 	inherit_debuglevel = getenv(HADEBUGVAL);
@@ -257,15 +341,6 @@ execra( const char * rsc_id, const char * rsc_type, const char * provider,
 
 		g_string_free(debug_info, TRUE);
 	} 
-
-	closefiles(); /* don't leak open files */
-	execv(ra_pathname, params_argv);
-	/* oops, exec failed */
-	save_errno = errno; /* cl_perror may change errno */
-	cl_perror("(%s:%s:%d) execv failed for %s"
-		  , __FILE__, __FUNCTION__, __LINE__, ra_pathname);
-	errno = save_errno;
-	exit(get_failed_exec_rc());
 }
 
 static uniform_ret_execra_t
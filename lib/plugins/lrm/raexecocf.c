@@ -67,6 +67,15 @@ static uniform_ret_execra_t map_ra_retvalue(int ret_execra,
 static int get_resource_list(GList ** rsc_info);
 static char* get_resource_meta(const char* rsc_type,  const char* provider);
 static int get_provider_list(const char* ra_type, GList ** providers);
+static int prepare_exec(const char * rsc_id,
+			const char * rsc_type,
+			const char * provider,
+			const char * op_type,
+			const int    timeout,
+			GHashTable * params,
+			char **	     path,
+			char ***     argv,
+			char ***     envp);
 
 /* The end of exported function list */
 
@@ -76,6 +85,8 @@ static void add_OCF_env_vars(GHashTable * env, const char * rsc_id,
 			     const char * rsc_type, const char * provider);
 static void add_prefix_foreach(gpointer key, gpointer value,
 				   gpointer user_data);
+static void log_execra(const char * rsc_id, const char * rsc_type,
+		       const char * op_type, GHashTable * params);
 
 static void hash_to_str(GHashTable * , GString *);
 static void hash_to_str_foreach(gpointer key, gpointer value,
@@ -102,12 +113,19 @@ static struct RAExecOps raops =
 	get_resource_meta
 };
 
+/* lrmd starts the RA itself with these */
+static struct RASpawnOps spawnops =
+{	prepare_exec
+};
+
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
 
 static const PILPluginImports*  PluginImports;
 static PILPlugin*               OurPlugin;
 static PILInterface*		OurInterface;
 static void*			OurImports;
+static PILInterface*		OurSpawnInterface;
+static void*			OurSpawnImports;
 static void*			interfprivate;
 
 /*
@@ -120,6 +138,8 @@ PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports);
 PIL_rc
 PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports)
 {
+	PIL_rc rc;
+
 	/* Force the compiler to do a little type checking */
 	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
 
@@ -130,9 +150,17 @@ PIL_PLUGIN_INIT(PILPlugin * us, const PILPluginImports* imports)
 	imports->register_plugin(us, &OurPIExports);
 
 	/*  Register our interfaces */
- 	return imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S,
+ 	rc = imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S,
 		&raops, NULL, &OurInterface, &OurImports,
 		interfprivate);
+	if (rc != PIL_OK) {
+		return rc;
+	}
+	/* only lrmd knows this one, the others do without it */
+	imports->register_interface(us, RA_SPAWN_TYPE_S, PIL_PLUGIN_S,
+		&spawnops, NULL, &OurSpawnInterface, &OurSpawnImports,
+		interfprivate);
+	return PIL_OK;
 }
 
 /*
@@ -144,8 +172,6 @@ execra(const char * rsc_id, const char * rsc_type, const char * provider,
 {
 	char ra_pathname[RA_MAX_NAME_LENGTH];
 	GHashTable * tmp_for_setenv;
-	GString * params_gstring;
-	char * inherit_debuglevel = NULL;
 	int save_errno;
 
 	get_ra_pathname(RA_PATH, rsc_type, provider, ra_pathname);
@@ -158,15 +184,7 @@ execra(const char * rsc_id, const char * rsc_type, const char * provider,
 	g_hash_table_foreach_remove(tmp_for_setenv, let_remove_eachitem, NULL);
 	g_hash_table_destroy(tmp_for_setenv);
 
-	/* let this log show only high loglevel. */
-	inherit_debuglevel = getenv(HADEBUGVAL);
-	if ((inherit_debuglevel != NULL) && (atoi(inherit_debuglevel) > 1)) {
-		params_gstring = g_string_new("");
-		hash_to_str(params, params_gstring);
-		cl_log(LOG_DEBUG, "RA instance %s executing: OCF::%s %s. Parameters: "
-			"{%s}", rsc_id, rsc_type, op_type, params_gstring->str);
-		g_string_free(params_gstring, TRUE);
-	}
+	log_execra(rsc_id, rsc_type, op_type, params);
 
 	closefiles(); /* don't leak open files */
 	/* execute the RA */
@@ -179,6 +197,58 @@ execra(const char * rsc_id, const char * rsc_type, const char * provider,
 	exit(get_failed_exec_rc());
 }
 
+/*
+ * What execra() would run, with the OCF variables in the environment
+ * instead of setenv().
+ */
+static int
+prepare_exec(const char * rsc_id, const char * rsc_type, const char * provider,
+	     const char * op_type, const int timeout, GHashTable * params,
+	     char ** path, char *** argv, char *** envp)
+{
+	char ra_pathname[RA_MAX_NAME_LENGTH];
+	GHashTable * tmp_for_setenv;
+
+	get_ra_pathname(RA_PATH, rsc_type, provider, ra_pathname);
+	if (ra_pathname[0] == EOS) {
+		return -1;
+	}
+
+	tmp_for_setenv = g_hash_table_new(g_str_hash, g_str_equal);
+	add_OCF_prefix(params, tmp_for_setenv);
+	add_OCF_env_vars(tmp_for_setenv, rsc_id, rsc_type, provider);
+	*envp = raexec_envp(tmp_for_setenv);
+	g_hash_table_foreach_remove(tmp_for_setenv, let_remove_eachitem, NULL);
+	g_hash_table_destroy(tmp_for_setenv);
+
+	log_execra(rsc_id, rsc_type, op_type, params);
+
+	*path = g_strdup(ra_pathname);
+	*argv = g_new(char *, 3);
+	(*argv)[0] = g_strdup(ra_pathname);
+	(*argv)[1] = g_strdup(op_type);
+	(*argv)[2] = NULL;
+	return 0;
+}
+
+static void
+log_execra(const char * rsc_id, const char * rsc_type, const char * op_type,
+	   GHashTable * params)
+{
+	GString * params_gstring;
+	char * inherit_debuglevel = NULL;
+
+	/* let this log show only high loglevel. */
+	inherit_debuglevel = getenv(HADEBUGVAL);
+	if ((inherit_debuglevel != NULL) && (atoi(inherit_debuglevel) > 1)) {
+		params_gstring = g_string_new("");
+		hash_to_str(params, params_gstring);
+		cl_log(LOG_DEBUG, "RA instance %s executing: OCF::%s %s. Parameters: "
+			"{%s}", rsc_id, rsc_type, op_type, params_gstring->str);
+		g_string_free(params_gstring, TRUE);
+	}
+}
+
 static uniform_ret_execra_t
 map_ra_retvalue(int ret_execra, const char * op_type, const char * std_output)
 {
@@ -295,7 +365,6 @@ get_resource_meta(const char* rsc_type, const char* provider)
 	char ra_pathname[RA_MAX_NAME_LENGTH];
 	FILE* file = NULL;
 	GHashTable * tmp_for_setenv;
-	struct timespec short_sleep = {0,200000000L}; /*20ms*/
 
 	get_ra_pathname(RA_PATH, rsc_type, provider, ra_pathname);
 
@@ -313,15 +382,15 @@ get_resource_meta(const char* rsc_type, const char* provider)
 	}
 
 	g_str_tmp = g_string_new("");
-	while(!feof(file)) {
-		read_len = fread(buff, 1, BUFF_LEN - 1, file);
-		if (0<read_len) {
-			*(buff+read_len) = '\0';
-			g_string_append(g_str_tmp, buff);
-		}
-		else {
-			nanosleep(&short_sleep,NULL);
-		}
+	/* fread() blocks until there is something, so nothing means
+	 * the agent is done (or the read failed) */
+	while ((read_len = fread(buff, 1, BUFF_LEN - 1, file)) > 0) {
+		*(buff+read_len) = '\0';
+		g_string_append(g_str_tmp, buff);
+	}
+	if (ferror(file)) {
+		cl_log(LOG_ERR, "%s: read from %s failed: %s"
+		,	__FUNCTION__, ra_pathname, strerror(errno));
 	}
 	if( pclose(file) ) {
 		cl_log(LOG_ERR, "%s: pclose failed: %s", __FUNCTION__, strerror(errno));
@@ -35,7 +35,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
 #include <clplumbing/Gmain_timeout.h>
+#include <clplumbing/longclock.h>
 #include <clplumbing/coredumps.h>
 #include <clplumbing/setproctitle.h>
 #include <clplumbing/cl_signal.h>
@@ -43,6 +46,7 @@
 #include <sys/wait.h>
 #include <clplumbing/cl_pidfile.h>
 #include <clplumbing/cl_syslog.h>
+#include "logd_shard.h"
 
 /*two processes involved
   1. parent process which reads messages from all client channels 
@@ -70,6 +74,8 @@
 #define WRITE_PROC_CHAN	0
 #define READ_PROC_CHAN	1
 #define LOGD_QUEUE_LEN  128
+#define LOGD_BUFSIZE	(256*1024)	/* see cl_log_use_batched_io() */
+#define LOGD_MAXENTITIES 4096		/* interned entity names */
 
 #define EOS '\0'
 #define	nullchk(a)	((a) ? (a) : "<null>")
@@ -91,6 +97,12 @@ static struct {
 	int		log_facility;
 	mode_t		logmode;
 	gboolean	syslogfmtmsgs;
+	size_t		logbufsize;
+	int		fsyncpriority;
+	unsigned long	fsyncinterval;
+	char		journal[MAXLINE];
+	int		ratelimit;
+	time_t		ratewindow;
 } logd_config =
 	{
 		.debugfile = "",
@@ -99,7 +111,13 @@ static struct {
 		.syslogprefix = "",
 		.log_facility = HA_LOG_FACILITY,
 		.logmode  = 0644,
-		.syslogfmtmsgs = FALSE
+		.syslogfmtmsgs = FALSE,
+		.logbufsize = LOGD_BUFSIZE,
+		.fsyncpriority = LOG_ERR,
+		.fsyncinterval = 0,
+		.journal = "",
+		.ratelimit = 0,
+		.ratewindow = 0
 	};
 
 static void	logd_log(const char * fmt, ...) G_GNUC_PRINTF(1,2);
@@ -112,6 +130,12 @@ static int	set_sendqlen(const char * option);
 static int	set_recvqlen(const char * option);
 static int	set_logmode(const char * option);
 static int	set_syslogfmtmsgs(const char * option);
+static int	set_logbufsize(const char * option);
+static int	set_fsyncpriority(const char * option);
+static int	set_fsyncinterval(const char * option);
+static int	set_journal(const char * option);
+static void	logd_journal_close(void);
+static int	set_ratelimit(const char * option);
 
 
 static char*			cmdname = NULL;
@@ -129,7 +153,17 @@ static struct directive {
 	{"sendqlen",	set_sendqlen},
 	{"recvqlen",	set_recvqlen},
 	{"logmode",	set_logmode},
-	{"syslogmsgfmt",set_syslogfmtmsgs}
+	{"syslogmsgfmt",set_syslogfmtmsgs},
+	{"logbufsize",	set_logbufsize},
+	{"fsyncpriority",set_fsyncpriority},
+	{"fsyncinterval",set_fsyncinterval},
+	{"journal",	set_journal},
+	{"logdir",	set_logdir},
+	{"logsplit",	set_logsplit},
+	{"rotatesize",	set_rotatesize},
+	{"rotateinterval",set_rotateinterval},
+	{"rotatecompress",set_rotatecompress},
+	{"ratelimit",	set_ratelimit}
 };
 
 static void
@@ -311,6 +345,117 @@ set_syslogfmtmsgs(const char * option)
 	return TRUE;
 }
 
+static int
+set_logbufsize(const char * option)
+{
+	long	size;
+	char *	endptr;
+
+	if (!option){
+		cl_log(LOG_ERR, "NULL logbufsize parameter");
+		return FALSE;
+	}
+	size = strtol(option, &endptr, 10);
+	if (*endptr != EOS || size < 0) {
+		cl_log(LOG_ERR, "Invalid log buffer size [%s]", option);
+		return FALSE;
+	}
+	cl_log(LOG_INFO, "setting log buffer size to %ld", size);
+	logd_config.logbufsize = size;
+	return TRUE;
+}
+
+static int
+set_fsyncpriority(const char * option)
+{
+	int	pri;
+
+	if (!option){
+		cl_log(LOG_ERR, "NULL fsyncpriority parameter");
+		return FALSE;
+	}
+	if (!strcasecmp(option, "none")) {
+		logd_config.fsyncpriority = -1;
+		return TRUE;
+	}
+	for (pri = LOG_EMERG; pri <= LOG_DEBUG; pri++) {
+		if (!strcasecmp(option, prio2str(pri))) {
+			logd_config.fsyncpriority = pri;
+			return TRUE;
+		}
+	}
+	cl_log(LOG_ERR, "Invalid fsync priority [%s]", option);
+	return FALSE;
+}
+
+static int
+set_fsyncinterval(const char * option)
+{
+	long	ms;
+	char *	endptr;
+
+	if (!option){
+		cl_log(LOG_ERR, "NULL fsyncinterval parameter");
+		return FALSE;
+	}
+	ms = strtol(option, &endptr, 10);
+	if (*endptr != EOS || ms < 0) {
+		cl_log(LOG_ERR, "Invalid fsync interval [%s]", option);
+		return FALSE;
+	}
+	logd_config.fsyncinterval = ms;
+	return TRUE;
+}
+
+/* messages/seconds */
+static int
+set_ratelimit(const char * option)
+{
+	long	max, window = 1;
+	char*	endptr;
+
+	if (!option) {
+		return FALSE;
+	}
+	max = strtol(option, &endptr, 10);
+	if (*endptr == '/') {
+		window = strtol(endptr + 1, &endptr, 10);
+	}
+	if (*endptr != EOS || max < 0 || window <= 0) {
+		cl_log(LOG_ERR, "Invalid rate limit [%s]", option);
+		return FALSE;
+	}
+	logd_config.ratelimit = max;
+	logd_config.ratewindow = window;
+	return TRUE;
+}
+
+static int
+set_journal(const char * option)
+{
+	if (!option) {
+		logd_config.journal[0] = EOS;
+		return FALSE;
+	}
+	cl_log(LOG_INFO, "setting binary journal file to %s", option);
+	strncpy(logd_config.journal, option, MAXLINE);
+	logd_config.journal[MAXLINE-1] = EOS;
+	return TRUE;
+}
+
+
+/*
+ * Entity names of binary records. The ids the clients use are only
+ * good for their connection, the read process gives each name an id
+ * of its own for the channel to the write process, and sends the name
+ * along with the first record using it. Past LOGD_MAXENTITIES names
+ * the name goes with every record, with id 0.
+ */
+struct logd_entity {
+	unsigned	id;
+	gboolean	defined;	/* sent to the write process */
+	char		name[MAXENTITY];
+};
 
 typedef struct {
 	char		app_name[MAXENTITY];
@@ -321,9 +466,17 @@ typedef struct {
 	IPC_Channel*	chan;
 	IPC_Channel*	logchan;
 	GCHSource*	g_src;
+
+	unsigned		rec_id;		/* the client's entity id */
+	struct logd_entity*	entity;		/* and what it means */
+	struct logd_entity	own;		/* when the table is full */
+
+	unsigned long		shed;		/* dropped, see logd_admit() */
 }ha_logd_client_t;
 
 static GList*	logd_client_list = NULL;
+static GHashTable*	logd_entities = NULL;
+static unsigned		logd_entity_last = 0;
 
 static IPC_Message*
 getIPCmsg(IPC_Channel* ch)
@@ -406,6 +559,241 @@ logd_resume_clients(IPC_Channel* notused1, gpointer notused2)
 	}
 }
 
+static struct logd_entity*
+logd_entity_get(ha_logd_client_t* client, const char* name, size_t len)
+{
+	struct logd_entity*	ent;
+	char			key[MAXENTITY];
+
+	if (len >= MAXENTITY) {
+		len = MAXENTITY - 1;
+	}
+	memcpy(key, name, len);
+	key[len] = EOS;
+
+	if (logd_entities == NULL) {
+		logd_entities = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	if ((ent = g_hash_table_lookup(logd_entities, key)) != NULL) {
+		return ent;
+	}
+	if (g_hash_table_size(logd_entities) >= LOGD_MAXENTITIES
+	||	(ent = malloc(sizeof(*ent))) == NULL) {
+		ent = &client->own;
+		ent->id = 0;
+		strncpy(ent->name, key, MAXENTITY);
+		return ent;
+	}
+	ent->id = ++logd_entity_last;
+	ent->defined = FALSE;
+	strncpy(ent->name, key, MAXENTITY);
+	g_hash_table_insert(logd_entities, ent->name, ent);
+	return ent;
+}
+
+static int
+logd_msgtype(IPC_Message* ipcmsg)
+{
+	int	msgtype;
+
+	if (ipcmsg->msg_body == NULL
+	||	ipcmsg->msg_len < (int)sizeof(LogDaemonMsgHdr)) {
+		return -1;
+	}
+	memcpy(&msgtype, (char*)ipcmsg->msg_body
+	+	offsetof(LogDaemonMsgHdr, msgtype), sizeof(msgtype));
+	return msgtype;
+}
+
+/*
+ * Overload shedding. While the write process is behind, debug messages
+ * are dropped once the queue to it is half full, notice and info at
+ * three quarters; warnings and worse always go on (the clients are
+ * paused only when the queue is full). With ratelimit, each entity may
+ * also log only so many notice/info/debug messages in its window
+ * before those are dropped for a window; see cl_limit_log(). How many
+ * were shed is logged by a timer once the queue is down to a quarter.
+ */
+struct logd_limit {
+	struct msg_ctrl*	ml;
+	unsigned long		dropped;
+};
+
+static GHashTable*	logd_limits = NULL;	/* entity -> logd_limit */
+static struct logspam	logd_lspam;
+static unsigned long	logd_shed = 0;
+static guint		logd_shed_timer = 0;
+
+#define LOGD_SHED_CHECK_MS	1000	/* for the queue to drain */
+
+static struct logd_limit*
+logd_limit_get(const char* entity)
+{
+	struct logd_limit*	lim;
+
+	if (logd_limits == NULL) {
+		logd_limits = g_hash_table_new(g_str_hash, g_str_equal);
+		logd_lspam.id = "logd";
+		logd_lspam.max = logd_config.ratelimit;
+		logd_lspam.window = logd_config.ratewindow;
+		logd_lspam.reset_time = logd_config.ratewindow;
+		logd_lspam.advice = "";
+	}
+	if ((lim = g_hash_table_lookup(logd_limits, entity)) != NULL
+	||	g_hash_table_size(logd_limits) >= LOGD_MAXENTITIES) {
+		return lim;
+	}
+	if ((lim = malloc(sizeof(*lim))) == NULL) {
+		return NULL;
+	}
+	if ((lim->ml = cl_limit_log_new(&logd_lspam)) == NULL) {
+		free(lim);
+		return NULL;
+	}
+	lim->dropped = 0;
+	g_hash_table_insert(logd_limits, strdup(entity), lim);
+	return lim;
+}
+
+static gboolean
+logd_shed_timeout(gpointer data)
+{
+	IPC_Channel*	logchan = data;
+	long		qlen = logchan->send_queue->current_qlen;
+	long		max = logchan->send_queue->max_qlen;
+
+	if (qlen >= max / 4) {
+		return TRUE;
+	}
+	cl_log(LOG_WARNING, "%lu low priority messages were dropped"
+	" while the write process was behind", logd_shed);
+	logd_shed = 0;
+	logd_shed_timer = 0;
+	return FALSE;
+}
+
+static gboolean
+logd_admit(ha_logd_client_t* client, int priority, const char* entity)
+{
+	IPC_Channel*		logchan = client->logchan;
+	long			qlen = logchan->send_queue->current_qlen;
+	long			max = logchan->send_queue->max_qlen;
+	struct logd_limit*	lim;
+	gboolean		started;
+
+	if (priority <= LOG_WARNING) {
+		return TRUE;
+	}
+	if ((priority >= LOG_DEBUG && qlen >= max / 2)
+	||	qlen >= (max * 3) / 4) {
+		client->shed++;
+		logd_shed++;
+		if (!logd_shed_timer) {
+			logd_shed_timer = Gmain_timeout_add(LOGD_SHED_CHECK_MS
+			,	logd_shed_timeout, logchan);
+		}
+		return FALSE;
+	}
+	if (logd_config.ratelimit <= 0
+	||	(lim = logd_limit_get(entity)) == NULL) {
+		return TRUE;
+	}
+	if (!cl_limit_log_allow(lim->ml, time(NULL), &started)) {
+		if (started) {
+			cl_log(LOG_WARNING, "%s logs too much, dropping its"
+			" notice, info and debug messages for %ld seconds"
+			,	entity, (long)logd_config.ratewindow);
+		}
+		lim->dropped++;
+		client->shed++;
+		return FALSE;
+	}
+	if (lim->dropped) {
+		cl_log(LOG_INFO, "%lu messages of %s were dropped"
+		,	lim->dropped, entity);
+		lim->dropped = 0;
+	}
+	return TRUE;
+}
+
+/* tell a client which sent LD_HELLO that we take binary records */
+static void
+logd_answer_hello(IPC_Channel* ch)
+{
+	unsigned char	version = LD_REC_V1;
+	IPC_Message*	msg;
+
+	msg = ch->ops->new_ipcmsg(ch, &version, 1, NULL);
+	if (msg && ch->ops->send(ch, msg) != IPC_OK) {
+		msg->msg_done(msg);
+	}
+}
+
+/* pass a binary record on with our entity id */
+static void
+logd_forward_rec(ha_logd_client_t* client, IPC_Message* ipcmsg)
+{
+	IPC_Channel*		logchan = client->logchan;
+	IPC_Message*		out;
+	struct cl_logrec	rec;
+	struct logd_entity*	ent;
+	size_t			maxlen;
+	int			len;
+
+	if (cl_logrec_decode(ipcmsg->msg_body, ipcmsg->msg_len, &rec)
+	!=	HA_OK) {
+		cl_log(LOG_ERR, "%s: bad log record from [%s:%d]"
+		,	__FUNCTION__, client->app_name, client->pid);
+		return;
+	}
+	if (rec.flags & LD_REC_ENTITY) {
+		client->rec_id = rec.entity_id;
+		client->entity = logd_entity_get(client, rec.entity
+		,	rec.entity_len);
+		if (client->app_name[0] == '\0') {
+			strncpy(client->app_name, client->entity->name
+			,	MAXENTITY);
+		}
+	}else if (client->entity == NULL || rec.entity_id != client->rec_id) {
+		cl_log(LOG_ERR, "%s: unknown entity %u from [%s:%d]"
+		,	__FUNCTION__, rec.entity_id
+		,	client->app_name, client->pid);
+		return;
+	}
+	ent = client->entity;
+	if (!logd_admit(client, rec.priority, ent->name)) {
+		return;
+	}
+	rec.entity_id = ent->id;
+	rec.flags &= ~LD_REC_ENTITY;
+	if (ent->id == 0 || !ent->defined) {
+		rec.flags |= LD_REC_ENTITY;
+		rec.entity = ent->name;
+		rec.entity_len = strlen(ent->name);
+	}
+
+	maxlen = cl_logrec_maxlen(&rec);
+	out = logchan->ops->new_ipcmsg(logchan, NULL, maxlen, NULL);
+	if (out == NULL) {
+		return;
+	}
+	if ((len = cl_logrec_encode(&rec, out->msg_body, maxlen)) < 0) {
+		out->msg_done(out);
+		return;
+	}
+	out->msg_len = len;
+	if (logchan->ops->send(logchan, out) != IPC_OK) {
+		cl_log(LOG_ERR
+		,	"%s: forwarding msg from [%s:%d] to"
+		" write process failed"
+		,	__FUNCTION__
+		,	client->app_name, client->pid);
+		out->msg_done(out);
+		return;
+	}
+	ent->defined = TRUE;
+}
+
 static gboolean
 on_receive_cmd (IPC_Channel* ch, gpointer user_data)
 {
@@ -427,7 +815,27 @@ on_receive_cmd (IPC_Channel* ch, gpointer user_data)
 		return FALSE;
 	}
 	
-	if( ipcmsg->msg_body &&	ipcmsg->msg_len > 0 ){
+	if (ipcmsg->msg_body && ipcmsg->msg_len > 0
+	&&	*(unsigned char*)ipcmsg->msg_body == LD_REC_V1) {
+		if (!IPC_ISWCONN(logchan)){
+			cl_log(LOG_ERR
+			,	"%s: channel to write process disconnected"
+			,	__FUNCTION__);
+			return FALSE;
+		}
+		logd_forward_rec(client, ipcmsg);
+		ipcmsg->msg_done(ipcmsg);
+
+	}else if (logd_msgtype(ipcmsg) == LD_HELLO) {
+		if (client->app_name[0] == '\0'){
+			LogDaemonMsgHdr*	logmsghdr;
+			logmsghdr = (LogDaemonMsgHdr*) ipcmsg->msg_body;
+			strncpy(client->app_name, logmsghdr->entity, MAXENTITY);
+		}
+		logd_answer_hello(ch);
+		ipcmsg->msg_done(ipcmsg);
+
+	}else if( ipcmsg->msg_body &&	ipcmsg->msg_len > 0 ){
 		
 		if (client->app_name[0] == '\0'){
 			LogDaemonMsgHdr*	logmsghdr;
@@ -441,6 +849,21 @@ on_receive_cmd (IPC_Channel* ch, gpointer user_data)
 			,	__FUNCTION__);
 			return FALSE;
 		}
+		if (logd_msgtype(ipcmsg) == LD_LOGIT) {
+			int	priority;
+			char	entity[MAXENTITY];
+
+			memcpy(&priority, (char*)ipcmsg->msg_body
+			+	offsetof(LogDaemonMsgHdr, priority)
+			,	sizeof(priority));
+			memcpy(entity, (char*)ipcmsg->msg_body
+			+	offsetof(LogDaemonMsgHdr, entity), MAXENTITY);
+			entity[MAXENTITY-1] = EOS;
+			if (!logd_admit(client, priority, entity)) {
+				ipcmsg->msg_done(ipcmsg);
+				goto getout;
+			}
+		}
 		if (logchan->ops->send(logchan, ipcmsg) != IPC_OK){
 			cl_log(LOG_ERR
 			,	"%s: forwarding msg from [%s:%d] to"
@@ -734,6 +1157,8 @@ static gboolean
 logd_hup_action(int sig, gpointer userdata)
 {
 	cl_log_close_log_files();
+	logd_journal_close();
+	logd_shard_close();
 	if (write_process_pid)
 		/* do we want to propagate the HUP,
 		 * or do we assume that it was a killall anyways? */
@@ -743,6 +1168,36 @@ logd_hup_action(int sig, gpointer userdata)
 	return TRUE;
 }
 
+/*
+ * Handle SIGUSR1 to log the IPC statistics. The read process logs its
+ * client channels and the one to the write process, then passes the
+ * signal on so that the write process logs its end.
+ */
+static gboolean
+logd_usr1_action(int sig, gpointer userdata)
+{
+	GList*	gl;
+	char	name[MAXENTITY + 64];
+
+	if (!write_process_pid) {
+		ipc_chanstats_log(chanspair[WRITE_PROC_CHAN]
+		,	"write process: from read process", LOG_INFO);
+		return TRUE;
+	}
+	for (gl = g_list_first(logd_client_list); gl != NULL
+	;	gl = g_list_next(gl)) {
+		ha_logd_client_t* client = gl->data;
+
+		snprintf(name, sizeof(name), "client %s[%d] (%lu shed)"
+		,	client->app_name, client->pid, client->shed);
+		ipc_chanstats_log(client->chan, name, LOG_INFO);
+	}
+	ipc_chanstats_log(chanspair[READ_PROC_CHAN]
+	,	"read process: to write process", LOG_INFO);
+	CL_KILL(write_process_pid, SIGUSR1);
+	return TRUE;
+}
+
 static void
 read_msg_process(IPC_Channel* chan)
 {
@@ -783,81 +1238,295 @@ read_msg_process(IPC_Channel* chan)
 	
 	G_main_add_SignalHandler(G_PRIORITY_DEFAULT, SIGHUP, 
 				 logd_hup_action, mainloop, NULL);
+	G_main_add_SignalHandler(G_PRIORITY_DEFAULT, SIGUSR1, 
+				 logd_usr1_action, mainloop, NULL);
 	g_main_run(mainloop);
 	
 	return;
 }
 
+/*
+ * Group commit: the log files are written at the end of every backlog,
+ * they are fsynced when the backlog had a message of fsyncpriority or
+ * worse, but no more often than every fsyncinterval ms. A sync which
+ * comes too early is left to a timer.
+ */
+static gboolean		fsync_pending = FALSE;
+static guint		fsync_timer = 0;
+static longclock_t	last_fsync;
+
+/*
+ * The binary journal: the records as they came in, each after its
+ * length (4 bytes, network byte order). The entity name goes with the
+ * first record of each entity in a file, the file can be read with
+ * cl_logrec_decode().
+ */
+static FILE*		journal_fp = NULL;
+static GHashTable*	journal_ids = NULL;	/* entities in journal_fp */
+static GHashTable*	write_entities = NULL;	/* id -> name */
+
+static void
+logd_journal_close(void)
+{
+	if (journal_fp) {
+		fclose(journal_fp);
+		journal_fp = NULL;
+	}
+	if (journal_ids) {
+		g_hash_table_destroy(journal_ids);
+		journal_ids = NULL;
+	}
+}
+
+static void
+logd_journal_write(struct cl_logrec* rec, const char* entity)
+{
+	static char*	buf = NULL;
+	static size_t	bufsize = 0;
+	size_t		maxlen;
+	uint32_t	nlen;
+	int		len;
+	gpointer	id = GUINT_TO_POINTER(rec->entity_id);
+
+	if (journal_fp == NULL) {
+		if ((journal_fp = fopen(logd_config.journal, "a")) == NULL) {
+			return;
+		}
+		journal_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	rec->flags &= ~LD_REC_ENTITY;
+	if (rec->entity_id == 0
+	||	g_hash_table_lookup(journal_ids, id) == NULL) {
+		rec->flags |= LD_REC_ENTITY;
+		rec->entity = entity;
+		rec->entity_len = strlen(entity);
+		if (rec->entity_id != 0) {
+			g_hash_table_insert(journal_ids, id, id);
+		}
+	}
+	maxlen = cl_logrec_maxlen(rec);
+	if (maxlen > bufsize) {
+		free(buf);
+		bufsize = 0;
+		if ((buf = malloc(maxlen)) == NULL) {
+			return;
+		}
+		bufsize = maxlen;
+	}
+	if ((len = cl_logrec_encode(rec, buf, bufsize)) < 0) {
+		return;
+	}
+	nlen = htonl((uint32_t)len);
+	if (fwrite(&nlen, sizeof(nlen), 1, journal_fp) != 1
+	||	fwrite(buf, len, 1, journal_fp) != 1) {
+		cl_perror("%s: write to %s failed"
+		,	__FUNCTION__, logd_config.journal);
+	}
+}
+
+/* a binary record from the read process */
+static int
+logd_write_rec(IPC_Message* ipcmsg)
+{
+	struct cl_logrec	rec;
+	char			entity[MAXENTITY];
+	const char*		name;
+	size_t			len;
+
+	if (cl_logrec_decode(ipcmsg->msg_body, ipcmsg->msg_len, &rec)
+	!=	HA_OK) {
+		cl_log(LOG_ERR, "%s: bad log record", __FUNCTION__);
+		return LOG_DEBUG + 1;
+	}
+	if (write_entities == NULL) {
+		write_entities = g_hash_table_new_full(g_direct_hash
+		,	g_direct_equal, NULL, free);
+	}
+	if (rec.flags & LD_REC_ENTITY) {
+		len = rec.entity_len < MAXENTITY ? rec.entity_len : MAXENTITY-1;
+		memcpy(entity, rec.entity, len);
+		entity[len] = EOS;
+		if (rec.entity_id != 0) {
+			g_hash_table_replace(write_entities
+			,	GUINT_TO_POINTER(rec.entity_id), strdup(entity));
+		}
+		name = entity;
+	}else{
+		name = g_hash_table_lookup(write_entities
+		,	GUINT_TO_POINTER(rec.entity_id));
+		if (name == NULL) {
+			name = "unknown";
+		}
+	}
+	cl_direct_log(rec.priority, rec.text, rec.flags & LD_REC_PRISTR
+	,	name, rec.pid, rec.timestamp);
+	logd_shard_log(rec.priority, name, rec.pid, rec.timestamp
+	,	rec.flags & LD_REC_PRISTR ? prio2str(rec.priority) : NULL
+	,	rec.text);
+	if (*logd_config.journal) {
+		logd_journal_write(&rec, name);
+	}
+	return rec.priority;
+}
+
+static void
+logd_fsync(void)
+{
+	cl_log_do_fflush(TRUE);
+	logd_shard_flush(TRUE);
+	if (journal_fp) {
+		fflush(journal_fp);
+		fsync(fileno(journal_fp));
+	}
+	fsync_pending = FALSE;
+	last_fsync = time_longclock();
+}
+
 static gboolean
-direct_log(IPC_Channel* ch, gpointer user_data)
+logd_fsync_timeout(gpointer data)
 {
-	IPC_Message*		ipcmsg;
+	fsync_timer = 0;
+	if (fsync_pending) {
+		logd_fsync();
+	}
+	return FALSE;
+}
+
+static void
+logd_flush(int pri)
+{
+	unsigned long	elapsed;
+
+	if (pri <= logd_config.fsyncpriority) {
+		fsync_pending = TRUE;
+	}
+	if (!fsync_pending) {
+		cl_log_do_fflush(FALSE);
+		logd_shard_flush(FALSE);
+		if (journal_fp) {
+			fflush(journal_fp);
+		}
+		return;
+	}
+	elapsed = longclockto_ms(sub_longclock(time_longclock(), last_fsync));
+	if (elapsed >= logd_config.fsyncinterval) {
+		logd_fsync();
+		return;
+	}
+	cl_log_do_fflush(FALSE);
+	logd_shard_flush(FALSE);
+	if (journal_fp) {
+		fflush(journal_fp);
+	}
+	if (!fsync_timer) {
+		fsync_timer = Gmain_timeout_add(
+			logd_config.fsyncinterval - elapsed
+		,	logd_fsync_timeout, NULL);
+	}
+}
+
+/* log one message from the read process, returns its priority */
+static int
+logd_write_msg(IPC_Message* ipcmsg)
+{
+	int	pri = LOG_DEBUG + 1;
+
+	if (ipcmsg->msg_body && ipcmsg->msg_len > 0
+	&&	*(unsigned char*)ipcmsg->msg_body == LD_REC_V1) {
+		pri = logd_write_rec(ipcmsg);
+
+	}else if( ipcmsg->msg_body 
+	    && ipcmsg->msg_len > 0 ){
+		LogDaemonMsgHdr *logmsghdr;
+		LogDaemonMsgHdr	copy;
+		char *msgtext;
+		
+		logmsghdr = (LogDaemonMsgHdr*) ipcmsg->msg_body;
+		/* this copy nonsense is here because apparently ia64
+		 * complained about "unaligned memory access. */
+#define	COPYFIELD(copy, msg, field) memcpy(((u_char*)&copy.field), ((u_char*)&msg->field), sizeof(copy.field))
+		COPYFIELD(copy, logmsghdr, use_pri_str);
+		COPYFIELD(copy, logmsghdr, entity);
+		COPYFIELD(copy, logmsghdr, entity_pid);
+		COPYFIELD(copy, logmsghdr, timestamp);
+		COPYFIELD(copy, logmsghdr, priority);
+		/* Don't want to copy the following message text */
+	
+		msgtext = (char *)logmsghdr + sizeof(LogDaemonMsgHdr);
+		cl_direct_log(copy.priority, msgtext
+		,	copy.use_pri_str
+		,	copy.entity, copy.entity_pid
+		,	copy.timestamp);
+		logd_shard_log(copy.priority, copy.entity
+		,	copy.entity_pid, copy.timestamp
+		,	copy.use_pri_str ? prio2str(copy.priority) : NULL
+		,	msgtext);
+
+		pri = copy.priority;
+
+		(void)logd_log;
+/*
+		if (verbose){
+			logd_log("%s[%d]: %s %s\n", 
+				 logmsg->entity[0]=='\0'?
+				 "unknown": copy.entity,
+				 copy.entity_pid, 
+				 ha_timestamp(copy.timestamp),
+				 msgtext);
+			 }
+ */
+	}
+	if (ipcmsg->msg_done){
+		ipcmsg->msg_done(ipcmsg);
+	}
+	return pri;
+}
+
+/*
+ * The messages come in batches (see G_main_add_IPC_Channel_batch);
+ * whatever else is pending is taken too, a batch per read, before
+ * the files are flushed.
+ */
+static gboolean
+direct_log(IPC_Channel* ch, IPC_Message** msgs, int nmsgs
+,	gpointer user_data)
+{
+	IPC_Message*		more[G_CH_BATCH_MAX];
 	GMainLoop*		loop;
 	int			pri = LOG_DEBUG + 1;
+	int			recpri;
+	int			j;
 
 	loop =(GMainLoop*)user_data;
-	
-	while(ch->ops->is_message_pending(ch)){
-		if (ch->ch_status == IPC_DISCONNECT){
+
+	for (;;) {
+		for (j = 0; j < nmsgs; j++) {
+			recpri = logd_write_msg(msgs[j]);
+			if (recpri < pri)
+				pri = recpri;
+		}
+		if (ch->ch_status == IPC_DISCONNECT
+		&&	ch->recv_queue->current_qlen == 0) {
 			cl_log(LOG_ERR, "read channel is disconnected:"
 			       "something very wrong happened");
 			return FALSE;
 		}
-		
-		ipcmsg = getIPCmsg(ch);
-		if (ipcmsg == NULL){
-			return TRUE;
-		}
-		
-		if( ipcmsg->msg_body 
-		    && ipcmsg->msg_len > 0 ){
-			LogDaemonMsgHdr *logmsghdr;
-			LogDaemonMsgHdr	copy;
-			char *msgtext;
-			
-			logmsghdr = (LogDaemonMsgHdr*) ipcmsg->msg_body;
-			/* this copy nonsense is here because apparently ia64
-			 * complained about "unaligned memory access. */
-#define	COPYFIELD(copy, msg, field) memcpy(((u_char*)&copy.field), ((u_char*)&msg->field), sizeof(copy.field))
-			COPYFIELD(copy, logmsghdr, use_pri_str);
-			COPYFIELD(copy, logmsghdr, entity);
-			COPYFIELD(copy, logmsghdr, entity_pid);
-			COPYFIELD(copy, logmsghdr, timestamp);
-			COPYFIELD(copy, logmsghdr, priority);
-			/* Don't want to copy the following message text */
-		
-			msgtext = (char *)logmsghdr + sizeof(LogDaemonMsgHdr);
-			cl_direct_log(copy.priority, msgtext
-			,	copy.use_pri_str
-			,	copy.entity, copy.entity_pid
-			,	copy.timestamp);
-
-			if (copy.priority < pri)
-				pri = copy.priority;
-
-			(void)logd_log;
-/*
-			if (verbose){
-				logd_log("%s[%d]: %s %s\n", 
-					 logmsg->entity[0]=='\0'?
-					 "unknown": copy.entity,
-					 copy.entity_pid, 
-					 ha_timestamp(copy.timestamp),
-					 msgtext);
-				 }
- */
-			if (ipcmsg->msg_done){
-				ipcmsg->msg_done(ipcmsg);
-			}
+		if (!ch->ops->is_message_pending(ch)
+		||	ch->ops->recv_batch(ch, more, G_CH_BATCH_MAX, &nmsgs)
+		!=	IPC_OK) {
+			break;
 		}
+		msgs = more;
 	}
 	/* current message backlog processed,
 	 * about to return to mainloop,
 	 * fflush and potentially fsync stuff */
-	cl_log_do_fflush(pri <= LOG_ERR);
+	logd_flush(pri);
 
 	if(needs_shutdown) {
 		cl_log(LOG_INFO, "Exiting write process");
+		logd_fsync();
+		logd_shard_stop();
 		g_main_quit(loop);
 		return FALSE;
 	}
@@ -875,7 +1544,7 @@ logd_term_write_action(int sig, gpointer userdata)
 	cl_log(LOG_DEBUG, "Writing out %d messages then quitting",
 	       (int)chanspair[WRITE_PROC_CHAN]->recv_queue->current_qlen);
 
-	direct_log(chanspair[WRITE_PROC_CHAN], userdata);
+	direct_log(chanspair[WRITE_PROC_CHAN], NULL, 0, userdata);
 
 	return TRUE;
 }
@@ -889,8 +1558,10 @@ write_msg_process(IPC_Channel* readchan)
 	
 	
 	mainloop = g_main_new(FALSE);   
+	logd_shard_init(logd_config.logfile, logd_config.debugfile
+	,	logd_config.logmode);
 	
-	G_main_add_IPC_Channel(G_PRIORITY_DEFAULT,
+	G_main_add_IPC_Channel_batch(G_PRIORITY_DEFAULT,
 			       ch, FALSE,
 			       direct_log, mainloop, NULL);
 
@@ -899,6 +1570,8 @@ write_msg_process(IPC_Channel* readchan)
 				 
 	G_main_add_SignalHandler(G_PRIORITY_DEFAULT, SIGHUP, 
 				 logd_hup_action, mainloop, NULL);
+	G_main_add_SignalHandler(G_PRIORITY_DEFAULT, SIGUSR1, 
+				 logd_usr1_action, mainloop, NULL);
 	
 	g_main_run(mainloop);
 	
@@ -1060,6 +1733,7 @@ main(int argc, char** argv, char** envp)
 	case 0:
 		/*child*/
 		cl_log_use_buffered_io(1);
+		cl_log_use_batched_io(logd_config.logbufsize);
 		set_proc_title("ha_logd: write process");
 		write_msg_process(chanspair[WRITE_PROC_CHAN]);		
 		break;
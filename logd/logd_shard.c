@@ -0,0 +1,802 @@
+/*
+ * logd_shard.c: per entity/priority log files of the logging daemon
+ *
+ * With "logdir", the write process also writes each message to a file
+ * of its own entity (or priority) in that directory. Those files are
+ * rotated by logd itself: when they grow past "rotatesize" bytes or
+ * get older than "rotateinterval" seconds they are renamed to
+ * <name>.<date>-<time> and, with "rotatecompress", compressed to a
+ * .gz or .bz2 file from the main loop when it is idle.
+ *
+ * Files moved away by somebody else (logrotate) are noticed through
+ * inotify on their directories, for the plain log files too. Without
+ * inotify we look once a minute, like cl_log does.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#endif
+#include <zlib.h>
+#include <bzlib.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include "logd_shard.h"
+
+#define	SHARD_BUFSIZE	(64*1024)	/* lines batched per file */
+#define	SHARD_MAX	256		/* open files, the rest is "other" */
+#define	SHARD_CHECKTIME	60		/* s between stat()s w/o inotify */
+#define	COMPRESS_BLOCK	(256*1024)
+#define	SHARD_SUFFIXES	100		/* rotated names per second */
+
+enum shard_split { SPLIT_ENTITY, SPLIT_PRIORITY };
+enum shard_compress { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_BZIP2 };
+
+static char			shard_dir[MAXLINE] = "";
+static mode_t			shard_mode = 0644;
+static enum shard_split		shard_split = SPLIT_ENTITY;
+static unsigned long long	rotate_size = 0;
+static unsigned long		rotate_interval = 0;
+static enum shard_compress	rotate_compress = COMPRESS_NONE;
+
+struct logd_shard {
+	char	path[MAXLINE];
+	int	fd;
+	ino_t	ino;
+	off_t	size;		/* written so far, wlen comes on top */
+	TIME_T	opened;
+	TIME_T	rotate_failed;	/* all names of this second were taken */
+	char*	wbuf;
+	size_t	wlen;
+};
+
+static GHashTable*	shards = NULL;	/* key -> struct logd_shard */
+/* names in shard_dir which we moved or removed ourselves -> how often;
+ * the inotify events for those are ours, see shard_inotify() */
+static GHashTable*	self_moved = NULL;
+#ifdef HAVE_SYS_INOTIFY_H
+static int		shard_wd = -1;
+#endif
+
+static void
+shard_moved(const char * path)
+{
+	const char*	name;
+	gpointer	n;
+
+	if (self_moved == NULL) {
+		return;
+	}
+	name = (name = strrchr(path, '/')) != NULL ? name + 1 : path;
+	n = g_hash_table_lookup(self_moved, name);
+	if (n == NULL) {
+		g_hash_table_insert(self_moved, strdup(name)
+		,	GINT_TO_POINTER(1));
+	}else{
+		g_hash_table_replace(self_moved, strdup(name)
+		,	GINT_TO_POINTER(GPOINTER_TO_INT(n) + 1));
+	}
+}
+
+int
+set_logdir(const char * option)
+{
+	struct stat	st;
+
+	if (!option || stat(option, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		cl_log(LOG_ERR, "Invalid log directory [%s]"
+		,	option ? option : "");
+		return FALSE;
+	}
+	cl_log(LOG_INFO, "setting log directory to %s", option);
+	strncpy(shard_dir, option, MAXLINE);
+	shard_dir[MAXLINE-1] = EOS;
+	return TRUE;
+}
+
+int
+set_logsplit(const char * option)
+{
+	if (option && strcmp(option, "entity") == 0) {
+		shard_split = SPLIT_ENTITY;
+	}else if (option && strcmp(option, "priority") == 0) {
+		shard_split = SPLIT_PRIORITY;
+	}else{
+		cl_log(LOG_ERR, "Invalid logsplit [%s]"
+		,	option ? option : "");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int
+set_rotatesize(const char * option)
+{
+	unsigned long long	size;
+	char*			endptr;
+
+	if (!option) {
+		return FALSE;
+	}
+	size = strtoull(option, &endptr, 10);
+	switch (*endptr) {
+	case 'k': case 'K':	size <<= 10; endptr++; break;
+	case 'm': case 'M':	size <<= 20; endptr++; break;
+	case 'g': case 'G':	size <<= 30; endptr++; break;
+	}
+	if (*endptr != EOS) {
+		cl_log(LOG_ERR, "Invalid rotate size [%s]", option);
+		return FALSE;
+	}
+	rotate_size = size;
+	return TRUE;
+}
+
+int
+set_rotateinterval(const char * option)
+{
+	long	secs;
+	char*	endptr;
+
+	if (!option) {
+		return FALSE;
+	}
+	secs = strtol(option, &endptr, 10);
+	if (*endptr != EOS || secs < 0) {
+		cl_log(LOG_ERR, "Invalid rotate interval [%s]", option);
+		return FALSE;
+	}
+	rotate_interval = secs;
+	return TRUE;
+}
+
+/* "zlib" and "bz2" are the names of the compress plugins */
+int
+set_rotatecompress(const char * option)
+{
+	if (!option || strcmp(option, "none") == 0) {
+		rotate_compress = COMPRESS_NONE;
+	}else if (strcmp(option, "gzip") == 0 || strcmp(option, "zlib") == 0) {
+		rotate_compress = COMPRESS_GZIP;
+	}else if (strcmp(option, "bzip2") == 0 || strcmp(option, "bz2") == 0) {
+		rotate_compress = COMPRESS_BZIP2;
+	}else{
+		cl_log(LOG_ERR, "Invalid rotate compression [%s]", option);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Compression of rotated files, to <name>.gz or <name>.bz2 as gzip or
+ * bzip2 would write them. The file is read in blocks of COMPRESS_BLOCK
+ * bytes, one per idle call; the original is removed when all is done.
+ */
+static GQueue*	compress_todo = NULL;
+static guint	compress_idle_id = 0;
+static struct {
+	char*		src;
+	char		tmp[MAXLINE];
+	int		in;
+	int		out;
+	char*		ibuf;
+	char*		obuf;
+	gboolean	streaming;	/* z or bz set up */
+	z_stream	z;
+	bz_stream	bz;
+} cjob = { NULL, "", -1, -1, NULL, NULL, FALSE };
+
+static const char *
+compress_suffix(void)
+{
+	return rotate_compress == COMPRESS_GZIP ? "gz" : "bz2";
+}
+
+static void
+compress_stream_end(void)
+{
+	if (!cjob.streaming) {
+		return;
+	}
+	if (rotate_compress == COMPRESS_GZIP) {
+		deflateEnd(&cjob.z);
+	}else{
+		BZ2_bzCompressEnd(&cjob.bz);
+	}
+	cjob.streaming = FALSE;
+}
+
+static void
+compress_end(gboolean ok)
+{
+	char	dst[MAXLINE];
+
+	compress_stream_end();
+	close(cjob.in);
+	if (cjob.out >= 0 && close(cjob.out) < 0) {
+		ok = FALSE;
+	}
+	if (ok) {
+		snprintf(dst, sizeof(dst), "%s.%s", cjob.src
+		,	compress_suffix());
+		if (rename(cjob.tmp, dst) < 0) {
+			cl_perror("%s: rename %s", __FUNCTION__, cjob.tmp);
+			ok = FALSE;
+		}else{
+			shard_moved(cjob.tmp);
+			if (unlink(cjob.src) == 0) {
+				shard_moved(cjob.src);
+			}
+		}
+	}
+	if (!ok) {
+		if (unlink(cjob.tmp) == 0) {
+			shard_moved(cjob.tmp);
+		}
+		cl_log(LOG_WARNING, "%s left uncompressed", cjob.src);
+	}
+	free(cjob.src);
+	cjob.src = NULL;
+	cjob.in = cjob.out = -1;
+}
+
+static gboolean
+compress_start(void)
+{
+	if (cjob.ibuf == NULL) {
+		cjob.ibuf = malloc(COMPRESS_BLOCK);
+		cjob.obuf = malloc(COMPRESS_BLOCK);
+		if (cjob.ibuf == NULL || cjob.obuf == NULL) {
+			free(cjob.ibuf);
+			free(cjob.obuf);
+			cjob.ibuf = cjob.obuf = NULL;
+			return FALSE;
+		}
+	}
+	cjob.src = g_queue_pop_head(compress_todo);
+	snprintf(cjob.tmp, sizeof(cjob.tmp), "%s.%s.tmp", cjob.src
+	,	compress_suffix());
+	if ((cjob.in = open(cjob.src, O_RDONLY)) < 0) {
+		cl_perror("%s: open %s", __FUNCTION__, cjob.src);
+		free(cjob.src);
+		cjob.src = NULL;
+		return TRUE;
+	}
+	if ((cjob.out = open(cjob.tmp, O_WRONLY|O_CREAT|O_TRUNC, shard_mode))
+	<	0) {
+		cl_perror("%s: open %s", __FUNCTION__, cjob.tmp);
+		compress_end(FALSE);
+		return TRUE;
+	}
+	fcntl(cjob.in, F_SETFD, FD_CLOEXEC);
+	fcntl(cjob.out, F_SETFD, FD_CLOEXEC);
+	if (rotate_compress == COMPRESS_GZIP) {
+		memset(&cjob.z, 0, sizeof(cjob.z));
+		/* 16 more window bits: gzip header and trailer */
+		cjob.streaming = deflateInit2(&cjob.z, Z_DEFAULT_COMPRESSION
+		,	Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	}else{
+		memset(&cjob.bz, 0, sizeof(cjob.bz));
+		cjob.streaming = BZ2_bzCompressInit(&cjob.bz, 9, 0, 0) == BZ_OK;
+	}
+	if (!cjob.streaming) {
+		cl_log(LOG_ERR, "%s: cannot compress %s", __FUNCTION__
+		,	cjob.src);
+		compress_end(FALSE);
+	}
+	return TRUE;
+}
+
+static gboolean
+compress_write(size_t len)
+{
+	size_t	done = 0;
+	ssize_t	rc;
+
+	while (done < len) {
+		rc = write(cjob.out, cjob.obuf + done, len - done);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cl_perror("%s: write %s", __FUNCTION__, cjob.tmp);
+			return FALSE;
+		}
+		done += rc;
+	}
+	return TRUE;
+}
+
+/* returns 1 when the stream is finished, -1 on error */
+static int
+gzip_block(size_t len, gboolean last)
+{
+	int	rc;
+
+	cjob.z.next_in = (Bytef*)cjob.ibuf;
+	cjob.z.avail_in = len;
+	do {
+		cjob.z.next_out = (Bytef*)cjob.obuf;
+		cjob.z.avail_out = COMPRESS_BLOCK;
+		rc = deflate(&cjob.z, last ? Z_FINISH : Z_NO_FLUSH);
+		if (rc == Z_STREAM_ERROR
+		||	!compress_write(COMPRESS_BLOCK - cjob.z.avail_out)) {
+			return -1;
+		}
+	}while (cjob.z.avail_out == 0);
+	return rc == Z_STREAM_END;
+}
+
+static int
+bzip2_block(size_t len, gboolean last)
+{
+	int	rc;
+
+	cjob.bz.next_in = cjob.ibuf;
+	cjob.bz.avail_in = len;
+	do {
+		cjob.bz.next_out = cjob.obuf;
+		cjob.bz.avail_out = COMPRESS_BLOCK;
+		rc = BZ2_bzCompress(&cjob.bz, last ? BZ_FINISH : BZ_RUN);
+		if (rc < 0
+		||	!compress_write(COMPRESS_BLOCK - cjob.bz.avail_out)) {
+			return -1;
+		}
+	}while (last ? rc != BZ_STREAM_END : cjob.bz.avail_in > 0);
+	return rc == BZ_STREAM_END;
+}
+
+static int
+compress_block(void)
+{
+	ssize_t	n;
+
+	n = read(cjob.in, cjob.ibuf, COMPRESS_BLOCK);
+	if (n < 0) {
+		cl_perror("%s: read %s", __FUNCTION__, cjob.src);
+		return -1;
+	}
+	/* the end of the file finishes the stream */
+	return rotate_compress == COMPRESS_GZIP
+	?	gzip_block(n, n == 0) : bzip2_block(n, n == 0);
+}
+
+static gboolean
+compress_idle(gpointer data)
+{
+	int	rc;
+
+	if (cjob.src == NULL) {
+		if (compress_todo->length == 0 || !compress_start()) {
+			compress_idle_id = 0;
+			return FALSE;
+		}
+		return TRUE;
+	}
+	if ((rc = compress_block()) != 0) {
+		compress_end(rc > 0);
+	}
+	return TRUE;
+}
+
+static void
+compress_later(const char * path)
+{
+	if (compress_todo == NULL) {
+		compress_todo = g_queue_new();
+	}
+	g_queue_push_tail(compress_todo, strdup(path));
+	if (!compress_idle_id) {
+		compress_idle_id = g_idle_add_full(G_PRIORITY_LOW
+		,	compress_idle, NULL, NULL);
+	}
+}
+
+static void
+shard_write(struct logd_shard * sh, const char * buf, size_t len)
+{
+	size_t	done = 0;
+	ssize_t	rc;
+
+	while (done < len) {
+		rc = write(sh->fd, buf + done, len - done);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cl_perror("%s: write %s", __FUNCTION__, sh->path);
+			break;
+		}
+		done += rc;
+	}
+	sh->size += done;
+}
+
+static void
+shard_flush(struct logd_shard * sh, int do_fsync)
+{
+	if (sh->fd < 0) {
+		return;
+	}
+	shard_write(sh, sh->wbuf, sh->wlen);
+	sh->wlen = 0;
+	if (do_fsync) {
+		fsync(sh->fd);
+	}
+}
+
+static void
+shard_close(struct logd_shard * sh)
+{
+	if (sh->fd < 0) {
+		return;
+	}
+	shard_flush(sh, TRUE);
+	close(sh->fd);
+	sh->fd = -1;
+}
+
+static gboolean
+shard_open(struct logd_shard * sh, TIME_T now)
+{
+	struct stat	st;
+
+	sh->fd = open(sh->path, O_WRONLY|O_CREAT|O_APPEND, shard_mode);
+	if (sh->fd < 0) {
+		cl_perror("%s: open %s", __FUNCTION__, sh->path);
+		return FALSE;
+	}
+	fcntl(sh->fd, F_SETFD, FD_CLOEXEC);
+	fstat(sh->fd, &st);
+	sh->ino = st.st_ino;
+	sh->size = st.st_size;
+	sh->opened = now;
+	return TRUE;
+}
+
+/* close it if it's not there anymore */
+static void
+shard_check(gpointer key, gpointer value, gpointer data)
+{
+	struct logd_shard*	sh = value;
+	struct stat		st;
+
+	if (sh->fd >= 0
+	&&	(stat(sh->path, &st) < 0 || st.st_ino != sh->ino)) {
+		shard_close(sh);
+		cl_log(LOG_INFO, "log-rotate detected on logfile %s"
+		,	sh->path);
+	}
+}
+
+static void
+shard_rotate(struct logd_shard * sh, TIME_T now)
+{
+	char		path[MAXLINE];
+	char		stamp[32];
+	struct stat	st;
+	time_t		t = now;
+	int		j;
+
+	if (sh->rotate_failed == now) {
+		return;
+	}
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+	snprintf(path, sizeof(path), "%s.%s", sh->path, stamp);
+	for (j = 1; stat(path, &st) == 0; j++) {
+		if (j == SHARD_SUFFIXES) {
+			/* the stamp is different in a second; till then
+			 * the file just grows */
+			cl_log(LOG_WARNING, "%s: %s rotated %d times in %s"
+			,	__FUNCTION__, sh->path, j, stamp);
+			sh->rotate_failed = now;
+			return;
+		}
+		snprintf(path, sizeof(path), "%s.%s.%d", sh->path, stamp, j);
+	}
+	shard_close(sh);
+	if (rename(sh->path, path) < 0) {
+		cl_perror("%s: rename %s", __FUNCTION__, sh->path);
+		return;
+	}
+	shard_moved(sh->path);
+	if (rotate_compress != COMPRESS_NONE) {
+		compress_later(path);
+	}
+}
+
+/* the file name for an entity, or priority */
+static void
+shard_key(char * key, size_t len, int priority, const char * entity)
+{
+	const char*	name = entity;
+	size_t		j;
+
+	if (shard_split == SPLIT_PRIORITY) {
+		name = prio2str(priority);
+	}
+	if (name == NULL || *name == EOS) {
+		name = "unknown";
+	}
+	for (j = 0; name[j] != EOS && j < len - 1; j++) {
+		key[j] = (isalnum((unsigned char)name[j]) || name[j] == '-'
+		||	name[j] == '_' || (name[j] == '.' && j > 0))
+		?	name[j] : '_';
+	}
+	key[j] = EOS;
+}
+
+static struct logd_shard *
+shard_get(int priority, const char * entity)
+{
+	struct logd_shard*	sh;
+	char			key[MAXLINE];
+
+	shard_key(key, sizeof(key), priority, entity);
+	if ((sh = g_hash_table_lookup(shards, key)) != NULL) {
+		return sh;
+	}
+	if (g_hash_table_size(shards) >= SHARD_MAX) {
+		strncpy(key, "other", sizeof(key));
+		if ((sh = g_hash_table_lookup(shards, key)) != NULL) {
+			return sh;
+		}
+	}
+	if ((sh = malloc(sizeof(*sh))) == NULL) {
+		return NULL;
+	}
+	if ((sh->wbuf = malloc(SHARD_BUFSIZE)) == NULL) {
+		free(sh);
+		return NULL;
+	}
+	snprintf(sh->path, sizeof(sh->path), "%s/%s.log", shard_dir, key);
+	sh->fd = -1;
+	sh->wlen = 0;
+	sh->rotate_failed = 0;
+	g_hash_table_insert(shards, strdup(key), sh);
+	return sh;
+}
+
+static void
+shard_free(gpointer data)
+{
+	struct logd_shard*	sh = data;
+
+	shard_close(sh);
+	free(sh->wbuf);
+	free(sh);
+}
+
+void
+logd_shard_log(int priority, const char * entity, int entity_pid
+,	TIME_T ts, const char * pristr, const char * msg)
+{
+	struct logd_shard*	sh;
+	char*			line;
+	int			len;
+	/* rotation goes by our clock, ts is the client's */
+	TIME_T			now = time(NULL);
+#ifndef HAVE_SYS_INOTIFY_H
+	static TIME_T		last_check = 0;
+#endif
+
+	if (*shard_dir == EOS || (sh = shard_get(priority, entity)) == NULL) {
+		return;
+	}
+#ifndef HAVE_SYS_INOTIFY_H
+	if (now - last_check >= SHARD_CHECKTIME) {
+		g_hash_table_foreach(shards, shard_check, NULL);
+		last_check = now;
+	}
+#endif
+	if (sh->fd < 0 && !shard_open(sh, now)) {
+		return;
+	}
+
+	len = cl_log_format_line(sh->wbuf + sh->wlen, SHARD_BUFSIZE - sh->wlen
+	,	entity, entity_pid, ts, pristr, msg);
+	if (len < 0) {
+		return;
+	}
+	if ((size_t)len >= SHARD_BUFSIZE - sh->wlen) {
+		shard_flush(sh, FALSE);
+		if ((size_t)len < SHARD_BUFSIZE) {
+			sh->wlen = cl_log_format_line(sh->wbuf, SHARD_BUFSIZE
+			,	entity, entity_pid, ts, pristr, msg);
+		}else if ((line = malloc(len + 1)) != NULL) {
+			cl_log_format_line(line, len + 1
+			,	entity, entity_pid, ts, pristr, msg);
+			shard_write(sh, line, len);
+			free(line);
+		}
+	}else{
+		sh->wlen += len;
+	}
+
+	if ((rotate_size && (unsigned long long)sh->size + sh->wlen
+		>= rotate_size)
+	||	(rotate_interval && now - sh->opened >= (TIME_T)rotate_interval)) {
+		shard_rotate(sh, now);
+	}
+}
+
+static void
+shard_flush_one(gpointer key, gpointer value, gpointer data)
+{
+	shard_flush(value, GPOINTER_TO_INT(data));
+}
+
+void
+logd_shard_flush(int do_fsync)
+{
+	if (shards) {
+		g_hash_table_foreach(shards, shard_flush_one
+		,	GINT_TO_POINTER(do_fsync));
+	}
+}
+
+static void
+shard_close_one(gpointer key, gpointer value, gpointer data)
+{
+	shard_close(value);
+}
+
+void
+logd_shard_close(void)
+{
+	if (shards) {
+		g_hash_table_foreach(shards, shard_close_one, NULL);
+	}
+}
+
+void
+logd_shard_stop(void)
+{
+	logd_shard_close();
+	if (cjob.src) {
+		/* the rest is left for the next logd */
+		compress_stream_end();
+		close(cjob.in);
+		close(cjob.out);
+		if (unlink(cjob.tmp) == 0) {
+			shard_moved(cjob.tmp);
+		}
+		free(cjob.src);
+		cjob.src = NULL;
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* ours, if we moved or removed the file (which is then forgotten) */
+static gboolean
+shard_own_event(const struct inotify_event * ev, const char * name)
+{
+	gpointer	n;
+
+	if (ev->wd != shard_wd || ev->len == 0 || self_moved == NULL
+	||	(n = g_hash_table_lookup(self_moved, name)) == NULL) {
+		return FALSE;
+	}
+	if (GPOINTER_TO_INT(n) > 1) {
+		g_hash_table_replace(self_moved, strdup(name)
+		,	GINT_TO_POINTER(GPOINTER_TO_INT(n) - 1));
+	}else{
+		g_hash_table_remove(self_moved, name);
+	}
+	return TRUE;
+}
+
+/* something was moved or removed in one of our directories */
+static gboolean
+shard_inotify(int fd, gpointer user_data)
+{
+	char			buf[4096];
+	struct inotify_event	ev;
+	ssize_t			n;
+	ssize_t			j;
+	gboolean		theirs = FALSE;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (j = 0; j + (ssize_t)sizeof(ev) <= n
+		;	j += sizeof(ev) + ev.len) {
+			memcpy(&ev, buf + j, sizeof(ev));
+			if (!shard_own_event(&ev, buf + j + sizeof(ev))) {
+				theirs = TRUE;
+			}
+		}
+	}
+	/* rotation and compression by us don't need a look */
+	if (!theirs) {
+		return TRUE;
+	}
+	/* which one doesn't matter, stat()ing all of ours is cheap enough */
+	if (shards) {
+		g_hash_table_foreach(shards, shard_check, NULL);
+	}
+	cl_log_check_log_files();
+	return TRUE;
+}
+
+static int
+shard_watch_dir(int fd, const char * file, gboolean isdir)
+{
+	int	wd;
+
+	char	dir[MAXLINE];
+	char*	slash;
+
+	if (file == NULL || *file == EOS) {
+		return -1;
+	}
+	strncpy(dir, file, sizeof(dir));
+	dir[MAXLINE-1] = EOS;
+	if (!isdir) {
+		if ((slash = strrchr(dir, '/')) == NULL) {
+			strncpy(dir, ".", sizeof(dir));
+		}else if (slash == dir) {
+			dir[1] = EOS;
+		}else{
+			*slash = EOS;
+		}
+	}
+	if ((wd = inotify_add_watch(fd, dir, IN_MOVED_FROM|IN_DELETE
+	|	IN_MOVE_SELF|IN_DELETE_SELF)) < 0) {
+		cl_perror("%s: inotify_add_watch %s", __FUNCTION__, dir);
+	}
+	return wd;
+}
+#endif
+
+void
+logd_shard_init(const char * logfile, const char * debugfile, mode_t mode)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	int	fd;
+#endif
+
+	shard_mode = mode;
+	if (*shard_dir) {
+		shards = g_hash_table_new_full(g_str_hash, g_str_equal
+		,	free, shard_free);
+	}
+#ifdef HAVE_SYS_INOTIFY_H
+	if ((fd = inotify_init()) < 0) {
+		cl_perror("%s: inotify_init", __FUNCTION__);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	shard_wd = shard_watch_dir(fd, shard_dir, TRUE);
+	if (shard_wd >= 0) {
+		self_moved = g_hash_table_new_full(g_str_hash, g_str_equal
+		,	free, NULL);
+	}
+	shard_watch_dir(fd, logfile, FALSE);
+	shard_watch_dir(fd, debugfile, FALSE);
+	G_main_add_fd(G_PRIORITY_DEFAULT, fd, FALSE, shard_inotify
+	,	NULL, NULL);
+#endif
+}
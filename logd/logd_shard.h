@@ -0,0 +1,40 @@
+/*
+ * logd_shard.h: per entity/priority log files of the logging daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _LOGD_SHARD_H
+#define _LOGD_SHARD_H
+
+/* config directives, TRUE if the option is good */
+int	set_logdir(const char * option);
+int	set_logsplit(const char * option);
+int	set_rotatesize(const char * option);
+int	set_rotateinterval(const char * option);
+int	set_rotatecompress(const char * option);
+
+/* in the write process, after the config is read; the plain log files
+ * are given to watch them for rotation, mode is the logmode directive */
+void	logd_shard_init(const char * logfile, const char * debugfile
+,	mode_t mode);
+/* pristr NULL: no priority string */
+void	logd_shard_log(int priority, const char * entity, int entity_pid
+,	TIME_T ts, const char * pristr, const char * msg);
+void	logd_shard_flush(int do_fsync);
+/* close all files, they are reopened when written to again */
+void	logd_shard_close(void);
+/* and give up on compressing, before exit */
+void	logd_shard_stop(void);
+
+#endif
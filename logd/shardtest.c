@@ -0,0 +1,421 @@
+/*
+ * shardtest.c: rotation and compression of the logd per entity files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Each case runs in a child of its own, in a new directory under
+ * /tmp which is removed again. The rotated files have to be gzip or
+ * bzip2 files which hold every line exactly once, together with the
+ * file still being written. Exits 1 on failure.
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+
+#include "logd_shard.h"
+
+#define	NLINES		300
+#define	LOGMODE		0640
+#define	LOGNAME		"shardtest.log"
+
+static char	dir[] = "/tmp/shardtestXXXXXX";
+static int	seen[NLINES];
+
+/* skew: of the client's clock */
+static void
+log_lines(int n, long skew)
+{
+	char	msg[32];
+	int	j;
+
+	for (j = 0; j < n; j++) {
+		snprintf(msg, sizeof(msg), "line %d", j);
+		logd_shard_log(LOG_INFO, "shardtest", getpid()
+		,	time(NULL) + skew, "info", msg);
+	}
+	logd_shard_flush(FALSE);
+}
+
+/* count the lines logged by log_lines() */
+static void
+count_lines(GString * text)
+{
+	char*	line;
+	char*	p;
+	int	n;
+
+	for (line = text->str; (p = strstr(line, ": line ")) != NULL; ) {
+		n = atoi(p + 7);
+		if (n >= 0 && n < NLINES) {
+			seen[n]++;
+		}
+		if ((line = strchr(p, '\n')) == NULL) {
+			break;
+		}
+	}
+}
+
+static gboolean
+read_plain(const char * path, GString * text)
+{
+	FILE*	fp;
+	char	buf[4096];
+	size_t	n;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return FALSE;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		g_string_append_len(text, buf, n);
+	}
+	fclose(fp);
+	return TRUE;
+}
+
+static gboolean
+read_gzip(const char * path, GString * text)
+{
+	gzFile	gz;
+	char	buf[4096];
+	int	n;
+
+	if ((gz = gzopen(path, "rb")) == NULL) {
+		return FALSE;
+	}
+	while ((n = gzread(gz, buf, sizeof(buf))) > 0) {
+		g_string_append_len(text, buf, n);
+	}
+	return gzclose(gz) == Z_OK && n == 0;
+}
+
+static gboolean
+read_bzip2(const char * path, GString * text)
+{
+	FILE*	fp;
+	BZFILE*	bz;
+	char	buf[4096];
+	int	bzerr = BZ_OK;
+	int	n;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		return FALSE;
+	}
+	if ((bz = BZ2_bzReadOpen(&bzerr, fp, 0, 0, NULL, 0)) == NULL) {
+		fclose(fp);
+		return FALSE;
+	}
+	while (bzerr == BZ_OK) {
+		n = BZ2_bzRead(&bzerr, bz, buf, sizeof(buf));
+		if (bzerr == BZ_OK || bzerr == BZ_STREAM_END) {
+			g_string_append_len(text, buf, n);
+		}
+	}
+	BZ2_bzReadClose(&n, bz);
+	fclose(fp);
+	return bzerr == BZ_STREAM_END;
+}
+
+static const char *
+endswith(const char * s, const char * suffix)
+{
+	size_t	len = strlen(s);
+	size_t	slen = strlen(suffix);
+
+	return len > slen && strcmp(s + len - slen, suffix) == 0
+	?	s + len - slen : NULL;
+}
+
+/* all files in dir: the rotated ones compressed with suffix */
+static int
+check_files(const char * suffix)
+{
+	DIR*		dp;
+	struct dirent*	de;
+	struct stat	st;
+	char		path[MAXLINE];
+	GString*	text;
+	gboolean	ok;
+	int		rotated = 0;
+	int		failed = 0;
+	int		j;
+
+	memset(seen, 0, sizeof(seen));
+	if ((dp = opendir(dir)) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (*de->d_name == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		text = g_string_new("");
+		if (strcmp(de->d_name, LOGNAME) == 0) {
+			ok = read_plain(path, text);
+		}else if (endswith(de->d_name, suffix) == NULL) {
+			fprintf(stderr, "FAIL: %s: left uncompressed\n", path);
+			ok = FALSE;
+		}else{
+			rotated++;
+			ok = strcmp(suffix, ".gz") == 0
+			?	read_gzip(path, text) : read_bzip2(path, text);
+			if (!ok) {
+				fprintf(stderr, "FAIL: %s: cannot read it\n"
+				,	path);
+			}
+		}
+		if (!ok) {
+			failed = 1;
+		}else if (stat(path, &st) < 0
+		||	(st.st_mode & 0777) != LOGMODE) {
+			fprintf(stderr, "FAIL: %s: mode %o, not %o\n"
+			,	path, st.st_mode & 0777, LOGMODE);
+			failed = 1;
+		}
+		count_lines(text);
+		g_string_free(text, TRUE);
+	}
+	closedir(dp);
+	if (rotated < 2) {
+		fprintf(stderr, "FAIL: rotated %d times\n", rotated);
+		failed = 1;
+	}
+	for (j = 0; j < NLINES; j++) {
+		if (seen[j] != 1) {
+			fprintf(stderr, "FAIL: line %d found %d times\n"
+			,	j, seen[j]);
+			failed = 1;
+			break;
+		}
+	}
+	return failed;
+}
+
+static int
+test_compress(const char * how, const char * suffix)
+{
+	int	failed;
+
+	if (!set_rotatesize("2k") || !set_rotatecompress(how)) {
+		return 1;
+	}
+	logd_shard_init(NULL, NULL, LOGMODE);
+	log_lines(NLINES, 0);
+	/* till the idle compression is through */
+	while (g_main_context_iteration(NULL, FALSE)) {
+		;
+	}
+	logd_shard_stop();
+	failed = check_files(suffix);
+	if (!failed) {
+		printf("ok: rotation with %s\n", how);
+	}
+	return failed;
+}
+
+/*
+ * All names the rotated file could get in the next few seconds are
+ * taken; they must be left alone and the file must not be rotated.
+ */
+static int
+test_names_taken(void)
+{
+	char		path[MAXLINE];
+	char		stamp[32];
+	GString*	text;
+	time_t		now = time(NULL);
+	time_t		t;
+	FILE*		fp;
+	int		failed = 0;
+	int		j;
+
+	for (t = now; t < now + 3; t++) {
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S"
+		,	localtime(&t));
+		for (j = 0; j < 100; j++) {
+			if (j == 0) {
+				snprintf(path, sizeof(path), "%s/%s.%s"
+				,	dir, LOGNAME, stamp);
+			}else{
+				snprintf(path, sizeof(path), "%s/%s.%s.%d"
+				,	dir, LOGNAME, stamp, j);
+			}
+			if ((fp = fopen(path, "w")) == NULL) {
+				perror(path);
+				return 1;
+			}
+			fputs("old\n", fp);
+			fclose(fp);
+		}
+	}
+	if (!set_rotatesize("1")) {
+		return 1;
+	}
+	logd_shard_init(NULL, NULL, LOGMODE);
+	log_lines(10, 0);
+	logd_shard_stop();
+
+	memset(seen, 0, sizeof(seen));
+	snprintf(path, sizeof(path), "%s/%s", dir, LOGNAME);
+	text = g_string_new("");
+	read_plain(path, text);
+	count_lines(text);
+	g_string_free(text, TRUE);
+	for (j = 0; j < 10; j++) {
+		if (seen[j] != 1) {
+			fprintf(stderr, "FAIL: line %d is %d times in %s\n"
+			,	j, seen[j], LOGNAME);
+			failed = 1;
+			break;
+		}
+	}
+	for (t = now; t < now + 3; t++) {
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S"
+		,	localtime(&t));
+		snprintf(path, sizeof(path), "%s/%s.%s.99", dir, LOGNAME
+		,	stamp);
+		text = g_string_new("");
+		if (!read_plain(path, text) || strcmp(text->str, "old\n")) {
+			fprintf(stderr, "FAIL: %s was overwritten\n", path);
+			failed = 1;
+		}
+		g_string_free(text, TRUE);
+	}
+	if (!failed) {
+		printf("ok: no rotation when all names are taken\n");
+	}
+	return failed;
+}
+
+/* the clients' timestamps don't drive the rotation */
+static int
+test_client_clock(void)
+{
+	DIR*		dp;
+	struct dirent*	de;
+	int		files = 0;
+
+	if (!set_rotateinterval("60")) {
+		return 1;
+	}
+	logd_shard_init(NULL, NULL, LOGMODE);
+	log_lines(10, 3600);
+	log_lines(10, -3600);
+	logd_shard_stop();
+	if ((dp = opendir(dir)) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (*de->d_name != '.') {
+			files++;
+		}
+	}
+	closedir(dp);
+	if (files != 1) {
+		fprintf(stderr, "FAIL: %d files, rotated by the client's "
+			"clock\n", files);
+		return 1;
+	}
+	printf("ok: no rotation by the client's clock\n");
+	return 0;
+}
+
+static void
+remove_dir(void)
+{
+	DIR*		dp;
+	struct dirent*	de;
+	char		path[MAXLINE];
+
+	if ((dp = opendir(dir)) == NULL) {
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (*de->d_name != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dp);
+	rmdir(dir);
+}
+
+/* one case in a child, the shard files are per process */
+static int
+run(int (*test)(const char *, const char *), const char * how
+,	const char * suffix)
+{
+	pid_t	pid;
+	int	status;
+
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	if ((pid = fork()) == 0) {
+		status = set_logdir(dir) ? test(how, suffix) : 1;
+		fflush(stdout);
+		_exit(status);
+	}
+	status = 1;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+		perror("fork");
+	}
+	remove_dir();
+	strncpy(dir, "/tmp/shardtestXXXXXX", sizeof(dir));
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static int
+names_taken(const char * how, const char * suffix)
+{
+	return test_names_taken();
+}
+
+static int
+client_clock(const char * how, const char * suffix)
+{
+	return test_client_clock();
+}
+
+int
+main(int argc, char** argv)
+{
+	int	failed = 0;
+
+	cl_log_set_entity("shardtest");
+	cl_log_enable_stderr(TRUE);
+	umask(0);
+	failed |= run(test_compress, "gzip", ".gz");
+	failed |= run(test_compress, "bzip2", ".bz2");
+	failed |= run(names_taken, NULL, NULL);
+	failed |= run(client_clock, NULL, NULL);
+	return failed;
+}
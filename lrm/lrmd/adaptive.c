@@ -0,0 +1,231 @@
+/*
+ * adaptive.c: adjust the lrmd max-children limit to the load
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * The controller is run every ADAPT_INTERVAL ms (see lrmd.c) when
+ * the adaptive-children lrmd parameter is set. It looks at:
+ *
+ *	- CPU and IO pressure (/proc/pressure/{cpu,io}, the "some"
+ *	  avg10 value); without PSI the number of runnable tasks from
+ *	  /proc/loadavg relative to the number of processors is used
+ *	- whether operations are waiting for a child slot
+ *	- how long RA children run and how long ops wait in the queue
+ *	  (the exec_time and queue_time computed in store_timestamps())
+ *
+ * and then grows the limit additively while the box is idle and ops
+ * wait, or shrinks it multiplicatively while the box is under
+ * pressure. Long running but mostly sleeping agents (the typical
+ * monitor) leave the pressure low, so the limit grows quicker when
+ * the average exec time is long.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/proctrack.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+
+#include <lrmd.h>
+
+/* pressure (in %) above which we shrink and below which we may grow */
+#define PRESSURE_HIGH	40.0
+#define PRESSURE_LOW	10.0
+/* exec time (ms) above which children are considered mostly sleeping */
+#define LONG_EXEC_MS	2000
+/* weight of a new sample in the running averages, in 1/16 */
+#define EWMA_WEIGHT	4
+
+static int adapt_min = 1;
+static int adapt_max = 0;	/* 0: computed from the number of cpus */
+static int nprocs = 0;
+static unsigned long avg_exec_ms = 0;
+static unsigned long avg_queue_ms = 0;
+static unsigned long nr_samples = 0;
+static char status[256] = "idle";
+
+static int read_psi(const char *path, double *avg10);
+static int read_runnable(void);
+static void init_nprocs(void);
+
+static void
+init_nprocs(void)
+{
+	if (nprocs > 0) {
+		return;
+	}
+#ifdef _SC_NPROCESSORS_ONLN
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nprocs < 1) {
+		nprocs = 1;
+	}
+}
+
+/* the "some avg10=" value from a /proc/pressure file */
+static int
+read_psi(const char *path, double *avg10)
+{
+	FILE *fp;
+	char line[256];
+	int rc = -1;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "some avg10=%lf", avg10) == 1) {
+			rc = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return rc;
+}
+
+/* the number of currently runnable tasks from /proc/loadavg */
+static int
+read_runnable(void)
+{
+	FILE *fp;
+	double l1, l5, l15;
+	int running = -1, total;
+
+	if ((fp = fopen("/proc/loadavg", "r")) == NULL) {
+		return -1;
+	}
+	if (fscanf(fp, "%lf %lf %lf %d/%d", &l1, &l5, &l15
+	,	&running, &total) != 5) {
+		running = -1;
+	}
+	fclose(fp);
+	return running;
+}
+
+void
+adapt_record_op(unsigned long exec_ms, unsigned long queue_ms)
+{
+	if (nr_samples++ == 0) {
+		avg_exec_ms = exec_ms;
+		avg_queue_ms = queue_ms;
+		return;
+	}
+	avg_exec_ms = (avg_exec_ms*(16-EWMA_WEIGHT) + exec_ms*EWMA_WEIGHT)/16;
+	avg_queue_ms = (avg_queue_ms*(16-EWMA_WEIGHT) + queue_ms*EWMA_WEIGHT)/16;
+}
+
+int
+adapt_set_limits(int min, int max)
+{
+	if (min < 1 || (max && max < min)) {
+		return HA_FAIL;
+	}
+	adapt_min = min;
+	adapt_max = max;
+	return HA_OK;
+}
+
+void
+adapt_get_limits(int *min, int *max)
+{
+	init_nprocs();
+	*min = adapt_min;
+	if (adapt_max) {
+		*max = adapt_max;
+	} else {
+		*max = (nprocs > 1) ? 4*nprocs : 4;
+	}
+}
+
+const char *
+adapt_status(void)
+{
+	return status;
+}
+
+/*
+ * cur: the current limit, running: children running now,
+ * waiting: resources waiting for a slot
+ * returns the new limit
+ */
+int
+adapt_max_children(int cur, int running, int waiting)
+{
+	double cpu = 0, io = 0, pressure;
+	int runnable, lo, hi, step, new_max = cur;
+	const char *decision = "hold";
+	gboolean have_psi;
+
+	adapt_get_limits(&lo, &hi);
+	have_psi = (read_psi("/proc/pressure/cpu", &cpu) == 0);
+	have_psi = (read_psi("/proc/pressure/io", &io) == 0) || have_psi;
+	runnable = read_runnable();
+	if (have_psi) {
+		pressure = (cpu > io) ? cpu : io;
+	} else if (runnable >= 0) {
+		/* 100% means one runnable task per processor beyond
+		 * those on the cpus already */
+		pressure = (runnable > nprocs) ?
+			100.0*(runnable-nprocs)/nprocs : 0;
+	} else {
+		pressure = 0;
+	}
+
+	if (pressure >= PRESSURE_HIGH
+	||	(runnable >= 0 && runnable > 2*nprocs)) {
+		new_max = cur - ((cur >= 8) ? cur/4 : 1);
+		decision = "shrink";
+	} else if (pressure < PRESSURE_LOW && waiting > 0 && running >= cur) {
+		step = 1;
+		if (avg_exec_ms >= LONG_EXEC_MS && nprocs > 2) {
+			/* the children are mostly sleeping */
+			step = nprocs/2;
+		}
+		new_max = cur + ((step < waiting) ? step : waiting);
+		decision = "grow";
+	}
+	if (new_max < lo) {
+		new_max = lo;
+	} else if (new_max > hi) {
+		new_max = hi;
+	}
+	if (new_max == cur) {
+		decision = "hold";
+	}
+
+	snprintf(status, sizeof(status)
+	,	"%s: max-children=%d (limits %d-%d), running=%d, waiting=%d"
+		", cpu-psi=%.1f, io-psi=%.1f%s, runnable=%d/%d cpus"
+		", avg-exec=%lums, avg-queue=%lums"
+	,	decision, new_max, lo, hi, running, waiting
+	,	cpu, io, have_psi ? "" : " (n/a)", runnable, nprocs
+	,	avg_exec_ms, avg_queue_ms);
+	if (new_max != cur) {
+		lrmd_log(LOG_INFO, "adaptive max-children %s", status);
+	} else {
+		lrmd_debug2(LOG_DEBUG, "adaptive max-children %s", status);
+	}
+	return new_max;
+}
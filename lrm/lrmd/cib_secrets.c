@@ -49,7 +49,7 @@
 
 #include <lrmd.h>
 
-int replace_secret_params(char *rsc_id, GHashTable* params);
+int replace_secret_params(const char *rsc_id, GHashTable* params);
 static int is_magic_value(char *p);
 static int check_md5_hash(char *hash, char *value);
 static void add_secret_params(gpointer key, gpointer value, gpointer user_data);
@@ -113,7 +113,7 @@ read_local_file(char *local_file)
  */
 
 int
-replace_secret_params(char *rsc_id, GHashTable* params)
+replace_secret_params(const char *rsc_id, GHashTable* params)
 {
 	char local_file[FILENAME_MAX+1], *start_pname;
 	char hash_file[FILENAME_MAX+1], *hash;
@@ -0,0 +1,667 @@
+/*
+ * executor.c: helper processes which start the RAs for lrmd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Forking lrmd for every op gets expensive as lrmd grows. With -e N,
+ * N executors are forked at startup, while lrmd is still small, and
+ * the RAs are started by them instead.
+ *
+ * Each executor has two socketpairs to lrmd:
+ *
+ *  - requests: lrmd sends the op as an ha_msg, with the write ends of
+ *    the RA's stdout and stderr pipes attached (SCM_RIGHTS). The
+ *    executor forks, the child runs the RA as a forked lrmd would
+ *    (ra_child_exec()) and lrmd gets the pid back right away. lrmd
+ *    reads the output from its ends of the pipes as usual.
+ *  - events: the executor reaps its children and sends their pid and
+ *    wait status. lrmd hands that to proctrack (ReportProcHasDied()),
+ *    so to the rest of lrmd the RA looks like one of its children.
+ *    The executor doesn't block on that: what lrmd doesn't take right
+ *    away is queued until it does.
+ *
+ * An executor which doesn't answer in time is killed. When one is
+ * gone, the RAs it started are left running: lrmd looks for their
+ * pids every EXEC_ORPHAN_MS and reports them (as killed, their exit
+ * code is lost) once they are gone; op timeouts still apply. If no
+ * executor is left, lrmd forks as before.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <clplumbing/proctrack.h>
+#include <clplumbing/uids.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+#include <lrm/lrm_msg.h>
+#include <lrm/raexec.h>
+
+#include <lrmd.h>
+
+#define EXEC_MAXMSG	(64*1024)	/* largest request */
+#define EXEC_REPLY_MS	1000		/* for the pid of a started RA */
+#define EXEC_ORPHAN_MS	1000		/* look for the RAs of the dead */
+
+struct exec_reply {
+	pid_t	pid;		/* -1: fork failed */
+	int	err;
+};
+
+struct exec_event {
+	pid_t	pid;
+	int	status;		/* as from waitpid() */
+};
+
+struct executor {
+	pid_t		pid;
+	int		req_fd;
+	int		ev_fd;		/* -1: gone */
+	GFDSource*	ev_src;
+	int		running;
+	gboolean	dead;		/* no more requests */
+};
+
+static struct executor*	executors = NULL;
+static int		n_executors = 0;
+static GHashTable*	ra_pids = NULL;	/* RA pid -> executor */
+static guint		orphan_timer = 0;
+static int		sigchld_pipe[2];
+
+/* the events lrmd hasn't taken yet (executor side) */
+static struct exec_event*	ev_pending = NULL;
+static int			n_pending = 0;
+static int			max_pending = 0;
+
+/* ------------------------------ executor side ---------------------------- */
+
+static void
+exec_sigchld(int sig)
+{
+	int save_errno = errno;
+
+	if (write(sigchld_pipe[1], "", 1) < 0) {
+		/* full: it'll be read anyway */
+	}
+	errno = save_errno;
+}
+
+/* send what lrmd takes without blocking, keep the rest */
+static void
+exec_flush(int ev_fd)
+{
+	int	i;
+	ssize_t	n = 0;
+
+	for (i = 0; i < n_pending; i++) {
+		do {
+			n = send(ev_fd, &ev_pending[i], sizeof(ev_pending[i])
+			,	MSG_DONTWAIT);
+		} while (n < 0 && errno == EINTR);
+		if (n != sizeof(ev_pending[i])) {
+			break;
+		}
+	}
+	if (i < n_pending && !(n < 0 && errno == EAGAIN)) {
+		/* lrmd is gone */
+		cl_perror("%s: send", __FUNCTION__);
+		i = n_pending;
+	}
+	n_pending -= i;
+	memmove(ev_pending, ev_pending + i, n_pending * sizeof(*ev_pending));
+}
+
+static void
+exec_reap(int ev_fd)
+{
+	struct exec_event	ev;
+	char			buf[64];
+
+	while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+		;
+	}
+	while ((ev.pid = waitpid(-1, &ev.status, WNOHANG)) > 0) {
+		if (n_pending == max_pending) {
+			max_pending = max_pending ? 2 * max_pending : 16;
+			ev_pending = g_renew(struct exec_event, ev_pending
+			,	max_pending);
+		}
+		ev_pending[n_pending++] = ev;
+	}
+	exec_flush(ev_fd);
+}
+
+/* one request: the op and the two fds */
+static struct ha_msg*
+exec_recv(int fd, int fds[2])
+{
+	static char		buf[EXEC_MAXMSG];
+	struct msghdr		mh;
+	struct iovec		iov;
+	struct cmsghdr*		cm;
+	char			cbuf[CMSG_SPACE(2*sizeof(int))];
+	ssize_t			n;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	fds[0] = fds[1] = -1;
+
+	do {
+		n = recvmsg(fd, &mh, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		return NULL;
+	}
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET
+		&&  cm->cmsg_type == SCM_RIGHTS
+		&&  cm->cmsg_len == CMSG_LEN(2*sizeof(int))) {
+			memcpy(fds, CMSG_DATA(cm), 2*sizeof(int));
+		}
+	}
+	return wirefmt2msg(buf, n, 0);
+}
+
+static void
+exec_run(int req_fd, int ev_fd, struct ha_msg* msg, int fds[2])
+{
+	struct exec_reply	reply;
+	GHashTable*		params;
+	int			timeout = 0;
+
+	if (fds[0] < 0 || fds[1] < 0) {
+		reply.pid = -1;
+		reply.err = EINVAL;
+		goto out;
+	}
+	switch (reply.pid = fork()) {
+	case -1:
+		reply.err = errno;
+		break;
+	case 0:		/* Child */
+		close(req_fd);
+		close(ev_fd);
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		signal(SIGCHLD, SIG_DFL);
+		params = ha_msg_value_str_table(msg, F_LRM_PARAM);
+		ha_msg_value_int(msg, F_LRM_TIMEOUT, &timeout);
+		ra_child_exec(ha_msg_value(msg, F_LRM_RID)
+		,	ha_msg_value(msg, F_LRM_RCLASS)
+		,	ha_msg_value(msg, F_LRM_RTYPE)
+		,	ha_msg_value(msg, F_LRM_RPROVIDER)
+		,	ha_msg_value(msg, F_LRM_OP)
+		,	timeout, params, fds[0], fds[1]);
+		/* not reached */
+	default:
+		reply.err = 0;
+	}
+out:
+	if (fds[0] >= 0) {
+		close(fds[0]);
+	}
+	if (fds[1] >= 0) {
+		close(fds[1]);
+	}
+	if (send(req_fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+		cl_perror("%s: send", __FUNCTION__);
+	}
+}
+
+/* the executor's main loop; it exits when lrmd closes the requests */
+static void
+exec_main(int req_fd, int ev_fd)
+{
+	struct sigaction	sa;
+	struct pollfd		pfd[3];
+	struct ha_msg*		msg;
+	int			fds[2];
+
+	if (pipe(sigchld_pipe) < 0) {
+		cl_perror("%s: pipe", __FUNCTION__);
+		exit(1);
+	}
+	fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = exec_sigchld;
+	sa.sa_flags = SA_RESTART|SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGTERM, SIG_DFL);
+
+	pfd[0].fd = req_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sigchld_pipe[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = ev_fd;
+	for (;;) {
+		pfd[2].events = n_pending ? POLLOUT : 0;
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cl_perror("%s: poll", __FUNCTION__);
+			exit(1);
+		}
+		if (pfd[1].revents) {
+			exec_reap(ev_fd);
+		}else if (pfd[2].revents) {
+			exec_flush(ev_fd);
+		}
+		if (pfd[0].revents == 0) {
+			continue;
+		}
+		if ((msg = exec_recv(req_fd, fds)) == NULL) {
+			/* lrmd is gone (or sent garbage) */
+			exit(0);
+		}
+		exec_run(req_fd, ev_fd, msg, fds);
+		ha_msg_del(msg);
+	}
+}
+
+/* ------------------------------- lrmd side ------------------------------- */
+
+/* FALSE once the executor closed its end */
+static gboolean
+exec_events(struct executor* e)
+{
+	struct exec_event	ev;
+	ssize_t			n;
+
+	while ((n = recv(e->ev_fd, &ev, sizeof(ev), MSG_DONTWAIT))
+	==	sizeof(ev)) {
+		if (g_hash_table_lookup(ra_pids, GINT_TO_POINTER(ev.pid))) {
+			g_hash_table_remove(ra_pids, GINT_TO_POINTER(ev.pid));
+			--e->running;
+		}
+		ReportProcHasDied(ev.pid, ev.status);
+	}
+	return n < 0 && (errno == EAGAIN || errno == EINTR);
+}
+
+/* collect the RAs of dead executors which are gone */
+static void
+exec_orphan_gone(gpointer key, gpointer value, gpointer user_data)
+{
+	struct executor*	e = value;
+	GList**			gone = user_data;
+
+	if (e->ev_fd < 0 && kill(GPOINTER_TO_INT(key), 0) < 0
+	&&  errno == ESRCH) {
+		*gone = g_list_prepend(*gone, key);
+	}
+}
+
+static gboolean
+exec_orphans(gpointer data)
+{
+	GList*			gone = NULL;
+	GList*			l;
+	struct executor*	e;
+	int			hadprivs;
+
+	if (!(hadprivs = cl_have_full_privs())) {
+		return_to_orig_privs();
+	}
+	g_hash_table_foreach(ra_pids, exec_orphan_gone, &gone);
+	if (!hadprivs) {
+		return_to_dropped_privs();
+	}
+	for (l = gone; l != NULL; l = l->next) {
+		e = g_hash_table_lookup(ra_pids, l->data);
+		g_hash_table_remove(ra_pids, l->data);
+		--e->running;
+		lrmd_log(LOG_WARNING, "RA %d of executor %d is gone, its exit "
+			"code is lost", GPOINTER_TO_INT(l->data), (int)e->pid);
+		ReportProcHasDied(GPOINTER_TO_INT(l->data), SIGKILL);
+	}
+	g_list_free(gone);
+	if (g_hash_table_size(ra_pids) == 0) {
+		orphan_timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * The executor is gone or of no use any more: kill it and close its
+ * sockets, after taking the events it sent. The RAs it started are
+ * left alone, exec_orphans() reports them once they are gone.
+ */
+static void
+exec_lost(struct executor* e)
+{
+	int	hadprivs;
+
+	if (e->ev_fd < 0) {
+		return;
+	}
+	if (e->ev_src != NULL) {
+		exec_events(e);
+		G_main_del_fd(e->ev_src);
+		e->ev_src = NULL;
+	}
+	lrmd_log(LOG_ERR, "RA executor %d is gone, %d RA(s) left running"
+	,	(int)e->pid, e->running);
+	if (e->req_fd >= 0) {
+		close(e->req_fd);
+	}
+	close(e->ev_fd);
+	e->req_fd = e->ev_fd = -1;
+	e->dead = TRUE;
+
+	if (!(hadprivs = cl_have_full_privs())) {
+		return_to_orig_privs();
+	}
+	kill(e->pid, SIGKILL);
+	if (!hadprivs) {
+		return_to_dropped_privs();
+	}
+	if (e->running > 0 && !orphan_timer) {
+		orphan_timer = Gmain_timeout_add(EXEC_ORPHAN_MS
+		,	exec_orphans, NULL);
+	}
+}
+
+static gboolean
+exec_input(int fd, gpointer user_data)
+{
+	struct executor*	e = user_data;
+
+	if (exec_events(e)) {
+		return TRUE;
+	}
+	e->ev_src = NULL;
+	exec_lost(e);
+	return FALSE;
+}
+
+/*
+ * Fork n executors. Call it early, before lrmd has grown and
+ * opened anything the RAs shouldn't get, but after the RA plugins
+ * are loaded.
+ */
+void
+executor_init(int n)
+{
+	struct executor*	e;
+	int			req[2];
+	int			ev[2];
+	int			i;
+	int			j;
+
+	if (n <= 0) {
+		return;
+	}
+	executors = g_new0(struct executor, n);
+	ra_pids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (i = 0; i < n; i++) {
+		e = &executors[n_executors];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, req) < 0) {
+			cl_perror("%s: socketpair", __FUNCTION__);
+			break;
+		}
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ev) < 0) {
+			cl_perror("%s: socketpair", __FUNCTION__);
+			close(req[0]);
+			close(req[1]);
+			break;
+		}
+		switch (e->pid = fork()) {
+		case -1:
+			cl_perror("%s: fork", __FUNCTION__);
+			close(req[0]);
+			close(req[1]);
+			close(ev[0]);
+			close(ev[1]);
+			break;
+		case 0:		/* Child */
+			close(req[0]);
+			close(ev[0]);
+			for (j = 0; j < n_executors; j++) {
+				close(executors[j].req_fd);
+				close(executors[j].ev_fd);
+			}
+			exec_main(req[1], ev[1]);
+			exit(0);
+		}
+		if (e->pid < 0) {
+			break;
+		}
+		close(req[1]);
+		close(ev[1]);
+		e->req_fd = req[0];
+		e->ev_fd = ev[0];
+		fcntl(e->req_fd, F_SETFD, FD_CLOEXEC);
+		fcntl(e->ev_fd, F_SETFD, FD_CLOEXEC);
+		++n_executors;
+	}
+	lrmd_log(LOG_INFO, "%d RA executor(s) started", n_executors);
+}
+
+/* once the main loop is there: watch for the exits of the RAs */
+void
+executor_start(void)
+{
+	int i;
+
+	for (i = 0; i < n_executors; i++) {
+		executors[i].ev_src = G_main_add_fd(G_PRIORITY_HIGH
+		,	executors[i].ev_fd, FALSE, exec_input, &executors[i]
+		,	NULL);
+	}
+}
+
+void
+executor_stop(void)
+{
+	int i;
+
+	for (i = 0; i < n_executors; i++) {
+		if (executors[i].req_fd >= 0) {
+			close(executors[i].req_fd);
+			executors[i].req_fd = -1;
+		}
+		executors[i].dead = TRUE;
+	}
+}
+
+/* it doesn't answer: no more ops for it, the RAs it started run on */
+static void
+exec_fail(struct executor* e)
+{
+	lrmd_log(LOG_ERR, "RA executor %d does not answer, killing it"
+	,	(int)e->pid);
+	exec_lost(e);
+}
+
+/* the executor with the fewest RAs running */
+static struct executor*
+exec_pick(void)
+{
+	struct executor*	best = NULL;
+	int			i;
+
+	for (i = 0; i < n_executors; i++) {
+		if (executors[i].dead) {
+			continue;
+		}
+		if (best == NULL || executors[i].running < best->running) {
+			best = &executors[i];
+		}
+	}
+	return best;
+}
+
+static int
+exec_send(struct executor* e, char* data, size_t len
+,	int stdout_fd, int stderr_fd)
+{
+	struct msghdr	mh;
+	struct iovec	iov;
+	struct cmsghdr*	cm;
+	char		cbuf[CMSG_SPACE(2*sizeof(int))];
+	int		fds[2];
+	ssize_t		n;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(2*sizeof(int));
+	fds[0] = stdout_fd;
+	fds[1] = stderr_fd;
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	do {
+		n = sendmsg(e->req_fd, &mh, MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	return n == (ssize_t)len ? HA_OK : HA_FAIL;
+}
+
+/*
+ * This does block the mainloop, but not for long: the executor
+ * answers right after fork(), and one sending nothing back within
+ * EXEC_REPLY_MS is taken for hung and killed by exec_fail(), never to
+ * be picked again; the op is forked then. The executor doesn't wait
+ * on lrmd for sending its events (exec_flush()), so it can't be stuck
+ * on us here. With -e N that's at most N such waits over the life of
+ * lrmd. The request, which is sent with MSG_DONTWAIT, doesn't
+ * block either: there is never more than one in the socket.
+ */
+static int
+exec_wait_reply(struct executor* e, struct exec_reply* reply)
+{
+	struct pollfd	pfd;
+	ssize_t		n;
+	int		rc;
+
+	pfd.fd = e->req_fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, EXEC_REPLY_MS);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0) {
+		return HA_FAIL;
+	}
+	n = recv(e->req_fd, reply, sizeof(*reply), 0);
+	return n == sizeof(*reply) ? HA_OK : HA_FAIL;
+}
+
+/*
+ * Have an executor start the RA, stdout and stderr going to the
+ * fds given. The pid of the RA or -1 if there is no executor or it
+ * failed; fork it then.
+ */
+pid_t
+executor_run(const char* rsc_id, const char* rclass, const char* rtype
+,	const char* provider, const char* op_type, int timeout
+,	GHashTable* params, int stdout_fd, int stderr_fd)
+{
+	struct executor*	e;
+	struct ha_msg*		msg;
+	struct exec_reply	reply;
+	char*			data = NULL;
+	size_t			len = 0;
+
+	if ((e = exec_pick()) == NULL) {
+		return -1;
+	}
+	if ((msg = ha_msg_new(7)) == NULL) {
+		return -1;
+	}
+	if (HA_OK != ha_msg_add(msg, F_LRM_RID, rsc_id)
+	||  HA_OK != ha_msg_add(msg, F_LRM_RCLASS, rclass)
+	||  HA_OK != ha_msg_add(msg, F_LRM_RTYPE, rtype)
+	||  (provider && HA_OK != ha_msg_add(msg, F_LRM_RPROVIDER, provider))
+	||  HA_OK != ha_msg_add(msg, F_LRM_OP, op_type)
+	||  HA_OK != ha_msg_add_int(msg, F_LRM_TIMEOUT, timeout)
+	||  (params && HA_OK != ha_msg_add_str_table(msg, F_LRM_PARAM, params))
+	||  (data = msg2wirefmt(msg, &len)) == NULL) {
+		lrmd_log(LOG_ERR, "%s: cannot create the request for %s"
+		,	__FUNCTION__, rsc_id);
+		ha_msg_del(msg);
+		return -1;
+	}
+	ha_msg_del(msg);
+	if (len > EXEC_MAXMSG) {
+		lrmd_log(LOG_WARNING, "%s: parameters of %s too large for "
+			"the executors", __FUNCTION__, rsc_id);
+		free(data);
+		return -1;
+	}
+
+	if (HA_OK != exec_send(e, data, len, stdout_fd, stderr_fd)
+	||  HA_OK != exec_wait_reply(e, &reply)) {
+		free(data);
+		exec_fail(e);
+		return -1;
+	}
+	free(data);
+	if (reply.pid < 0) {
+		lrmd_log(LOG_WARNING, "%s: RA executor %d cannot fork: %s"
+		,	__FUNCTION__, (int)e->pid, strerror(reply.err));
+		return -1;
+	}
+	g_hash_table_insert(ra_pids, GINT_TO_POINTER(reply.pid), e);
+	++e->running;
+	return reply.pid;
+}
+
+/* executors still working */
+int
+executor_count(void)
+{
+	int i;
+	int n = 0;
+
+	for (i = 0; i < n_executors; i++) {
+		if (!executors[i].dead) {
+			++n;
+		}
+	}
+	return n;
+}
@@ -34,6 +34,13 @@
 #include <pwd.h>
 #include <time.h>
 #include <sched.h>
+#include <signal.h>
+/* posix_spawn() is used only if it can close the fds lrmd has open */
+#if defined(HAVE_POSIX_SPAWN) \
+	&& defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#  include <spawn.h>
+#  define LRMD_SPAWN
+#endif
 
 #include <glib.h>
 #include <pils/plugin.h>
@@ -47,6 +54,7 @@
 #include <clplumbing/Gmain_timeout.h>
 #include <clplumbing/cl_pidfile.h>
 #include <clplumbing/realtime.h>
+#include <clplumbing/cl_misc.h>
 #include <ha_msg.h>
 #ifdef ENABLE_APPHB
 #  include <apphb.h>
@@ -104,6 +112,7 @@ struct msg_map msg_maps[] = {
 	{CANCELOP,	REPLY_NOW,	on_msg_cancel_op, PRIV_ADMIN},
 	{GETRSCSTATE,	NO_MSG,	on_msg_get_state, PRIV_ADMIN},
 	{GETRSCMETA,	NO_MSG, 	on_msg_get_metadata, 0},
+	{GETALLMETAS,	NO_MSG, 	on_msg_get_all_metadata, 0},
 	{SETLRMDPARAM,	REPLY_NOW, 	on_msg_set_lrmd_param, PRIV_ADMIN},
 	{GETLRMDPARAM,	NO_MSG, 	on_msg_get_lrmd_param, 0},
 };
@@ -116,6 +125,7 @@ static GMainLoop* mainloop 		= NULL;
 static int call_id 			= 1;
 static const char* lrm_system_name 	= "lrmd";
 static GHashTable * RAExecFuncs 	= NULL;
+static GHashTable * RASpawnFuncs 	= NULL;	/* plugins which have it */
 static GList* ra_class_list		= NULL;
 static gboolean shutdown_in_progress	= FALSE;
 static unsigned long apphb_interval 	= 2000; /* Millisecond */
@@ -123,7 +133,16 @@ static gboolean reg_to_apphbd		= FALSE;
 static int max_child_count		= 4;
 static int retry_interval		= 1000; /* Millisecond */
 static int child_count			= 0;
+static GList* run_queue[SCHED_CLASSES];	/* rscs waiting for a child slot */
+static int runq_len			= 0;
+static lrmd_rsc_t* runq_current		= NULL; /* rsc being dispatched */
+static int adaptive_children		= FALSE;
+static guint adapt_timeout_tag		= 0;
+static int monitor_spread		= 0; /* % of the interval */
+static int monitor_jitter		= 0; /* % of the interval */
 static IPC_Auth	* auth = NULL;
+static const char* metadata_cache_file	= NULL;
+static int n_executors			= 0;
 
 static struct {
 	int	opcount;
@@ -279,8 +298,7 @@ lrmd_op_destroy(lrmd_op_t* op)
 	}
 	lrmd_debug2(LOG_DEBUG, "%s: free the %s with address %p"
 		  ,__FUNCTION__, op_info(op), op);
-	ha_msg_del(op->msg);
-	op->msg = NULL;
+	op_msg_release(op);
 	if( op->rsc_id ) {
 		free(op->rsc_id);
 		op->rsc_id = NULL;
@@ -292,9 +310,7 @@ lrmd_op_destroy(lrmd_op_t* op)
 	}
 	op->first_line_ra_stdout[0] = EOS;
 
-	if( op->repeat_timeout_tag ) {
-		Gmain_timeout_remove(op->repeat_timeout_tag);
-	}
+	tw_del(&op->repeat_timer);
 	free(op);
 }
 
@@ -310,8 +326,9 @@ lrmd_op_new(void)
 	}
 	op->rsc_id = NULL;
 	op->msg = NULL;
+	op->msg_refs = NULL;
 	op->exec_pid = -1;
-	op->repeat_timeout_tag = 0;
+	tw_timer_init(&op->repeat_timer);
 	op->rapop = NULL;
 	op->first_line_ra_stdout[0] = EOS;
 	op->t_recv = time_longclock();
@@ -325,6 +342,59 @@ lrmd_op_new(void)
 	return op;
 }
 
+/*
+ * The message of an op, which carries all the RA parameters, is
+ * shared between the op and its copies in last_op_done, the last op
+ * tables and the repeat list. Nobody may change a shared message:
+ * get it through op_msg_w() before modifying it, which makes a
+ * private copy if the message is shared.
+ */
+static void
+op_msg_set(lrmd_op_t* op, struct ha_msg* msg)
+{
+	op->msg = msg;
+	op->msg_refs = NULL;
+	if (msg == NULL) {
+		return;
+	}
+	op->msg_refs = (int*)malloc(sizeof(int));
+	if (op->msg_refs == NULL) {
+		lrmd_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		ha_msg_del(msg);
+		op->msg = NULL;
+		return;
+	}
+	*op->msg_refs = 1;
+}
+
+static void
+op_msg_release(lrmd_op_t* op)
+{
+	if (op->msg_refs && --*op->msg_refs == 0) {
+		ha_msg_del(op->msg);
+		free(op->msg_refs);
+	}
+	op->msg = NULL;
+	op->msg_refs = NULL;
+}
+
+static struct ha_msg*
+op_msg_w(lrmd_op_t* op)
+{
+	struct ha_msg* msg;
+
+	if (op->msg_refs && *op->msg_refs > 1) {
+		msg = ha_msg_copy(op->msg);
+		if (msg == NULL) {
+			lrmd_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+			return NULL;
+		}
+		--*op->msg_refs;
+		op_msg_set(op, msg);
+	}
+	return op->msg;
+}
+
 static lrmd_op_t* 
 lrmd_op_copy(const lrmd_op_t* op)
 {
@@ -344,13 +414,15 @@ lrmd_op_copy(const lrmd_op_t* op)
 	 * pointers, but it's still untidy at the least.
 	 * Be sure and care of this situation when using this function.
 	 */
-	/* Do a "deep" copy of the message structure */
+	/* The message is shared (see op_msg_w()) */
 	ret->rapop = NULL;
-	ret->msg = ha_msg_copy(op->msg);
+	if (ret->msg_refs) {
+		++*ret->msg_refs;
+	}
 	ret->rsc_id = strdup(op->rsc_id);
 	ret->rapop = NULL;
 	ret->first_line_ra_stdout[0] = EOS;
-	ret->repeat_timeout_tag = 0;
+	tw_timer_init(&ret->repeat_timer);
 	ret->exec_pid = -1;
 	ret->t_recv = op->t_recv;
  	ret->t_perform = op->t_perform;
@@ -440,8 +512,8 @@ lrmd_op_dump(const lrmd_op_t* op, const char * text)
 	,	(op->is_copy ? "copy" : "original")
 	,	(op->is_cancelled ? "cancelled" : ""));
 	lrmd_debug(LOG_DEBUG
-	,	"%s: lrmd_op2: rt_tag: %d, interval: %d, delay: %d"
-	,	text,  op->repeat_timeout_tag
+	,	"%s: lrmd_op2: rt_remaining: %lums, interval: %d, delay: %d"
+	,	text,  tw_remaining(&op->repeat_timer)
 	,	op->interval, op->delay);
 	lrmd_debug(LOG_DEBUG
 	,	"%s: lrmd_op3: t_recv: %ldms, t_add: %ldms"
@@ -473,6 +545,7 @@ lrmd_client_destroy(lrmd_client_t* client)
 static lrmd_client_t*
 lrmd_client_new(void)
 {
+	static unsigned long	serial = 0;
 	lrmd_client_t*	client;
 	client = calloc(sizeof(lrmd_client_t), 1);
 	if (client == NULL) {
@@ -480,6 +553,7 @@ lrmd_client_new(void)
 			 "calloc lrmd_client_t.");
 		return NULL;
 	}
+	client->serial = ++serial;
 	client->g_src = NULL;
 	client->g_src_cbk = NULL;
 	++lrm_objectstats.clientcount;
@@ -520,6 +594,10 @@ lrmd_client_dump(gpointer key, gpointer value, gpointer user_data)
 			,	(long)client->ch_cmd->recv_queue->current_qlen
 			,	(long)client->ch_cmd->send_queue->current_qlen);
 		}
+		if (debug_level >= 1) {
+			ipc_chanstats_log(client->ch_cmd, "Command channel"
+			,	LOG_DEBUG);
+		}
 	}
 	if (!client->ch_cbk) {
 		lrmd_debug(LOG_DEBUG, "NULL client ch_cbk in %s()", __FUNCTION__);
@@ -529,6 +607,10 @@ lrmd_client_dump(gpointer key, gpointer value, gpointer user_data)
 		,	client->ch_cbk->ch_status
 		,	(long)client->ch_cbk->recv_queue->current_qlen
 		,	(long)client->ch_cbk->send_queue->current_qlen);
+		if (debug_level >= 1) {
+			ipc_chanstats_log(client->ch_cbk, "Callback channel"
+			,	LOG_DEBUG);
+		}
 	}
 }
 static void
@@ -565,6 +647,7 @@ lrmd_rsc_destroy(lrmd_rsc_t* rsc)
 		, __FUNCTION__, lrm_str(rsc->id));
 	}
 	g_hash_table_remove(resources, rsc->id);
+	raworker_stop(rsc->id);
 	if (rsc->id) {
 		free(rsc->id);
 		rsc->id = NULL;
@@ -600,6 +683,7 @@ lrmd_rsc_destroy(lrmd_rsc_t* rsc)
 		Gmain_timeout_remove(rsc->delay_timeout);
 		rsc->delay_timeout = (guint)0;
 	}
+	runq_remove(rsc);
 
 	free(rsc);
 	LRMAUDIT();
@@ -811,6 +895,12 @@ main(int argc, char ** argv)
 					apphb_interval = atoi(optarg);
 				}
 				break;
+			case 'c':		/* RA meta-data cache file */
+				metadata_cache_file = optarg;
+				break;
+			case 'e':		/* RA executors */
+				n_executors = atoi(optarg);
+				break;
 			default:
 				++argerr;
 				break;
@@ -894,8 +984,10 @@ init_stop(const char *pid_file)
 	return rc;
 }
 
-static const char usagemsg[] = "[-srkhv]\n\ts: status\n\tr: restart"
+static const char usagemsg[] = "[-srkhv] [-c file] [-e n]\n\ts: status\n\tr: restart"
 	"\n\tk: kill\n\tm: register to apphbd\n\ti: the interval of apphb\n\t"
+	"c: keep the RA meta-data cache in this file\n\t"
+	"e: start the RAs from n helper processes instead of forking\n\t"
 	"h: help\n\tv: debug\n";
 
 void
@@ -1103,6 +1195,24 @@ calc_max_children()
 	lrmd_log(LOG_INFO, "max-children set to %d", max_child_count);
 }
 
+static gboolean
+on_adapt_timeout(gpointer data)
+{
+	int new_max;
+
+	if (!adaptive_children) {
+		adapt_timeout_tag = 0;
+		return FALSE;
+	}
+	new_max = adapt_max_children(max_child_count, child_count
+	,	runq_len);
+	if (new_max != max_child_count) {
+		max_child_count = new_max;
+		runq_dispatch();
+	}
+	return TRUE;
+}
+
 /* main loop of the daemon*/
 int
 init_start ()
@@ -1125,6 +1235,7 @@ init_start ()
 
 	PILGenericIfMgmtRqst RegisterRqsts[]= {
 		{"RAExec", &RAExecFuncs, NULL, NULL, NULL},
+		{RA_SPAWN_TYPE_S, &RASpawnFuncs, NULL, NULL, NULL},
 		{ NULL, NULL, NULL, NULL, NULL} };
 
 	if( getenv("LRMD_MAX_CHILDREN") ) {
@@ -1132,6 +1243,16 @@ init_start ()
 	} else {
 		calc_max_children();
 	}
+	if( getenv("LRMD_ADAPTIVE_CHILDREN") ) {
+		set_lrmd_param("adaptive-children"
+		,	getenv("LRMD_ADAPTIVE_CHILDREN"));
+	}
+	if( getenv("LRMD_MONITOR_SPREAD") ) {
+		set_lrmd_param("monitor-spread", getenv("LRMD_MONITOR_SPREAD"));
+	}
+	if( getenv("LRMD_MONITOR_JITTER") ) {
+		set_lrmd_param("monitor-jitter", getenv("LRMD_MONITOR_JITTER"));
+	}
 
 	qsort(msg_maps, MSG_NR, sizeof(struct msg_map), msg_type_cmp);
 
@@ -1185,6 +1306,9 @@ init_start ()
 	}
 	closedir(dir); dir = NULL; /* Don't forget to close 'dir' */
 
+	/* the executors are forked now, while we are small */
+	executor_init(n_executors);
+
 	/*
 	 *create the waiting connections
 	 *one for register the client,
@@ -1277,9 +1401,15 @@ init_start ()
 		cl_log(LOG_ERR, "can not new hash table resources");
 		exit(100);
 	}
+	racache_init(metadata_cache_file);
+	raworker_init();
 
 	/*Create the mainloop and run it*/
 	mainloop = g_main_new(FALSE);
+	/* format the (debug) chatter when the main loop is idle */
+	if (cl_log_set_deferred(LRMD_LOG_RING) != HA_OK) {
+		lrmd_log(LOG_WARNING, "deferred logging not available");
+	}
 	lrmd_debug(LOG_DEBUG, "main: run the loop...");
 	lrmd_log(LOG_INFO, "Started.");
 
@@ -1287,8 +1417,12 @@ init_start ()
 	init_using_apphb();
 	emit_apphb(NULL); /* Avoid warning */
 
+	executor_start();
 	g_main_run(mainloop);
 
+	executor_stop();
+	raworker_stop_all();
+	racache_save();
 	emit_apphb(NULL);
         if (reg_to_apphbd == TRUE) {
 #ifdef ENABLE_APPHB
@@ -1334,7 +1468,7 @@ on_connect_cmd (IPC_Channel* ch, gpointer user_data)
 	}
 	client->app_name = NULL;
 	client->ch_cmd = ch;
-	client->g_src = G_main_add_IPC_Channel(G_PRIORITY_DEFAULT,
+	client->g_src = G_main_add_IPC_Channel_batch(G_PRIORITY_DEFAULT,
 				ch, FALSE, on_receive_cmd, (gpointer)client,
 				on_remove_client);
 
@@ -1388,6 +1522,7 @@ on_connect_cbk (IPC_Channel* ch, gpointer user_data)
 		send_ret_msg(ch, HA_FAIL);
 		return TRUE;
 	}
+	set_client_msgfmts(ch, msg);
 	ha_msg_del(msg);
 
 	/*get the client in the client list*/
@@ -1407,7 +1542,7 @@ on_connect_cbk (IPC_Channel* ch, gpointer user_data)
 
 	/*fill the channel of callback field*/
 	client->ch_cbk = ch;
-	send_ret_msg(ch, HA_OK);
+	send_reg_ret_msg(ch, HA_OK);
 	return TRUE;
 }
 
@@ -1422,36 +1557,47 @@ msg_type_cmp(const void *p1, const void *p2)
 }
 
 gboolean
-on_receive_cmd (IPC_Channel* ch, gpointer user_data)
+on_receive_cmd (IPC_Channel* ch, IPC_Message** msgs, int nmsgs
+,	gpointer user_data)
 {
-	struct msg_map *msgmap_p, in_type;
 	lrmd_client_t* client = NULL;
 	struct ha_msg* msg = NULL;
-	char *msg_s;
-	int ret = FALSE;
+	int j;
 
 	client = (lrmd_client_t*)user_data;
 
-	if (IPC_DISCONNECT == ch->ch_status) {
+	if (nmsgs == 0) {
 		lrmd_debug(LOG_DEBUG,
 			"on_receive_cmd: the IPC to client [pid:%d] disconnected."
 		,	client->pid);
 		return FALSE;
 	}
 
-	if (!ch->ops->is_message_pending(ch)) {
-		lrmd_debug(LOG_DEBUG, "on_receive_cmd: no pending message in IPC "
-			 "channel.");
-		return TRUE;
+	for (j = 0; j < nmsgs; j++) {
+		/* the handlers copy what they keep, so the message
+		 * can be parsed in place, see wirefmt2msg_borrow() */
+		msg = ipcmsg2hamsg_borrow(msgs[j]);
+		if (NULL == msg) {
+			lrmd_log(LOG_ERR, "on_receive_cmd: can not receive messages.");
+			continue;
+		}
+		if (!on_receive_msg(ch, client, msg)) {
+			while (++j < nmsgs) {
+				msgs[j]->msg_done(msgs[j]);
+			}
+			return FALSE;
+		}
 	}
+	return TRUE;
+}
 
-
-	/*get the message */
-	msg = msgfromIPC(ch, 0);
-	if (NULL == msg) {
-		lrmd_log(LOG_ERR, "on_receive_cmd: can not receive messages.");
-		return TRUE;
-	}
+/* one request from the client, msg is deleted */
+static gboolean
+on_receive_msg(IPC_Channel* ch, lrmd_client_t* client, struct ha_msg* msg)
+{
+	struct msg_map *msgmap_p, in_type;
+	char *msg_s;
+	int ret = FALSE;
 
 	if (TRUE == shutdown_in_progress ) {
 		send_ret_msg(ch,HA_FAIL);
@@ -1502,7 +1648,11 @@ on_receive_cmd (IPC_Channel* ch, gpointer user_data)
 
 		/*return rc to client if need*/
 		if (send_msg_now(msgmap_p)) {
-			send_ret_msg(ch, ret);
+			if (msgmap_p->handler == on_msg_register) {
+				send_reg_ret_msg(ch, ret);
+			} else {
+				send_ret_msg(ch, ret);
+			}
 			client->lastrcsent = time(NULL);
 		}
 	}
@@ -1599,9 +1749,7 @@ on_repeat_op_readytorun(gpointer data)
 	}
 
 	rsc->repeat_op_list = g_list_remove(rsc->repeat_op_list, op);
-	if (op->repeat_timeout_tag != 0) {
-		op->repeat_timeout_tag = (guint)0;
-	}
+	tw_del(&op->repeat_timer);
 
 	op->exec_pid = -1;
 
@@ -1653,6 +1801,7 @@ on_msg_register(lrmd_client_t* client, struct ha_msg* msg)
 	else
 		client->priv_lvl = 0;
 
+	set_client_msgfmts(client->ch_cmd, msg);
 	g_hash_table_insert(clients, (gpointer)&client->pid, client);
 	lrmd_debug(LOG_DEBUG, "on_msg_register:client %s [%d] registered"
 	,	client->app_name
@@ -1686,21 +1835,162 @@ on_msg_get_rsc_classes(lrmd_client_t* client, struct ha_msg* msg)
 	return HA_OK;
 }
 
+/*
+ * The type and provider lists and the meta-data come from the RA
+ * plugins, which may have to run the agents. That is done in a child
+ * (see raquery.c) and the reply sent once it is done. The client may
+ * be gone by then, so the request keeps its pid, not the client.
+ */
+struct ra_req {
+	pid_t			client_pid;
+	unsigned long		client_serial;	/* that connection of it */
+	char*			rclass;
+	char*			rtype;
+	char*			provider;
+	/* GETALLMETAS */
+	struct RAExecOps*	RAExec;
+	GList*			todo;	/* "type<TAB>provider" to ask for */
+	int			running;
+	struct ha_msg*		metas;
+};
+
+static struct ra_req*
+ra_req_new(lrmd_client_t* client, const char* rclass, const char* rtype
+,	const char* provider)
+{
+	struct ra_req* req = g_new0(struct ra_req, 1);
+
+	req->client_pid = client->pid;
+	req->client_serial = client->serial;
+	req->rclass = g_strdup(rclass);
+	req->rtype = g_strdup(rtype);
+	req->provider = g_strdup(provider);
+	return req;
+}
+
+static void
+ra_req_free(struct ra_req* req)
+{
+	GList* l;
+
+	for (l = req->todo; l != NULL; l = l->next) {
+		g_free(l->data);
+	}
+	g_list_free(req->todo);
+	if (req->metas != NULL) {
+		ha_msg_del(req->metas);
+	}
+	g_free(req->rclass);
+	g_free(req->rtype);
+	g_free(req->provider);
+	g_free(req);
+}
+
+static lrmd_client_t*
+ra_req_client(struct ra_req* req)
+{
+	lrmd_client_t* client = lookup_client(req->client_pid);
+
+	if (client != NULL && client->serial != req->client_serial) {
+		/* reconnected since, the new connection didn't ask */
+		client = NULL;
+	}
+	if (client == NULL) {
+		lrmd_debug(LOG_DEBUG, "the client [pid:%d] is gone, "
+			"not sending the reply", req->client_pid);
+	}
+	return client;
+}
+
+/* RA queries take a child slot, like the ops */
+int
+ra_query_start(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider, raq_done_fn done, gpointer data)
+{
+	if (HA_OK != raq_start(RAExec, kind, rtype, provider, done, data)) {
+		return HA_FAIL;
+	}
+	++child_count;
+	return HA_OK;
+}
+
+/* in the done function of a query, before it returns */
+void
+release_query_slot(void)
+{
+	if (--child_count < 0) {
+		lrmd_log(LOG_ERR, "%s:%d: child count is less than zero: %d"
+			, __FUNCTION__, __LINE__, child_count);
+		child_count = 0;
+	}
+	runq_dispatch();
+}
+
+/* the lines of a list query in field of the reply */
+static void
+send_list_reply(struct ra_req* req, int rc, GString* out
+,	const char* field)
+{
+	lrmd_client_t* client;
+	struct ha_msg* ret;
+	GList* list = NULL;
+	GList* l;
+	char* line;
+	gsize pos = 0;
+
+	if ((client = ra_req_client(req)) == NULL) {
+		return;
+	}
+	if ((ret = create_lrm_ret(HA_OK, 5)) == NULL) {
+		lrmd_log(LOG_ERR, "%s: cannot create a ret message"
+		,	__FUNCTION__);
+		return;
+	}
+	if (rc == 0) {
+		while ((line = raq_next_line(out, &pos)) != NULL) {
+			list = g_list_append(list, line);
+		}
+	}
+	if (list != NULL) {
+		cl_msg_add_list(ret, field, list);
+		for (l = list; l != NULL; l = l->next) {
+			g_free(l->data);
+		}
+		g_list_free(list);
+	}
+	if (HA_OK != msg2ipcchan(ret, client->ch_cmd)) {
+		lrmd_log(LOG_ERR, "%s: can not send the ret msg"
+		,	__FUNCTION__);
+	}
+	ha_msg_del(ret);
+}
+
+static void
+on_rsc_types_done(int rc, GString* out, gpointer data)
+{
+	release_query_slot();
+	send_list_reply(data, rc, out, F_LRM_RTYPES);
+	ra_req_free(data);
+}
+
+static void
+on_rsc_providers_done(int rc, GString* out, gpointer data)
+{
+	release_query_slot();
+	send_list_reply(data, rc, out, F_LRM_RPROVIDERS);
+	ra_req_free(data);
+}
+
 int
 on_msg_get_rsc_types(lrmd_client_t* client, struct ha_msg* msg)
 {
-	struct ha_msg* ret = NULL;
 	struct RAExecOps * RAExec = NULL;
-	GList* types = NULL;
-	GList* type;
+	struct ra_req* req;
 	const char* rclass = NULL;
 
 	CHECK_ALLOCATED(client, "client", HA_FAIL);
 	CHECK_ALLOCATED(msg, "message", HA_FAIL);
 
-	ret = create_lrm_ret(HA_OK,5);
-	CHECK_RETURN_OF_CREATE_LRM_RET;
-
 	rclass = ha_msg_value(msg, F_LRM_RCLASS);
 	if (rclass == NULL) {
 		lrmd_log(LOG_ERR, "on_msg_get_rsc_types: cannot get the "
@@ -1718,43 +2008,30 @@ on_msg_get_rsc_types(lrmd_client_t* client, struct ha_msg* msg)
 	if (NULL == RAExec) {
 		lrmd_log(LOG_NOTICE, "on_msg_get_rsc_types: can not find this "
 			"RA class %s.", rclass);
-	} else {
-		if (0 <= RAExec->get_resource_list(&types) && types != NULL) {
-			cl_msg_add_list(ret, F_LRM_RTYPES, types);
-			while (NULL != (type = g_list_first(types))) {
-					types = g_list_remove_link(types, type);
-				g_free(type->data);
-				g_list_free_1(type);
-			}
-			g_list_free(types);
-		}
+		send_ret_msg(client->ch_cmd, HA_OK);
+		return HA_OK;
 	}
 
-	if (HA_OK != msg2ipcchan(ret, client->ch_cmd)) {
-		lrmd_log(LOG_ERR,
-			"on_msg_get_rsc_types: can not send the ret message.");
+	req = ra_req_new(client, rclass, NULL, NULL);
+	if (HA_OK != ra_query_start(RAExec, RAQ_TYPES, NULL, NULL
+	,	on_rsc_types_done, req)) {
+		ra_req_free(req);
+		send_ret_msg(client->ch_cmd, HA_FAIL);
 	}
-	ha_msg_del(ret);
-
 	return HA_OK;
 }
 
 int
 on_msg_get_rsc_providers(lrmd_client_t* client, struct ha_msg* msg)
 {
-	struct ha_msg* ret = NULL;
 	struct RAExecOps * RAExec = NULL;
-	GList* providers = NULL;
-	GList* provider = NULL;
+	struct ra_req* req;
 	const char* rclass = NULL;
 	const char* rtype = NULL;
 
 	CHECK_ALLOCATED(client, "client", HA_FAIL);
 	CHECK_ALLOCATED(msg, "message", HA_FAIL);
 
-	ret = create_lrm_ret(HA_OK,5);
-	CHECK_RETURN_OF_CREATE_LRM_RET;
-
 	rclass = ha_msg_value(msg, F_LRM_RCLASS);
 	rtype = ha_msg_value(msg, F_LRM_RTYPE);
 	if( !rclass || !rtype ) {
@@ -1779,38 +2056,81 @@ on_msg_get_rsc_providers(lrmd_client_t* client, struct ha_msg* msg)
 		, 	"%s: can not find the class %s."
 		,	__FUNCTION__
 		,	rclass);
+		send_ret_msg(client->ch_cmd, HA_OK);
+		return HA_OK;
 	}
-	else {
-		if (0 <= RAExec->get_provider_list(rtype, &providers)) {
-			if (providers != NULL) {
-				cl_msg_add_list(ret, F_LRM_RPROVIDERS, providers);
-			}
-			while (NULL != (provider = g_list_first(providers))) {
-				providers = g_list_remove_link(providers, provider);
-				g_free(provider->data);
-				g_list_free_1(provider);
-			}
-			g_list_free(providers);
+
+	req = ra_req_new(client, rclass, rtype, NULL);
+	if (HA_OK != ra_query_start(RAExec, RAQ_PROVIDERS, rtype, NULL
+	,	on_rsc_providers_done, req)) {
+		ra_req_free(req);
+		send_ret_msg(client->ch_cmd, HA_FAIL);
+	}
+	return HA_OK;
+}
+
+/* meta NULL or empty: there is none, tell the client so */
+static void
+send_metadata(lrmd_client_t* client, const char* rclass
+,	const char* provider, const char* rtype, const char* meta)
+{
+	struct ha_msg* ret;
+
+	if ((ret = create_lrm_ret(HA_OK, 5)) == NULL) {
+		lrmd_log(LOG_ERR, "%s: cannot create a ret message"
+		,	__FUNCTION__);
+		return;
+	}
+	if (NULL != meta && *meta != EOS) {
+		if (HA_OK != ha_msg_add(ret,F_LRM_METADATA, meta)) {
+			LOG_FAILED_TO_ADD_FIELD("metadata");
 		}
 	}
+	else {
+		lrmd_log(LOG_WARNING
+		, 	"%s: empty metadata for %s::%s::%s."
+		,	__FUNCTION__
+		,	lrm_str(rclass)
+		,	lrm_str(provider)
+		,	lrm_str(rtype));
+		ha_msg_mod_int(ret, F_LRM_RET, HA_FAIL);
+	}
 
 	if (HA_OK != msg2ipcchan(ret, client->ch_cmd)) {
 		lrmd_log(LOG_ERR,
-			"on_msg_get_rsc_providers: can not send the ret msg");
+			"on_msg_get_metadata: can not send the ret msg");
 	}
 	ha_msg_del(ret);
+}
 
-	return HA_OK;
+static void
+on_metadata_done(int rc, GString* out, gpointer data)
+{
+	struct ra_req* req = data;
+	lrmd_client_t* client;
+	const char* meta = (rc == 0 && out->len > 0) ? out->str : NULL;
+
+	release_query_slot();
+	/* cache it even if nobody is waiting any more */
+	if (meta != NULL) {
+		racache_put(req->rclass, req->provider, req->rtype, meta);
+	}
+	if ((client = ra_req_client(req)) != NULL) {
+		send_metadata(client, req->rclass, req->provider, req->rtype
+		,	meta);
+	}
+	ra_req_free(req);
 }
 
 int
 on_msg_get_metadata(lrmd_client_t* client, struct ha_msg* msg)
 {
-	struct ha_msg* ret = NULL;
 	struct RAExecOps * RAExec = NULL;
+	struct ra_req* req;
 	const char* rtype = NULL;
 	const char* rclass = NULL;
 	const char* provider = NULL;
+	char* meta;
 
 	CHECK_ALLOCATED(client, "client", HA_FAIL);
 	CHECK_ALLOCATED(msg, "message", HA_FAIL);
@@ -1827,43 +2147,193 @@ on_msg_get_metadata(lrmd_client_t* client, struct ha_msg* msg)
 	,	lrm_str(provider)
 	,	lrm_str(rtype));
 
-	ret = create_lrm_ret(HA_OK, 5);
-	CHECK_RETURN_OF_CREATE_LRM_RET;
-
-	RAExec = g_hash_table_lookup(RAExecFuncs,rclass);
+	RAExec = rclass ? g_hash_table_lookup(RAExecFuncs,rclass) : NULL;
 	if (NULL == RAExec) {
 		lrmd_log(LOG_NOTICE
 		, 	"%s: can not find the class %s."
 		,	__FUNCTION__
-		,	rclass);
+		,	lrm_str(rclass));
+		send_ret_msg(client->ch_cmd, HA_OK);
+		return HA_OK;
 	}
-	else {
-		char* meta = RAExec->get_resource_meta(rtype,provider);
-		if (NULL != meta && strlen(meta) > 0) {
-			if (HA_OK != ha_msg_add(ret,F_LRM_METADATA, meta)) {
-				LOG_FAILED_TO_ADD_FIELD("metadata");
-			}
+
+	if (NULL != (meta = racache_get(rclass, provider, rtype))) {
+		send_metadata(client, rclass, provider, rtype, meta);
+		g_free(meta);
+		return HA_OK;
+	}
+	req = ra_req_new(client, rclass, rtype, provider);
+	if (HA_OK != ra_query_start(RAExec, RAQ_META, rtype, provider
+	,	on_metadata_done, req)) {
+		ra_req_free(req);
+		send_metadata(client, rclass, provider, rtype, NULL);
+	}
+	return HA_OK;
+}
+
+/*
+ * GETALLMETAS: the meta-data of all types of a class in one reply.
+ * What is not in the cache is asked for in parallel, as many at a
+ * time as there are free RA process slots (but at least one).
+ */
+struct all_metas_query {
+	struct ra_req*	req;
+	char*		type;
+	char*		provider;
+};
+
+static void all_metas_next(struct ra_req* req);
+
+static void
+all_metas_add(struct ra_req* req, const char* type, const char* provider
+,	const char* meta)
+{
+	char* key = g_strdup_printf("%s:%s", type, provider);
+
+	if (HA_OK != ha_msg_add(req->metas, key, meta)) {
+		LOG_FAILED_TO_ADD_FIELD("metadata");
+	}
+	g_free(key);
+}
+
+static void
+on_all_metas_one_done(int rc, GString* out, gpointer data)
+{
+	struct all_metas_query* q = data;
+	struct ra_req* req = q->req;
+
+	release_query_slot();
+	--req->running;
+	if (rc == 0 && out->len > 0) {
+		racache_put(req->rclass, q->provider, q->type, out->str);
+		all_metas_add(req, q->type, q->provider, out->str);
+	}
+	g_free(q->type);
+	g_free(q->provider);
+	g_free(q);
+	all_metas_next(req);
+}
+
+static void
+all_metas_next(struct ra_req* req)
+{
+	lrmd_client_t* client;
+	struct ha_msg* ret;
+	struct all_metas_query* q;
+	char* line;
+	char* tab;
+
+	/* ours are counted in child_count, but one may always run */
+	while (req->todo != NULL
+	&&	(child_count < max_child_count || req->running == 0)) {
+		line = req->todo->data;
+		req->todo = g_list_delete_link(req->todo, req->todo);
+		tab = strchr(line, '\t');
+		*tab = EOS;
+		q = g_new(struct all_metas_query, 1);
+		q->req = req;
+		q->type = g_strdup(line);
+		q->provider = g_strdup(tab+1);
+		g_free(line);
+		if (HA_OK != ra_query_start(req->RAExec, RAQ_META, q->type
+		,	q->provider, on_all_metas_one_done, q)) {
+			g_free(q->type);
+			g_free(q->provider);
+			g_free(q);
+			continue;
+		}
+		++req->running;
+	}
+	if (req->running > 0) {
+		return;
+	}
+
+	if ((client = ra_req_client(req)) != NULL) {
+		ret = create_lrm_ret(HA_OK, 2);
+		if (ret == NULL
+		||  HA_OK != ha_msg_addstruct(ret, F_LRM_METAS, req->metas)
+		||  HA_OK != msg2ipcchan(ret, client->ch_cmd)) {
+			lrmd_log(LOG_ERR, "%s: can not send the ret msg"
+			,	__FUNCTION__);
+		}
+		if (ret != NULL) {
+			ha_msg_del(ret);
+		}
+	}
+	ra_req_free(req);
+}
+
+static void
+on_all_types_done(int rc, GString* out, gpointer data)
+{
+	struct ra_req* req = data;
+	char* line;
+	char* tab;
+	char* meta;
+	gsize pos = 0;
+
+	release_query_slot();
+	while ((line = raq_next_line(out, &pos)) != NULL) {
+		if ((tab = strchr(line, '\t')) == NULL) {
+			g_free(line);
+			continue;
+		}
+		*tab = EOS;
+		meta = racache_get(req->rclass, tab+1, line);
+		if (meta != NULL) {
+			all_metas_add(req, line, tab+1, meta);
 			g_free(meta);
+			g_free(line);
 		}
 		else {
-			lrmd_log(LOG_WARNING
-			, 	"%s: empty metadata for %s::%s::%s."
-			,	__FUNCTION__
-			,	lrm_str(rclass)
-			,	lrm_str(provider)
-			,	lrm_str(rtype));
-			ha_msg_mod_int(ret, F_LRM_RET, HA_FAIL);
+			*tab = '\t';
+			req->todo = g_list_append(req->todo, line);
 		}
 	}
+	all_metas_next(req);
+}
 
-	if (HA_OK != msg2ipcchan(ret, client->ch_cmd)) {
-		lrmd_log(LOG_ERR,
-			"on_msg_get_metadata: can not send the ret msg");
+int
+on_msg_get_all_metadata(lrmd_client_t* client, struct ha_msg* msg)
+{
+	struct RAExecOps * RAExec = NULL;
+	struct ra_req* req;
+	const char* rclass = NULL;
+
+	CHECK_ALLOCATED(client, "client", HA_FAIL);
+	CHECK_ALLOCATED(msg, "message", HA_FAIL);
+
+	rclass = ha_msg_value(msg, F_LRM_RCLASS);
+	if (rclass == NULL) {
+		lrmd_log(LOG_ERR, "%s: cannot get the resource class field "
+			"from the message.", __FUNCTION__);
+		send_ret_msg(client->ch_cmd, HA_FAIL);
+		return HA_FAIL;
+	}
+
+	lrmd_debug2(LOG_DEBUG, "%s: the client [pid:%d] wants the "
+		"metadata of all types of class %s"
+	,	__FUNCTION__, client->pid, rclass);
+
+	RAExec = g_hash_table_lookup(RAExecFuncs, rclass);
+	if (NULL == RAExec) {
+		lrmd_log(LOG_NOTICE, "%s: can not find the class %s."
+		,	__FUNCTION__, rclass);
+		send_ret_msg(client->ch_cmd, HA_OK);
+		return HA_OK;
 	}
-	ha_msg_del(ret);
 
+	req = ra_req_new(client, rclass, NULL, NULL);
+	req->RAExec = RAExec;
+	if (NULL == (req->metas = ha_msg_new(0))
+	||  HA_OK != ra_query_start(RAExec, RAQ_ALLTYPES, NULL, NULL
+	,	on_all_types_done, req)) {
+		ra_req_free(req);
+		send_ret_msg(client->ch_cmd, HA_FAIL);
+	}
 	return HA_OK;
 }
+
 static void
 add_rid_to_msg(gpointer key, gpointer value, gpointer user_data)
 {
@@ -2415,8 +2885,9 @@ on_msg_perform_op(lrmd_client_t* client, struct ha_msg* msg)
 	op->interval = interval;
 	op->delay = delay;
 	op->weight = no_child_count(rsc) ? 0 : 1;
+	op->sched_class = op_sched_class(ha_msg_value(msg, F_LRM_OP), interval);
 
-	op->msg = ha_msg_copy(msg);
+	op_msg_set(op, ha_msg_copy(msg));
 
 	if( ha_msg_value_int(msg,F_LRM_COPYPARAMS,&op->copyparams) == HA_OK
 			&& op->copyparams ) {
@@ -2437,8 +2908,8 @@ on_msg_perform_op(lrmd_client_t* client, struct ha_msg* msg)
 	,	NULL!=op->rsc_id ? op->rsc_id : "#EMPTY#");
 
 	if ( 0 < op->delay ) {
-		op->repeat_timeout_tag = Gmain_timeout_add(op->delay
-						,on_repeat_op_readytorun, op);
+		tw_add(&op->repeat_timer, op->delay, 0
+		,	on_repeat_op_readytorun, op);
 		rsc->repeat_op_list = 
 			g_list_append (rsc->repeat_op_list, op);
 		lrmd_debug(LOG_DEBUG
@@ -2685,7 +3156,6 @@ record_op_completion(lrmd_rsc_t* rsc, lrmd_op_t* op)
 			, __FUNCTION__, __LINE__);
 		return 1;
 	}
-	rsc->last_op_done->repeat_timeout_tag = (guint)0;
 
 	client = lookup_client(op->client_id);
 	if (!client) {
@@ -2704,6 +3174,7 @@ static void
 to_repeatlist(lrmd_rsc_t* rsc, lrmd_op_t* op)
 {
 	lrmd_op_t *repeat_op;
+	unsigned long repeat_interval;
 
 	if (!(repeat_op = lrmd_op_copy(op))) {
 		lrmd_log(LOG_ERR, "%s:%d out of memory" 
@@ -2711,9 +3182,18 @@ to_repeatlist(lrmd_rsc_t* rsc, lrmd_op_t* op)
 	}
 	reset_timestamps(repeat_op);
 	repeat_op->is_copy = FALSE;
-	repeat_op->repeat_timeout_tag = 
-		Gmain_timeout_add(op->interval,	
-				on_repeat_op_readytorun, repeat_op);
+	repeat_interval = op->interval;
+	if (monitor_spread && !repeat_op->phase_spread) {
+		/* move the first repetition by a part of the interval,
+		 * so that the monitors of the same interval started
+		 * together won't keep running together */
+		repeat_interval += tw_spread(op->interval)
+			* monitor_spread / 100;
+		repeat_op->phase_spread = TRUE;
+	}
+	tw_add(&repeat_op->repeat_timer, repeat_interval
+	,	(unsigned long)op->interval * monitor_jitter / 100
+	,	on_repeat_op_readytorun, repeat_op);
 	rsc->repeat_op_list = 
 		g_list_append (rsc->repeat_op_list, repeat_op);
 	lrmd_debug2(LOG_DEBUG
@@ -2825,7 +3305,7 @@ on_op_done(lrmd_rsc_t* rsc, lrmd_op_t* op)
 		&& ((last_rc == -1) || (last_rc != op_rc))
 	);
 	if (rc_changed) {
-		if (HA_OK != ha_msg_mod_int(op->msg, F_LRM_LASTRC, op_rc)) {
+		if (HA_OK != ha_msg_mod_int(op_msg_w(op), F_LRM_LASTRC, op_rc)) {
 			lrmd_log(LOG_ERR,"%s: cannot save status to msg",__FUNCTION__);
 			return HA_FAIL;
 		}
@@ -2846,7 +3326,7 @@ on_op_done(lrmd_rsc_t* rsc, lrmd_op_t* op)
 				to_repeatlist(rsc,op);
 		}
 	} else {
-		if (HA_OK != ha_msg_mod_int(op->msg,F_LRM_OPSTATUS,(int)LRM_OP_CANCELLED)) {
+		if (HA_OK != ha_msg_mod_int(op_msg_w(op),F_LRM_OPSTATUS,(int)LRM_OP_CANCELLED)) {
 			LOG_FAILED_TO_ADD_FIELD(F_LRM_OPSTATUS);
 			return HA_FAIL;
 		}
@@ -2855,7 +3335,7 @@ on_op_done(lrmd_rsc_t* rsc, lrmd_op_t* op)
 	}
 
 	if (rsc_removal_pending(rsc)) {
-		if (HA_OK != ha_msg_add_int(op->msg,F_LRM_RSCDELETED,1)) {
+		if (HA_OK != ha_msg_add_int(op_msg_w(op),F_LRM_RSCDELETED,1)) {
 			LOG_FAILED_TO_ADD_FIELD(F_LRM_RSCDELETED);
 		}
 	}
@@ -2899,13 +3379,13 @@ flush_op(lrmd_op_t* op)
 		return HA_FAIL;
 	}
 
-	if (HA_OK != ha_msg_mod_int(op->msg, F_LRM_RC, HA_FAIL)) {
+	if (HA_OK != ha_msg_mod_int(op_msg_w(op), F_LRM_RC, HA_FAIL)) {
 		LOG_FAILED_TO_ADD_FIELD("F_LRM_RC");
 		return HA_FAIL;
 	}
 
 	if( op->exec_pid == -1 ) {
-		if (HA_OK != ha_msg_mod_int(op->msg,F_LRM_OPSTATUS,(int)LRM_OP_CANCELLED)){
+		if (HA_OK != ha_msg_mod_int(op_msg_w(op),F_LRM_OPSTATUS,(int)LRM_OP_CANCELLED)){
 			LOG_FAILED_TO_ADD_FIELD("opstatus");
 			return HA_FAIL;
 		}
@@ -2989,19 +3469,18 @@ perform_op(lrmd_rsc_t* rsc)
 			}
 			break;
 		}
-		if (op->weight && child_count >= max_child_count) {
-			if ((int)rsc->delay_timeout > 0) {
-				lrmd_log(LOG_INFO
-				,	"%s:%d: max_child_count (%d) reached and operations on resource %s already delayed"
-				, __FUNCTION__, __LINE__, max_child_count, lrm_str(rsc->id));
-			} else {
+		if (op->weight && rsc != runq_current
+		&& (child_count >= max_child_count || runq_len)) {
+			/* wait for a free child slot along with the others;
+			 * runq_dispatch() decides who gets it */
+			if (child_count >= max_child_count) {
 				lrmd_debug(LOG_NOTICE
-				, 	"max_child_count (%d) reached, postponing "
-					"execution of %s by %d ms"
-				, 	max_child_count, op_info(op), retry_interval);
-				rsc->delay_timeout = Gmain_timeout_add(retry_interval
-						, rsc_execution_freeze_timeout, rsc);
+				, 	"max_child_count (%d) reached, queueing "
+					"execution of %s"
+				, 	max_child_count, small_op_info(op));
 			}
+			runq_add(rsc);
+			runq_dispatch();
 			break;
 		}
 
@@ -3009,7 +3488,7 @@ perform_op(lrmd_rsc_t* rsc)
 			lrmd_log(LOG_ERR
 			,	"unable to perform_ra_op on %s"
 			,	op_info(op));
-			if (HA_OK != ha_msg_add_int(op->msg, F_LRM_OPSTATUS,
+			if (HA_OK != ha_msg_add_int(op_msg_w(op), F_LRM_OPSTATUS,
 						LRM_OP_ERROR)) {
 				LOG_FAILED_TO_ADD_FIELD("opstatus");
 			}
@@ -3025,10 +3504,166 @@ perform_op(lrmd_rsc_t* rsc)
 	return HA_OK;
 }
 
+static int
+op_sched_class(const char* op_type, int interval)
+{
+	if (op_type == NULL) {
+		return SCHED_CLASS_OTHER;
+	}
+	if (!strcmp(op_type, "monitor") || !strcmp(op_type, "status")) {
+		return interval ? SCHED_CLASS_MONITOR : SCHED_CLASS_PROBE;
+	}
+	if (!strcmp(op_type, "start") || !strcmp(op_type, "stop")
+	||	!strcmp(op_type, "promote") || !strcmp(op_type, "demote")
+	||	!strcmp(op_type, "migrate_to")
+	||	!strcmp(op_type, "migrate_from")) {
+		return SCHED_CLASS_STATE;
+	}
+	return SCHED_CLASS_OTHER;
+}
+
+/*
+ * The run queue is a FIFO of resources per scheduling class and
+ * client (struct runq_client), filed by the op at the head of the
+ * resource's op_list. Only the heads of these are looked at when a
+ * slot is free, so picking doesn't get slower as the queue grows.
+ */
+struct runq_client
+{
+	pid_t		client_id;
+	GQueue		rscs;
+};
+
+static void
+runq_add(lrmd_rsc_t* rsc)
+{
+	lrmd_op_t* op;
+	struct runq_client* rq = NULL;
+	GList* node;
+	int class = SCHED_CLASS_OTHER;
+	pid_t client_id = 0;
+
+	if (rsc->in_run_queue) {
+		return;
+	}
+	if (rsc->op_list != NULL) {
+		op = (lrmd_op_t*)rsc->op_list->data;
+		class = op->sched_class;
+		client_id = op->client_id;
+	}
+	for (node = run_queue[class]; node; node = g_list_next(node)) {
+		if (((struct runq_client*)node->data)->client_id == client_id) {
+			rq = node->data;
+			break;
+		}
+	}
+	if (rq == NULL) {
+		rq = g_new0(struct runq_client, 1);
+		rq->client_id = client_id;
+		run_queue[class] = g_list_append(run_queue[class], rq);
+	}
+	g_queue_push_tail(&rq->rscs, rsc);
+	rsc->runq_link = rq->rscs.tail;
+	rsc->runq_client = rq;
+	rsc->runq_class = class;
+	rsc->t_runq = time_longclock();
+	rsc->in_run_queue = TRUE;
+	++runq_len;
+	lrmd_debug2(LOG_DEBUG, "%s: resource %s waits for a child slot "
+		"(%d in the run queue)"
+	,	__FUNCTION__, lrm_str(rsc->id), runq_len);
+}
+
+static void
+runq_remove(lrmd_rsc_t* rsc)
+{
+	struct runq_client* rq = rsc->runq_client;
+
+	if (!rsc->in_run_queue) {
+		return;
+	}
+	g_queue_delete_link(&rq->rscs, rsc->runq_link);
+	if (g_queue_is_empty(&rq->rscs)) {
+		run_queue[rsc->runq_class] =
+			g_list_remove(run_queue[rsc->runq_class], rq);
+		g_free(rq);
+	}
+	rsc->runq_link = NULL;
+	rsc->runq_client = NULL;
+	rsc->in_run_queue = FALSE;
+	--runq_len;
+}
+
+/*
+ * Pick the resource whose next operation should get the next
+ * free child slot, from the heads of the per class and client
+ * FIFOs: the lowest scheduling class goes first (resources move
+ * up a class for every SCHED_AGING_MS spent waiting, so that
+ * monitors and probes are not starved), then the one of the client
+ * which currently has the fewest ops running, then the one which
+ * has been waiting the longest.
+ */
+static lrmd_rsc_t*
+runq_pick(void)
+{
+	GList* node;
+	struct runq_client* rq;
+	lrmd_rsc_t* rsc;
+	lrmd_rsc_t* best = NULL;
+	lrmd_client_t* client;
+	longclock_t now = time_longclock();
+	int class, prio, load;
+	int best_prio = 0, best_load = 0;
+
+	for (class = 0; class < SCHED_CLASSES; class++) {
+		for (node = run_queue[class]; node; node = g_list_next(node)) {
+			rq = (struct runq_client*)node->data;
+			rsc = (lrmd_rsc_t*)g_queue_peek_head(&rq->rscs);
+			if (rsc->op_list == NULL) {
+				/* nothing to run; let perform_op() drop it */
+				return rsc;
+			}
+			prio = class
+				- (int)(longclockto_ms(sub_longclock(now
+				,	rsc->t_runq)) / SCHED_AGING_MS);
+			client = lookup_client(rq->client_id);
+			load = client ? client->running_ops : 0;
+			if (best == NULL || prio < best_prio
+			||	(prio == best_prio && load < best_load)
+			||	(prio == best_prio && load == best_load
+				&& cmp_longclock(rsc->t_runq, best->t_runq) < 0)) {
+				best = rsc;
+				best_prio = prio;
+				best_load = load;
+			}
+		}
+	}
+	return best;
+}
+
+/* hand out free child slots to the resources in the run queue */
+static void
+runq_dispatch(void)
+{
+	lrmd_rsc_t* rsc;
+
+	if (runq_current != NULL) {
+		/* perform_op() called us while dispatching */
+		return;
+	}
+	while (runq_len > 0 && child_count < max_child_count) {
+		rsc = runq_pick();
+		runq_remove(rsc);
+		runq_current = rsc;
+		perform_op(rsc);
+		runq_current = NULL;
+	}
+}
+
 static int
 store_timestamps(lrmd_op_t* op)
 {
-	struct ha_msg* msg = op->msg;
+	struct ha_msg* msg = op_msg_w(op);
 	longclock_t	now = time_longclock(), /* tm2unix() needs this */
 		exec_time = zero_longclock,
 		queue_time = zero_longclock;
@@ -3039,12 +3674,17 @@ store_timestamps(lrmd_op_t* op)
 		if (op->t_done) {
 			exec_time =
 				longclockto_ms(sub_longclock(op->t_done,op->t_perform));
+			if (op->weight) {
+				adapt_record_op((unsigned long)exec_time
+				,	(unsigned long)queue_time);
+			}
 		}
 	}
 	if ((HA_OK!=ha_msg_mod_ul(msg,F_LRM_T_RUN,tm2unix(op->t_perform)))
 		|| (HA_OK!=ha_msg_mod_ul(msg,F_LRM_T_RCCHANGE,tm2unix(op->t_rcchange)))
 		|| (HA_OK!=ha_msg_mod_ul(msg,F_LRM_EXEC_TIME,exec_time))
 		|| (HA_OK!=ha_msg_mod_ul(msg,F_LRM_QUEUE_TIME,queue_time))
+		|| (HA_OK!=ha_msg_mod_ul(msg,F_LRM_SPAWN_TIME,op->spawn_us))
 	) {
 		lrmd_log(LOG_ERR,"%s: can not save timestamps to msg",__FUNCTION__);
 		return 1;
@@ -3052,15 +3692,26 @@ store_timestamps(lrmd_op_t* op)
 	return 0;
 }
 
+/* those of an earlier run, in an op which hasn't run (again) */
+static void
+strip_timestamps(struct ha_msg* msg)
+{
+	cl_msg_remove(msg, F_LRM_T_RUN);
+	cl_msg_remove(msg, F_LRM_T_RCCHANGE);
+	cl_msg_remove(msg, F_LRM_EXEC_TIME);
+	cl_msg_remove(msg, F_LRM_QUEUE_TIME);
+	cl_msg_remove(msg, F_LRM_SPAWN_TIME);
+}
+
 static void
 reset_timestamps(lrmd_op_t* op)
 {
+	/* the timestamps in the (shared) message are left alone;
+	 * op_to_msg() and notify_client() don't report them until
+	 * the op is done again */
 	op->t_perform = zero_longclock;
 	op->t_done = zero_longclock;
-	cl_msg_remove(op->msg, F_LRM_T_RUN);
-	cl_msg_remove(op->msg, F_LRM_T_RCCHANGE);
-	cl_msg_remove(op->msg, F_LRM_EXEC_TIME);
-	cl_msg_remove(op->msg, F_LRM_QUEUE_TIME);
+	op->spawn_us = 0;
 }
 
 struct ha_msg*
@@ -3078,6 +3729,9 @@ op_to_msg(lrmd_op_t* op)
 		lrmd_log(LOG_ERR,"%s: can not copy the msg",__FUNCTION__);
 		return NULL;
 	}
+	if (!op->t_done) {
+		strip_timestamps(msg);
+	}
 	if ((HA_OK!=ha_msg_mod_int(msg,F_LRM_CALLID,op->call_id))) {
 		lrmd_log(LOG_ERR,"%s: can not save F_LRM_CALLID to msg",__FUNCTION__);
 		ha_msg_del(msg);
@@ -3086,6 +3740,203 @@ op_to_msg(lrmd_op_t* op)
 	return msg;
 }
 
+/*
+ * In the child: run the RA with its stdout and stderr going to the
+ * fds given. Doesn't return. The executors use it too (executor.c).
+ */
+void
+ra_child_exec(const char* rsc_id, const char* rclass, const char* rtype
+,	const char* provider, const char* op_type, int timeout
+,	GHashTable* params, int stdout_fd, int stderr_fd)
+{
+	struct RAExecOps * RAExec = NULL;
+
+#ifdef DEFAULT_REALTIME_POLICY
+	if (sched_getscheduler(0) != SCHED_OTHER) {
+		struct sched_param sp;
+		lrmd_debug(LOG_DEBUG,
+			"perform_ra_op: resetting scheduler class to SCHED_OTHER");
+		sp.sched_priority = 0;
+		if (sched_setscheduler(0, SCHED_OTHER, &sp) == -1)
+			cl_perror("%s::%d: sched_setscheduler",
+				__FUNCTION__, __LINE__);
+	}
+#endif
+	/* Man: The call setpgrp() is equivalent to setpgid(0,0)
+	 * _and_ compiles on BSD variants too
+	 * need to investigate if it works the same too.
+	 */
+	setpgid(0,0);
+	if (STDOUT_FILENO != stdout_fd) {
+		if (dup2(stdout_fd, STDOUT_FILENO)!=STDOUT_FILENO) {
+			cl_perror("%s::%d: dup2"
+				, __FUNCTION__, __LINE__);
+		}
+		close(stdout_fd);
+	}
+	if (STDERR_FILENO != stderr_fd) {
+		if (dup2(stderr_fd, STDERR_FILENO)!=STDERR_FILENO) {
+			cl_perror("%s::%d: dup2", __FUNCTION__, __LINE__);
+		}
+		close(stderr_fd);
+	}
+	RAExec = rclass ? g_hash_table_lookup(RAExecFuncs,rclass) : NULL;
+	if (NULL == RAExec || NULL == rsc_id || NULL == op_type) {
+		lrmd_log(LOG_ERR,"%s::%d: can't find RAExec for class %s"
+		, __FUNCTION__, __LINE__, lrm_str(rclass));
+		exit(EXECRA_EXEC_UNKNOWN_ERROR);
+	}
+
+	/*should we use logging daemon or not in script*/
+	setenv(HALOGD, cl_log_get_uselogd()?"yes":"no",1);
+
+	/* Name of the resource and some others also
+	 * need to be passed in. Maybe pass through the
+	 * entire lrm_op_t too? */
+	lrmd_debug2(LOG_DEBUG
+	,	"perform_ra_op:calling RA plugin to perform %s:%s, pid: [%d]"
+	,	rsc_id, op_type, getpid());
+
+	if (replace_secret_params(rsc_id, params) < 0) {
+		/* replacing secrets failed! */
+		if (!strcmp(op_type,"stop")) {
+			/* don't fail on stop! */
+			lrmd_log(LOG_INFO
+			, "%s:%d: proceeding with the stop operation for %s"
+			, __FUNCTION__, __LINE__, rsc_id);
+		} else {
+			lrmd_log(LOG_ERR
+			, "%s:%d: failed to get secrets for %s, "
+			"considering resource not configured"
+			, __FUNCTION__, __LINE__, rsc_id);
+			exit(EXECRA_NOT_CONFIGURED);
+		}
+	}
+	RAExec->execra (rsc_id,
+			rtype,
+			provider,
+			op_type,
+			timeout,
+			params);
+
+	/* execra should never return. */
+	exit(EXECRA_EXEC_UNKNOWN_ERROR);
+}
+
+/*
+ * Have an executor start the RA, if there are any (-e).
+ */
+static pid_t
+exec_ra(lrmd_rsc_t* rsc, lrmd_op_t* op, const char* op_type, int timeout
+,	int stdout_fd, int stderr_fd)
+{
+	GHashTable* params;
+	GHashTable* op_params;
+	pid_t pid;
+
+	if (executor_count() == 0) {
+		return -1;
+	}
+	op_params = ha_msg_value_str_table(op->msg, F_LRM_PARAM);
+	params = merge_str_tables(rsc->params, op_params);
+	if (op_params) {
+		free_str_table(op_params);
+	}
+	pid = executor_run(rsc->id, rsc->class, rsc->type, rsc->provider
+	,	op_type, timeout, params, stdout_fd, stderr_fd);
+	free_str_table(params);
+	return pid;
+}
+
+#ifdef LRMD_SPAWN
+/*
+ * Start the RA with posix_spawn() if its plugin can tell us what to
+ * run (see prepare_exec in raexec.h). That doesn't copy lrmd and the
+ * arguments and environment are prepared here, not in the child.
+ * -1 if it can't be done this way; perform_ra_op() forks then.
+ */
+static pid_t
+spawn_ra(lrmd_rsc_t* rsc, lrmd_op_t* op, const char* op_type, int timeout
+,	int stdout_fd, int stderr_fd)
+{
+	struct RASpawnOps * RASpawn;
+	GHashTable* params;
+	GHashTable* op_params;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	short flags;
+	char* path = NULL;
+	char** argv = NULL;
+	char** envp = NULL;
+	pid_t pid;
+	int rc;
+
+	RASpawn = g_hash_table_lookup(RASpawnFuncs, rsc->class);
+	if (NULL == RASpawn) {
+		return -1;
+	}
+
+	op_params = ha_msg_value_str_table(op->msg, F_LRM_PARAM);
+	params = merge_str_tables(rsc->params, op_params);
+	if (op_params) {
+		free_str_table(op_params);
+	}
+	/* on failure the forked child decides what to do */
+	if (replace_secret_params(rsc->id, params) < 0) {
+		free_str_table(params);
+		return -1;
+	}
+	/* HALOGD is set in envp, by raexec_envp() */
+	rc = RASpawn->prepare_exec(rsc->id, rsc->type, rsc->provider, op_type
+	,	timeout, params, &path, &argv, &envp);
+	free_str_table(params);
+	if (rc != 0) {
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, stdout_fd, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, stderr_fd, STDERR_FILENO);
+	posix_spawn_file_actions_addclosefrom_np(&fa, STDERR_FILENO + 1);
+
+	posix_spawnattr_init(&attr);
+	flags = POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF;
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigfillset(&sigs);
+	sigdelset(&sigs, SIGKILL);
+	sigdelset(&sigs, SIGSTOP);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+#ifdef DEFAULT_REALTIME_POLICY
+	if (sched_getscheduler(0) != SCHED_OTHER) {
+		struct sched_param sp;
+
+		sp.sched_priority = 0;
+		flags |= POSIX_SPAWN_SETSCHEDULER;
+		posix_spawnattr_setschedpolicy(&attr, SCHED_OTHER);
+		posix_spawnattr_setschedparam(&attr, &sp);
+	}
+#endif
+	posix_spawnattr_setflags(&attr, flags);
+
+	rc = posix_spawn(&pid, path, &fa, &attr, argv, envp);
+	if (rc != 0) {
+		/* the forked child reports it as the RA would */
+		lrmd_debug(LOG_DEBUG, "%s: cannot spawn %s: %s"
+		,	__FUNCTION__, path, strerror(rc));
+		pid = -1;
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	g_free(path);
+	g_strfreev(argv);
+	g_strfreev(envp);
+	return pid;
+}
+#endif
+
 /* //////////////////////////////RA wrap funcs/////////////////////////////////// */
 int
 perform_ra_op(lrmd_op_t* op)
@@ -3094,25 +3945,18 @@ perform_ra_op(lrmd_op_t* op)
 	int stderr_fd[2];
 	pid_t pid;
 	int timeout;
-	struct RAExecOps * RAExec = NULL;
 	const char* op_type = NULL;
         GHashTable* params = NULL;
         GHashTable* op_params = NULL;
 	lrmd_rsc_t* rsc = NULL;
+	lrmd_client_t* client = NULL;
 	ra_pipe_op_t * rapop;
+	unsigned long long t_fork;
 
 	LRMAUDIT();
 	CHECK_ALLOCATED(op, "op", HA_FAIL);
 	rsc = (lrmd_rsc_t*)lookup_rsc(op->rsc_id);
 	CHECK_ALLOCATED(rsc, "rsc", HA_FAIL);
-	
-	if ( pipe(stdout_fd) < 0 ) {
-		cl_perror("%s::%d: pipe", __FUNCTION__, __LINE__);
-	}
-
-	if ( pipe(stderr_fd) < 0 ) {
-		cl_perror("%s::%d: pipe", __FUNCTION__, __LINE__);
-	}
 
 	if (op->exec_pid == 0) {
 		lrmd_log(LOG_ERR, "%s::%d: op->exec_pid == 0.", __FUNCTION__, __LINE__);
@@ -3133,7 +3977,41 @@ perform_ra_op(lrmd_op_t* op)
 		cl_perror("%s::%d: failed to raise privileges"
 		, __FUNCTION__, __LINE__);
 	}
-	switch(pid=fork()) {
+	if (HA_OK == raworker_run(g_hash_table_lookup(RAExecFuncs, rsc->class)
+	,	g_hash_table_lookup(RASpawnFuncs, rsc->class)
+	,	rsc, op, op_type, timeout)) {
+		op->spawn_us = 0;
+		child_count += op->weight;
+		if ((client = lookup_client(op->client_id)) != NULL) {
+			client->running_ops += op->weight;
+		}
+		if( return_to_dropped_privs() ) {
+			lrmd_log(LOG_WARNING,"%s::%d: failed to drop privileges: %s"
+			, __FUNCTION__, __LINE__, strerror(errno));
+		}
+		LRMAUDIT();
+		return HA_OK;
+	}
+
+	if ( pipe(stdout_fd) < 0 ) {
+		cl_perror("%s::%d: pipe", __FUNCTION__, __LINE__);
+	}
+
+	if ( pipe(stderr_fd) < 0 ) {
+		cl_perror("%s::%d: pipe", __FUNCTION__, __LINE__);
+	}
+	t_fork = ipc_time_us();
+	pid = exec_ra(rsc, op, op_type, timeout, stdout_fd[1], stderr_fd[1]);
+#ifdef LRMD_SPAWN
+	if (pid < 0) {
+		pid = spawn_ra(rsc, op, op_type, timeout
+		,	stdout_fd[1], stderr_fd[1]);
+	}
+#endif
+	if (pid < 0) {
+		pid = fork();
+	}
+	switch(pid) {
 		case -1:
 			cl_perror("%s::%d: fork", __FUNCTION__, __LINE__);
 			close(stdout_fd[0]);
@@ -3147,7 +4025,11 @@ perform_ra_op(lrmd_op_t* op)
 			return HA_FAIL;
 
 		default:	/* Parent */
+			op->spawn_us = ipc_time_us() - t_fork;
 			child_count += op->weight;
+			if ((client = lookup_client(op->client_id)) != NULL) {
+				client->running_ops += op->weight;
+			}
 			NewTrackedProc(pid, 1
 			,	debug_level ?
 				((op->interval && !is_logmsg_due(op)) ? PT_LOGNORMAL : PT_LOGVERBOSE) : PT_LOGNONE
@@ -3200,88 +4082,18 @@ perform_ra_op(lrmd_op_t* op)
 			return HA_OK;
 
 		case 0:		/* Child */
-#ifdef DEFAULT_REALTIME_POLICY
-			if (sched_getscheduler(0) != SCHED_OTHER) {
-				struct sched_param sp;
-				lrmd_debug(LOG_DEBUG,
-					"perform_ra_op: resetting scheduler class to SCHED_OTHER");
-				sp.sched_priority = 0;
-				if (sched_setscheduler(0, SCHED_OTHER, &sp) == -1)
-					cl_perror("%s::%d: sched_setscheduler",
-						__FUNCTION__, __LINE__);
-			}
-#endif
-			/* Man: The call setpgrp() is equivalent to setpgid(0,0)
-			 * _and_ compiles on BSD variants too
-			 * need to investigate if it works the same too.
-			 */
-			setpgid(0,0);
 			close(stdout_fd[0]);
 			close(stderr_fd[0]);
-			if (STDOUT_FILENO != stdout_fd[1]) {
-				if (dup2(stdout_fd[1], STDOUT_FILENO)!=STDOUT_FILENO) {
-					cl_perror("%s::%d: dup2"
-						, __FUNCTION__, __LINE__);
-				}
-				close(stdout_fd[1]);
-			}
-			if (STDERR_FILENO != stderr_fd[1]) {
-				if (dup2(stderr_fd[1], STDERR_FILENO)!=STDERR_FILENO) {
-					cl_perror("%s::%d: dup2", __FUNCTION__, __LINE__);
-				}
-				close(stderr_fd[1]);
-			}
-			RAExec = g_hash_table_lookup(RAExecFuncs,rsc->class);
-			if (NULL == RAExec) {
-				close(stdout_fd[1]);
-				close(stderr_fd[1]);
-				lrmd_log(LOG_ERR,"%s::%d: can't find RAExec for class %s"
-				, __FUNCTION__, __LINE__, rsc->class);
-				exit(EXECRA_EXEC_UNKNOWN_ERROR);
-			}
-			
-			/*should we use logging daemon or not in script*/
-			setenv(HALOGD, cl_log_get_uselogd()?"yes":"no",1);
-
-			/* Name of the resource and some others also
-			 * need to be passed in. Maybe pass through the
-			 * entire lrm_op_t too? */
-			lrmd_debug2(LOG_DEBUG
-			,	"perform_ra_op:calling RA plugin to perform %s, pid: [%d]"
-			,	op_info(op), getpid());		
-
 			op_params = ha_msg_value_str_table(op->msg, F_LRM_PARAM);
 			params = merge_str_tables(rsc->params,op_params);
 			if (op_params) {
 				free_str_table(op_params);
 				op_params = NULL;
 			}
-
-			if (replace_secret_params(rsc->id, params) < 0) {
-				/* replacing secrets failed! */
-				if (!strcmp(op_type,"stop")) {
-					/* don't fail on stop! */
-					lrmd_log(LOG_INFO
-					, "%s:%d: proceeding with the stop operation for %s"
-					, __FUNCTION__, __LINE__, rsc->id);
-				} else {
-					lrmd_log(LOG_ERR
-					, "%s:%d: failed to get secrets for %s, "
-					"considering resource not configured"
-					, __FUNCTION__, __LINE__, rsc->id);
-					exit(EXECRA_NOT_CONFIGURED);
-				}
-			}
-			RAExec->execra (rsc->id,
-					rsc->type,
-					rsc->provider,
-					op_type,
-					timeout,
-					params);
-
-			/* execra should never return. */
-			exit(EXECRA_EXEC_UNKNOWN_ERROR);
-
+			ra_child_exec(rsc->id, rsc->class, rsc->type
+			,	rsc->provider, op_type, timeout, params
+			,	stdout_fd[1], stderr_fd[1]);
+			/* not reached */
 	}
 	lrmd_log(LOG_ERR, "perform_ra_op: end(impossible).");
 	return HA_OK;
@@ -3292,12 +4104,78 @@ on_ra_proc_registered(ProcTrack* p)
 {
 }
 
+/* the fields go to logd separately, for whoever wants to filter on them */
+static void
+log_op_exit(lrmd_op_t* op, const char* op_type, pid_t pid, int rc
+,	int exitcode)
+{
+	struct cl_logfield	fields[5];
+
+	memset(fields, 0, sizeof(fields));
+	fields[0].key = CL_LOGF_RSC;
+	fields[0].str = lrm_str(op->rsc_id);
+	fields[1].key = CL_LOGF_OP;
+	fields[1].str = lrm_str(op_type);
+	fields[2].key = CL_LOGF_CALLID;
+	fields[2].ival = op->call_id;
+	fields[3].key = CL_LOGF_RC;
+	fields[3].ival = rc;
+	fields[4].key = CL_LOGF_EXECMS;
+	fields[4].ival = longclockto_ms(sub_longclock(time_longclock()
+	,	op->t_perform));
+
+	if (rc == exitcode) {
+		cl_log_fields(LOG_INFO, fields, DIMOF(fields)
+		,	"%s: pid %d exited with return code %d"
+		,	small_op_info(op), pid, rc);
+	}else{
+		cl_log_fields(LOG_INFO, fields, DIMOF(fields)
+		,	"%s: pid %d exited with return code %d (mapped from %d)"
+		,	small_op_info(op), pid, rc, exitcode);
+	}
+}
+
+/* give back the child slot of the op */
+static void
+release_op_slot(lrmd_op_t* op)
+{
+	lrmd_client_t* client = NULL;
+
+	child_count -= op->weight;
+	if (child_count < 0) {
+		lrmd_log(LOG_ERR, "%s:%d: child count is less than zero: %d"
+			, __FUNCTION__, __LINE__, child_count);
+		child_count = 0;
+	}
+	client = lookup_client(op->client_id);
+	if (client != NULL && client->running_ops >= op->weight) {
+		client->running_ops -= op->weight;
+	}
+}
+
 /* Handle one of our ra child processes finished*/
 static void
 on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 ,	int waslogged)
 {
-	lrmd_op_t* op = NULL;
+	LRMAUDIT();
+
+	CHECK_ALLOCATED(p, "ProcTrack p", );
+	RemoveTrackedProcTimeouts(proctrack_pid(p));
+	ra_op_finished(proctrack_data(p), proctrack_pid(p), signo
+	,	proctrack_timedout(p), exitcode);
+	reset_proctrack_data(p);
+}
+
+/*
+ * The op is done, either its RA process exited or its worker
+ * (raworker.c) answered. signo is the signal which killed it, if
+ * any, timedout whether that was for the timeout.
+ */
+void
+ra_op_finished(lrmd_op_t* op, pid_t pid, int signo, gboolean timedout
+,	int exitcode)
+{
 	lrmd_rsc_t* rsc = NULL;
 	struct RAExecOps * RAExec = NULL;
 	const char* op_type;
@@ -3305,27 +4183,16 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
         int ret;
 	int op_status;
 
-	LRMAUDIT();
-
-	CHECK_ALLOCATED(p, "ProcTrack p", );
-	op = proctrack_data(p);
+	release_op_slot(op);
 
-	child_count -= op->weight;
-	if (child_count < 0) {
-		lrmd_log(LOG_ERR, "%s:%d: child count is less than zero: %d"
-			, __FUNCTION__, __LINE__, child_count);
-		child_count = 0;
-	}
-
-	lrmd_debug2(LOG_DEBUG, "on_ra_proc_finished: accessing the op whose "
-		  "address is %p", op);
+	lrmd_debug2(LOG_DEBUG, "%s: accessing the op whose "
+		  "address is %p", __FUNCTION__, op);
 	CHECK_ALLOCATED(op, "op", );
 	if (op->exec_pid == 0) {
-		lrmd_log(LOG_ERR, "on_ra_proc_finished: the op was freed.");
+		lrmd_log(LOG_ERR, "%s: the op was freed.", __FUNCTION__);
 		dump_data_for_debug();
 		return;
 	}
-	RemoveTrackedProcTimeouts(op->exec_pid);
 	op->exec_pid = -1;
 
 	rsc = lookup_rsc(op->rsc_id);
@@ -3336,15 +4203,15 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 		lrmd_dump_all_resources();
 		/* delete the op */
 		lrmd_op_destroy(op);
-		reset_proctrack_data(p);
+		runq_dispatch();
 		LRMAUDIT();
 		return;
 	}
 
 	RAExec = g_hash_table_lookup(RAExecFuncs,rsc->class);
 	if (NULL == RAExec) {
-		lrmd_log(LOG_ERR,"on_ra_proc_finished: can not find RAExec for"
-			" resource class <%s>", rsc->class);
+		lrmd_log(LOG_ERR,"%s: can not find RAExec for"
+			" resource class <%s>", __FUNCTION__, rsc->class);
 		dump_data_for_debug();
 		return;
 	}
@@ -3368,9 +4235,9 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 	}
 
 	if( signo ) {
-		if( proctrack_timedout(p) ) {
+		if( timedout ) {
 			lrmd_log(LOG_WARNING,	"%s: pid %d timed out"
-			, small_op_info(op), proctrack_pid(p));
+			, small_op_info(op), pid);
 			op_status = LRM_OP_TIMEOUT;
 		} else {
 			op_status = LRM_OP_ERROR;
@@ -3379,21 +4246,12 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 		rc = RAExec->map_ra_retvalue(exitcode, op_type
 						 , op->first_line_ra_stdout);
 		if (!op->interval || is_logmsg_due(op) || debug_level > 0) { /* log non-repeating ops */
-			if (rc == exitcode) {
-				lrmd_log(LOG_INFO
-				,	"%s: pid %d exited with"
-				" return code %d", small_op_info(op), proctrack_pid(p), rc);
-			}else{
-				lrmd_log(LOG_INFO
-				,	"%s: pid %d exited with"
-				" return code %d (mapped from %d)"
-				,	small_op_info(op), proctrack_pid(p), rc, exitcode);
-			}
+			log_op_exit(op, op_type, pid, rc, exitcode);
 		}
 		if (EXECRA_EXEC_UNKNOWN_ERROR == rc || EXECRA_NO_RA == rc) {
 			op_status = LRM_OP_ERROR;
 			lrmd_log(LOG_CRIT
-			,	"on_ra_proc_finished: the exit code indicates a problem.");
+			,	"%s: the exit code indicates a problem.", __FUNCTION__);
 		} else {
 			op_status = LRM_OP_DONE;
 		}
@@ -3402,20 +4260,20 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 		op->t_lastlogmsg = time_longclock();
 	}
 	if (HA_OK !=
-			ha_msg_mod_int(op->msg, F_LRM_OPSTATUS, op_status)) {
+			ha_msg_mod_int(op_msg_w(op), F_LRM_OPSTATUS, op_status)) {
 		LOG_FAILED_TO_ADD_FIELD("opstatus");
 		return ;
 	}
-	if (HA_OK != ha_msg_mod_int(op->msg, F_LRM_RC, rc)) {
+	if (HA_OK != ha_msg_mod_int(op_msg_w(op), F_LRM_RC, rc)) {
 		LOG_FAILED_TO_ADD_FIELD("F_LRM_RC");
 		return ;
 	}
 
 	if ( 0 < strlen(op->first_line_ra_stdout) ) {
 		if (NULL != cl_get_string(op->msg, F_LRM_DATA)) {
-			cl_msg_remove(op->msg, F_LRM_DATA);
+			cl_msg_remove(op_msg_w(op), F_LRM_DATA);
 		}
-		ret = ha_msg_add(op->msg, F_LRM_DATA, op->first_line_ra_stdout);
+		ret = ha_msg_add(op_msg_w(op), F_LRM_DATA, op->first_line_ra_stdout);
 		if (HA_OK != ret) {
 			LOG_FAILED_TO_ADD_FIELD("data");
 		}
@@ -3424,10 +4282,29 @@ on_ra_proc_finished(ProcTrack* p, int status, int signo, int exitcode
 	if (on_op_done(rsc,op) >= 0) {
 		perform_op(rsc);
 	}
-	reset_proctrack_data(p);
+	/* the slot we freed may be waited for by other resources */
+	runq_dispatch();
 	LRMAUDIT();
 }
 
+/*
+ * The worker running the op (raworker.c) went away before it
+ * answered: run the op again, the usual way.
+ */
+void
+ra_op_retry(lrmd_op_t* op)
+{
+	lrmd_rsc_t* rsc;
+
+	CHECK_ALLOCATED(op, "op", );
+	release_op_slot(op);
+	op->exec_pid = -1;
+	if ((rsc = lookup_rsc(op->rsc_id)) != NULL) {
+		perform_op(rsc);
+	}
+	runq_dispatch();
+}
+
 /* Handle the death of one of our managed child processes */
 static const char *
 on_ra_proc_query_name(ProcTrack* p)
@@ -3457,6 +4334,64 @@ on_ra_proc_query_name(ProcTrack* p)
 	return proc_name;
 }
 
+struct ipc_stats_buf {
+	char*	buf;
+	int	len;
+	int	used;
+};
+
+/* one line per client channel */
+static void
+client_ipc_stats(gpointer key, gpointer value, gpointer user_data)
+{
+	lrmd_client_t* client = (lrmd_client_t*)value;
+	struct ipc_stats_buf* sb = (struct ipc_stats_buf*)user_data;
+	IPC_Channel* chans[2];
+	const char* names[2] = {"cmd", "cbk"};
+	int j, rc;
+
+	chans[0] = client->ch_cmd;
+	chans[1] = client->ch_cbk;
+	for (j = 0; j < 2 && sb->used < sb->len - 1; j++) {
+		if (!chans[j]) {
+			continue;
+		}
+		rc = snprintf(sb->buf + sb->used, sb->len - sb->used
+		,	"%s[%d] %s: ", lrm_str(client->app_name)
+		,	client->pid, names[j]);
+		if (rc > 0) {
+			sb->used += rc;
+		}
+		if (sb->used < sb->len - 1) {
+			rc = ipc_chanstats_format(chans[j], sb->buf + sb->used
+			,	sb->len - sb->used);
+			if (rc > 0) {
+				sb->used += rc;
+			}
+		}
+		if (sb->used < sb->len - 1) {
+			sb->buf[sb->used++] = '\n';
+			sb->buf[sb->used] = EOS;
+		}
+	}
+	if (sb->used > sb->len - 1) {
+		sb->used = sb->len - 1;
+	}
+}
+
+static void
+client_ipc_stats_reset(gpointer key, gpointer value, gpointer user_data)
+{
+	lrmd_client_t* client = (lrmd_client_t*)value;
+
+	if (client->ch_cmd) {
+		ipc_chanstats_reset(client->ch_cmd);
+	}
+	if (client->ch_cbk) {
+		ipc_chanstats_reset(client->ch_cbk);
+	}
+}
+
 static int
 get_lrmd_param(const char *name, char *value, int maxstring)
 {
@@ -3467,6 +4402,38 @@ get_lrmd_param(const char *name, char *value, int maxstring)
 	if (!strcmp(name,"max-children")) {
 		snprintf(value, maxstring, "%d", max_child_count);
 		return HA_OK;
+	} else if (!strcmp(name,"adaptive-children")) {
+		snprintf(value, maxstring, "%s", adaptive_children ? "yes" : "no");
+		return HA_OK;
+	} else if (!strcmp(name,"adaptive-children-min")
+	||	!strcmp(name,"adaptive-children-max")) {
+		int min, max;
+		adapt_get_limits(&min, &max);
+		snprintf(value, maxstring, "%d"
+		,	!strcmp(name,"adaptive-children-min") ? min : max);
+		return HA_OK;
+	} else if (!strcmp(name,"adaptive-children-status")) {
+		snprintf(value, maxstring, "%s"
+		,	adaptive_children ? adapt_status() : "disabled");
+		return HA_OK;
+	} else if (!strcmp(name,"monitor-spread")) {
+		snprintf(value, maxstring, "%d", monitor_spread);
+		return HA_OK;
+	} else if (!strcmp(name,"monitor-jitter")) {
+		snprintf(value, maxstring, "%d", monitor_jitter);
+		return HA_OK;
+	} else if (!strcmp(name,"metadata-cache")) {
+		snprintf(value, maxstring, "%s", racache_status());
+		return HA_OK;
+	} else if (!strcmp(name,"ipc-stats")) {
+		struct ipc_stats_buf sb;
+
+		sb.buf = value;
+		sb.len = maxstring;
+		sb.used = 0;
+		value[0] = EOS;
+		g_hash_table_foreach(clients, client_ipc_stats, &sb);
+		return HA_OK;
 	} else {
 		lrmd_log(LOG_ERR, "%s: unknown lrmd parameter %s", __FUNCTION__, name);
 		return HA_FAIL;
@@ -3498,6 +4465,66 @@ set_lrmd_param(const char *name, const char *value)
 		}
 		lrmd_log(LOG_INFO, "setting max-children to %d", ival);
 		max_child_count = ival;
+		runq_dispatch();
+		return HA_OK;
+	} else if (!strcmp(name,"adaptive-children")) {
+		if (cl_str_to_boolean(value, &ival) != HA_OK) {
+			lrmd_log(LOG_ERR, "%s: invalid value for lrmd parameter %s"
+				, __FUNCTION__, name);
+			return HA_FAIL;
+		}
+		adaptive_children = ival;
+		if (adaptive_children && !adapt_timeout_tag) {
+			adapt_timeout_tag = Gmain_timeout_add(ADAPT_INTERVAL
+			,	on_adapt_timeout, NULL);
+		} else if (!adaptive_children && adapt_timeout_tag) {
+			Gmain_timeout_remove(adapt_timeout_tag);
+			adapt_timeout_tag = 0;
+		}
+		lrmd_log(LOG_INFO, "adaptive max-children %s"
+		,	adaptive_children ? "enabled" : "disabled");
+		return HA_OK;
+	} else if (!strcmp(name,"adaptive-children-min")
+	||	!strcmp(name,"adaptive-children-max")) {
+		int min, max;
+		adapt_get_limits(&min, &max);
+		ival = atoi(value);
+		if (!strcmp(name,"adaptive-children-min")) {
+			min = ival;
+		} else {
+			max = ival;
+		}
+		if (adapt_set_limits(min, max) != HA_OK) {
+			lrmd_log(LOG_ERR, "%s: invalid value for lrmd parameter %s"
+				, __FUNCTION__, name);
+			return HA_FAIL;
+		}
+		lrmd_log(LOG_INFO, "setting %s to %d", name, ival);
+		return HA_OK;
+	} else if (!strcmp(name,"monitor-spread")
+	||	!strcmp(name,"monitor-jitter")) {
+		ival = atoi(value);
+		if (ival < 0 || ival > 100
+		||	(!strcmp(name,"monitor-jitter") && ival > 50)) {
+			lrmd_log(LOG_ERR, "%s: invalid value for lrmd parameter %s"
+				, __FUNCTION__, name);
+			return HA_FAIL;
+		}
+		if (!strcmp(name,"monitor-spread")) {
+			monitor_spread = ival;
+		} else {
+			monitor_jitter = ival;
+		}
+		lrmd_log(LOG_INFO, "setting %s to %d%%", name, ival);
+		return HA_OK;
+	} else if (!strcmp(name,"ipc-stats")) {
+		if (strcmp(value, "reset")) {
+			lrmd_log(LOG_ERR, "%s: invalid value for lrmd parameter %s"
+				, __FUNCTION__, name);
+			return HA_FAIL;
+		}
+		g_hash_table_foreach(clients, client_ipc_stats_reset, NULL);
+		lrmd_log(LOG_INFO, "IPC statistics reset");
 		return HA_OK;
 	} else {
 		lrmd_log(LOG_ERR, "%s: unknown lrmd parameter %s"
@@ -3529,7 +4556,7 @@ on_msg_get_lrmd_param(lrmd_client_t* client, struct ha_msg* msg)
 {
 	struct ha_msg* ret = NULL;
 	const char *name;
-	char value[MAX_NAME_LEN];
+	char value[LRMD_PARAM_VALUE_LEN];
 
 	CHECK_ALLOCATED(client, "client", HA_FAIL);
 	CHECK_ALLOCATED(msg, "message", HA_FAIL);
@@ -3538,7 +4565,7 @@ on_msg_get_lrmd_param(lrmd_client_t* client, struct ha_msg* msg)
 	CHECK_RETURN_OF_CREATE_LRM_RET;
 
 	name = ha_msg_value(msg,F_LRM_LRMD_PARAM_NAME);
-	if (get_lrmd_param(name, value, MAX_NAME_LEN) != HA_OK) {
+	if (get_lrmd_param(name, value, sizeof(value)) != HA_OK) {
 		return HA_FAIL;
 	}
 	if (HA_OK != ha_msg_add(ret, F_LRM_LRMD_PARAM_VAL, value)) {
@@ -3570,6 +4597,41 @@ send_ret_msg (IPC_Channel* ch, int ret)
 	return HA_OK;
 }
 
+/* the reply to REGISTER also tells the client which formats we read */
+static int
+send_reg_ret_msg (IPC_Channel* ch, int ret)
+{
+	struct ha_msg* msg = NULL;
+
+	msg = create_lrm_ret(ret, 3);
+	CHECK_RETURN_OF_CREATE_LRM_RET;
+
+	if (HA_OK != ha_msg_add_int(msg, F_LRM_MSGFMTS, LRM_MSGFMTS)) {
+		lrmd_log(LOG_ERR, "send_reg_ret_msg: can not add the formats");
+	}
+	if (HA_OK != ha_msg_add_int(msg, F_LRM_FEATURES, LRM_FEATURES)) {
+		lrmd_log(LOG_ERR, "send_reg_ret_msg: can not add the features");
+	}
+	if (HA_OK != msg2ipcchan(msg, ch)) {
+		lrmd_log(LOG_ERR, "send_reg_ret_msg: can not send the ret msg");
+	}
+	ha_msg_del(msg);
+	return HA_OK;
+}
+
+/* use the formats the client says it can read (old clients: text) */
+static void
+set_client_msgfmts(IPC_Channel* ch, struct ha_msg* msg)
+{
+	int fmts;
+
+	if (HA_OK == ha_msg_value_int(msg, F_LRM_MSGFMTS, &fmts)) {
+		ch->msgfmts = fmts & LRM_MSGFMTS;
+		lrmd_debug2(LOG_DEBUG, "%s: client reads formats 0x%x"
+		,	__FUNCTION__, ch->msgfmts);
+	}
+}
+
 static void
 send_cbk_msg(struct ha_msg* msg, lrmd_client_t* client)
 {
@@ -3607,8 +4669,13 @@ void
 notify_client(lrmd_op_t* op)
 {
 	lrmd_client_t* client = lookup_client(op->client_id);
+	struct ha_msg* msg;
 
 	if (client) {
+		/* cancelled or flushed before it ran (again) */
+		if (!op->t_done && (msg = op_msg_w(op)) != NULL) {
+			strip_timestamps(msg);
+		}
 		/* send the result to client */
 		send_cbk_msg(op->msg, client);
 	} else {
@@ -3950,6 +5017,9 @@ dump_data_for_debug(void)
 	lrmd_debug(LOG_DEBUG, "begin to dump internal data for debugging.");
 	lrmd_dump_all_clients();
 	lrmd_dump_all_resources();
+	lrmd_debug(LOG_DEBUG, "%d children running (max %d), %d resources "
+		"in the run queue"
+	,	child_count, max_child_count, runq_len);
 	lrmd_debug(LOG_DEBUG, "end to dump internal data for debugging.");
 }
 
@@ -1,9 +1,13 @@
+#include <timerwheel.h>
+
 #define	MAX_PID_LEN 256
 #define	MAX_PROC_NAME 256
 #define	MAX_MSGTYPELEN 32
 #define	MAX_CLASSNAMELEN 32
+#define	LRMD_PARAM_VALUE_LEN 8192 /* ipc-stats has a line per channel */
+#define	LRMD_LOG_RING (256*1024) /* see cl_log_set_deferred() */
 #define WARNINGTIME_IN_LIST 10000
-#define OPTARGS		"skrhvmi:"
+#define OPTARGS		"skrhvmi:c:e:"
 #define PID_FILE 	HA_VARRUNDIR"/lrmd.pid"
 #define LRMD_COREDUMP_ROOT_DIR HA_COREDIR
 #define APPHB_WARNTIME_FACTOR	3
@@ -121,6 +125,10 @@
  *
  *	resources - a hash table of all (currently configured) resources
  *
+ *	run_queue - resources whose next operation waits for a free
+ *		child slot (max_child_count), ordered on dispatch by
+ *		operation class and per-client fair share
+ *
  *	Proctrack keeps its own private data structures to keep track of
  *	child processes that it created.  They in turn point to the
  *	lrmd_op_t objects that caused us to fork the child process.
@@ -153,6 +161,8 @@ typedef struct
 	time_t		lastreqend;
 	time_t		lastrcsent;
 	int		priv_lvl; /* client privilege level (depends on uid/gid) */
+	int		running_ops; /* child slots used by this client's ops */
+	unsigned long	serial;	/* tells connections of the same pid apart */
 }lrmd_client_t;
 
 typedef struct lrmd_rsc lrmd_rsc_t;
@@ -181,6 +191,18 @@ typedef struct ra_pipe_op  ra_pipe_op_t;
 #define no_child_count(rsc) \
 	(strcmp((rsc)->class,"stonith") == 0)
 
+/*
+ * Scheduling classes of operations waiting in the run queue for
+ * a free child slot (see runq_dispatch()). Lower classes go first.
+ */
+#define SCHED_CLASS_STATE	0	/* start, stop, promote, ... */
+#define SCHED_CLASS_OTHER	1	/* other non-repeating operations */
+#define SCHED_CLASS_MONITOR	2	/* repeating monitors */
+#define SCHED_CLASS_PROBE	3	/* probes (non-repeating monitors) */
+#define SCHED_CLASSES		4
+/* waiting ops are promoted one class per this many ms in the queue */
+#define SCHED_AGING_MS		10000
+
 struct lrmd_rsc
 {
 	char*		id;		/* Unique resource identifier	*/
@@ -196,6 +218,11 @@ struct lrmd_rsc
 	lrmd_op_t*	last_op_done;	/* The last finished op of the resource */
 	guint		delay_timeout;  /* The delay value of op_list execution */
 	int			state;  /* status of the resource */
+	gboolean	in_run_queue;	/* waiting for a free child slot */
+	int		runq_class;	/* the run queue it is in ... */
+	struct runq_client* runq_client; /* ... and where, see runq_add() */
+	GList*		runq_link;
+	longclock_t	t_runq;		/* when it was queued */
 };
 
 struct lrmd_op
@@ -205,13 +232,16 @@ struct lrmd_op
 	pid_t			client_id;
 	int			call_id;
 	int			exec_pid;
-	guint			repeat_timeout_tag;
+	tw_timer_t		repeat_timer; /* pending while in repeat_op_list */
+	gboolean		phase_spread; /* first run already spread */
 	int			interval;
 	int			delay;
 	gboolean		is_cancelled;
 	int			weight;
+	int			sched_class; /* SCHED_CLASS_* */
 	int			copyparams;
-	struct ha_msg*		msg;
+	struct ha_msg*		msg;	/* shared with copies, see op_msg_w() */
+	int*			msg_refs;
 	ra_pipe_op_t *		rapop;
 	char			first_line_ra_stdout[80]; /* only for heartbeat RAs*/
 	/*time stamps*/
@@ -221,6 +251,7 @@ struct lrmd_op
 	longclock_t		t_done; /* set in on_op_done() */
 	longclock_t		t_rcchange; /* set in on_op_done(), could equal t_perform */
 	longclock_t		t_lastlogmsg; /* the last time the monitor op was logged */
+	unsigned long		spawn_us; /* to fork or spawn the RA, see perform_ra_op() */
 	ProcTrackKillInfo	killseq[3];
 };
 
@@ -276,7 +307,70 @@ const char *gen_op_info(const lrmd_op_t* op, gboolean add_params);
 #	define MEGALRMAUDIT() /*nothing*/
 #endif
 
+/*
+ * adaptive max-children controller (adaptive.c)
+ */
+#define ADAPT_INTERVAL	5000	/* Millisecond */
+void adapt_record_op(unsigned long exec_ms, unsigned long queue_ms);
+int adapt_max_children(int cur, int running, int waiting);
+int adapt_set_limits(int min, int max);
+void adapt_get_limits(int *min, int *max);
+const char *adapt_status(void);
+
+/*
+ * RA meta-data cache (racache.c)
+ */
+void racache_init(const char* file);
+char* racache_get(const char* rclass, const char* provider, const char* rtype);
+void racache_put(const char* rclass, const char* provider, const char* rtype
+,	const char* meta);
+void racache_save(void);
+const char* racache_status(void);
+
+/*
+ * RA plugin queries in a child process (raquery.c)
+ */
+enum { RAQ_META, RAQ_TYPES, RAQ_PROVIDERS, RAQ_ALLTYPES };
+typedef void (*raq_done_fn)(int rc, GString* out, gpointer data);
+struct RAExecOps;
+int raq_start(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider, raq_done_fn done, gpointer data);
+int raq_count(void);
+char* raq_next_line(const GString* out, gsize* pos);
+
+/*
+ * helper processes which start the RAs (executor.c)
+ */
+void executor_init(int n);
+void executor_start(void);
+void executor_stop(void);
+int executor_count(void);
+pid_t executor_run(const char* rsc_id, const char* rclass, const char* rtype
+,	const char* provider, const char* op_type, int timeout
+,	GHashTable* params, int stdout_fd, int stderr_fd);
+/* in lrmd.c, for the executors */
+void ra_child_exec(const char* rsc_id, const char* rclass, const char* rtype
+,	const char* provider, const char* op_type, int timeout
+,	GHashTable* params, int stdout_fd, int stderr_fd);
+
+/*
+ * long-lived OCF agents answering the monitors (raworker.c)
+ */
+struct RASpawnOps;
+void raworker_init(void);
+int raworker_run(struct RAExecOps* RAExec, struct RASpawnOps* RASpawn
+,	lrmd_rsc_t* rsc, lrmd_op_t* op, const char* op_type, int timeout);
+void raworker_stop(const char* rsc_id);
+void raworker_stop_all(void);
+/* in lrmd.c, for the workers */
+void ra_op_finished(lrmd_op_t* op, pid_t pid, int signo, gboolean timedout
+,	int exitcode);
+void ra_op_retry(lrmd_op_t* op);
+int ra_query_start(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider, raq_done_fn done, gpointer data);
+void release_query_slot(void);
+
 /*
  * load parameters from an ini file (cib_secrets.c)
  */
-int replace_secret_params(char* rsc_id, GHashTable* params);
+int replace_secret_params(const char* rsc_id, GHashTable* params);
@@ -9,7 +9,10 @@ static void dump_data_for_debug(void);
 static gboolean on_connect_cmd(IPC_Channel* ch_cmd, gpointer user_data);
 static gboolean on_connect_cbk(IPC_Channel* ch_cbk, gpointer user_data);
 static int msg_type_cmp(const void *p1, const void *p2);
-static gboolean on_receive_cmd(IPC_Channel* ch_cmd, gpointer user_data);
+static gboolean on_receive_cmd(IPC_Channel* ch_cmd, IPC_Message** msgs
+,	int nmsgs, gpointer user_data);
+static gboolean on_receive_msg(IPC_Channel* ch, lrmd_client_t* client
+,	struct ha_msg* msg);
 static gboolean on_repeat_op_readytorun(gpointer data);
 static void on_remove_client(gpointer user_data);
 static void destroy_pipe_ra_stderr(gpointer user_data);
@@ -21,6 +24,7 @@ static int on_msg_get_rsc_classes(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_get_rsc_types(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_get_rsc_providers(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_get_metadata(lrmd_client_t* client, struct ha_msg* msg);
+static int on_msg_get_all_metadata(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_add_rsc(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_get_rsc(lrmd_client_t* client, struct ha_msg* msg);
 static int on_msg_get_last_op(lrmd_client_t* client, struct ha_msg* msg);
@@ -49,9 +53,15 @@ static int flush_op(lrmd_op_t* op);
 static gboolean rsc_execution_freeze_timeout(gpointer data);
 static void add_op_to_runlist(lrmd_rsc_t* rsc, lrmd_op_t* op);
 static int perform_op(lrmd_rsc_t* rsc);
+static int op_sched_class(const char* op_type, int interval);
+static void runq_add(lrmd_rsc_t* rsc);
+static void runq_remove(lrmd_rsc_t* rsc);
+static void runq_dispatch(void);
 static int unregister_client(lrmd_client_t* client);
 static int on_op_done(lrmd_rsc_t* rsc, lrmd_op_t* op);
 static int send_ret_msg ( IPC_Channel* ch, int rc);
+static int send_reg_ret_msg ( IPC_Channel* ch, int rc);
+static void set_client_msgfmts(IPC_Channel* ch, struct ha_msg* msg);
 static void send_cbk_msg(struct ha_msg* msg, lrmd_client_t* client);
 static void send_msg(struct ha_msg* msg, lrmd_client_t* client);
 static void notify_client(lrmd_op_t* op);
@@ -64,6 +74,7 @@ static gboolean handle_pipe_ra_stderr(int fd, gpointer user_data);
 static struct ha_msg* op_to_msg(lrmd_op_t* op);
 static int store_timestamps(lrmd_op_t* op);
 static void reset_timestamps(lrmd_op_t* op);
+static void strip_timestamps(struct ha_msg* msg);
 static gboolean lrm_shutdown(void);
 static gboolean can_shutdown(void);
 static gboolean free_str_hash_pair(gpointer key
@@ -71,6 +82,9 @@ static gboolean free_str_hash_pair(gpointer key
 static gboolean free_str_op_pair(gpointer key
 ,	 gpointer value, gpointer user_data);
 static lrmd_op_t* lrmd_op_copy(const lrmd_op_t* op);
+static void op_msg_set(lrmd_op_t* op, struct ha_msg* msg);
+static void op_msg_release(lrmd_op_t* op);
+static struct ha_msg* op_msg_w(lrmd_op_t* op);
 static void send_last_op(gpointer key, gpointer value, gpointer user_data);
 static void replace_last_op(lrmd_client_t* client, lrmd_rsc_t* rsc, lrmd_op_t* op);
 static int record_op_completion(lrmd_rsc_t* rsc, lrmd_op_t* op);
@@ -88,6 +102,7 @@ static void async_notify(gpointer key, gpointer val, gpointer data);
 static gboolean client_cmp_name(gpointer key, gpointer val, gpointer app_name);
 static lrmd_client_t* lookup_client_by_name(char *app_name);
 static void calc_max_children(void);
+static gboolean on_adapt_timeout(gpointer data);
 
 /*
  * following functions are used to monitor the exit of ra proc
@@ -0,0 +1,532 @@
+/*
+ * racache.c: cache of resource agent meta-data for lrmd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Getting the meta-data means running the agent, and the CRM asks
+ * for the same meta-data over and over. The answers are kept here,
+ * keyed by class:provider:type, together with the mtime, size and
+ * inode of the agent. Every lookup stat()s the agent, so a changed
+ * agent is never served stale meta-data; with inotify the entries of
+ * changed agents are also dropped right away, so that they don't
+ * linger in the cache file.
+ *
+ * Only the classes with agents in a known directory (ocf, lsb and
+ * heartbeat) are cached. If a cache file is given (lrmd -c), the
+ * cache is loaded from it on startup and written back a little
+ * while after it changed and on exit.
+ *
+ * The cache file is a header line and then for every entry
+ *
+ *	class provider type mtime size inode length\n
+ *	<length bytes of meta-data>\n
+ *
+ * with "-" for no provider.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#endif
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <clplumbing/proctrack.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+#include <lrm/raexec.h>
+
+#include <lrmd.h>
+
+#define RACACHE_MAGIC		"lrmd-metadata-cache 1"
+#define RACACHE_SAVE_DELAY	5000	/* ms after a change */
+#define RACACHE_MAXMETA		(1024*1024)
+
+struct ra_meta {
+	char*	rclass;
+	char*	provider;	/* NULL for none */
+	char*	rtype;
+	char*	path;		/* of the agent */
+	time_t	mtime;
+	off_t	size;
+	ino_t	ino;
+	char*	meta;
+};
+
+static GHashTable*	ra_metas = NULL;	/* class:provider:type */
+static char*		cache_file = NULL;
+static guint		save_tag = 0;
+static unsigned long	nhits, nmisses;
+#ifdef HAVE_SYS_INOTIFY_H
+static int		inotify_fd = -1;
+static GHashTable*	watches = NULL;		/* dir -> wd */
+static GHashTable*	watch_dirs = NULL;	/* wd -> dir */
+#endif
+
+static void racache_changed(void);
+
+static void
+ra_meta_free(gpointer data)
+{
+	struct ra_meta*	m = data;
+
+	g_free(m->rclass);
+	g_free(m->provider);
+	g_free(m->rtype);
+	g_free(m->path);
+	g_free(m->meta);
+	g_free(m);
+}
+
+static char*
+ra_meta_key(const char* rclass, const char* provider, const char* rtype)
+{
+	return g_strdup_printf("%s:%s:%s", rclass
+	,	provider ? provider : "", rtype);
+}
+
+/* the agent file, FALSE if the class hasn't got any we know of */
+static gboolean
+ra_path(const char* rclass, const char* provider, const char* rtype
+,	char path[])
+{
+	const char*	dir;
+
+	if (rclass == NULL || rtype == NULL) {
+		return FALSE;
+	}
+	if (!strcmp(rclass, "ocf")) {
+		if (provider == NULL) {
+			return FALSE;
+		}
+		dir = OCF_RA_DIR;
+	}else if (!strcmp(rclass, "lsb")) {
+		dir = LSB_RA_DIR;
+		provider = NULL;
+	}else if (!strcmp(rclass, "heartbeat")) {
+		dir = HB_RA_DIR;
+		provider = NULL;
+	}else{
+		return FALSE;
+	}
+	get_ra_pathname(dir, rtype, provider, path);
+	return *path != EOS;
+}
+
+/* no blanks, it goes into a line of the cache file */
+static gboolean
+ra_name_ok(const char* s)
+{
+	return s == NULL || (*s != EOS && strpbrk(s, " \t\n") == NULL);
+}
+
+static void
+ra_meta_insert(struct ra_meta* m)
+{
+	char*	key = ra_meta_key(m->rclass, m->provider, m->rtype);
+
+	g_hash_table_replace(ra_metas, key, m);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static gboolean
+drop_in_dir(gpointer key, gpointer value, gpointer user_data)
+{
+	struct ra_meta*	m = value;
+	const char*	dir = user_data;
+	size_t		len = strlen(dir);
+
+	return !strncmp(m->path, dir, len) && m->path[len] == '/';
+}
+
+static gboolean
+drop_path(gpointer key, gpointer value, gpointer user_data)
+{
+	struct ra_meta*	m = value;
+
+	return !strcmp(m->path, (const char*)user_data);
+}
+
+static gboolean
+drop_all(gpointer key, gpointer value, gpointer user_data)
+{
+	return TRUE;
+}
+
+static void
+ra_unwatch(int wd)
+{
+	char*	dir = g_hash_table_lookup(watch_dirs, GINT_TO_POINTER(wd));
+
+	if (dir == NULL) {
+		return;
+	}
+	g_hash_table_foreach_remove(ra_metas, drop_in_dir, dir);
+	g_hash_table_remove(watches, dir);
+	g_hash_table_remove(watch_dirs, GINT_TO_POINTER(wd));
+}
+
+/* an agent (or a whole directory of them) changed */
+static gboolean
+racache_inotify(int fd, gpointer user_data)
+{
+	char				buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event*	ev;
+	const char*			dir;
+	char*				path;
+	ssize_t				len;
+	ssize_t				off;
+	guint				before = g_hash_table_size(ra_metas);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < len; off += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event*)(buf + off);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				g_hash_table_foreach_remove(ra_metas
+				,	drop_all, NULL);
+				continue;
+			}
+			if (ev->mask & (IN_IGNORED|IN_DELETE_SELF
+			|	IN_MOVE_SELF)) {
+				if (!(ev->mask & IN_IGNORED)) {
+					inotify_rm_watch(fd, ev->wd);
+				}
+				ra_unwatch(ev->wd);
+				continue;
+			}
+			dir = g_hash_table_lookup(watch_dirs
+			,	GINT_TO_POINTER(ev->wd));
+			if (dir == NULL || ev->len == 0) {
+				continue;
+			}
+			path = g_strdup_printf("%s/%s", dir, ev->name);
+			g_hash_table_foreach_remove(ra_metas, drop_path, path);
+			g_free(path);
+		}
+	}
+	if (g_hash_table_size(ra_metas) != before) {
+		lrmd_debug(LOG_DEBUG, "%s: %u meta-data entries dropped"
+		,	__FUNCTION__, before - g_hash_table_size(ra_metas));
+		racache_changed();
+	}
+	return TRUE;
+}
+
+static void
+ra_watch(const char* path)
+{
+	char*	dir;
+	int	wd;
+
+	if (inotify_fd < 0 || strrchr(path, '/') == NULL) {
+		return;
+	}
+	dir = g_strndup(path, strrchr(path, '/') - path);
+	if (g_hash_table_lookup(watches, dir) != NULL) {
+		g_free(dir);
+		return;
+	}
+	wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE|IN_ATTRIB
+	|	IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE
+	|	IN_DELETE_SELF|IN_MOVE_SELF);
+	if (wd < 0) {
+		cl_perror("%s: inotify_add_watch %s", __FUNCTION__, dir);
+		g_free(dir);
+		return;
+	}
+	/* the same wd comes back for a directory we already watch
+	 * under another name */
+	if (g_hash_table_lookup(watch_dirs, GINT_TO_POINTER(wd)) == NULL) {
+		g_hash_table_insert(watch_dirs, GINT_TO_POINTER(wd)
+		,	g_strdup(dir));
+	}
+	g_hash_table_insert(watches, dir, GINT_TO_POINTER(wd));
+}
+#else
+#	define ra_watch(path)	/* nothing, every lookup stat()s */
+#endif
+
+static gboolean
+ra_meta_fresh(const struct ra_meta* m)
+{
+	struct stat	st;
+
+	return stat(m->path, &st) == 0
+	&&	st.st_mtime == m->mtime
+	&&	st.st_size == m->size
+	&&	st.st_ino == m->ino;
+}
+
+/* the meta-data (to be g_free()d) or NULL if not cached */
+char*
+racache_get(const char* rclass, const char* provider, const char* rtype)
+{
+	struct ra_meta*	m;
+	char*		key;
+
+	if (ra_metas == NULL) {
+		return NULL;
+	}
+	if (rclass != NULL && strcmp(rclass, "ocf")) {
+		provider = NULL;
+	}
+	key = ra_meta_key(rclass, provider, rtype);
+	m = g_hash_table_lookup(ra_metas, key);
+	if (m != NULL && !ra_meta_fresh(m)) {
+		g_hash_table_remove(ra_metas, key);
+		racache_changed();
+		m = NULL;
+	}
+	g_free(key);
+	if (m == NULL) {
+		++nmisses;
+		return NULL;
+	}
+	++nhits;
+	return g_strdup(m->meta);
+}
+
+void
+racache_put(const char* rclass, const char* provider, const char* rtype
+,	const char* meta)
+{
+	struct ra_meta*	m;
+	struct stat	st;
+	char		path[RA_MAX_NAME_LENGTH];
+
+	if (rclass != NULL && strcmp(rclass, "ocf")) {
+		provider = NULL;
+	}
+	if (ra_metas == NULL || meta == NULL
+	||	strlen(meta) > RACACHE_MAXMETA
+	||	!ra_path(rclass, provider, rtype, path)
+	||	!ra_name_ok(rclass) || !ra_name_ok(provider)
+	||	!ra_name_ok(rtype)) {
+		return;
+	}
+	/* an agent which changes while it's asked for its meta-data
+	 * just doesn't get cached this time round */
+	if (stat(path, &st) != 0) {
+		return;
+	}
+	m = g_new0(struct ra_meta, 1);
+	m->rclass = g_strdup(rclass);
+	m->provider = g_strdup(provider);
+	m->rtype = g_strdup(rtype);
+	m->path = g_strdup(path);
+	m->mtime = st.st_mtime;
+	m->size = st.st_size;
+	m->ino = st.st_ino;
+	m->meta = g_strdup(meta);
+	ra_meta_insert(m);
+	ra_watch(path);
+	racache_changed();
+}
+
+const char*
+racache_status(void)
+{
+	static char	buf[128];
+
+	snprintf(buf, sizeof(buf), "entries %u hits %lu misses %lu"
+	,	ra_metas ? g_hash_table_size(ra_metas) : 0
+	,	nhits, nmisses);
+	return buf;
+}
+
+static void
+save_one(gpointer key, gpointer value, gpointer user_data)
+{
+	struct ra_meta*	m = value;
+	FILE*		fp = user_data;
+
+	fprintf(fp, "%s %s %s %ld %ld %lu %lu\n", m->rclass
+	,	m->provider ? m->provider : "-", m->rtype
+	,	(long)m->mtime, (long)m->size, (unsigned long)m->ino
+	,	(unsigned long)strlen(m->meta));
+	fputs(m->meta, fp);
+	fputc('\n', fp);
+}
+
+void
+racache_save(void)
+{
+	char*	tmp;
+	FILE*	fp;
+	int	fd;
+
+	if (save_tag) {
+		Gmain_timeout_remove(save_tag);
+		save_tag = 0;
+	}
+	if (cache_file == NULL || ra_metas == NULL) {
+		return;
+	}
+	tmp = g_strdup_printf("%s.tmp", cache_file);
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0
+	||	(fp = fdopen(fd, "w")) == NULL) {
+		cl_perror("%s: cannot write %s", __FUNCTION__, tmp);
+		if (fd >= 0) {
+			close(fd);
+		}
+		g_free(tmp);
+		return;
+	}
+	fprintf(fp, "%s\n", RACACHE_MAGIC);
+	g_hash_table_foreach(ra_metas, save_one, fp);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		cl_perror("%s: cannot write %s", __FUNCTION__, tmp);
+		fclose(fp);
+		unlink(tmp);
+	}else if (fclose(fp) != 0 || rename(tmp, cache_file) != 0) {
+		cl_perror("%s: cannot write %s", __FUNCTION__, cache_file);
+		unlink(tmp);
+	}
+	g_free(tmp);
+}
+
+static gboolean
+racache_save_timeout(gpointer data)
+{
+	save_tag = 0;
+	racache_save();
+	return FALSE;
+}
+
+static void
+racache_changed(void)
+{
+	if (cache_file != NULL && !save_tag) {
+		save_tag = Gmain_timeout_add(RACACHE_SAVE_DELAY
+		,	racache_save_timeout, NULL);
+	}
+}
+
+static void
+racache_load(void)
+{
+	FILE*		fp;
+	char		line[3*RA_MAX_NAME_LENGTH];
+	char		rclass[RA_MAX_NAME_LENGTH];
+	char		provider[RA_MAX_NAME_LENGTH];
+	char		rtype[RA_MAX_NAME_LENGTH];
+	char		path[RA_MAX_NAME_LENGTH];
+	long		mtime, size;
+	unsigned long	ino, len;
+	struct ra_meta*	m;
+	int		n = 0;
+
+	if ((fp = fopen(cache_file, "r")) == NULL) {
+		if (errno != ENOENT) {
+			cl_perror("%s: cannot read %s", __FUNCTION__
+			,	cache_file);
+		}
+		return;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL
+	||	strncmp(line, RACACHE_MAGIC "\n", sizeof(line))) {
+		lrmd_log(LOG_WARNING, "%s: %s is not a meta-data cache"
+		,	__FUNCTION__, cache_file);
+		fclose(fp);
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%239s %239s %239s %ld %ld %lu %lu"
+		,	rclass, provider, rtype, &mtime, &size, &ino, &len) != 7
+		||	len > RACACHE_MAXMETA) {
+			goto bad;
+		}
+		if (!strcmp(provider, "-")) {
+			*provider = EOS;
+		}
+		m = g_new0(struct ra_meta, 1);
+		m->meta = g_malloc(len + 1);
+		if (fread(m->meta, 1, len + 1, fp) != len + 1
+		||	m->meta[len] != '\n') {
+			g_free(m->meta);
+			g_free(m);
+			goto bad;
+		}
+		m->meta[len] = EOS;
+		if (!ra_path(rclass, *provider ? provider : NULL, rtype
+		,	path)) {
+			g_free(m->meta);
+			g_free(m);
+			continue;
+		}
+		m->rclass = g_strdup(rclass);
+		m->provider = *provider ? g_strdup(provider) : NULL;
+		m->rtype = g_strdup(rtype);
+		m->path = g_strdup(path);
+		m->mtime = mtime;
+		m->size = size;
+		m->ino = ino;
+		if (!ra_meta_fresh(m)) {
+			ra_meta_free(m);
+			continue;
+		}
+		ra_meta_insert(m);
+		ra_watch(path);
+		++n;
+	}
+	fclose(fp);
+	lrmd_debug(LOG_DEBUG, "%s: %d meta-data entries from %s"
+	,	__FUNCTION__, n, cache_file);
+	return;
+bad:
+	lrmd_log(LOG_WARNING, "%s: %s is damaged, %d entries loaded"
+	,	__FUNCTION__, cache_file, n);
+	fclose(fp);
+	racache_changed();
+}
+
+/* file is where the cache is kept over restarts, NULL for nowhere */
+void
+racache_init(const char* file)
+{
+	ra_metas = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, ra_meta_free);
+#ifdef HAVE_SYS_INOTIFY_H
+	watches = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, NULL);
+	watch_dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal
+	,	NULL, g_free);
+	if ((inotify_fd = inotify_init()) < 0) {
+		cl_perror("%s: inotify_init", __FUNCTION__);
+	}else{
+		fcntl(inotify_fd, F_SETFL, O_NONBLOCK);
+		fcntl(inotify_fd, F_SETFD, FD_CLOEXEC);
+		G_main_add_fd(G_PRIORITY_DEFAULT, inotify_fd, FALSE
+		,	racache_inotify, NULL, NULL);
+	}
+#endif
+	if (file != NULL && *file != EOS) {
+		cache_file = g_strdup(file);
+		racache_load();
+	}
+}
@@ -0,0 +1,295 @@
+/*
+ * raquery.c: ask resource agent plugins in a child process
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * The meta-data and the lists of types and providers come from the
+ * RA plugins, which run the agent or walk directories. That is done
+ * in a child, like the RA operations, so that a slow or hung agent
+ * doesn't stall the main loop. The child writes the answer to a
+ * pipe which is read as it comes; the caller's function is called
+ * once the child has exited, with everything it wrote.
+ *
+ * Lists are written one entry per line, RAQ_ALLTYPES writes
+ * "type<TAB>provider" lines (see raq_child()).
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/proctrack.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+#include <lrm/raexec.h>
+
+#include <lrmd.h>
+
+#define RAQ_TIMEOUT	30000	/* ms before the child is killed */
+
+struct raq {
+	int			kind;
+	GString*		out;
+	int			fd;
+	GFDSource*		src;
+	raq_done_fn		done;
+	gpointer		data;
+	ProcTrackKillInfo	killseq[3];
+};
+
+static int	raq_running = 0;
+
+static const char* raq_kinds[] = {
+	"meta-data", "types", "providers", "all types"
+};
+
+static void raq_died(ProcTrack* p, int status, int signo, int exitcode
+,	int waslogged);
+static void raq_registered(ProcTrack* p);
+static const char* raq_proctype(ProcTrack* p);
+
+static ProcTrack_ops RAQueryTrackOps = {
+	raq_died,
+	raq_registered,
+	raq_proctype
+};
+
+/* whatever the child wrote so far; FALSE on EOF (or error) */
+static gboolean
+raq_read(struct raq* q)
+{
+	char	buf[4096];
+	ssize_t	n;
+
+	while ((n = read(q->fd, buf, sizeof(buf))) > 0) {
+		g_string_append_len(q->out, buf, n);
+	}
+	return n < 0 && (errno == EAGAIN || errno == EINTR);
+}
+
+static gboolean
+raq_input(int fd, gpointer user_data)
+{
+	struct raq*	q = user_data;
+
+	if (raq_read(q)) {
+		return TRUE;
+	}
+	q->src = NULL;
+	return FALSE;
+}
+
+static void
+raq_write_list(GList* list)
+{
+	GList*	l;
+
+	for (l = list; l != NULL; l = l->next) {
+		printf("%s\n", (const char*)l->data);
+	}
+}
+
+/* in the child; doesn't return */
+static void
+raq_child(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider)
+{
+	GList*	list = NULL;
+	GList*	providers;
+	GList*	l;
+	GList*	p;
+	char*	meta;
+	int	rc = 0;
+
+	switch (kind) {
+	case RAQ_META:
+		meta = RAExec->get_resource_meta(rtype, provider);
+		if (meta == NULL || *meta == EOS) {
+			rc = 1;
+		}else{
+			fputs(meta, stdout);
+		}
+		break;
+	case RAQ_TYPES:
+		if (RAExec->get_resource_list(&list) < 0) {
+			rc = 1;
+		}
+		raq_write_list(list);
+		break;
+	case RAQ_PROVIDERS:
+		if (RAExec->get_provider_list(rtype, &list) < 0) {
+			rc = 1;
+		}
+		raq_write_list(list);
+		break;
+	case RAQ_ALLTYPES:
+		if (RAExec->get_resource_list(&list) < 0) {
+			rc = 1;
+		}
+		for (l = list; l != NULL; l = l->next) {
+			providers = NULL;
+			RAExec->get_provider_list(l->data, &providers);
+			for (p = providers; p != NULL; p = p->next) {
+				printf("%s\t%s\n", (const char*)l->data
+				,	(const char*)p->data);
+			}
+		}
+		break;
+	default:
+		rc = 1;
+	}
+	if (fflush(stdout) != 0) {
+		rc = 1;
+	}
+	/* no atexit handlers or stdio buffers of the parent's */
+	_exit(rc);
+}
+
+/*
+ * Start a query. done() is called with the exit code of the child
+ * (0 is fine, -1 if it was killed) and what it wrote. RAQ_META and
+ * RAQ_PROVIDERS need rtype; provider is for RAQ_META only.
+ */
+int
+raq_start(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider, raq_done_fn done, gpointer data)
+{
+	struct raq*	q;
+	int		fd[2];
+	pid_t		pid;
+
+	if (pipe(fd) < 0) {
+		cl_perror("%s: pipe", __FUNCTION__);
+		return HA_FAIL;
+	}
+	switch (pid = fork()) {
+	case -1:
+		cl_perror("%s: fork", __FUNCTION__);
+		close(fd[0]);
+		close(fd[1]);
+		return HA_FAIL;
+
+	case 0:		/* Child */
+		setpgid(0,0);
+		close(fd[0]);
+		if (fd[1] != STDOUT_FILENO) {
+			if (dup2(fd[1], STDOUT_FILENO) != STDOUT_FILENO) {
+				cl_perror("%s: dup2", __FUNCTION__);
+				_exit(1);
+			}
+			close(fd[1]);
+		}
+		raq_child(RAExec, kind, rtype, provider);
+		/* not reached */
+	}
+
+	/* Parent */
+	close(fd[1]);
+	q = g_new0(struct raq, 1);
+	q->kind = kind;
+	q->out = g_string_new("");
+	q->fd = fd[0];
+	q->done = done;
+	q->data = data;
+	fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK);
+	fcntl(q->fd, F_SETFD, FD_CLOEXEC);
+	q->src = G_main_add_fd(G_PRIORITY_HIGH, q->fd, FALSE, raq_input
+	,	q, NULL);
+
+	NewTrackedProc(pid, 1, debug_level ? PT_LOGVERBOSE : PT_LOGNONE
+	,	q, &RAQueryTrackOps);
+	q->killseq[0].mstimeout = RAQ_TIMEOUT;
+	q->killseq[0].signalno  = SIGKILL;
+	q->killseq[1].mstimeout = 5000;
+	q->killseq[1].signalno  = 0;
+	SetTrackedProcTimeouts(pid, q->killseq);
+	++raq_running;
+	lrmd_debug2(LOG_DEBUG, "%s: %s %s:%s (pid %d)", __FUNCTION__
+	,	raq_kinds[kind], lrm_str(provider), lrm_str(rtype), (int)pid);
+	return HA_OK;
+}
+
+/* queries still running */
+int
+raq_count(void)
+{
+	return raq_running;
+}
+
+static void
+raq_died(ProcTrack* p, int status, int signo, int exitcode
+,	int waslogged)
+{
+	struct raq*	q = proctrack_data(p);
+	int		rc = signo ? -1 : exitcode;
+
+	reset_proctrack_data(p);
+	--raq_running;
+	if (signo) {
+		lrmd_log(LOG_WARNING, "%s query (pid %d) killed by signal %d"
+		,	raq_kinds[q->kind], (int)proctrack_pid(p), signo);
+	}
+	/* the child is gone, what it wrote is in the pipe (unless
+	 * somebody it started still holds it open) */
+	if (q->src != NULL) {
+		raq_read(q);
+		G_main_del_fd(q->src);
+		q->src = NULL;
+	}
+	close(q->fd);
+	q->done(rc, q->out, q->data);
+	g_string_free(q->out, TRUE);
+	g_free(q);
+}
+
+static void
+raq_registered(ProcTrack* p)
+{
+}
+
+static const char*
+raq_proctype(ProcTrack* p)
+{
+	return "RA query";
+}
+
+/* one line of a list, NULL at the end; moves *pos past it */
+char*
+raq_next_line(const GString* out, gsize* pos)
+{
+	const char*	s;
+	const char*	nl;
+
+	if (*pos >= out->len) {
+		return NULL;
+	}
+	s = out->str + *pos;
+	if ((nl = strchr(s, '\n')) == NULL) {
+		nl = out->str + out->len;
+	}
+	*pos = nl - out->str + 1;
+	return g_strndup(s, nl - s);
+}
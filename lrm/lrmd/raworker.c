@@ -0,0 +1,698 @@
+/*
+ * raworker.c: long-lived OCF agents answering the monitors for lrmd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Every monitor forks and execs the agent, which for a shell script
+ * is mostly start-up cost. An OCF agent which lists the "worker"
+ * action in its meta-data is instead run once per resource as
+ *
+ *	<agent> worker
+ *
+ * with the resource's parameters in the environment, as for any
+ * other action. It reads requests on stdin, one per line:
+ *
+ *	<seq> monitor
+ *
+ * and answers each of them on stdout, in order, with the exit code
+ * the monitor action would have had:
+ *
+ *	<seq> <rc>
+ *
+ * What it writes to stderr is logged. It exits on EOF on stdin.
+ *
+ * Only repeating monitors go to the worker; probes and all other
+ * operations run the agent as usual. If the worker doesn't answer
+ * within the op timeout, it is killed and the op timed out. If it
+ * exits, the op in flight is run the usual way and the resource
+ * gets no worker for RAWORKER_RETRY seconds. A worker is replaced
+ * when the parameters change and stopped with its resource.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <clplumbing/proctrack.h>
+#include <clplumbing/uids.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+#include <lrm/lrm_msg.h>
+#include <lrm/raexec.h>
+#include <lrm/racommon.h>
+
+#include <lrmd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#define RAWORKER_ACTION	"worker"
+#define RAWORKER_RETRY	60	/* s without a worker after one exited */
+#define RAWORKER_STOP_MS 5000	/* before a worker told to exit is killed */
+#define RAWORKER_MAXLINE 1024	/* longer lines are dropped */
+
+struct raworker {
+	char*		rsc_id;
+	pid_t		pid;		/* 0: not running */
+	int		fd;		/* the worker's stdin and stdout */
+	GFDSource*	src;
+	GString*	in;		/* what it wrote, up to a newline */
+	int		err_fd;		/* its stderr */
+	GFDSource*	err_src;
+	GString*	err;
+	char*		params;		/* it runs with, see params_str() */
+	lrmd_op_t*	op;		/* the request in flight */
+	unsigned	seq;
+	guint		timer;
+	gboolean	killed;		/* by us, or told to exit */
+	gboolean	detached;	/* not the resource's worker any more */
+	time_t		retry_at;
+	ProcTrackKillInfo killseq[2];
+};
+
+/* meta-data being fetched to see whether the agent does workers */
+struct raworker_meta {
+	char*		key;
+	char*		provider;
+	char*		rtype;
+};
+
+static GHashTable*	workers = NULL;	/* rsc_id -> current worker */
+static GHashTable*	meta_asked = NULL;
+
+static void worker_died(ProcTrack* p, int status, int signo, int exitcode
+,	int waslogged);
+static void worker_registered(ProcTrack* p);
+static const char* worker_proctype(ProcTrack* p);
+
+static ProcTrack_ops WorkerTrackOps = {
+	worker_died,
+	worker_registered,
+	worker_proctype
+};
+
+void
+raworker_init(void)
+{
+	workers = g_hash_table_new(g_str_hash, g_str_equal);
+	meta_asked = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void
+on_worker_meta_done(int rc, GString* out, gpointer data)
+{
+	struct raworker_meta*	m = data;
+	char*			meta = NULL;
+
+	if (rc == 0 && out->len > 0) {
+		racache_put("ocf", m->provider, m->rtype, out->str);
+		meta = racache_get("ocf", m->provider, m->rtype);
+	}
+	if (meta != NULL) {
+		/* ask again once the agent changes */
+		g_free(meta);
+		g_hash_table_remove(meta_asked, m->key);
+		g_free(m->key);
+	}
+	/* else (failed, or the cache wouldn't take it) don't ask
+	 * again, or every monitor would fetch the meta-data; the
+	 * agent runs as usual */
+	g_free(m->provider);
+	g_free(m->rtype);
+	g_free(m);
+	/* last: the queue may run ops of this agent */
+	release_query_slot();
+}
+
+/* does the agent of the resource do workers? */
+static gboolean
+worker_wanted(struct RAExecOps* RAExec, struct RASpawnOps* RASpawn
+,	lrmd_rsc_t* rsc)
+{
+	struct raworker_meta*	m;
+	char*			meta;
+	char*			key;
+	gboolean		rc;
+
+	if (RAExec == NULL || RASpawn == NULL) {
+		return FALSE;
+	}
+	meta = racache_get(rsc->class, rsc->provider, rsc->type);
+	if (meta != NULL) {
+		rc = strstr(meta, "<action name=\"" RAWORKER_ACTION "\"") != NULL;
+		g_free(meta);
+		return rc;
+	}
+	/* not known yet, run the agent as usual this time */
+	key = g_strconcat(lrm_str(rsc->provider), ":", rsc->type, NULL);
+	if (g_hash_table_lookup(meta_asked, key) != NULL) {
+		g_free(key);
+		return FALSE;
+	}
+	m = g_new0(struct raworker_meta, 1);
+	m->key = key;
+	m->provider = g_strdup(rsc->provider);
+	m->rtype = g_strdup(rsc->type);
+	if (HA_OK != ra_query_start(RAExec, RAQ_META, m->rtype, m->provider
+	,	on_worker_meta_done, m)) {
+		g_free(m->key);
+		g_free(m->provider);
+		g_free(m->rtype);
+		g_free(m);
+		return FALSE;
+	}
+	g_hash_table_insert(meta_asked, m->key, m->key);
+	return FALSE;
+}
+
+static void
+params_key(gpointer key, gpointer value, gpointer user_data)
+{
+	GList**	keys = user_data;
+
+	*keys = g_list_prepend(*keys, key);
+}
+
+/* the parameters in a string, to see whether they changed */
+static char*
+params_str(GHashTable* params)
+{
+	GList*		keys = NULL;
+	GList*		l;
+	GString*	s = g_string_new("");
+	char*		ret;
+
+	if (params != NULL) {
+		g_hash_table_foreach(params, params_key, &keys);
+	}
+	keys = g_list_sort(keys, (GCompareFunc)strcmp);
+	for (l = keys; l != NULL; l = l->next) {
+		g_string_append_printf(s, "%s=%s\n", (const char*)l->data
+		,	(const char*)g_hash_table_lookup(params, l->data));
+	}
+	g_list_free(keys);
+	ret = s->str;
+	g_string_free(s, FALSE);
+	return ret;
+}
+
+/* FALSE on EOF (or error) */
+static gboolean
+worker_read(int fd, GString* buf)
+{
+	char	b[1024];
+	ssize_t	n;
+
+	while ((n = read(fd, b, sizeof(b))) > 0) {
+		g_string_append_len(buf, b, n);
+	}
+	return n < 0 && (errno == EAGAIN || errno == EINTR);
+}
+
+/* log whole lines, or everything if all is set */
+static void
+worker_log_err(struct raworker* w, gboolean all)
+{
+	char*	nl;
+	gssize	len;
+
+	while ((nl = memchr(w->err->str, '\n', w->err->len)) != NULL
+	||	(all && w->err->len > 0)) {
+		len = nl != NULL ? nl - w->err->str + 1 : (gssize)w->err->len;
+		if (nl != NULL) {
+			*nl = EOS;
+		}
+		lrmd_log(LOG_INFO, "RA output: (%s:" RAWORKER_ACTION ":stderr) %s"
+		,	w->rsc_id, w->err->str);
+		g_string_erase(w->err, 0, len);
+	}
+	if (w->err->len > RAWORKER_MAXLINE) {
+		g_string_truncate(w->err, 0);
+	}
+}
+
+static gboolean
+worker_err_input(int fd, gpointer user_data)
+{
+	struct raworker*	w = user_data;
+	gboolean		more;
+
+	more = worker_read(fd, w->err);
+	worker_log_err(w, !more);
+	if (!more) {
+		w->err_src = NULL;
+	}
+	return more;
+}
+
+/*
+ * The op in flight, if the worker has answered it (rc is the
+ * answer). Other lines are complained about and dropped.
+ */
+static lrmd_op_t*
+worker_reply(struct raworker* w, int* rc)
+{
+	lrmd_op_t*	op;
+	char*		nl;
+	unsigned	seq;
+	int		n;
+
+	while ((nl = memchr(w->in->str, '\n', w->in->len)) != NULL) {
+		*nl = EOS;
+		n = sscanf(w->in->str, "%u %d", &seq, rc);
+		if (n != 2 || w->op == NULL || seq != w->seq) {
+			lrmd_log(LOG_WARNING, "rsc:%s: unexpected line from "
+				"the " RAWORKER_ACTION ": %s"
+			,	w->rsc_id, w->in->str);
+			g_string_erase(w->in, 0, nl - w->in->str + 1);
+			continue;
+		}
+		g_string_erase(w->in, 0, nl - w->in->str + 1);
+		if (w->timer != 0) {
+			Gmain_timeout_remove(w->timer);
+			w->timer = 0;
+		}
+		op = w->op;
+		w->op = NULL;
+		return op;
+	}
+	if (w->in->len > RAWORKER_MAXLINE) {
+		g_string_truncate(w->in, 0);
+	}
+	return NULL;
+}
+
+static gboolean
+worker_input(int fd, gpointer user_data)
+{
+	struct raworker*	w = user_data;
+	lrmd_op_t*		op;
+	gboolean		more;
+	int			rc;
+
+	more = worker_read(fd, w->in);
+	if (!more) {
+		w->src = NULL;
+	}
+	/* the worker stays until it is reaped, see worker_died() */
+	while ((op = worker_reply(w, &rc)) != NULL) {
+		ra_op_finished(op, w->pid, 0, FALSE, rc);
+	}
+	return more;
+}
+
+static void
+worker_kill(struct raworker* w, int sig)
+{
+	int	hadprivs;
+
+	if (!(hadprivs = cl_have_full_privs())) {
+		return_to_orig_privs();
+	}
+	/* the worker's own process group, it may have children */
+	kill(-w->pid, sig);
+	if (!hadprivs) {
+		return_to_dropped_privs();
+	}
+	w->killed = TRUE;
+}
+
+static gboolean
+worker_timeout(gpointer data)
+{
+	struct raworker*	w = data;
+	lrmd_op_t*		op = w->op;
+
+	w->timer = 0;
+	if (op == NULL) {
+		return FALSE;
+	}
+	w->op = NULL;
+	lrmd_log(LOG_WARNING, "rsc:%s: the " RAWORKER_ACTION " (pid %d) "
+		"did not answer in time, killing it"
+	,	w->rsc_id, (int)w->pid);
+	worker_kill(w, SIGKILL);
+	w->retry_at = time(NULL) + RAWORKER_RETRY;
+	ra_op_finished(op, w->pid, SIGKILL, TRUE, 0);
+	return FALSE;
+}
+
+static void
+worker_free(struct raworker* w)
+{
+	g_string_free(w->in, TRUE);
+	g_string_free(w->err, TRUE);
+	g_free(w->params);
+	g_free(w->rsc_id);
+	g_free(w);
+}
+
+/* w isn't the resource's worker any more, it is to exit */
+static void
+worker_detach(struct raworker* w)
+{
+	if (!w->detached) {
+		g_hash_table_remove(workers, w->rsc_id);
+		w->detached = TRUE;
+	}
+	if (w->pid == 0) {
+		worker_free(w);
+		return;
+	}
+	if (w->killed) {
+		return;
+	}
+	/* EOF on stdin, and SIGKILL if that isn't enough */
+	shutdown(w->fd, SHUT_WR);
+	w->killed = TRUE;
+	w->killseq[0].mstimeout = RAWORKER_STOP_MS;
+	w->killseq[0].signalno  = SIGKILL;
+	w->killseq[1].mstimeout = 5000;
+	w->killseq[1].signalno  = 0;
+	SetTrackedProcTimeouts(w->pid, w->killseq);
+}
+
+/* in the child; doesn't return */
+static void
+worker_child(const char* path, char** argv, char** envp, int fd
+,	int err_fd)
+{
+#ifdef DEFAULT_REALTIME_POLICY
+	if (sched_getscheduler(0) != SCHED_OTHER) {
+		struct sched_param sp;
+
+		sp.sched_priority = 0;
+		if (sched_setscheduler(0, SCHED_OTHER, &sp) == -1) {
+			cl_perror("%s: sched_setscheduler", __FUNCTION__);
+		}
+	}
+#endif
+	setpgid(0,0);
+	if (dup2(fd, STDIN_FILENO) != STDIN_FILENO
+	||	dup2(fd, STDOUT_FILENO) != STDOUT_FILENO
+	||	dup2(err_fd, STDERR_FILENO) != STDERR_FILENO) {
+		cl_perror("%s: dup2", __FUNCTION__);
+		exit(EXECRA_EXEC_UNKNOWN_ERROR);
+	}
+	closefiles(); /* don't leak open files */
+	execve(path, argv, envp);
+	cl_perror("%s: execve %s", __FUNCTION__, path);
+	exit(EXECRA_EXEC_UNKNOWN_ERROR);
+}
+
+static int
+worker_start(struct raworker* w, struct RASpawnOps* RASpawn, lrmd_rsc_t* rsc
+,	GHashTable* params, const char* pstr)
+{
+	int	sv[2];
+	int	errfd[2];
+	char*	path = NULL;
+	char**	argv = NULL;
+	char**	envp = NULL;
+	pid_t	pid;
+
+	/* a forked RA reports a problem with the secrets */
+	if (replace_secret_params(rsc->id, params) < 0) {
+		return HA_FAIL;
+	}
+	/* HALOGD is set in envp, by raexec_envp() */
+	if (RASpawn->prepare_exec(rsc->id, rsc->type, rsc->provider
+	,	RAWORKER_ACTION, 0, params, &path, &argv, &envp) != 0) {
+		return HA_FAIL;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		cl_perror("%s: socketpair", __FUNCTION__);
+		goto out;
+	}
+	if (pipe(errfd) < 0) {
+		cl_perror("%s: pipe", __FUNCTION__);
+		close(sv[0]);
+		close(sv[1]);
+		goto out;
+	}
+	switch (pid = fork()) {
+	case -1:
+		cl_perror("%s: fork", __FUNCTION__);
+		close(sv[0]);
+		close(sv[1]);
+		close(errfd[0]);
+		close(errfd[1]);
+		goto out;
+
+	case 0:		/* Child */
+		close(sv[0]);
+		close(errfd[0]);
+		worker_child(path, argv, envp, sv[1], errfd[1]);
+		/* not reached */
+	}
+
+	/* Parent */
+	close(sv[1]);
+	close(errfd[1]);
+	w->pid = pid;
+	w->fd = sv[0];
+	w->err_fd = errfd[0];
+	fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+	fcntl(w->fd, F_SETFD, FD_CLOEXEC);
+	fcntl(w->err_fd, F_SETFL, fcntl(w->err_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(w->err_fd, F_SETFD, FD_CLOEXEC);
+	w->src = G_main_add_fd(G_PRIORITY_HIGH, w->fd, FALSE
+	,	worker_input, w, NULL);
+	w->err_src = G_main_add_fd(G_PRIORITY_DEFAULT, w->err_fd, FALSE
+	,	worker_err_input, w, NULL);
+	g_string_truncate(w->in, 0);
+	g_string_truncate(w->err, 0);
+	g_free(w->params);
+	w->params = g_strdup(pstr);
+	w->killed = FALSE;
+	NewTrackedProc(pid, 1, debug_level ? PT_LOGVERBOSE : PT_LOGNORMAL
+	,	w, &WorkerTrackOps);
+	lrmd_log(LOG_INFO, "rsc:%s: started the " RAWORKER_ACTION " (pid %d)"
+	,	w->rsc_id, (int)pid);
+out:
+	g_free(path);
+	g_strfreev(argv);
+	g_strfreev(envp);
+	return w->pid != 0 ? HA_OK : HA_FAIL;
+}
+
+/*
+ * Send a repeating monitor of an OCF resource to its worker, which
+ * is started if need be. HA_FAIL if the op is to be run as usual.
+ * On HA_OK the op is finished by ra_op_finished() (or handed back
+ * with ra_op_retry()) later.
+ */
+int
+raworker_run(struct RAExecOps* RAExec, struct RASpawnOps* RASpawn
+,	lrmd_rsc_t* rsc, lrmd_op_t* op, const char* op_type, int timeout)
+{
+	struct raworker*	w;
+	GHashTable*		params;
+	GHashTable*		op_params;
+	char*			pstr;
+	char			req[64];
+	int			len;
+
+	if (workers == NULL || !op->interval || strcmp(rsc->class, "ocf")
+	||	strcmp(op_type, "monitor")) {
+		return HA_FAIL;
+	}
+	w = g_hash_table_lookup(workers, rsc->id);
+	if (!worker_wanted(RAExec, RASpawn, rsc)) {
+		if (w != NULL) {
+			worker_detach(w);
+		}
+		return HA_FAIL;
+	}
+	if (w != NULL) {
+		/* busy or on its way out */
+		if (w->op != NULL || (w->pid != 0 && w->killed)) {
+			return HA_FAIL;
+		}
+		if (w->pid == 0 && time(NULL) < w->retry_at) {
+			return HA_FAIL;
+		}
+	}
+
+	op_params = ha_msg_value_str_table(op->msg, F_LRM_PARAM);
+	params = merge_str_tables(rsc->params, op_params);
+	if (op_params) {
+		free_str_table(op_params);
+	}
+	pstr = params_str(params);
+	if (w != NULL && w->pid != 0 && strcmp(w->params, pstr)) {
+		lrmd_log(LOG_INFO, "rsc:%s: parameters changed, replacing "
+			"the " RAWORKER_ACTION " (pid %d)"
+		,	w->rsc_id, (int)w->pid);
+		worker_detach(w);
+		w = NULL;
+	}
+	if (w == NULL) {
+		w = g_new0(struct raworker, 1);
+		w->rsc_id = g_strdup(rsc->id);
+		w->fd = w->err_fd = -1;
+		w->in = g_string_new("");
+		w->err = g_string_new("");
+		g_hash_table_insert(workers, w->rsc_id, w);
+	}
+	if (w->pid == 0 && HA_OK != worker_start(w, RASpawn, rsc, params
+	,	pstr)) {
+		w->retry_at = time(NULL) + RAWORKER_RETRY;
+	}
+	free_str_table(params);
+	g_free(pstr);
+	if (w->pid == 0) {
+		return HA_FAIL;
+	}
+
+	len = snprintf(req, sizeof(req), "%u monitor\n", ++w->seq);
+	if (send(w->fd, req, len, MSG_NOSIGNAL|MSG_DONTWAIT) != len) {
+		lrmd_log(LOG_WARNING, "rsc:%s: cannot send to the "
+			RAWORKER_ACTION " (pid %d): %s"
+		,	w->rsc_id, (int)w->pid, strerror(errno));
+		worker_kill(w, SIGKILL);
+		w->retry_at = time(NULL) + RAWORKER_RETRY;
+		return HA_FAIL;
+	}
+	w->op = op;
+	op->exec_pid = w->pid;
+	if (timeout > 0) {
+		w->timer = Gmain_timeout_add(timeout, worker_timeout, w);
+	}
+	lrmd_debug(LOG_DEBUG, "rsc:%s %s[%d] (" RAWORKER_ACTION " pid %d)"
+	,	rsc->id, op_type, op->call_id, (int)w->pid);
+	return HA_OK;
+}
+
+/* the resource is gone */
+void
+raworker_stop(const char* rsc_id)
+{
+	struct raworker*	w;
+
+	if (workers != NULL
+	&&	(w = g_hash_table_lookup(workers, rsc_id)) != NULL) {
+		worker_detach(w);
+	}
+}
+
+static void
+worker_stop_one(gpointer key, gpointer value, gpointer user_data)
+{
+	struct raworker*	w = value;
+
+	if (w->pid != 0) {
+		shutdown(w->fd, SHUT_WR);
+		worker_kill(w, SIGTERM);
+	}
+}
+
+/* on the way out */
+void
+raworker_stop_all(void)
+{
+	if (workers != NULL) {
+		g_hash_table_foreach(workers, worker_stop_one, NULL);
+	}
+}
+
+static void
+worker_died(ProcTrack* p, int status, int signo, int exitcode
+,	int waslogged)
+{
+	struct raworker*	w = proctrack_data(p);
+	lrmd_op_t*		op;
+	pid_t			pid = w->pid;
+	gboolean		answered = FALSE;
+	int			rc = 0;
+
+	reset_proctrack_data(p);
+	RemoveTrackedProcTimeouts(pid);
+	/* what it wrote last is still there */
+	if (w->src != NULL) {
+		worker_read(w->fd, w->in);
+		G_main_del_fd(w->src);
+		w->src = NULL;
+	}
+	if (w->err_src != NULL) {
+		worker_read(w->err_fd, w->err);
+		G_main_del_fd(w->err_src);
+		w->err_src = NULL;
+	}
+	worker_log_err(w, TRUE);
+	if (!w->killed) {
+		lrmd_log(LOG_WARNING, "rsc:%s: the " RAWORKER_ACTION
+			" (pid %d) exited, running the agent as usual"
+			" for %d s"
+		,	w->rsc_id, (int)pid, RAWORKER_RETRY);
+		w->retry_at = time(NULL) + RAWORKER_RETRY;
+	}
+	close(w->fd);
+	close(w->err_fd);
+	w->fd = w->err_fd = -1;
+	w->pid = 0;
+	if (w->timer != 0) {
+		Gmain_timeout_remove(w->timer);
+		w->timer = 0;
+	}
+	if ((op = worker_reply(w, &rc)) != NULL) {
+		answered = TRUE;
+	}else{
+		op = w->op;
+		w->op = NULL;
+	}
+	g_string_truncate(w->in, 0);
+	if (w->detached) {
+		worker_free(w);
+	}
+	/* w may be gone (or restarted) from here on */
+	if (op == NULL) {
+		return;
+	}
+	if (answered) {
+		ra_op_finished(op, pid, 0, FALSE, rc);
+	}else if (op->is_cancelled) {
+		ra_op_finished(op, pid, SIGKILL, FALSE, 0);
+	}else{
+		ra_op_retry(op);
+	}
+}
+
+static void
+worker_registered(ProcTrack* p)
+{
+}
+
+static const char*
+worker_proctype(ProcTrack* p)
+{
+	return "RA " RAWORKER_ACTION;
+}
@@ -0,0 +1,413 @@
+/*
+ * raworkertest.c: the worker protocol of raworker.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * raworker.c with the rest of lrmd stubbed out below. The agent is
+ * a shell script in /tmp which, as a worker, answers, hangs or exits
+ * as its "mode" parameter says. Runs in a second or so, exits 1 on
+ * failure.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <clplumbing/proctrack.h>
+#include <ha_msg.h>
+
+#include <lrm/lrm_api.h>
+#include <lrm/lrm_msg.h>
+#include <lrm/raexec.h>
+
+#include <lrmd.h>
+
+#define WAIT_MS		5000	/* for anything to happen */
+#define TIMEOUT_MS	500	/* of the monitors */
+
+static const char agent_text[] =
+"#!/bin/sh\n"
+"[ \"$1\" = worker ] || exit 3\n"
+"while read seq op; do\n"
+"	case \"$OCF_RESKEY_mode\" in\n"
+"	answer)	echo \"$seq 7\";;\n"
+"	hang)	sleep 60;;\n"
+"	*)	exit 1;;\n"
+"	esac\n"
+"done\n";
+
+static char	agent[] = "/tmp/raworkertestXXXXXX";
+static int	failed = 0;
+
+/* what became of the op */
+static enum { OP_RUNNING, OP_FINISHED, OP_RETRIED } op_state;
+static pid_t	op_pid;
+static int	op_signo;
+static gboolean	op_timedout;
+static int	op_rc;
+
+/* meta-data queries: for rtype RTYPE_NOCACHE the cache takes none */
+#define RTYPE_NOCACHE	"nocache"
+static int		raq_started = 0;
+static int		raq_slots = 0;	/* taken and not released */
+static raq_done_fn	raq_done;
+static gpointer		raq_data;
+
+/* the rest of lrmd */
+
+char*
+racache_get(const char* rclass, const char* provider, const char* rtype)
+{
+	if (strcmp(rtype, RTYPE_NOCACHE) == 0) {
+		return NULL;
+	}
+	return g_strdup("<actions><action name=\"worker\"/></actions>");
+}
+
+void
+racache_put(const char* rclass, const char* provider, const char* rtype
+,	const char* meta)
+{
+}
+
+int
+ra_query_start(struct RAExecOps* RAExec, int kind, const char* rtype
+,	const char* provider, raq_done_fn done, gpointer data)
+{
+	++raq_started;
+	++raq_slots;
+	raq_done = done;
+	raq_data = data;
+	return HA_OK;
+}
+
+void
+release_query_slot(void)
+{
+	--raq_slots;
+}
+
+int
+replace_secret_params(const char* rsc_id, GHashTable* params)
+{
+	return 0;
+}
+
+void
+ra_op_finished(lrmd_op_t* op, pid_t pid, int signo, gboolean timedout
+,	int exitcode)
+{
+	op_state = OP_FINISHED;
+	op_pid = pid;
+	op_signo = signo;
+	op_timedout = timedout;
+	op_rc = exitcode;
+}
+
+void
+ra_op_retry(lrmd_op_t* op)
+{
+	op_state = OP_RETRIED;
+}
+
+static void
+add_env(gpointer key, gpointer value, gpointer user_data)
+{
+	char***	env = user_data;
+
+	*(*env)++ = g_strconcat("OCF_RESKEY_", (const char*)key, "="
+	,	(const char*)value, NULL);
+}
+
+static int
+prepare_exec(const char* rsc_id, const char* rsc_type, const char* provider
+,	const char* op_type, const int timeout, GHashTable* params
+,	char** path, char*** argv, char*** envp)
+{
+	char**	env;
+
+	*envp = g_new0(char*, g_hash_table_size(params) + 2);
+	env = *envp;
+	g_hash_table_foreach(params, add_env, &env);
+	*env = g_strdup("PATH=/bin:/usr/bin");
+	*path = g_strdup(agent);
+	*argv = g_new(char*, 3);
+	(*argv)[0] = g_strdup(agent);
+	(*argv)[1] = g_strdup(op_type);
+	(*argv)[2] = NULL;
+	return 0;
+}
+
+static struct RAExecOps		execops;	/* only looked at */
+static struct RASpawnOps	spawnops = { prepare_exec };
+
+/* the tests */
+
+static gboolean
+on_tick(gpointer data)
+{
+	return TRUE;
+}
+
+/* run the mainloop for up to ms, until done() */
+static gboolean
+wait_for(gboolean (*done)(pid_t), pid_t pid, unsigned long ms)
+{
+	longclock_t	start = time_longclock();
+
+	while (!done(pid)) {
+		if (longclockto_ms(sub_longclock(time_longclock(), start)) > ms) {
+			return FALSE;
+		}
+		g_main_context_iteration(NULL, TRUE);
+	}
+	return TRUE;
+}
+
+static gboolean
+op_done(pid_t pid)
+{
+	return op_state != OP_RUNNING;
+}
+
+/* reaped, that is */
+static gboolean
+proc_gone(pid_t pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+static lrmd_rsc_t*
+rsc_new(const char* id, const char* mode)
+{
+	lrmd_rsc_t*	rsc = g_new0(lrmd_rsc_t, 1);
+
+	rsc->id = g_strdup(id);
+	rsc->class = g_strdup("ocf");
+	rsc->type = g_strdup("raworkertest");
+	rsc->provider = g_strdup("heartbeat");
+	rsc->params = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, g_free);
+	g_hash_table_insert(rsc->params, g_strdup("mode"), g_strdup(mode));
+	return rsc;
+}
+
+static void
+rsc_free(lrmd_rsc_t* rsc)
+{
+	raworker_stop(rsc->id);
+	g_hash_table_destroy(rsc->params);
+	g_free(rsc->id);
+	g_free(rsc->class);
+	g_free(rsc->type);
+	g_free(rsc->provider);
+	g_free(rsc);
+}
+
+/* a repeating monitor of rsc, to the worker if it takes it */
+static int
+monitor(lrmd_rsc_t* rsc, lrmd_op_t* op)
+{
+	static int call_id = 0;
+
+	memset(op, 0, sizeof(*op));
+	op->rsc_id = rsc->id;
+	op->call_id = ++call_id;
+	op->interval = 1000;
+	op->msg = ha_msg_new(0);
+	op_state = OP_RUNNING;
+	return raworker_run(&execops, &spawnops, rsc, op, "monitor"
+	,	TIMEOUT_MS);
+}
+
+static void
+fail(const char* what, const char* why)
+{
+	fprintf(stderr, "FAIL: %s: %s\n", what, why);
+	failed = 1;
+}
+
+/* answered, and the worker replaced when the parameters change */
+static void
+test_answer(void)
+{
+	const char*	what = "answer, replace on new parameters";
+	lrmd_rsc_t*	rsc = rsc_new("answer", "answer");
+	lrmd_op_t	op;
+	pid_t		first;
+
+	if (HA_OK != monitor(rsc, &op)) {
+		fail(what, "not run by a worker");
+	}else if (!wait_for(op_done, 0, WAIT_MS)
+	||	op_state != OP_FINISHED || op_timedout || op_rc != 7) {
+		fail(what, "no rc 7 from the worker");
+	}else{
+		first = op_pid;
+		ha_msg_del(op.msg);
+		g_hash_table_replace(rsc->params, g_strdup("gen")
+		,	g_strdup("2"));
+		if (HA_OK != monitor(rsc, &op)) {
+			fail(what, "the new worker did not take the op");
+		}else if (!wait_for(op_done, 0, WAIT_MS)
+		||	op_state != OP_FINISHED || op_rc != 7) {
+			fail(what, "no rc 7 from the new worker");
+		}else if (op_pid == first) {
+			fail(what, "the worker was not replaced");
+		}else if (!wait_for(proc_gone, first, WAIT_MS)) {
+			fail(what, "the old worker did not exit");
+		}else{
+			printf("ok: %s\n", what);
+		}
+	}
+	ha_msg_del(op.msg);
+	rsc_free(rsc);
+}
+
+/* killed on timeout, and no worker for a while */
+static void
+test_timeout(void)
+{
+	const char*	what = "timeout";
+	lrmd_rsc_t*	rsc = rsc_new("timeout", "hang");
+	lrmd_op_t	op;
+	lrmd_op_t	again;
+
+	if (HA_OK != monitor(rsc, &op)) {
+		fail(what, "not run by a worker");
+	}else if (!wait_for(op_done, 0, TIMEOUT_MS + WAIT_MS)
+	||	op_state != OP_FINISHED || !op_timedout
+	||	op_signo != SIGKILL) {
+		fail(what, "the op did not time out");
+	}else if (!wait_for(proc_gone, op_pid, WAIT_MS)) {
+		fail(what, "the worker was not killed");
+	}else{
+		if (HA_OK == monitor(rsc, &again)) {
+			fail(what, "a new worker right away");
+		}else{
+			printf("ok: %s\n", what);
+		}
+		ha_msg_del(again.msg);
+	}
+	ha_msg_del(op.msg);
+	rsc_free(rsc);
+}
+
+/* the op in flight handed back, and no worker for a while */
+static void
+test_exit(void)
+{
+	const char*	what = "worker exits, retry";
+	lrmd_rsc_t*	rsc = rsc_new("exit", "exit");
+	lrmd_op_t	op;
+	lrmd_op_t	again;
+
+	if (HA_OK != monitor(rsc, &op)) {
+		fail(what, "not run by a worker");
+	}else if (!wait_for(op_done, 0, WAIT_MS)
+	||	op_state != OP_RETRIED) {
+		fail(what, "the op was not handed back");
+	}else{
+		if (HA_OK == monitor(rsc, &again)) {
+			fail(what, "a new worker right away");
+		}else{
+			printf("ok: %s\n", what);
+		}
+		ha_msg_del(again.msg);
+	}
+	ha_msg_del(op.msg);
+	rsc_free(rsc);
+}
+
+/* meta-data the cache won't take is not fetched for every monitor */
+static void
+test_nocache(void)
+{
+	const char*	what = "meta-data not cached, asked once";
+	lrmd_rsc_t*	rsc = rsc_new("nocache", "answer");
+	lrmd_op_t	op;
+	GString*	out;
+
+	g_free(rsc->type);
+	rsc->type = g_strdup(RTYPE_NOCACHE);
+	if (HA_OK == monitor(rsc, &op) || raq_started != 1) {
+		fail(what, "the meta-data was not asked for");
+	}else{
+		out = g_string_new(
+			"<actions><action name=\"worker\"/></actions>");
+		raq_done(0, out, raq_data);
+		g_string_free(out, TRUE);
+		ha_msg_del(op.msg);
+		if (raq_slots != 0) {
+			fail(what, "the child slot of the query was kept");
+		}else if (HA_OK == monitor(rsc, &op)) {
+			fail(what, "run by a worker");
+		}else if (raq_started != 1) {
+			fail(what, "the meta-data was asked for again");
+		}else{
+			printf("ok: %s\n", what);
+		}
+	}
+	ha_msg_del(op.msg);
+	rsc_free(rsc);
+}
+
+static gboolean
+write_agent(void)
+{
+	int	fd;
+	ssize_t	len = sizeof(agent_text) - 1;
+
+	if ((fd = mkstemp(agent)) < 0) {
+		perror(agent);
+		return FALSE;
+	}
+	if (write(fd, agent_text, len) != len || fchmod(fd, 0755) < 0) {
+		perror(agent);
+		close(fd);
+		return FALSE;
+	}
+	close(fd);
+	return TRUE;
+}
+
+int
+main(int argc, char** argv)
+{
+	cl_log_set_entity("raworkertest");
+	cl_log_enable_stderr(TRUE);
+	if (!write_agent()) {
+		return 1;
+	}
+	set_sigchld_proctrack(G_PRIORITY_HIGH, DEFAULT_MAXDISPATCHTIME);
+	Gmain_timeout_add(100, on_tick, NULL);
+	raworker_init();
+	test_answer();
+	test_timeout();
+	test_exit();
+	test_nocache();
+	unlink(agent);
+	return failed;
+}
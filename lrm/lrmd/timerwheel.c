@@ -0,0 +1,301 @@
+/*
+ * timerwheel.c: hierarchical timer wheel for lrmd repeating operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/cl_random.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/Gmain_timeout.h>
+
+#include <timerwheel.h>
+
+/*
+ * Level 0 holds the timers expiring within the next TW_SLOTS ticks,
+ * one slot per tick. Level n holds timers expiring within the next
+ * TW_SLOTS^(n+1) ticks, one slot per TW_SLOTS^n ticks. Whenever the
+ * level 0 index wraps, the current slot of the next level is
+ * cascaded down (and so on for the upper levels).
+ */
+static tw_timer_t*	wheel[TW_LEVELS][TW_SLOTS];
+static unsigned long	tw_now = 0;	/* the current tick */
+static longclock_t	tw_now_time;	/* when the current tick started */
+static gboolean		tw_initialized = FALSE;
+static int		tw_ntimers = 0;
+static guint		tw_source = 0;	/* the Gmain timeout driving us */
+static unsigned long	tw_armed = 0;	/* tick tw_source is armed for */
+static GHashTable*	tw_phases = NULL; /* interval -> timers spread */
+
+static void tw_insert(tw_timer_t* t);
+static void tw_link(tw_timer_t** head, tw_timer_t* t);
+static void tw_cascade(int level);
+static void tw_run(void);
+static void tw_arm(void);
+static gboolean tw_dispatch(gpointer data);
+static unsigned long tw_ticks_now(void);
+
+static void
+tw_init(void)
+{
+	if (tw_initialized) {
+		return;
+	}
+	memset(wheel, 0, sizeof(wheel));
+	tw_now = 0;
+	tw_now_time = time_longclock();
+	tw_initialized = TRUE;
+}
+
+/* the tick we should be at by now */
+static unsigned long
+tw_ticks_now(void)
+{
+	return tw_now + longclockto_ms(sub_longclock(time_longclock()
+	,	tw_now_time)) / TW_TICK_MS;
+}
+
+void
+tw_timer_init(tw_timer_t* t)
+{
+	memset(t, 0, sizeof(*t));
+}
+
+int
+tw_count(void)
+{
+	return tw_ntimers;
+}
+
+static void
+tw_link(tw_timer_t** head, tw_timer_t* t)
+{
+	t->next = *head;
+	if (t->next) {
+		t->next->pprev = &t->next;
+	}
+	*head = t;
+	t->pprev = head;
+}
+
+static void
+tw_insert(tw_timer_t* t)
+{
+	unsigned long delta;
+	int level;
+
+	if (t->expires <= tw_now) {
+		t->expires = tw_now + 1;
+	}
+	delta = t->expires - tw_now;
+	for (level = 0; level < TW_LEVELS-1; level++) {
+		if (delta < (1UL << (TW_BITS*(level+1)))) {
+			break;
+		}
+	}
+	if (level == TW_LEVELS-1
+	&&	delta >= (1UL << (TW_BITS*TW_LEVELS))) {
+		/* too far out; it will be put back when cascaded */
+		t->expires = tw_now + (1UL << (TW_BITS*TW_LEVELS)) - 1;
+	}
+	tw_link(&wheel[level][(t->expires >> (TW_BITS*level)) & TW_MASK], t);
+}
+
+void
+tw_add(tw_timer_t* t, unsigned long ms, unsigned long jitter_ms
+,	GSourceFunc fn, gpointer data)
+{
+	tw_init();
+	if (tw_pending(t)) {
+		tw_del(t);
+	}
+	if (jitter_ms > 0) {
+		if (jitter_ms > ms) {
+			jitter_ms = ms;
+		}
+		ms = ms - jitter_ms + cl_rand_from_interval(0, 2*jitter_ms);
+	}
+	t->fn = fn;
+	t->data = data;
+	/* round up: never expire early */
+	t->expires = tw_ticks_now() + (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+	tw_insert(t);
+	tw_ntimers++;
+	tw_arm();
+}
+
+void
+tw_del(tw_timer_t* t)
+{
+	if (!tw_pending(t)) {
+		return;
+	}
+	*t->pprev = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+	tw_ntimers--;
+	if (tw_ntimers == 0 && tw_source) {
+		Gmain_timeout_remove(tw_source);
+		tw_source = 0;
+	}
+}
+
+unsigned long
+tw_remaining(const tw_timer_t* t)
+{
+	unsigned long now;
+
+	if (!tw_pending(t)) {
+		return 0;
+	}
+	now = tw_ticks_now();
+	return t->expires > now ? (t->expires - now) * TW_TICK_MS : 0;
+}
+
+unsigned long
+tw_spread(unsigned long interval_ms)
+{
+	gpointer key = GUINT_TO_POINTER((guint)interval_ms);
+	unsigned long k;
+	double phase;
+
+	if (interval_ms == 0) {
+		return 0;
+	}
+	if (tw_phases == NULL) {
+		tw_phases = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	k = GPOINTER_TO_UINT(g_hash_table_lookup(tw_phases, key));
+	g_hash_table_insert(tw_phases, key, GUINT_TO_POINTER((guint)(k+1)));
+	/* the fractional parts of k*(golden ratio) are spread about
+	 * evenly over [0,1) for any number of timers */
+	phase = k * 0.6180339887498949;
+	phase -= (unsigned long)phase;
+	return (unsigned long)(phase * interval_ms);
+}
+
+/* move the timers from the current slot of a level one level down */
+static void
+tw_cascade(int level)
+{
+	tw_timer_t* list;
+	tw_timer_t* t;
+	int idx = (tw_now >> (TW_BITS*level)) & TW_MASK;
+
+	list = wheel[level][idx];
+	wheel[level][idx] = NULL;
+	if (list) {
+		list->pprev = &list;
+	}
+	while ((t = list) != NULL) {
+		list = t->next;
+		if (list) {
+			list->pprev = &list;
+		}
+		t->next = NULL;
+		tw_insert(t);
+	}
+	if (idx == 0 && level < TW_LEVELS-1) {
+		tw_cascade(level+1);
+	}
+}
+
+/* expire everything up to the current tick */
+static void
+tw_run(void)
+{
+	unsigned long target = tw_ticks_now();
+	tw_timer_t* list;
+	tw_timer_t* t;
+	int idx;
+
+	while (tw_now < target) {
+		tw_now++;
+		tw_now_time = add_longclock(tw_now_time
+		,	msto_longclock(TW_TICK_MS));
+		idx = tw_now & TW_MASK;
+		if (idx == 0) {
+			tw_cascade(1);
+		}
+		/* detach the slot: callbacks may add and delete timers,
+		 * including the ones still on our list */
+		list = wheel[0][idx];
+		wheel[0][idx] = NULL;
+		if (list) {
+			list->pprev = &list;
+		}
+		while ((t = list) != NULL) {
+			tw_del(t);
+			t->fn(t->data);
+		}
+	}
+}
+
+/* make sure that the Gmain timeout fires for the next interesting tick */
+static void
+tw_arm(void)
+{
+	unsigned long next = 0, tick, now, block;
+	long ms;
+
+	if (tw_ntimers == 0) {
+		return;
+	}
+	/* the next non-empty tick on level 0; its timers expire within
+	 * TW_SLOTS ticks, also past the point where the index wraps */
+	for (tick = tw_now+1; tick < tw_now+TW_SLOTS; tick++) {
+		if (wheel[0][tick & TW_MASK]) {
+			next = tick;
+			break;
+		}
+	}
+	/* the next cascade which brings down timers (or which may, for
+	 * the upper levels), if that comes first */
+	block = (tw_now >> TW_BITS) + 1;
+	while ((block & TW_MASK) != 0 && wheel[1][block & TW_MASK] == NULL
+	&&	(!next || (block << TW_BITS) < next)) {
+		block++;
+	}
+	if (!next || (block << TW_BITS) < next) {
+		next = block << TW_BITS;
+	}
+	if (tw_source) {
+		if (tw_armed == next) {
+			return;
+		}
+		Gmain_timeout_remove(tw_source);
+		tw_source = 0;
+	}
+	now = tw_ticks_now();
+	ms = next > now ? (long)((next - now) * TW_TICK_MS) : 0;
+	tw_armed = next;
+	tw_source = Gmain_timeout_add(ms, tw_dispatch, NULL);
+}
+
+static gboolean
+tw_dispatch(gpointer data)
+{
+	tw_source = 0;
+	tw_run();
+	tw_arm();
+	return FALSE;
+}
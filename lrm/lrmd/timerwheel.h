@@ -0,0 +1,62 @@
+/*
+ * timerwheel.h: hierarchical timer wheel for lrmd repeating operations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _LRMD_TIMERWHEEL_H
+#define _LRMD_TIMERWHEEL_H
+
+/*
+ * All repeating (and delayed) operations wait in one wheel instead
+ * of having a glib timeout source each. The wheel is driven by a
+ * single Gmain timeout which is armed only for ticks which have
+ * timers expiring (or for the next cascade of the upper levels), so
+ * the main loop wakes up at most once per TW_TICK_MS no matter how
+ * many monitors there are, and not at all for empty ticks.
+ *
+ * Timers are embedded in the objects they belong to and must be
+ * initialized with tw_timer_init() before use.
+ */
+
+#define TW_TICK_MS	100	/* wheel resolution */
+#define TW_BITS		6
+#define TW_SLOTS	(1<<TW_BITS)
+#define TW_MASK		(TW_SLOTS-1)
+#define TW_LEVELS	4	/* TW_SLOTS^TW_LEVELS ticks, about 19 days */
+
+typedef struct tw_timer tw_timer_t;
+struct tw_timer {
+	tw_timer_t*	next;
+	tw_timer_t**	pprev;		/* NULL if not pending */
+	unsigned long	expires;	/* in ticks */
+	GSourceFunc	fn;		/* return value is ignored */
+	gpointer	data;
+};
+
+#define tw_pending(t)	((t)->pprev != NULL)
+
+void tw_timer_init(tw_timer_t* t);
+/* (re)start the timer to expire in ms plus/minus jitter_ms */
+void tw_add(tw_timer_t* t, unsigned long ms, unsigned long jitter_ms
+,	GSourceFunc fn, gpointer data);
+void tw_del(tw_timer_t* t);
+/* ms until the timer expires */
+unsigned long tw_remaining(const tw_timer_t* t);
+/* phase offset in [0, interval_ms) for the next timer with this
+ * interval, so that timers of the same interval spread evenly over
+ * the interval instead of all expiring at the same time */
+unsigned long tw_spread(unsigned long interval_ms);
+int tw_count(void);
+
+#endif /* _LRMD_TIMERWHEEL_H */
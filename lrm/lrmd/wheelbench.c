@@ -0,0 +1,153 @@
+/*
+ * wheelbench.c: main loop wakeups caused by repeating operations,
+ *	one Gmain timeout per operation vs. the lrmd timer wheel
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Each "monitor" is rescheduled every interval ms once it fired,
+ * the way lrmd reschedules repeating operations. All monitors are
+ * started at once, as they are when lrmd starts or a node takes
+ * over resources.
+ *
+ *	wheelbench [-g] [-s] [-n monitors] [-i interval] [-j jitter] [-t secs]
+ *
+ *	-g	use a Gmain timeout per monitor (the old lrmd way)
+ *	-s	spread the first expiry over the interval (wheel only)
+ *	-j	jitter in ms (wheel only)
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/Gmain_timeout.h>
+
+#include <timerwheel.h>
+
+struct monitor {
+	tw_timer_t	timer;
+};
+
+static GMainLoop*	mainloop;
+static gboolean		use_gmain = FALSE;
+static unsigned long	interval = 10000;
+static unsigned long	jitter = 0;
+static unsigned long	wakeups = 0;
+static unsigned long	fired = 0;
+static unsigned long	fired_at_wakeup = 0;
+static unsigned long	max_per_wakeup = 0;
+static GPollFunc	real_poll;
+
+static gint
+counting_poll(GPollFD* ufds, guint nfds, gint timeout)
+{
+	if (fired - fired_at_wakeup > max_per_wakeup) {
+		max_per_wakeup = fired - fired_at_wakeup;
+	}
+	fired_at_wakeup = fired;
+	wakeups++;
+	return real_poll(ufds, nfds, timeout);
+}
+
+static gboolean
+on_monitor(gpointer data)
+{
+	struct monitor* m = (struct monitor*)data;
+
+	fired++;
+	if (use_gmain) {
+		Gmain_timeout_add(interval, on_monitor, m);
+	} else {
+		tw_add(&m->timer, interval, jitter, on_monitor, m);
+	}
+	return FALSE;
+}
+
+static gboolean
+on_end(gpointer data)
+{
+	g_main_quit(mainloop);
+	return FALSE;
+}
+
+int
+main(int argc, char** argv)
+{
+	int nmon = 10000, secs = 30, i, flag;
+	gboolean spread = FALSE;
+	struct monitor* mons;
+	struct rusage ru;
+	double cpu;
+
+	cl_log_set_entity("wheelbench");
+	cl_log_enable_stderr(TRUE);
+	while ((flag = getopt(argc, argv, "gsn:i:j:t:")) != EOF) {
+		switch (flag) {
+			case 'g': use_gmain = TRUE; break;
+			case 's': spread = TRUE; break;
+			case 'n': nmon = atoi(optarg); break;
+			case 'i': interval = atol(optarg); break;
+			case 'j': jitter = atol(optarg); break;
+			case 't': secs = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-g] [-s] [-n monitors]"
+				" [-i interval] [-j jitter] [-t secs]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	mons = calloc(nmon, sizeof(*mons));
+	if (mons == NULL) {
+		return 1;
+	}
+	mainloop = g_main_new(FALSE);
+	real_poll = g_main_context_get_poll_func(NULL);
+	g_main_context_set_poll_func(NULL, counting_poll);
+
+	for (i = 0; i < nmon; i++) {
+		if (use_gmain) {
+			Gmain_timeout_add(interval, on_monitor, &mons[i]);
+		} else {
+			tw_timer_init(&mons[i].timer);
+			tw_add(&mons[i].timer
+			,	interval + (spread ? tw_spread(interval) : 0)
+			,	jitter, on_monitor, &mons[i]);
+		}
+	}
+	Gmain_timeout_add(secs*1000, on_end, NULL);
+	g_main_run(mainloop);
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+	printf("%s%s: %d monitors, interval %lums, jitter %lums, %ds\n"
+	,	use_gmain ? "Gmain timeouts" : "timer wheel"
+	,	spread ? " (spread)" : ""
+	,	nmon, interval, jitter, secs);
+	printf("  wakeups/s: %.1f\n", (double)wakeups/secs);
+	printf("  monitors fired/s: %.1f\n", (double)fired/secs);
+	printf("  max monitors fired per wakeup: %lu\n", max_per_wakeup);
+	printf("  cpu time: %.2fs\n", cpu);
+	free(mons);
+	return 0;
+}
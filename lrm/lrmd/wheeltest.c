@@ -0,0 +1,113 @@
+/*
+ * wheeltest.c: timer wheel expiry tests
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Each timer is armed from the callback of the one before, so that
+ * it is the only one in the wheel, and must fire within a tick or
+ * so of when it is due. Runs in about 14s, exits 1 on failure.
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/Gmain_timeout.h>
+
+#include <timerwheel.h>
+
+#define LATE_MS		(3*TW_TICK_MS)	/* allowed for scheduling */
+
+static const struct {
+	const char*	what;
+	unsigned long	ms;
+} steps[] = {
+	{ "level 0, up to tick 60", 6000 },
+	/* armed at tick 60: expires in level 0 slot 6, past the wrap */
+	{ "level 0, across the wrap", 1000 },
+	/* armed at tick 70: expires in level 1 */
+	{ "level 1", 6500 },
+};
+
+static GMainLoop*	mainloop;
+static tw_timer_t	timer;
+static longclock_t	armed;
+static int		step = 0;
+static int		failed = 0;
+
+static gboolean on_timer(gpointer data);
+
+static void
+arm(void)
+{
+	armed = time_longclock();
+	tw_add(&timer, steps[step].ms, 0, on_timer, NULL);
+}
+
+static gboolean
+on_timer(gpointer data)
+{
+	unsigned long elapsed;
+
+	elapsed = longclockto_ms(sub_longclock(time_longclock(), armed));
+	if (elapsed + TW_TICK_MS < steps[step].ms
+	||	elapsed > steps[step].ms + LATE_MS) {
+		fprintf(stderr, "FAIL: %s: %lums timer fired after %lums\n"
+		,	steps[step].what, steps[step].ms, elapsed);
+		failed = 1;
+	}else{
+		printf("ok: %s: %lums timer fired after %lums\n"
+		,	steps[step].what, steps[step].ms, elapsed);
+	}
+	if (++step < DIMOF(steps)) {
+		arm();
+	}else{
+		g_main_quit(mainloop);
+	}
+	return FALSE;
+}
+
+static gboolean
+on_hang(gpointer data)
+{
+	fprintf(stderr, "FAIL: %s: %lums timer did not fire\n"
+	,	steps[step].what, steps[step].ms);
+	failed = 1;
+	g_main_quit(mainloop);
+	return FALSE;
+}
+
+int
+main(int argc, char** argv)
+{
+	unsigned long total = 0;
+	int i;
+
+	cl_log_set_entity("wheeltest");
+	cl_log_enable_stderr(TRUE);
+	for (i = 0; i < DIMOF(steps); i++) {
+		total += steps[i].ms + LATE_MS;
+	}
+	mainloop = g_main_new(FALSE);
+	tw_timer_init(&timer);
+	arm();
+	Gmain_timeout_add(total + 1000, on_hang, NULL);
+	g_main_run(mainloop);
+	return failed;
+}
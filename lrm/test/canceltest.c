@@ -0,0 +1,163 @@
+/*
+ * canceltest.c: cancel a repeating op between its runs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*
+ * Needs lrmd running and the lrmregtest OCF RA installed, as for
+ * regression.sh. Starts a resource, runs a repeating monitor and
+ * cancels it after its first run, while it waits for the next one.
+ * The cancel notification must not carry the timestamps and times
+ * of the run before. Exits 1 on failure.
+ */
+
+#include <lha_internal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <lrm/lrm_api.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/GSource.h>
+#include <clplumbing/Gmain_timeout.h>
+
+#define RSC_ID		"canceltest_rsc"
+#define INTERVAL_MS	2000
+#define CANCEL_MS	500	/* after the first run */
+#define WAIT_MS		20000	/* for the whole test */
+
+static ll_lrm_t*	lrm;
+static lrm_rsc_t*	rsc;
+static GMainLoop*	mainloop;
+static int		monitor_id = -1;
+static int		stop_id = -1;
+static int		failed = 1;
+
+static int
+perform(const char* op_type, int interval)
+{
+	lrm_op_t*	op = lrm_op_new();
+	int		call_id;
+
+	op->op_type = g_strdup(op_type);
+	op->params = NULL;
+	op->timeout = 10000;
+	op->interval = interval;
+	op->target_rc = EVERYTIME;
+	call_id = rsc->ops->perform_op(rsc, op);
+	lrm_free_op(op);
+	return call_id;
+}
+
+static gboolean
+on_cancel(gpointer data)
+{
+	if (HA_OK != rsc->ops->cancel_op(rsc, monitor_id)) {
+		fprintf(stderr, "FAIL: cannot cancel the monitor\n");
+		g_main_quit(mainloop);
+	}
+	return FALSE;
+}
+
+static gboolean
+on_hang(gpointer data)
+{
+	fprintf(stderr, "FAIL: no answer from lrmd\n");
+	g_main_quit(mainloop);
+	return FALSE;
+}
+
+static void
+lrm_op_done_callback(lrm_op_t* op)
+{
+	if (op->call_id == stop_id) {
+		g_main_quit(mainloop);
+	}else if (op->call_id != monitor_id) {
+		/* the start */
+		if (op->op_status != LRM_OP_DONE || op->rc != 0) {
+			fprintf(stderr, "FAIL: cannot start %s\n", RSC_ID);
+			g_main_quit(mainloop);
+			return;
+		}
+		monitor_id = perform("monitor", INTERVAL_MS);
+	}else if (op->op_status == LRM_OP_DONE) {
+		if (op->t_run == 0) {
+			fprintf(stderr, "FAIL: no timestamp of the run\n");
+			g_main_quit(mainloop);
+			return;
+		}
+		Gmain_timeout_add(CANCEL_MS, on_cancel, NULL);
+	}else if (op->op_status == LRM_OP_CANCELLED) {
+		if (op->t_run || op->t_rcchange
+		||	op->exec_time || op->queue_time) {
+			fprintf(stderr, "FAIL: cancelled monitor has the "
+				"times of its last run: t_run=%lu "
+				"t_rcchange=%lu exec_time=%lu queue_time=%lu\n"
+			,	op->t_run, op->t_rcchange
+			,	op->exec_time, op->queue_time);
+		}else{
+			printf("ok: no timestamps in the cancelled monitor\n");
+			failed = 0;
+		}
+		stop_id = perform("stop", 0);
+	}
+}
+
+static gboolean
+lrm_dispatch(IPC_Channel* notused, gpointer user_data)
+{
+	lrm->lrm_ops->rcvmsg(lrm, FALSE);
+	return TRUE;
+}
+
+int
+main(int argc, char* argv[])
+{
+	GHashTable*	params;
+
+	cl_log_set_entity("canceltest");
+	cl_log_enable_stderr(TRUE);
+	if ((lrm = ll_lrm_new("lrm")) == NULL
+	||	HA_OK != lrm->lrm_ops->signon(lrm, "canceltest")) {
+		fprintf(stderr, "FAIL: cannot sign on to lrmd\n");
+		return 1;
+	}
+	lrm->lrm_ops->set_lrm_callback(lrm, lrm_op_done_callback);
+	params = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_insert(params, g_strdup("delay"), g_strdup("0"));
+	if (HA_OK == lrm->lrm_ops->add_rsc(lrm, RSC_ID, "ocf", "lrmregtest"
+	,	"heartbeat", params)) {
+		rsc = lrm->lrm_ops->get_rsc(lrm, RSC_ID);
+	}
+	lrm_free_str_table(params);
+	if (rsc == NULL) {
+		fprintf(stderr, "FAIL: cannot add %s\n", RSC_ID);
+		lrm->lrm_ops->signoff(lrm);
+		return 1;
+	}
+
+	G_main_add_IPC_Channel(G_PRIORITY_LOW, lrm->lrm_ops->ipcchan(lrm)
+	,	FALSE, lrm_dispatch, lrm, NULL);
+	mainloop = g_main_new(FALSE);
+	Gmain_timeout_add(WAIT_MS, on_hang, NULL);
+	perform("start", 0);
+	g_main_run(mainloop);
+
+	lrm->lrm_ops->delete_rsc(lrm, RSC_ID);
+	lrm_free_rsc(rsc);
+	lrm->lrm_ops->signoff(lrm);
+	return failed;
+}